@@ -0,0 +1,156 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+// Throughput of the reader and printer modes over a generated corpus:
+//   make bench_sexp && ./bench_sexp [MiB] [seed]
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "sexp_corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, size_t bytes, double start) {
+  double secs = now() - start;
+  printf("%-12s %8.3fs %10.1f MiB/s\n", name, secs, bytes / secs / (1 << 20));
+  fflush(stdout);
+}
+
+// all top level forms of src, read with opts
+static sexp_t **read_forms(const char* src, const sexp_read_opts_t *opts, size_t *count) {
+  size_t cap = 1024;
+  sexp_t **forms = malloc(cap * sizeof(sexp_t*));
+  if (forms == NULL) die("out of memory\n");
+  *count = 0;
+  char* pos = (char*)src;
+  sexp_t *e;
+  while ((e = sexp_read_opts(pos, &pos, opts)) != NULL) {
+    if (*count == cap) {
+      cap *= 2;
+      forms = realloc(forms, cap * sizeof(sexp_t*));
+      if (forms == NULL) die("out of memory\n");
+    }
+    forms[(*count)++] = e;
+  }
+  if (*pos != '\0') die("corpus doesn't read to the end\n");
+  return forms;
+}
+
+static void free_forms(sexp_t **forms, size_t count) {
+  for (size_t i = 0; i < count; ++i) sexp_free(forms[i]);
+  free(forms);
+}
+
+// visits every atom under c, so the cursor skips and parses everything
+static size_t cursor_walk(sexp_cursor_t c) {
+  size_t n = 0;
+  for (; sexp_cursor_ok(c); c = sexp_cursor_next(c)) {
+    if (sexp_cursor_is_list(c)) n += cursor_walk(sexp_cursor_child(c));
+    else n += sexp_cursor_is_number(c) ? 1 : 2;
+  }
+  return n;
+}
+
+int main(int argc, char** argv) {
+  size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 32;
+  uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  size_t len;
+  char* src = sexp_corpus_generate(seed, mib << 20, SEXP_CORPUS_VALID, &len);
+  printf("corpus: %zu bytes\n", len);
+
+  double start = now();
+  size_t count;
+  sexp_t **forms = read_forms(src, NULL, &count);
+  report("read", len, start);
+  free_forms(forms, count);
+
+  start = now();
+  sexp_index_t *idx = sexp_index_new(src, len);
+  if (idx == NULL) die("corpus too large to index\n");
+  sexp_read_opts_t opts_idx = { .index = idx };
+  forms = read_forms(src, &opts_idx, &count);
+  report("indexed", len, start);
+  free_forms(forms, count);
+  sexp_index_free(idx);
+
+  // the readtable path without macros, which would read the corpus differently
+  sexp_readtable_t *t = sexp_readtable_new();
+  const char* chars = "'`,";
+  for (const char* c = chars; *c; ++c) sexp_readtable_set(t, *c, NULL, NULL);
+  for (int c = 1; c < 256; ++c) sexp_readtable_dispatch(t, c, NULL, NULL);
+  sexp_read_opts_t opts_rt = { .readtable = t };
+  start = now();
+  forms = read_forms(src, &opts_rt, &count);
+  report("readtable", len, start);
+  free_forms(forms, count);
+  sexp_readtable_free(t);
+
+  sexp_intern_t *intern = sexp_intern_new();
+  sexp_read_opts_t opts_intern = { .intern = intern };
+  start = now();
+  forms = read_forms(src, &opts_intern, &count);
+  report("intern", len, start);
+  free_forms(forms, count);
+  sexp_intern_free(intern);
+
+  start = now();
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  size_t tokens = 0;
+  while (sexp_parser_next(&p) > SEXP_TOKEN_EOF) tokens += 1;
+  report("parser", len, start);
+
+  start = now();
+  size_t atoms = cursor_walk(sexp_cursor_begin(src));
+  report("cursor", len, start);
+  if (tokens == 0 || atoms == 0) die("nothing read\n");
+
+  // the printers, over what the reader built
+  forms = read_forms(src, NULL, &count);
+  size_t out = 0;
+  start = now();
+  for (size_t i = 0; i < count; ++i) {
+    char* text = sexp_display(forms[i]);
+    out += strlen(text) + 1;
+    free(text);
+  }
+  report("display", out, start);
+
+  start = now();
+  sexp_writer_t *w = sexp_writer_new_buffer();
+  for (size_t i = 0; i < count; ++i) sexp_writer_value(w, forms[i]);
+  sexp_writer_text(w, &out);
+  sexp_writer_free(w);
+  report("writer", out, start);
+
+  start = now();
+  out = 0;
+  for (size_t i = 0; i < count; ++i) {
+    sexp_iov_t *v = sexp_display_iov(forms[i]);
+    out += sexp_iov_length(v) + 1;
+    sexp_iov_free(v);
+  }
+  report("iov", out, start);
+
+  free_forms(forms, count);
+  free(src);
+  return 0;
+}
@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+// Fuzz target for the readers and printers. Every input is run through all
+// reader and printer modes by sexp_corpus_check, and any disagreement
+// aborts.
+//
+// With libFuzzer:
+//   make fuzz_sexp && ./fuzz_sexp corpus/
+// Without it, compiled with -DSEXP_FUZZ_MAIN, inputs are read from the files
+// given or from stdin, which works with AFL and for replaying crashes:
+//   make fuzz_sexp_run && ./fuzz_sexp_run -seed corpus/ 100
+//   afl-fuzz -i corpus -o findings ./fuzz_sexp_run
+
+#include "sexp_corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+// larger inputs only make the fuzzer slower, not find more
+#define FUZZ_MAX_INPUT (1 << 16)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size > FUZZ_MAX_INPUT) return 0;
+  const char* failed = sexp_corpus_check((const char*)data, size);
+  if (failed != NULL) die("check failed: %s\n", failed);
+  return 0;
+}
+
+#ifdef SEXP_FUZZ_MAIN
+
+static char* read_all(FILE *f, size_t *len) {
+  size_t cap = 4096;
+  char* buf = malloc(cap);
+  if (buf == NULL) die("out of memory\n");
+  *len = 0;
+  size_t n;
+  while ((n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+    *len += n;
+    if (*len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      if (buf == NULL) die("out of memory\n");
+    }
+  }
+  return buf;
+}
+
+// count inputs of each kind and size from the generator, as a starting point
+static int write_seeds(const char* dir, int count) {
+  char path[4096];
+  for (int i = 0; i < count; ++i) {
+    int flags = i % 4;
+    size_t len;
+    char* src = sexp_corpus_generate(i, 16 << (i % 8), flags, &len);
+    snprintf(path, sizeof(path), "%s/seed_%d_%d", dir, flags, i);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(src, 1, len, f) != len || fclose(f) != 0) {
+      fprintf(stderr, "can't write %s\n", path);
+      free(src);
+      return 1;
+    }
+    free(src);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "-seed") == 0) {
+    if (argc < 3) die("usage: %s -seed dir [count]\n", argv[0]);
+    return write_seeds(argv[2], argc > 3 ? atoi(argv[3]) : 64);
+  }
+  if (argc < 2) {
+    size_t len;
+    char* buf = read_all(stdin, &len);
+    LLVMFuzzerTestOneInput((const uint8_t*)buf, len);
+    free(buf);
+    return 0;
+  }
+  for (int i = 1; i < argc; ++i) {
+    FILE *f = fopen(argv[i], "rb");
+    if (f == NULL) die("can't open %s\n", argv[i]);
+    size_t len;
+    char* buf = read_all(f, &len);
+    fclose(f);
+    fprintf(stderr, "%s\n", argv[i]);
+    LLVMFuzzerTestOneInput((const uint8_t*)buf, len);
+    free(buf);
+  }
+  return 0;
+}
+
+#endif
@@ -13,6 +13,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
 
@@ -24,13 +33,351 @@ typedef enum sexp_type_t {
   SEXP_LIST,
 } sexp_type_t;
 
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define SEXP_THREAD_LOCAL _Thread_local
+#else
+#define SEXP_THREAD_LOCAL __thread
+#endif
+
+// common header of all node types, every node struct starts with one
 typedef struct sexp_t {
   sexp_type_t type;
-  char _[];
+  unsigned refs;
+  size_t hash;                // 0 until computed by sexp_hash
+  const sexp_allocator_t *alloc; // the node came from here, NULL for default
 } sexp_t;
 
+/******************************************************************************
+ * ALLOCATION
+ *****************************************************************************/
+
+// Every allocation goes through an allocator, NULL stands for the default
+// one. New nodes come from the allocator of the creating thread and remember
+// it, so they can be freed from anywhere. Running out of memory makes the
+// failing call return NULL.
+
+static SEXP_THREAD_LOCAL const sexp_allocator_t *current_allocator;
+
+const sexp_allocator_t *sexp_set_allocator(const sexp_allocator_t *a) {
+  const sexp_allocator_t *prev = current_allocator;
+  current_allocator = a;
+  return prev;
+}
+
+#ifndef SEXP_NO_POOL
+
+// The default allocator serves small blocks from size classes. Each thread
+// carves its blocks from slabs and keeps freed blocks in free lists, so
+// recycling a node is a push and a pop. Threads that free more than they
+// allocate hand batches of blocks to a shared list that others refill from,
+// which bounds the memory kept in the pools by their peak use. Threads that
+// exit hand over all of their blocks and the rest of their slab, so they
+// don't strand any memory. Slabs are never returned to malloc.
+
+#define POOL_GRAIN 16
+#define POOL_CLASSES 16         // blocks up to 256 bytes
+#define POOL_MAX (POOL_GRAIN * POOL_CLASSES)
+#define POOL_SLAB (64 * 1024)
+#define POOL_BATCH 256          // blocks moved to and from the shared lists
+
+typedef struct pool_block_t {
+  struct pool_block_t *next;
+  struct pool_block_t *next_batch; // first block of a batch in a shared list
+} pool_block_t;
+
+// the unused end of a slab, handed over by an exiting thread
+typedef struct pool_tail_t {
+  struct pool_tail_t *next;
+  size_t left;
+} pool_tail_t;
+
+typedef struct pool_cache_t {
+  pool_block_t *free[POOL_CLASSES];
+  size_t count[POOL_CLASSES];
+  char *slab;                   // unused rest of the current slab
+  size_t slab_left;
+} pool_cache_t;
+
+static SEXP_THREAD_LOCAL pool_cache_t pool_cache;
+
+static struct {
+  int lock;
+  pool_block_t *batches[POOL_CLASSES];
+  pool_block_t *loose[POOL_CLASSES]; // fewer blocks than a batch, all in one list
+  size_t nloose[POOL_CLASSES];
+  pool_tail_t *tails;
+  void *slabs;                  // all slabs, linked through their first word
+} pool_shared;
+
+static void pool_lock() {
+  while (__sync_lock_test_and_set(&pool_shared.lock, 1)) {
+    while (__atomic_load_n(&pool_shared.lock, __ATOMIC_RELAXED)) {}
+  }
+}
+
+static void pool_unlock() {
+  __sync_lock_release(&pool_shared.lock);
+}
+
+static size_t pool_class(size_t size) {
+  return size == 0 ? 0 : (size - 1) / POOL_GRAIN;
+}
+
+// moves n blocks of class c from the thread's list to the shared one
+static void pool_give(pool_cache_t *cache, size_t c, size_t n) {
+  pool_block_t *first = cache->free[c], *last = first;
+  for (size_t i = 1; i < n; ++i) last = last->next;
+  cache->free[c] = last->next;
+  cache->count[c] -= n;
+  last->next = NULL;
+  pool_lock();
+  first->next_batch = pool_shared.batches[c];
+  __atomic_store_n(&pool_shared.batches[c], first, __ATOMIC_RELAXED);
+  pool_unlock();
+}
+
+// the shared blocks of class c, a batch or else the loose ones. n is set to
+// how many there are.
+static pool_block_t *pool_take(size_t c, size_t *n) {
+  if (!__atomic_load_n(&pool_shared.batches[c], __ATOMIC_RELAXED) &&
+      !__atomic_load_n(&pool_shared.loose[c], __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  pool_lock();
+  pool_block_t *b = pool_shared.batches[c];
+  if (b != NULL) {
+    __atomic_store_n(&pool_shared.batches[c], b->next_batch, __ATOMIC_RELAXED);
+    *n = POOL_BATCH;
+  } else if ((b = pool_shared.loose[c]) != NULL) {
+    __atomic_store_n(&pool_shared.loose[c], NULL, __ATOMIC_RELAXED);
+    *n = pool_shared.nloose[c];
+    pool_shared.nloose[c] = 0;
+  }
+  pool_unlock();
+  return b;
+}
+
+// starts on a slab tail another thread left, or a new slab
+static int pool_refill_slab(pool_cache_t *cache, size_t bytes) {
+  pool_tail_t *t = NULL;
+  if (__atomic_load_n(&pool_shared.tails, __ATOMIC_RELAXED)) {
+    pool_lock();
+    t = pool_shared.tails;
+    if (t != NULL) __atomic_store_n(&pool_shared.tails, t->next, __ATOMIC_RELAXED);
+    pool_unlock();
+  }
+  // a tail too short for this block is dropped, it's less than POOL_MAX
+  if (t != NULL && t->left >= bytes) {
+    cache->slab = (char*)t;
+    cache->slab_left = t->left;
+    return 1;
+  }
+  char *slab = malloc(POOL_SLAB);
+  if (slab == NULL) return 0;
+  pool_lock();
+  *(void**)slab = pool_shared.slabs;
+  pool_shared.slabs = slab;
+  pool_unlock();
+  cache->slab = slab + POOL_GRAIN;
+  cache->slab_left = POOL_SLAB - POOL_GRAIN;
+  return 1;
+}
+
+static void *pool_alloc(size_t size) {
+  pool_cache_t *cache = &pool_cache;
+  size_t c = pool_class(size);
+  pool_block_t *b = cache->free[c];
+  if (b == NULL) b = pool_take(c, &cache->count[c]);
+  if (b != NULL) {
+    cache->free[c] = b->next;
+    cache->count[c] -= 1;
+    return b;
+  }
+  size_t bytes = (c + 1) * POOL_GRAIN;
+  if (cache->slab_left < bytes && !pool_refill_slab(cache, bytes)) return NULL;
+  void *res = cache->slab;
+  cache->slab += bytes;
+  cache->slab_left -= bytes;
+  return res;
+}
+
+static void pool_free(void *p, size_t size) {
+  pool_cache_t *cache = &pool_cache;
+  size_t c = pool_class(size);
+  pool_block_t *b = p;
+  b->next = cache->free[c];
+  cache->free[c] = b;
+  cache->count[c] += 1;
+  if (cache->count[c] >= 2 * POOL_BATCH) pool_give(cache, c, POOL_BATCH);
+}
+
+void sexp_pool_release() {
+  pool_cache_t *cache = &pool_cache;
+  for (size_t c = 0; c < POOL_CLASSES; ++c) {
+    while (cache->count[c] >= POOL_BATCH) pool_give(cache, c, POOL_BATCH);
+    pool_block_t *first = cache->free[c], *last = first;
+    if (first == NULL) continue;
+    while (last->next != NULL) last = last->next;
+    pool_lock();
+    last->next = pool_shared.loose[c];
+    pool_shared.nloose[c] += cache->count[c];
+    __atomic_store_n(&pool_shared.loose[c], first, __ATOMIC_RELAXED);
+    pool_unlock();
+    cache->free[c] = NULL;
+    cache->count[c] = 0;
+  }
+  // slabs are carved in multiples of POOL_GRAIN, which fits a pool_tail_t
+  if (cache->slab_left >= sizeof(pool_tail_t)) {
+    pool_tail_t *t = (pool_tail_t*)cache->slab;
+    t->left = cache->slab_left;
+    pool_lock();
+    t->next = pool_shared.tails;
+    __atomic_store_n(&pool_shared.tails, t, __ATOMIC_RELAXED);
+    pool_unlock();
+  }
+  cache->slab = NULL;
+  cache->slab_left = 0;
+}
+
+static void *default_alloc(size_t size) {
+  return size <= POOL_MAX ? pool_alloc(size) : malloc(size);
+}
+
+static void default_free(void *p, size_t size) {
+  if (size <= POOL_MAX) pool_free(p, size);
+  else free(p);
+}
+
+static void *default_realloc(void *p, size_t old, size_t size) {
+  if (old > POOL_MAX && size > POOL_MAX) return realloc(p, size);
+  if (old <= POOL_MAX && size <= POOL_MAX && pool_class(old) == pool_class(size)) {
+    return p;
+  }
+  void *res = default_alloc(size);
+  if (res == NULL) return NULL;
+  memcpy(res, p, old < size ? old : size);
+  default_free(p, old);
+  return res;
+}
+
+// bytes that a block of size bytes is rounded up by
+static size_t default_slack(size_t size) {
+  return size <= POOL_MAX ? (pool_class(size) + 1) * POOL_GRAIN - size : 0;
+}
+
+#else
+
+void sexp_pool_release() {}
+
+static void *default_alloc(size_t size) {
+  return malloc(size);
+}
+
+static void default_free(void *p, size_t size) {
+  free(p);
+}
+
+static void *default_realloc(void *p, size_t old, size_t size) {
+  return realloc(p, size);
+}
+
+static size_t default_slack(size_t size) {
+  return 0;
+}
+
+#endif
+
+static void *mem_alloc(const sexp_allocator_t *a, size_t size) {
+  return a ? a->alloc(a->ctx, size) : default_alloc(size);
+}
+
+static void *mem_realloc(const sexp_allocator_t *a, void *p, size_t old, size_t size) {
+  return a ? a->realloc(a->ctx, p, old, size) : default_realloc(p, old, size);
+}
+
+static void mem_free(const sexp_allocator_t *a, void *p, size_t size) {
+  if (a) a->free(a->ctx, p, size);
+  else default_free(p, size);
+}
+
+// counting allocator, the counters are only approximately consistent with
+// each other while other threads allocate
+static void counting_add(sexp_counting_t *c, size_t bytes, size_t blocks) {
+  sexp_alloc_stats_t *s = &c->stats;
+  size_t live = __atomic_add_fetch(&s->live_bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->live_blocks, blocks, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->allocs, 1, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&s->peak_bytes, __ATOMIC_RELAXED);
+  while (live > peak && !__atomic_compare_exchange_n(&s->peak_bytes, &peak, live,
+        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static void counting_sub(sexp_counting_t *c, size_t bytes) {
+  __atomic_sub_fetch(&c->stats.live_bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&c->stats.live_blocks, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->stats.frees, 1, __ATOMIC_RELAXED);
+}
+
+static void *counting_alloc(void *ctx, size_t size) {
+  sexp_counting_t *c = ctx;
+  void *p = mem_alloc(c->inner, size);
+  if (p != NULL) counting_add(c, size, 1);
+  return p;
+}
+
+static void *counting_realloc(void *ctx, void *p, size_t old, size_t size) {
+  sexp_counting_t *c = ctx;
+  void *res = mem_realloc(c->inner, p, old, size);
+  if (res == NULL) return NULL;
+  counting_add(c, size - old, 0); // wraps around when shrinking
+  return res;
+}
+
+static void counting_free(void *ctx, void *p, size_t size) {
+  sexp_counting_t *c = ctx;
+  mem_free(c->inner, p, size);
+  counting_sub(c, size);
+}
+
+void sexp_counting_init(sexp_counting_t *c, const sexp_allocator_t *inner) {
+  memset(c, 0, sizeof(sexp_counting_t));
+  c->allocator.alloc = counting_alloc;
+  c->allocator.realloc = counting_realloc;
+  c->allocator.free = counting_free;
+  c->allocator.ctx = c;
+  c->inner = inner;
+}
+
+sexp_alloc_stats_t sexp_counting_stats(const sexp_counting_t *c) {
+  sexp_alloc_stats_t s;
+  s.live_bytes = __atomic_load_n(&c->stats.live_bytes, __ATOMIC_RELAXED);
+  s.live_blocks = __atomic_load_n(&c->stats.live_blocks, __ATOMIC_RELAXED);
+  s.peak_bytes = __atomic_load_n(&c->stats.peak_bytes, __ATOMIC_RELAXED);
+  s.allocs = __atomic_load_n(&c->stats.allocs, __ATOMIC_RELAXED);
+  s.frees = __atomic_load_n(&c->stats.frees, __ATOMIC_RELAXED);
+  return s;
+}
+
+// a node of size bytes with an initialized header, NULL if out of memory
+static void *sexp_alloc_node(sexp_type_t type, size_t size) {
+  const sexp_allocator_t *a = current_allocator;
+  sexp_t *e = mem_alloc(a, size);
+  if (e == NULL) return NULL;
+  e->type = type;
+  e->refs = 1;
+  e->hash = 0;
+  e->alloc = a;
+  return e;
+}
+
+sexp_t *sexp_ref(sexp_t *e) {
+  if (e != NULL) e->refs += 1;
+  return e;
+}
+
 void sexp_free(sexp_t *e) {
   if (e == NULL) return;
+  if (--e->refs > 0) return;
   switch (e->type) {
     case SEXP_STRING: sexp_string_free(e); return;
     case SEXP_SYMBOL: sexp_symbol_free(e); return;
@@ -45,7 +392,7 @@ void sexp_free(sexp_t *e) {
  *****************************************************************************/
 
 typedef struct sexp_string_t {
-  sexp_type_t type;
+  sexp_t head;
   size_t len;
   char val[];
 } sexp_string_t;
@@ -54,19 +401,33 @@ sexp_t *sexp_new_string(const char* s) {
   return sexp_new_string_len(s, strlen(s));
 }
 
+// string node with room for cap bytes and undefined contents
+static sexp_t *sexp_alloc_string(size_t cap) {
+  sexp_string_t *e = sexp_alloc_node(SEXP_STRING, sizeof(sexp_string_t) + cap + 1);
+  if (e) e->len = cap;
+  return (sexp_t*)e;
+}
+
+// gives back the room a string node doesn't need after shrinking to len
+static sexp_t *sexp_string_shrink(sexp_t *e, size_t cap) {
+  sexp_string_t *s = (sexp_string_t*)e;
+  if (s->len == cap) return e;
+  s = mem_realloc(e->alloc, s, sizeof(sexp_string_t) + cap + 1,
+      sizeof(sexp_string_t) + s->len + 1);
+  return (sexp_t*)s;
+}
+
 sexp_t *sexp_new_string_len(const char* s, size_t len) {
   if (s == NULL) return NULL;
-  sexp_string_t *e = malloc(sizeof(sexp_string_t) + len + 1);
-  if (!e) die("out of memory");
-  e->type = SEXP_STRING;
-  e->len = len;
+  sexp_string_t *e = (sexp_string_t*)sexp_alloc_string(len);
+  if (e == NULL) return NULL;
   memcpy(e->val, s, len);
   e->val[len] = '\0';
   return (sexp_t*)e;
 }
 
 void sexp_string_free(sexp_t *e) {
-  free(e);
+  mem_free(e->alloc, e, sizeof(sexp_string_t) + sexp_string_length(e) + 1);
 }
 
 int sexp_is_string(const sexp_t *e) {
@@ -90,7 +451,7 @@ size_t sexp_string_length(const sexp_t* e) {
  *****************************************************************************/
 
 typedef struct sexp_symbol_t {
-  sexp_type_t type;
+  sexp_t head;
   size_t len;
   char val[];
 } sexp_symbol_t;
@@ -101,9 +462,8 @@ sexp_t *sexp_new_symbol(const char* s) {
 
 sexp_t *sexp_new_symbol_len(const char* s, size_t len) {
   if (s == NULL) return NULL;
-  sexp_string_t *e = malloc(sizeof(sexp_symbol_t) + len + 1);
-  if (!e) die("out of memory");
-  e->type = SEXP_SYMBOL;
+  sexp_symbol_t *e = sexp_alloc_node(SEXP_SYMBOL, sizeof(sexp_symbol_t) + len + 1);
+  if (e == NULL) return NULL;
   e->len = len;
   memcpy(e->val, s, len);
   e->val[len] = '\0';
@@ -111,7 +471,7 @@ sexp_t *sexp_new_symbol_len(const char* s, size_t len) {
 }
 
 void sexp_symbol_free(sexp_t *e) {
-  free(e);
+  mem_free(e->alloc, e, sizeof(sexp_symbol_t) + sexp_symbol_length(e) + 1);
 }
 
 int sexp_is_symbol(const sexp_t *e) {
@@ -135,20 +495,19 @@ size_t sexp_symbol_length(const sexp_t* e) {
  *****************************************************************************/
 
 typedef struct sexp_num_t {
-  sexp_type_t type;
+  sexp_t head;
   double val;
 } sexp_num_t;
 
 sexp_t *sexp_new_number(double num) {
-  sexp_num_t *e = malloc(sizeof(sexp_num_t));
-  if (!e) die("out of memory");
-  e->type = SEXP_NUMBER;
+  sexp_num_t *e = sexp_alloc_node(SEXP_NUMBER, sizeof(sexp_num_t));
+  if (e == NULL) return NULL;
   e->val = num;
   return (sexp_t*)e;
 }
 
 void sexp_number_free(sexp_t *e) {
-  free(e);
+  mem_free(e->alloc, e, sizeof(sexp_num_t));
 }
 
 int sexp_is_number(const sexp_t *e) {
@@ -164,41 +523,350 @@ double sexp_number_get(const sexp_t *e) {
  * LIST
  *****************************************************************************/
 
+// Lists start out flat: a single array of elements that sexp_list_append
+// grows in place. The persistent operations (set, insert, remove, concat,
+// slice) return lists whose elements are in a rope, a height balanced tree of
+// chunks that versions of the list share. Flat inputs are copied into a new
+// rope and not changed, so they can be read by others meanwhile. Ropes are
+// never modified after construction, updates copy the O(log n) nodes on the
+// path to the change.
+
+#define ROPE_CHUNK 32
+
+typedef struct rope_t {
+  unsigned refs;
+  unsigned height;            // 0 for leaves
+  size_t size;                // number of elements in this subtree
+  const sexp_allocator_t *alloc;
+  struct rope_t *left;        // inner nodes only
+  struct rope_t *right;       // inner nodes only
+  sexp_t *items[];            // leaves only, holds a reference to each item
+} rope_t;
+
+// lookup table of a list that opted in with sexp_list_index, built there and
+// kept up to date by appends so that lookups only read it
+typedef struct list_index_t {
+  size_t cap;                 // power of two, 0 if building it ran out of memory
+  size_t *slots;              // position + 1 of the first element of a value
+} list_index_t;
+
 typedef struct sexp_list_t {
-  sexp_type_t type;
+  sexp_t head;
   size_t len;
   size_t cap;
+  rope_t *tree;               // if set, elements are unused
+  list_index_t *index;
   sexp_t *elements[];
 } sexp_list_t;
 
+// result of rope operations that ran out of memory, they release their
+// inputs then. operations given ROPE_OOM pass it on.
+static rope_t rope_oom;
+#define ROPE_OOM (&rope_oom)
+
+static unsigned rope_height(const rope_t *r) {
+  return r == NULL ? 0 : r->height;
+}
+
+static size_t rope_size(const rope_t *r) {
+  return r == NULL ? 0 : r->size;
+}
+
+static rope_t *rope_ref(rope_t *r) {
+  if (r != NULL && r != ROPE_OOM) r->refs += 1;
+  return r;
+}
+
+static void rope_release(rope_t *r) {
+  if (r == NULL || r == ROPE_OOM || --r->refs > 0) return;
+  if (r->height == 0) {
+    for (size_t i = 0; i < r->size; ++i) sexp_free(r->items[i]);
+    mem_free(r->alloc, r, sizeof(rope_t) + sizeof(sexp_t*) * r->size);
+  } else {
+    rope_release(r->left);
+    rope_release(r->right);
+    mem_free(r->alloc, r, sizeof(rope_t));
+  }
+}
+
+static rope_t *rope_alloc(size_t size) {
+  const sexp_allocator_t *a = current_allocator;
+  rope_t *r = mem_alloc(a, size);
+  if (r == NULL) return NULL;
+  r->refs = 1;
+  r->alloc = a;
+  return r;
+}
+
+// takes over the references to items, releases them if out of memory
+static rope_t *rope_leaf(sexp_t **items, size_t n) {
+  if (n == 0) return NULL;
+  rope_t *r = rope_alloc(sizeof(rope_t) + sizeof(sexp_t*) * n);
+  if (r == NULL) {
+    for (size_t i = 0; i < n; ++i) sexp_free(items[i]);
+    return ROPE_OOM;
+  }
+  r->height = 0;
+  r->size = n;
+  r->left = r->right = NULL;
+  memcpy(r->items, items, sizeof(sexp_t*) * n);
+  return r;
+}
+
+static rope_t *rope_leaf_copy(const rope_t *leaf, size_t from, size_t to) {
+  for (size_t i = from; i < to; ++i) sexp_ref(leaf->items[i]);
+  return rope_leaf((sexp_t**)&leaf->items[from], to - from);
+}
+
+// consumes l and r, both non-empty
+static rope_t *rope_node(rope_t *l, rope_t *r) {
+  if (l == ROPE_OOM || r == ROPE_OOM) {
+    rope_release(l);
+    rope_release(r);
+    return ROPE_OOM;
+  }
+  if (l->height == 0 && r->height == 0 && l->size + r->size <= ROPE_CHUNK) {
+    sexp_t *items[ROPE_CHUNK];
+    for (size_t i = 0; i < l->size; ++i) items[i] = sexp_ref(l->items[i]);
+    for (size_t i = 0; i < r->size; ++i) items[l->size+i] = sexp_ref(r->items[i]);
+    rope_t *res = rope_leaf(items, l->size + r->size);
+    rope_release(l);
+    rope_release(r);
+    return res;
+  }
+  rope_t *res = rope_alloc(sizeof(rope_t));
+  if (res == NULL) {
+    rope_release(l);
+    rope_release(r);
+    return ROPE_OOM;
+  }
+  res->height = (l->height > r->height ? l->height : r->height) + 1;
+  res->size = l->size + r->size;
+  res->left = l;
+  res->right = r;
+  return res;
+}
+
+// like rope_node, but restores balance if l and r differ in height by two
+static rope_t *rope_balance(rope_t *l, rope_t *r) {
+  if (l == ROPE_OOM || r == ROPE_OOM) return rope_node(l, r);
+  if (l->height > r->height + 1) {
+    rope_t *ll = rope_ref(l->left), *lr = rope_ref(l->right);
+    rope_release(l);
+    if (rope_height(ll) >= rope_height(lr)) {
+      return rope_node(ll, rope_node(lr, r));
+    }
+    rope_t *lrl = rope_ref(lr->left), *lrr = rope_ref(lr->right);
+    rope_release(lr);
+    return rope_node(rope_node(ll, lrl), rope_node(lrr, r));
+  }
+  if (r->height > l->height + 1) {
+    rope_t *rl = rope_ref(r->left), *rr = rope_ref(r->right);
+    rope_release(r);
+    if (rope_height(rr) >= rope_height(rl)) {
+      return rope_node(rope_node(l, rl), rr);
+    }
+    rope_t *rll = rope_ref(rl->left), *rlr = rope_ref(rl->right);
+    rope_release(rl);
+    return rope_node(rope_node(l, rll), rope_node(rlr, rr));
+  }
+  return rope_node(l, r);
+}
+
+// consumes l and r, runs in O(|height(l) - height(r)|)
+static rope_t *rope_concat(rope_t *l, rope_t *r) {
+  if (l == NULL) return r;
+  if (r == NULL) return l;
+  if (l == ROPE_OOM || r == ROPE_OOM) return rope_node(l, r);
+  if (l->height > r->height + 1) {
+    rope_t *ll = rope_ref(l->left), *lr = rope_ref(l->right);
+    rope_release(l);
+    return rope_balance(ll, rope_concat(lr, r));
+  }
+  if (r->height > l->height + 1) {
+    rope_t *rl = rope_ref(r->left), *rr = rope_ref(r->right);
+    rope_release(r);
+    return rope_balance(rope_concat(l, rl), rr);
+  }
+  return rope_node(l, r);
+}
+
+static size_t rope_edge_size(const rope_t *r, int last) {
+  while (r->height > 0) r = last ? r->right : r->left;
+  return r->size;
+}
+
+// l with the elements of the leaf r added to its last leaf, which must have
+// room for them. consumes neither.
+static rope_t *rope_append_leaf(rope_t *l, rope_t *r) {
+  if (l->height == 0) return rope_node(rope_ref(l), rope_ref(r));
+  rope_t *right = rope_append_leaf(l->right, r);
+  if (right == ROPE_OOM) return right;
+  return rope_node(rope_ref(l->left), right);
+}
+
+static void rope_split(rope_t *r, size_t n, rope_t **left, rope_t **right);
+
+// consumes l and r. leaves that meet at the seam are merged if they fit into
+// one chunk, so repeated appends, inserts and removes don't pile up tiny
+// leaves.
+static rope_t *rope_join(rope_t *l, rope_t *r) {
+  if (l == NULL || r == NULL || l == ROPE_OOM || r == ROPE_OOM) return rope_concat(l, r);
+  size_t first = rope_edge_size(r, 0);
+  if (rope_edge_size(l, 1) + first > ROPE_CHUNK) return rope_concat(l, r);
+  rope_t *leaf, *rest;
+  rope_split(r, first, &leaf, &rest);
+  if (leaf == ROPE_OOM || rest == ROPE_OOM) {
+    rope_release(l);
+    rope_release(rest);
+    return rope_node(leaf, ROPE_OOM);
+  }
+  rope_t *merged = rope_append_leaf(l, leaf);
+  rope_release(l);
+  rope_release(leaf);
+  return rope_concat(merged, rest);
+}
+
+// consumes r, left receives [0, n) and right [n, size). either side may be
+// ROPE_OOM afterwards.
+static void rope_split(rope_t *r, size_t n, rope_t **left, rope_t **right) {
+  if (r == NULL || r == ROPE_OOM) {
+    *left = *right = r;
+  } else if (n == 0) {
+    *left = NULL;
+    *right = r;
+  } else if (n >= r->size) {
+    *left = r;
+    *right = NULL;
+  } else if (r->height == 0) {
+    *left = rope_leaf_copy(r, 0, n);
+    *right = rope_leaf_copy(r, n, r->size);
+    rope_release(r);
+  } else {
+    size_t ls = r->left->size;
+    rope_t *a, *b;
+    if (n <= ls) {
+      rope_split(rope_ref(r->left), n, &a, &b);
+      *left = a;
+      *right = rope_join(b, rope_ref(r->right));
+    } else {
+      rope_split(rope_ref(r->right), n - ls, &a, &b);
+      *left = rope_join(rope_ref(r->left), a);
+      *right = b;
+    }
+    rope_release(r);
+  }
+}
+
+static sexp_t *rope_nth(const rope_t *r, size_t n) {
+  while (r->height > 0) {
+    if (n < r->left->size) {
+      r = r->left;
+    } else {
+      n -= r->left->size;
+      r = r->right;
+    }
+  }
+  return r->items[n];
+}
+
+// returns a copy of r with element n replaced by val, consumes val
+static rope_t *rope_set(const rope_t *r, size_t n, sexp_t *val) {
+  if (r->height == 0) {
+    rope_t *res = rope_leaf_copy(r, 0, r->size);
+    if (res == ROPE_OOM) {
+      sexp_free(val);
+      return res;
+    }
+    sexp_free(res->items[n]);
+    res->items[n] = val;
+    return res;
+  }
+  if (n < r->left->size) {
+    return rope_node(rope_set(r->left, n, val), rope_ref(r->right));
+  }
+  return rope_node(rope_ref(r->left), rope_set(r->right, n - r->left->size, val));
+}
+
+// takes over the references to items
+static rope_t *rope_build(sexp_t **items, size_t n) {
+  if (n <= ROPE_CHUNK) return rope_leaf(items, n);
+  size_t chunks = (n + ROPE_CHUNK - 1) / ROPE_CHUNK;
+  size_t half = (chunks / 2) * ROPE_CHUNK;
+  return rope_node(rope_build(items, half), rope_build(items + half, n - half));
+}
+
+static size_t sexp_list_size(size_t cap) {
+  return sizeof(sexp_list_t) + sizeof(sexp_t*) * cap;
+}
+
+// returns NULL if out of memory, list is unchanged then
 static sexp_list_t *sexp_list_ensure_size(sexp_list_t *list, size_t capacity) {
   if (list->cap < capacity) {
     size_t newcap = list->cap < 2 ? 2 : list->cap;
     while (newcap < capacity) {
       newcap *= 1.5;
     }
-    list = realloc(list, sizeof(sexp_list_t) + sizeof(sexp_t*) * newcap);
-    if (!list) die("out of memory");
+    list = mem_realloc(list->head.alloc, list, sexp_list_size(list->cap),
+        sexp_list_size(newcap));
+    if (list == NULL) return NULL;
     list->cap = newcap;
   }
   return list;
 }
 
-sexp_t *sexp_new_list() {
-  sexp_list_t *e = malloc(sizeof(sexp_list_t));
-  if (!e) die("out of memory");
-  e->type = SEXP_LIST;
+static sexp_list_t *sexp_list_alloc(size_t cap) {
+  sexp_list_t *e = sexp_alloc_node(SEXP_LIST, sexp_list_size(cap));
+  if (e == NULL) return NULL;
   e->len = 0;
-  e->cap = 0;
+  e->cap = cap;
+  e->tree = NULL;
+  e->index = NULL;
+  return e;
+}
+
+sexp_t *sexp_new_list() {
+  return (sexp_t*)sexp_list_alloc(0);
+}
+
+// consumes tree
+static sexp_t *sexp_new_list_tree(rope_t *tree) {
+  if (tree == ROPE_OOM) return NULL;
+  sexp_list_t *e = sexp_list_alloc(0);
+  if (e == NULL) {
+    rope_release(tree);
+    return NULL;
+  }
+  e->len = rope_size(tree);
+  e->tree = tree;
   return (sexp_t*)e;
 }
 
+static void list_index_reset(sexp_list_t *list) {
+  list_index_t *idx = list->index;
+  if (idx == NULL || idx->cap == 0) return;
+  mem_free(list->head.alloc, idx->slots, sizeof(size_t) * idx->cap);
+  idx->cap = 0;
+  idx->slots = NULL;
+}
+
+static int list_index_alloc(sexp_list_t *list);
+static void list_index_update(sexp_list_t *list);
+
 void sexp_list_free(sexp_t *e) {
   sexp_list_t *list = (sexp_list_t*)e;
-  for (int i = 0; i < list->len; ++i) {
-    sexp_free(list->elements[i]);
+  if (list->index) {
+    list_index_reset(list);
+    mem_free(e->alloc, list->index, sizeof(list_index_t));
   }
-  free(e);
+  if (list->tree) {
+    rope_release(list->tree);
+  } else {
+    for (int i = 0; i < list->len; ++i) {
+      sexp_free(list->elements[i]);
+    }
+  }
+  mem_free(e->alloc, e, sexp_list_size(list->cap));
 }
 
 int sexp_is_list(const sexp_t *e) {
@@ -212,160 +880,1458 @@ size_t sexp_list_length(const sexp_t *e) {
 sexp_t *sexp_list_nth(const sexp_t *e, int n) {
   sexp_list_t *list = (sexp_list_t*)e;
   assert(n >= 0 && n < list->len);
+  if (list->tree) return rope_nth(list->tree, n);
   return list->elements[n];
 }
 
 sexp_t *sexp_list_append(sexp_t *e, sexp_t *val) {
   sexp_list_t *list = (sexp_list_t*)e;
   size_t len = list->len;
+  if (list->tree) {
+    sexp_list_t *res = list;
+    if (e->refs > 1 && (res = sexp_list_alloc(0)) == NULL) return NULL;
+    if (res != list && list->index && !list_index_alloc(res)) {
+      sexp_list_free((sexp_t*)res);
+      return NULL;
+    }
+    // the leaf takes its own reference, so val survives a failed join
+    sexp_ref(val);
+    rope_t *tree = rope_join(rope_ref(list->tree), rope_leaf(&val, 1));
+    if (tree == ROPE_OOM) {
+      if (res != list) sexp_list_free((sexp_t*)res);
+      return NULL;
+    }
+    sexp_free(val);
+    if (res == list) {
+      rope_release(list->tree);
+    } else {
+      sexp_free(e);
+    }
+    res->tree = tree;
+    res->len = len + 1;
+    res->head.hash = 0;
+    list_index_update(res);
+    return (sexp_t*)res;
+  }
+  if (e->refs > 1) {
+    // shared with someone else, leave their version alone
+    sexp_list_t *copy = sexp_list_alloc(len + 1);
+    if (copy == NULL) return NULL;
+    if (list->index && !list_index_alloc(copy)) {
+      sexp_list_free((sexp_t*)copy);
+      return NULL;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      copy->elements[i] = sexp_ref(list->elements[i]);
+    }
+    copy->len = len;
+    sexp_free(e);
+    list = copy;
+  }
   list = sexp_list_ensure_size(list, len + 1);
+  if (list == NULL) return NULL;
   list->elements[len] = val;
   list->len = len + 1;
+  list->head.hash = 0;
+  list_index_update(list);
   return (sexp_t*)list;
 }
 
-/******************************************************************************
- * PARSER
- *****************************************************************************/
-
-static inline int isws(char ch) {
-  return ch == ' ' || ch == '\t' || ch == '\f' || ch == '\n';
+// a new reference to the elements of e as a rope. flat lists are copied into
+// a new rope and stay flat, the versions derived from them are ropes. returns
+// ROPE_OOM if out of memory.
+static rope_t *sexp_list_tree(const sexp_t *e) {
+  const sexp_list_t *list = (const sexp_list_t*)e;
+  if (list->tree != NULL || list->len == 0) return rope_ref(list->tree);
+  for (size_t i = 0; i < list->len; ++i) sexp_ref(list->elements[i]);
+  return rope_build((sexp_t**)list->elements, list->len);
 }
 
-int unescaped_length(const char* src, int len) {
-  if (len < 0) len = strlen(src);
-  size_t res = 0;
-  int p = 0;
-  while (p < len) {
-    if (src[p] == '\\') ++p;
-    ++p;
-    ++res;
+sexp_t *sexp_list_set(const sexp_t *e, int n, sexp_t *val) {
+  assert(n >= 0 && (size_t)n < sexp_list_length(e));
+  rope_t *tree = sexp_list_tree(e);
+  if (tree == ROPE_OOM) {
+    sexp_free(val);
+    return NULL;
   }
+  sexp_t *res = sexp_new_list_tree(rope_set(tree, n, val));
+  rope_release(tree);
   return res;
 }
 
-void unescape(const char* src, char* dst, int len) {
-  if (len < 0) len = strlen(src);
-  int p = 0;
-  while (p < len) {
-    if (src[p] == '\\') {
-      ++p;
-      switch (src[p]) {
-        case '0': *dst = '\0'; break;
-        case 'a': *dst = '\a'; break;
-        case 'b': *dst = '\b'; break;
-        case 'f': *dst = '\f'; break;
-        case 'n': *dst = '\n'; break;
-        case 'r': *dst = '\r'; break;
-        case 't': *dst = '\t'; break;
-        case 'v': *dst = '\v'; break;
-        case '?': *dst = '\?'; break;
-        default: *dst = src[p];
-      }
-    } else {
-      *dst = src[p];
-    }
-    dst++;
-    p++;
-  }
+sexp_t *sexp_list_insert(const sexp_t *e, int n, sexp_t *val) {
+  assert(n >= 0 && (size_t)n <= sexp_list_length(e));
+  rope_t *left, *right;
+  rope_split(sexp_list_tree(e), n, &left, &right);
+  left = rope_join(left, rope_leaf(&val, 1));
+  return sexp_new_list_tree(rope_join(left, right));
 }
 
-typedef enum token_type {
-  TT_ERR,
-  TT_EOF,
-  TT_OPEN,
-  TT_CLOSE,
-  TT_STRING,
-  TT_ELSE
-} token_type;
+sexp_t *sexp_list_remove(const sexp_t *e, int n) {
+  assert(n >= 0 && (size_t)n < sexp_list_length(e));
+  rope_t *left, *mid, *right;
+  rope_split(sexp_list_tree(e), n, &left, &right);
+  rope_split(right, 1, &mid, &right);
+  rope_release(mid);
+  return sexp_new_list_tree(rope_join(left, right));
+}
 
-typedef struct lexer {
-  token_type type;
-  const char* src;
-  const char* start;
-  const char* end;
-} lexer;
+sexp_t *sexp_list_concat(const sexp_t *a, const sexp_t *b) {
+  rope_t *l = sexp_list_tree(a);
+  rope_t *r = sexp_list_tree(b);
+  return sexp_new_list_tree(rope_join(l, r));
+}
 
-static void lexer_init(lexer *lex, const char* src) {
-  lex->type = TT_ERR;
-  lex->src = src;
-  lex->start = src;
-  lex->end = src;
+sexp_t *sexp_list_slice(const sexp_t *e, int from, int to) {
+  assert(from >= 0 && from <= to && (size_t)to <= sexp_list_length(e));
+  rope_t *left, *mid, *right;
+  rope_split(sexp_list_tree(e), to, &mid, &right);
+  rope_split(mid, from, &left, &mid);
+  rope_release(left);
+  rope_release(right);
+  return sexp_new_list_tree(mid);
 }
 
-static void lexer_print(lexer *lex) {
-  const char* rev[] = {
-    "TT_ERR", "TT_EOF", "TT_OPEN", "TT_CLOSE", "TT_STRING", "TT_ELSE"
-  };
-  if (lex->type != TT_ERR && lex->type != TT_EOF) {
-    printf("type = %s, start = %zu, end = %zu, val = '%.*s'\n",
-        rev[lex->type], lex->start - lex->src, lex->end - lex->src, 
-        (int)(lex->end - lex->start), lex->start);
-  } else {
-    printf("type = %s, start = %zu, end = %zu, val = 'N/A'\n",
-        rev[lex->type], lex->start - lex->src, lex->end - lex->src);
-  }
+static int list_index_alloc(sexp_list_t *list) {
+  list->index = mem_alloc(list->head.alloc, sizeof(list_index_t));
+  if (list->index == NULL) return 0;
+  list->index->cap = 0;
+  list->index->slots = NULL;
+  return 1;
 }
 
-static int lexer_next(lexer *lex) {
-  const char* s = lex->end;
-skip:
-  while (isws(*s)) ++s;
-  if (*s == ';') {
-    while (*s != '\n' && *s != '\0') ++s;
-    goto skip;
+// records element i unless an equal one comes before it
+static void list_index_put(sexp_list_t *list, size_t *slots, size_t cap, size_t i) {
+  const sexp_t *e = sexp_list_nth((sexp_t*)list, i);
+  size_t p = sexp_hash(e) & (cap - 1);
+  while (slots[p] != 0 && !sexp_equal(sexp_list_nth((sexp_t*)list, slots[p] - 1), e)) {
+    p = (p + 1) & (cap - 1);
   }
+  if (slots[p] == 0) slots[p] = i + 1;
+}
 
-  const char* start = s;
+static int list_index_build(sexp_list_t *list) {
+  list_index_t *idx = list->index;
+  size_t cap = 16;
+  while (cap < list->len * 2) cap *= 2;
+  size_t *slots = mem_alloc(list->head.alloc, sizeof(size_t) * cap);
+  if (slots == NULL) return 0;
+  memset(slots, 0, sizeof(size_t) * cap);
+  for (size_t i = 0; i < list->len; ++i) list_index_put(list, slots, cap, i);
+  list_index_reset(list);
+  idx->cap = cap;
+  idx->slots = slots;
+  return 1;
+}
 
-  if (*s == '\0') {
-    lex->type = TT_EOF;
-    goto done;
+// after an append, grows the table when it gets half full. without memory
+// for that the table is dropped and lookups scan.
+static void list_index_update(sexp_list_t *list) {
+  list_index_t *idx = list->index;
+  if (idx == NULL) return;
+  if (idx->cap > 0 && list->len * 2 <= idx->cap) {
+    list_index_put(list, idx->slots, idx->cap, list->len - 1);
+  } else if (!list_index_build(list)) {
+    list_index_reset(list);
   }
+}
 
-  if (*s == '"') {
-    ++s;
-    while (*s != '\0' && *s != '\n' && *s != '"') {
-      if (*s == '\\') ++s;
-      ++s;
-    }
-    if (*s == '"') {
-      ++s;
-      lex->type = TT_STRING;
-      goto done;
-    } else {
-      goto fail;
+int sexp_list_index(sexp_t *e) {
+  sexp_list_t *list = (sexp_list_t*)e;
+  if (list->index == NULL && !list_index_alloc(list)) return 0;
+  if (list_index_build(list)) return 1;
+  list_index_reset(list);
+  mem_free(e->alloc, list->index, sizeof(list_index_t));
+  list->index = NULL;
+  return 0;
+}
+
+int sexp_list_find(const sexp_t *e, const sexp_t *val) {
+  sexp_list_t *list = (sexp_list_t*)e;
+  list_index_t *idx = list->index;
+  if (idx != NULL && idx->cap > 0) {
+    size_t p = sexp_hash(val) & (idx->cap - 1);
+    while (idx->slots[p] != 0) {
+      size_t n = idx->slots[p] - 1;
+      if (sexp_equal(sexp_list_nth(e, n), val)) return n;
+      p = (p + 1) & (idx->cap - 1);
     }
+    return -1;
   }
-
-  if (*s == '(' || *s == '{' || *s == '[') {
-    ++s;
-    lex->type = TT_OPEN;
-    goto done;
+  // without an index, or out of memory for it
+  for (size_t i = 0; i < list->len; ++i) {
+    if (sexp_equal(sexp_list_nth(e, i), val)) return i;
   }
+  return -1;
+}
 
-  if (*s == ')' || *s == '}' || *s == ']') {
-    ++s;
-    lex->type = TT_CLOSE;
-    goto done;
-  }
+int sexp_list_contains(const sexp_t *e, const sexp_t *val) {
+  return sexp_list_find(e, val) >= 0;
+}
 
-  while (*s != 0 && strchr(" \n\t\f;({[]})\"", *s) == NULL) {
-    ++s;
-  }
-  lex->type = TT_ELSE;
-  goto done;
+/******************************************************************************
+ * FOOTPRINT
+ *****************************************************************************/
 
-fail:
-  lex->type = TT_ERR;
-  return 0;
+// A compacted tree lives in one block, each list followed by its elements in
+// preorder. Its nodes point to the allocator in the block header, which
+// counts them down as they are freed and frees the block with the last one.
+// Nodes that are reallocated move out of the block to the allocator the
+// block came from, which also serves everything else asked of the block.
 
-done:
-  lex->start = start;
+#define COMPACT_ALIGN 8
+
+typedef struct compact_block_t {
+  sexp_allocator_t allocator;
+  const sexp_allocator_t *inner;
+  size_t size;                // of the whole block
+  size_t live;                // nodes in the block that weren't freed yet
+} compact_block_t;
+
+static size_t compact_round(size_t size) {
+  return (size + COMPACT_ALIGN - 1) & ~(size_t)(COMPACT_ALIGN - 1);
+}
+
+static int compact_owns(const compact_block_t *b, const void *p) {
+  return (const char*)p >= (const char*)b && (const char*)p < (const char*)b + b->size;
+}
+
+static void compact_release(compact_block_t *b) {
+  if (__atomic_sub_fetch(&b->live, 1, __ATOMIC_ACQ_REL) == 0) {
+    mem_free(b->inner, b, b->size);
+  }
+}
+
+static void *compact_alloc(void *ctx, size_t size) {
+  compact_block_t *b = ctx;
+  return mem_alloc(b->inner, size);
+}
+
+// only nodes are in the block, so the header of the copy can be redirected
+static void *compact_realloc(void *ctx, void *p, size_t old, size_t size) {
+  compact_block_t *b = ctx;
+  if (!compact_owns(b, p)) return mem_realloc(b->inner, p, old, size);
+  sexp_t *res = mem_alloc(b->inner, size);
+  if (res == NULL) return NULL;
+  memcpy(res, p, old < size ? old : size);
+  res->alloc = b->inner;
+  compact_release(b);
+  return res;
+}
+
+static void compact_free(void *ctx, void *p, size_t size) {
+  compact_block_t *b = ctx;
+  if (compact_owns(b, p)) compact_release(b);
+  else mem_free(b->inner, p, size);
+}
+
+static int compacted(const sexp_t *e) {
+  return e->alloc != NULL && e->alloc->free == compact_free;
+}
+
+// set of nodes that are referenced more than once, mapped to their copies
+typedef struct node_map_t {
+  size_t len;
+  size_t cap;                 // power of two
+  const void **keys;
+  sexp_t **vals;
+} node_map_t;
+
+static size_t node_map_slot(const node_map_t *m, const void *key) {
+  size_t p = (size_t)(((uintptr_t)key >> 3) * 0x9e3779b97f4a7c15ull >> 16) & (m->cap - 1);
+  while (m->keys[p] != NULL && m->keys[p] != key) p = (p + 1) & (m->cap - 1);
+  return p;
+}
+
+// whether key was already in the map, -1 if out of memory
+static int node_map_add(node_map_t *m, const void *key) {
+  if (2 * (m->len + 1) > m->cap) {
+    node_map_t grown = { 0, m->cap ? m->cap * 2 : 64, NULL, NULL };
+    grown.keys = mem_alloc(current_allocator, sizeof(void*) * grown.cap);
+    grown.vals = mem_alloc(current_allocator, sizeof(sexp_t*) * grown.cap);
+    if (grown.keys == NULL || grown.vals == NULL) {
+      if (grown.keys) mem_free(current_allocator, grown.keys, sizeof(void*) * grown.cap);
+      if (grown.vals) mem_free(current_allocator, grown.vals, sizeof(sexp_t*) * grown.cap);
+      return -1;
+    }
+    memset(grown.keys, 0, sizeof(void*) * grown.cap);
+    for (size_t i = 0; i < m->cap; ++i) {
+      if (m->keys[i] == NULL) continue;
+      size_t p = node_map_slot(&grown, m->keys[i]);
+      grown.keys[p] = m->keys[i];
+      grown.vals[p] = m->vals[i];
+    }
+    grown.len = m->len;
+    if (m->cap > 0) {
+      mem_free(current_allocator, m->keys, sizeof(void*) * m->cap);
+      mem_free(current_allocator, m->vals, sizeof(sexp_t*) * m->cap);
+    }
+    *m = grown;
+  }
+  size_t p = node_map_slot(m, key);
+  if (m->keys[p] != NULL) return 1;
+  m->keys[p] = key;
+  m->vals[p] = NULL;
+  m->len += 1;
+  return 0;
+}
+
+static void node_map_free(node_map_t *m) {
+  if (m->cap == 0) return;
+  mem_free(current_allocator, m->keys, sizeof(void*) * m->cap);
+  mem_free(current_allocator, m->vals, sizeof(sexp_t*) * m->cap);
+}
+
+// bytes of the allocation holding e
+static size_t node_size(const sexp_t *e) {
+  switch (e->type) {
+    case SEXP_STRING: return sizeof(sexp_string_t) + sexp_string_length(e) + 1;
+    case SEXP_SYMBOL: return sizeof(sexp_symbol_t) + sexp_symbol_length(e) + 1;
+    case SEXP_NUMBER: return sizeof(sexp_num_t);
+    case SEXP_LIST: return sexp_list_size(((const sexp_list_t*)e)->cap);
+    default: die("invalid S-Expression");
+  }
+}
+
+// bytes allocated for size bytes from a
+static size_t alloc_slack(const sexp_allocator_t *a, size_t size) {
+  return a == NULL ? default_slack(size) : 0;
+}
+
+static void memory_add(sexp_memory_t *m, sexp_memory_kind_t *k, size_t bytes, size_t wasted) {
+  k->bytes += bytes;
+  k->wasted += wasted;
+  m->bytes += bytes;
+  m->wasted += wasted;
+}
+
+static void memory_rope(sexp_memory_t *m, node_map_t *seen, const rope_t *r);
+static void memory_node(sexp_memory_t *m, node_map_t *seen, const sexp_t *e);
+
+static void memory_rope(sexp_memory_t *m, node_map_t *seen, const rope_t *r) {
+  if (r == NULL || (r->refs > 1 && node_map_add(seen, r) == 1)) return;
+  size_t size = r->height == 0 ? sizeof(rope_t) + sizeof(sexp_t*) * r->size : sizeof(rope_t);
+  size_t slack = alloc_slack(r->alloc, size);
+  memory_add(m, &m->lists, size + slack, slack);
+  m->blocks += 1;
+  if (r->height > 0) {
+    memory_rope(m, seen, r->left);
+    memory_rope(m, seen, r->right);
+  } else {
+    for (size_t i = 0; i < r->size; ++i) memory_node(m, seen, r->items[i]);
+  }
+}
+
+static void memory_node(sexp_memory_t *m, node_map_t *seen, const sexp_t *e) {
+  if (e->refs > 1 && node_map_add(seen, e) == 1) return;
+  sexp_memory_kind_t *k = NULL;
+  switch (e->type) {
+    case SEXP_STRING: k = &m->strings; break;
+    case SEXP_SYMBOL: k = &m->symbols; break;
+    case SEXP_NUMBER: k = &m->numbers; break;
+    case SEXP_LIST: k = &m->lists; break;
+    default: die("invalid S-Expression");
+  }
+  size_t size = node_size(e);
+  size_t slack = compacted(e) ? compact_round(size) - size : alloc_slack(e->alloc, size);
+  k->count += 1;
+  memory_add(m, k, size + slack, slack);
+  if (!compacted(e) || node_map_add(seen, e->alloc->ctx) == 0) m->blocks += 1;
+  if (e->type != SEXP_LIST) return;
+
+  const sexp_list_t *list = (const sexp_list_t*)e;
+  size_t unused = list->tree ? list->cap : list->cap - list->len;
+  memory_add(m, k, 0, sizeof(sexp_t*) * unused);
+  if (list->index) {
+    size_t bytes = sizeof(list_index_t) + sizeof(size_t) * list->index->cap;
+    memory_add(m, k, bytes, 0);
+    m->blocks += list->index->cap > 0 ? 2 : 1;
+  }
+  if (list->tree) {
+    memory_rope(m, seen, list->tree);
+  } else {
+    for (size_t i = 0; i < list->len; ++i) memory_node(m, seen, list->elements[i]);
+  }
+}
+
+sexp_memory_t sexp_memory_usage(const sexp_t *e) {
+  sexp_memory_t m;
+  memset(&m, 0, sizeof(m));
+  node_map_t seen = { 0, 0, NULL, NULL };
+  if (e != NULL) memory_node(&m, &seen, e);
+  node_map_free(&seen);
+  return m;
+}
+
+// adds up the block size for the copy of e, and finds the shared nodes
+static int compact_measure(node_map_t *shared, const sexp_t *e, size_t *size) {
+  if (e->refs > 1) {
+    int seen = node_map_add(shared, e);
+    if (seen != 0) return seen == 1;
+  }
+  if (e->type != SEXP_LIST) {
+    *size += compact_round(node_size(e));
+    return 1;
+  }
+  size_t len = sexp_list_length(e);
+  *size += compact_round(sexp_list_size(len));
+  for (size_t i = 0; i < len; ++i) {
+    if (!compact_measure(shared, sexp_list_nth(e, i), size)) return 0;
+  }
+  return 1;
+}
+
+static sexp_t *compact_copy(compact_block_t *b, char** next, node_map_t *shared,
+    const sexp_t *e) {
+  size_t slot = 0;
+  if (e->refs > 1) {
+    slot = node_map_slot(shared, e);
+    if (shared->vals[slot] != NULL) return sexp_ref(shared->vals[slot]);
+  }
+  size_t len = e->type == SEXP_LIST ? sexp_list_length(e) : 0;
+  size_t size = e->type == SEXP_LIST ? sexp_list_size(len) : node_size(e);
+  sexp_t *res = (sexp_t*)*next;
+  *next += compact_round(size);
+  b->live += 1;
+  if (e->type != SEXP_LIST) {
+    memcpy(res, e, size);
+  } else {
+    sexp_list_t *list = (sexp_list_t*)res;
+    list->head = *e;
+    list->len = list->cap = len;
+    list->tree = NULL;
+    list->index = NULL;
+    for (size_t i = 0; i < len; ++i) {
+      list->elements[i] = compact_copy(b, next, shared, sexp_list_nth(e, i));
+    }
+  }
+  res->refs = 1;
+  res->alloc = &b->allocator;
+  if (e->refs > 1) shared->vals[slot] = res;
+  return res;
+}
+
+// lists that opted in to an index keep it, if there is memory for it
+static void compact_index(node_map_t *shared, const sexp_t *e, sexp_t *copy) {
+  if (e->type != SEXP_LIST) return;
+  if (e->refs > 1) {
+    size_t slot = node_map_slot(shared, e);
+    if (shared->vals[slot] == NULL) return;
+    shared->vals[slot] = NULL;  // visited
+  }
+  if (((const sexp_list_t*)e)->index) sexp_list_index(copy);
+  size_t len = sexp_list_length(e);
+  for (size_t i = 0; i < len; ++i) {
+    compact_index(shared, sexp_list_nth(e, i), sexp_list_nth(copy, i));
+  }
+}
+
+sexp_t *sexp_compact_copy(const sexp_t *e) {
+  if (e == NULL) return NULL;
+  node_map_t shared = { 0, 0, NULL, NULL };
+  size_t size = compact_round(sizeof(compact_block_t));
+  if (!compact_measure(&shared, e, &size)) {
+    node_map_free(&shared);
+    return NULL;
+  }
+  const sexp_allocator_t *a = current_allocator;
+  compact_block_t *b = mem_alloc(a, size);
+  if (b == NULL) {
+    node_map_free(&shared);
+    return NULL;
+  }
+  b->allocator.alloc = compact_alloc;
+  b->allocator.realloc = compact_realloc;
+  b->allocator.free = compact_free;
+  b->allocator.ctx = b;
+  b->inner = a;
+  b->size = size;
+  b->live = 0;
+  char* next = (char*)b + compact_round(sizeof(compact_block_t));
+  sexp_t *res = compact_copy(b, &next, &shared, e);
+  assert(next == (char*)b + size);
+  compact_index(&shared, e, res);
+  node_map_free(&shared);
+  return res;
+}
+
+sexp_t *sexp_compact(sexp_t *e) {
+  sexp_t *res = sexp_compact_copy(e);
+  if (res != NULL) sexp_free(e);
+  return res;
+}
+
+/******************************************************************************
+ * TRAVERSAL
+ *****************************************************************************/
+
+// The stack holds the lists on the path to the last node returned and the
+// position of the next element to visit in each. The last node itself is
+// pushed lazily by the next call, so it can still be skipped.
+
+typedef struct iter_frame_t {
+  const sexp_list_t *list;
+  size_t next;
+} iter_frame_t;
+
+typedef struct sexp_iter_t {
+  iter_frame_t *stack;
+  size_t depth;
+  size_t cap;
+  const sexp_t *root;         // not returned yet
+  const sexp_t *last;         // returned last, its elements are next
+  const sexp_allocator_t *alloc;
+} sexp_iter_t;
+
+sexp_iter_t *sexp_iter_new(const sexp_t *root) {
+  const sexp_allocator_t *a = current_allocator;
+  sexp_iter_t *it = mem_alloc(a, sizeof(sexp_iter_t));
+  if (it == NULL) return NULL;
+  it->cap = 16;
+  it->stack = mem_alloc(a, sizeof(iter_frame_t) * it->cap);
+  if (it->stack == NULL) {
+    mem_free(a, it, sizeof(sexp_iter_t));
+    return NULL;
+  }
+  it->alloc = a;
+  sexp_iter_reset(it, root);
+  return it;
+}
+
+void sexp_iter_free(sexp_iter_t *it) {
+  if (it == NULL) return;
+  mem_free(it->alloc, it->stack, sizeof(iter_frame_t) * it->cap);
+  mem_free(it->alloc, it, sizeof(sexp_iter_t));
+}
+
+void sexp_iter_reset(sexp_iter_t *it, const sexp_t *root) {
+  it->depth = 0;
+  it->root = root;
+  it->last = NULL;
+}
+
+const sexp_t *sexp_iter_next(sexp_iter_t *it) {
+  if (it->root != NULL) {
+    it->last = it->root;
+    it->root = NULL;
+    return it->last;
+  }
+  const sexp_t *last = it->last;
+  if (last != NULL && last->type == SEXP_LIST && sexp_list_length(last) > 0) {
+    if (it->depth == it->cap) {
+      iter_frame_t *stack = mem_realloc(it->alloc, it->stack,
+          sizeof(iter_frame_t) * it->cap, sizeof(iter_frame_t) * it->cap * 2);
+      if (stack == NULL) return NULL;
+      it->stack = stack;
+      it->cap *= 2;
+    }
+    it->stack[it->depth].list = (const sexp_list_t*)last;
+    it->stack[it->depth].next = 0;
+    it->depth += 1;
+  }
+  while (it->depth > 0) {
+    iter_frame_t *f = &it->stack[it->depth - 1];
+    if (f->next < f->list->len) {
+      size_t n = f->next++;
+      it->last = f->list->tree ? rope_nth(f->list->tree, n) : f->list->elements[n];
+      return it->last;
+    }
+    it->depth -= 1;
+  }
+  it->last = NULL;
+  return NULL;
+}
+
+size_t sexp_iter_depth(const sexp_iter_t *it) {
+  return it->depth;
+}
+
+void sexp_iter_skip(sexp_iter_t *it) {
+  if (it->root == NULL) it->last = NULL;
+}
+
+/******************************************************************************
+ * EQUALITY
+ *****************************************************************************/
+
+// Hashes are computed on first use and cached in the node. A list's cached
+// hash is reset by sexp_list_append, but nodes don't know the lists they are
+// in, so lists around it keep their stale hashes until sexp_rehash clears
+// them. The cache is read and written with
+// relaxed atomics: threads that hash the same node concurrently compute the
+// same value, so it doesn't matter whose write lands.
+
+static size_t hash_mix(size_t h, size_t v) {
+  h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  return h;
+}
+
+static size_t hash_bytes(size_t h, const char* buf, size_t len) {
+  uint64_t x = 0xcbf29ce484222325ull ^ h;
+  for (size_t i = 0; i < len; ++i) {
+    x ^= (unsigned char)buf[i];
+    x *= 0x100000001b3ull;
+  }
+  return (size_t)x;
+}
+
+static size_t hash_number(double val) {
+  uint64_t bits;
+  if (val == 0) val = 0; // -0.0 == 0.0
+  if (val != val) val = NAN;
+  memcpy(&bits, &val, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (size_t)bits;
+}
+
+size_t sexp_hash(const sexp_t *e) {
+  if (e == NULL) return 0;
+  size_t h = __atomic_load_n(&e->hash, __ATOMIC_RELAXED);
+  if (h != 0) return h;
+  h = e->type;
+  switch (e->type) {
+    case SEXP_STRING:
+      h = hash_bytes(h, sexp_string_get(e), sexp_string_length(e));
+      break;
+    case SEXP_SYMBOL:
+      h = hash_bytes(h, sexp_symbol_get(e), sexp_symbol_length(e));
+      break;
+    case SEXP_NUMBER:
+      h = hash_mix(h, hash_number(sexp_number_get(e)));
+      break;
+    case SEXP_LIST: {
+      size_t len = sexp_list_length(e);
+      h = hash_mix(h, len);
+      for (size_t i = 0; i < len; ++i) {
+        h = hash_mix(h, sexp_hash(sexp_list_nth(e, i)));
+      }
+      break;
+    }
+    default: die("invalid S-Expression");
+  }
+  if (h == 0) h = 1;
+  __atomic_store_n(&((sexp_t*)e)->hash, h, __ATOMIC_RELAXED);
+  return h;
+}
+
+static void hash_clear(sexp_t *e) {
+  if (e->type != SEXP_LIST) return;
+  __atomic_store_n(&e->hash, 0, __ATOMIC_RELAXED);
+  size_t len = sexp_list_length(e);
+  for (size_t i = 0; i < len; ++i) hash_clear(sexp_list_nth(e, i));
+}
+
+size_t sexp_rehash(sexp_t *e) {
+  if (e == NULL) return 0;
+  hash_clear(e);
+  return sexp_hash(e);
+}
+
+int sexp_equal(const sexp_t *a, const sexp_t *b) {
+  if (a == b) return 1;
+  if (a == NULL || b == NULL || a->type != b->type) return 0;
+  if (sexp_hash(a) != sexp_hash(b)) return 0;
+  switch (a->type) {
+    case SEXP_STRING:
+      return sexp_string_length(a) == sexp_string_length(b) &&
+        memcmp(sexp_string_get(a), sexp_string_get(b), sexp_string_length(a)) == 0;
+    case SEXP_SYMBOL:
+      return sexp_symbol_length(a) == sexp_symbol_length(b) &&
+        memcmp(sexp_symbol_get(a), sexp_symbol_get(b), sexp_symbol_length(a)) == 0;
+    case SEXP_NUMBER: {
+      double x = sexp_number_get(a), y = sexp_number_get(b);
+      return x == y || (x != x && y != y);
+    }
+    case SEXP_LIST: {
+      size_t len = sexp_list_length(a);
+      if (len != sexp_list_length(b)) return 0;
+      for (size_t i = 0; i < len; ++i) {
+        if (!sexp_equal(sexp_list_nth(a, i), sexp_list_nth(b, i))) return 0;
+      }
+      return 1;
+    }
+    default: die("invalid S-Expression");
+  }
+}
+
+/******************************************************************************
+ * INTERNING
+ *****************************************************************************/
+
+// Open addressing table of canonical nodes. The table holds a reference to
+// every node in it, so canonical nodes live at least as long as the table.
+
+typedef struct sexp_intern_t {
+  size_t len;
+  size_t cap;                 // power of two
+  sexp_t **slots;
+  const sexp_allocator_t *alloc;
+} sexp_intern_t;
+
+static sexp_t **sexp_intern_slots(const sexp_allocator_t *a, size_t cap) {
+  sexp_t **slots = mem_alloc(a, sizeof(sexp_t*) * cap);
+  if (slots) memset(slots, 0, sizeof(sexp_t*) * cap);
+  return slots;
+}
+
+sexp_intern_t *sexp_intern_new() {
+  const sexp_allocator_t *a = current_allocator;
+  sexp_intern_t *t = mem_alloc(a, sizeof(sexp_intern_t));
+  if (t == NULL) return NULL;
+  t->len = 0;
+  t->cap = 64;
+  t->alloc = a;
+  t->slots = sexp_intern_slots(a, t->cap);
+  if (t->slots == NULL) {
+    mem_free(a, t, sizeof(sexp_intern_t));
+    return NULL;
+  }
+  return t;
+}
+
+void sexp_intern_free(sexp_intern_t *t) {
+  if (t == NULL) return;
+  for (size_t i = 0; i < t->cap; ++i) {
+    sexp_free(t->slots[i]);
+  }
+  mem_free(t->alloc, t->slots, sizeof(sexp_t*) * t->cap);
+  mem_free(t->alloc, t, sizeof(sexp_intern_t));
+}
+
+size_t sexp_intern_size(const sexp_intern_t *t) {
+  return t->len;
+}
+
+static int sexp_intern_grow(sexp_intern_t *t) {
+  size_t cap = t->cap * 2;
+  sexp_t **slots = sexp_intern_slots(t->alloc, cap);
+  if (slots == NULL) return 0;
+  for (size_t i = 0; i < t->cap; ++i) {
+    sexp_t *e = t->slots[i];
+    if (e == NULL) continue;
+    size_t p = sexp_hash(e) & (cap - 1);
+    while (slots[p] != NULL) p = (p + 1) & (cap - 1);
+    slots[p] = e;
+  }
+  mem_free(t->alloc, t->slots, sizeof(sexp_t*) * t->cap);
+  t->slots = slots;
+  t->cap = cap;
+  return 1;
+}
+
+// sexp_equal, but numbers only match if their bits do. 0 and -0 are equal
+// and must stay apart, interning must not change values.
+static int intern_same(const sexp_t *a, const sexp_t *b) {
+  if (a == b) return 1;
+  if (a->type != b->type || sexp_hash(a) != sexp_hash(b)) return 0;
+  if (a->type == SEXP_NUMBER) {
+    double x = sexp_number_get(a), y = sexp_number_get(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  if (a->type != SEXP_LIST) return sexp_equal(a, b);
+  size_t len = sexp_list_length(a);
+  if (len != sexp_list_length(b)) return 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (!intern_same(sexp_list_nth(a, i), sexp_list_nth(b, i))) return 0;
+  }
+  return 1;
+}
+
+// interns a single node whose children are already canonical, consumes e.
+// NULL if out of memory.
+static sexp_t *sexp_intern_node(sexp_intern_t *t, sexp_t *e) {
+  if (t->len * 10 >= t->cap * 7 && !sexp_intern_grow(t)) {
+    sexp_free(e);
+    return NULL;
+  }
+  size_t p = sexp_hash(e) & (t->cap - 1);
+  while (t->slots[p] != NULL) {
+    if (intern_same(t->slots[p], e)) {
+      sexp_t *res = sexp_ref(t->slots[p]);
+      sexp_free(e);
+      return res;
+    }
+    p = (p + 1) & (t->cap - 1);
+  }
+  t->slots[p] = sexp_ref(e);
+  t->len += 1;
+  return e;
+}
+
+sexp_t *sexp_intern(sexp_intern_t *t, sexp_t *e) {
+  if (e == NULL) return NULL;
+  if (sexp_is_list(e)) {
+    size_t len = sexp_list_length(e);
+    sexp_t *list = sexp_new_list();
+    for (size_t i = 0; list != NULL && i < len; ++i) {
+      sexp_t *item = sexp_intern(t, sexp_ref(sexp_list_nth(e, i)));
+      sexp_t *res = item ? sexp_list_append(list, item) : NULL;
+      if (res == NULL) {
+        sexp_free(item);
+        sexp_free(list);
+      }
+      list = res;
+    }
+    sexp_free(e);
+    if (list == NULL) return NULL;
+    e = list;
+  }
+  return sexp_intern_node(t, e);
+}
+
+/******************************************************************************
+ * UTF-8
+ *****************************************************************************/
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// length of the valid multi-byte sequence at s, 0 if it is invalid
+static size_t utf8_sequence(const unsigned char* s, size_t len) {
+  unsigned char c = s[0];
+  unsigned char lo = 0x80, hi = 0xbf;
+  size_t n;
+  if (c >= 0xc2 && c <= 0xdf) n = 2;
+  else if (c == 0xe0) { n = 3; lo = 0xa0; }
+  else if (c == 0xed) { n = 3; hi = 0x9f; }
+  else if (c >= 0xe1 && c <= 0xef) n = 3;
+  else if (c == 0xf0) { n = 4; lo = 0x90; }
+  else if (c == 0xf4) { n = 4; hi = 0x8f; }
+  else if (c >= 0xf1 && c <= 0xf3) n = 4;
+  else return 0;
+  if (len < n || s[1] < lo || s[1] > hi) return 0;
+  for (size_t i = 2; i < n; ++i) {
+    if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+  }
+  return n;
+}
+
+int sexp_utf8_valid(const char* src, size_t len, size_t *bad) {
+  const unsigned char* s = (const unsigned char*)src;
+  size_t i = 0;
+  while (i < len) {
+#if defined(__SSE2__)
+    while (i + 16 <= len &&
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i))) == 0) {
+      i += 16;
+    }
+#else
+    uint64_t w;
+    while (i + 8 <= len && (memcpy(&w, s + i, 8), (w & 0x8080808080808080ull) == 0)) {
+      i += 8;
+    }
+#endif
+    if (i == len) break;
+    if (s[i] < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t n = utf8_sequence(s + i, len - i);
+    if (n == 0) {
+      if (bad) *bad = i;
+      return 0;
+    }
+    i += n;
+  }
+  return 1;
+}
+
+/******************************************************************************
+ * STRUCTURAL INDEX
+ *****************************************************************************/
+
+// Stage one of indexed reading: a single pass over the input that records
+// the extent of every token, so the reader doesn't need to look at the bytes
+// between tokens again. Input is classified 64 bytes at a time into bitmasks.
+// Escapes are resolved with carry arithmetic on the backslash mask, strings
+// and comments by walking only the quote, semicolon and newline bits.
+
+typedef struct index_token_t {
+  uint32_t start;
+  uint32_t end;               // start == end marks an unterminated string
+} index_token_t;
+
+typedef struct sexp_index_t {
+  const char* src;
+  size_t len;                 // up to the first NUL byte
+  size_t ntokens;
+  size_t cap;
+  index_token_t *tokens;
+  const sexp_allocator_t *alloc;
+} sexp_index_t;
+
+typedef struct index_masks_t {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t newline;
+  uint64_t semicolon;
+  uint64_t nul;
+  uint64_t ws;
+  uint64_t open;
+  uint64_t close;
+} index_masks_t;
+
+#if defined(__SSE2__)
+static uint64_t index_eq(const __m128i *v, char ch) {
+  __m128i c = _mm_set1_epi8(ch);
+  uint64_t res = 0;
+  for (int i = 0; i < 4; ++i) {
+    res |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], c)) << (16 * i);
+  }
+  return res;
+}
+
+static void index_classify(const char* block, index_masks_t *m) {
+  __m128i v[4];
+  for (int i = 0; i < 4; ++i) v[i] = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+  m->quote = index_eq(v, '"');
+  m->backslash = index_eq(v, '\\');
+  m->newline = index_eq(v, '\n');
+  m->semicolon = index_eq(v, ';');
+  m->nul = index_eq(v, '\0');
+  m->ws = index_eq(v, ' ') | index_eq(v, '\t') | index_eq(v, '\f') | m->newline;
+  m->open = index_eq(v, '(') | index_eq(v, '[') | index_eq(v, '{');
+  m->close = index_eq(v, ')') | index_eq(v, ']') | index_eq(v, '}');
+}
+#else
+static void index_classify(const char* block, index_masks_t *m) {
+  memset(m, 0, sizeof(index_masks_t));
+  for (int i = 0; i < 64; ++i) {
+    uint64_t bit = (uint64_t)1 << i;
+    switch (block[i]) {
+      case '"': m->quote |= bit; break;
+      case '\\': m->backslash |= bit; break;
+      case '\n': m->newline |= bit; m->ws |= bit; break;
+      case ';': m->semicolon |= bit; break;
+      case '\0': m->nul |= bit; break;
+      case ' ': case '\t': case '\f': m->ws |= bit; break;
+      case '(': case '[': case '{': m->open |= bit; break;
+      case ')': case ']': case '}': m->close |= bit; break;
+    }
+  }
+}
+#endif
+
+// characters preceded by an odd number of backslashes
+static uint64_t index_escaped(uint64_t backslash, uint64_t *carry) {
+  const uint64_t even = 0x5555555555555555ull;
+  if (backslash == 0) {
+    uint64_t res = *carry;
+    *carry = 0;
+    return res;
+  }
+  backslash &= ~*carry;
+  uint64_t follows = backslash << 1 | *carry;
+  uint64_t odd_starts = backslash & ~even & ~follows;
+  uint64_t sum = odd_starts + backslash;
+  *carry = sum < odd_starts;
+  return (even ^ (sum << 1)) & follows;
+}
+
+// bits [from, to] set
+static uint64_t index_range(int from, int to) {
+  uint64_t hi = to >= 63 ? ~(uint64_t)0 : ((uint64_t)1 << (to + 1)) - 1;
+  return hi & (~(uint64_t)0 << from);
+}
+
+static int index_push(sexp_index_t *idx, size_t start, size_t end) {
+  if (idx->ntokens == idx->cap) {
+    index_token_t *tokens = mem_realloc(idx->alloc, idx->tokens,
+        sizeof(index_token_t) * idx->cap, sizeof(index_token_t) * idx->cap * 2);
+    if (tokens == NULL) return 0;
+    idx->tokens = tokens;
+    idx->cap *= 2;
+  }
+  idx->tokens[idx->ntokens].start = start;
+  idx->tokens[idx->ntokens].end = end;
+  idx->ntokens += 1;
+  return 1;
+}
+
+enum { INDEX_NORMAL, INDEX_STRING, INDEX_COMMENT, INDEX_DONE, INDEX_ERROR };
+
+sexp_index_t *sexp_index_new(const char* src, size_t len) {
+  if (len >= UINT32_MAX) return NULL;
+  const sexp_allocator_t *a = current_allocator;
+  sexp_index_t *idx = mem_alloc(a, sizeof(sexp_index_t));
+  if (idx == NULL) return NULL;
+  idx->src = src;
+  idx->len = len;
+  idx->ntokens = 0;
+  idx->cap = len / 8 + 64;
+  idx->alloc = a;
+  idx->tokens = mem_alloc(a, sizeof(index_token_t) * idx->cap);
+  if (idx->tokens == NULL) {
+    mem_free(a, idx, sizeof(sexp_index_t));
+    return NULL;
+  }
+  int ok = 1;
+
+  int state = INDEX_NORMAL;
+  uint64_t escape_carry = 0;
+  uint64_t atom_carry = 0;
+  size_t pending = 0;         // start of the atom or string being indexed
+  char block[64];
+
+  for (size_t base = 0; base < len && state < INDEX_DONE && ok; base += 64) {
+    const char* p = src + base;
+    if (len - base < 64) {
+      // NUL padding ends the input like a terminator would
+      memset(block, 0, sizeof(block));
+      memcpy(block, p, len - base);
+      p = block;
+    }
+    index_masks_t m;
+    index_classify(p, &m);
+    uint64_t escaped = index_escaped(m.backslash, &escape_carry);
+
+    // strings and comments, in order of appearance
+    uint64_t in_string = 0, in_comment = 0;
+    uint64_t string_open = 0, string_close = 0;
+    int region = 0;
+    uint64_t events = m.quote | m.newline | m.semicolon | m.nul;
+    while (events != 0 && state < INDEX_DONE) {
+      int i = __builtin_ctzll(events);
+      uint64_t bit = (uint64_t)1 << i;
+      events &= events - 1;
+      if (state == INDEX_NORMAL) {
+        if (bit & m.quote) {
+          state = INDEX_STRING;
+          string_open |= bit;
+          region = i;
+        } else if (bit & m.semicolon) {
+          state = INDEX_COMMENT;
+          region = i;
+        } else if (bit & m.nul) {
+          state = INDEX_DONE;
+          idx->len = base + i;
+        }
+      } else if (state == INDEX_STRING) {
+        if ((bit & m.quote) && !(bit & escaped)) {
+          in_string |= index_range(region, i);
+          string_close |= bit;
+          state = INDEX_NORMAL;
+        } else if ((bit & m.nul) || ((bit & m.newline) && !(bit & escaped))) {
+          state = INDEX_ERROR;
+        }
+      } else if (bit & (m.newline | m.nul)) {
+        if (i > 0) in_comment |= index_range(region, i - 1);
+        state = INDEX_NORMAL;
+        if (bit & m.nul) {
+          state = INDEX_DONE;
+          idx->len = base + i;
+        }
+      }
+    }
+    if (state == INDEX_STRING || state == INDEX_ERROR) {
+      in_string |= index_range(region, 63);
+    } else if (state == INDEX_COMMENT) {
+      in_comment |= index_range(region, 63);
+    } else if (state == INDEX_DONE) {
+      uint64_t past = index_range(idx->len - base, 63);
+      m.open &= ~past;
+      m.close &= ~past;
+      m.nul |= past;
+    }
+
+    uint64_t outside = ~(in_string | in_comment);
+    uint64_t delim = m.ws | m.open | m.close | m.quote | m.semicolon | m.nul;
+    uint64_t atom = ~delim & outside;
+    uint64_t shifted = atom << 1 | atom_carry;
+    uint64_t atom_start = atom & ~shifted;
+    uint64_t atom_end = ~atom & shifted;
+    atom_carry = atom >> 63;
+
+    uint64_t structural = (m.open | m.close) & outside;
+    uint64_t bounds = structural | atom_start | atom_end | string_open | string_close;
+    while (bounds != 0) {
+      int i = __builtin_ctzll(bounds);
+      uint64_t bit = (uint64_t)1 << i;
+      bounds &= bounds - 1;
+      if (bit & atom_end) ok &= index_push(idx, pending, base + i);
+      if (bit & (atom_start | string_open)) pending = base + i;
+      if (bit & string_close) ok &= index_push(idx, pending, base + i + 1);
+      if (bit & structural) ok &= index_push(idx, base + i, base + i + 1);
+    }
+  }
+  if (state == INDEX_STRING || state == INDEX_ERROR) {
+    ok &= index_push(idx, pending, pending);
+  } else if (atom_carry) {
+    ok &= index_push(idx, pending, idx->len);
+  }
+  if (!ok) {
+    sexp_index_free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+void sexp_index_free(sexp_index_t *idx) {
+  if (idx == NULL) return;
+  mem_free(idx->alloc, idx->tokens, sizeof(index_token_t) * idx->cap);
+  mem_free(idx->alloc, idx, sizeof(sexp_index_t));
+}
+
+/******************************************************************************
+ * PARSER
+ *****************************************************************************/
+
+static inline int isws(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\f' || ch == '\n';
+}
+
+static int hex_value(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+static int read_hex(const char* src, const char* end, int digits, uint32_t *val) {
+  if (end - src < digits) return 0;
+  *val = 0;
+  for (int i = 0; i < digits; ++i) {
+    int d = hex_value(src[i]);
+    if (d < 0) return 0;
+    *val = *val * 16 + d;
+  }
+  return 1;
+}
+
+static size_t utf8_encode(uint32_t cp, char* dst) {
+  if (cp < 0x80) {
+    dst[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    dst[0] = 0xc0 | (cp >> 6);
+    dst[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    dst[0] = 0xe0 | (cp >> 12);
+    dst[1] = 0x80 | ((cp >> 6) & 0x3f);
+    dst[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  dst[0] = 0xf0 | (cp >> 18);
+  dst[1] = 0x80 | ((cp >> 12) & 0x3f);
+  dst[2] = 0x80 | ((cp >> 6) & 0x3f);
+  dst[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// Escapes never take less space than what they stand for, so dst needs at
+// most len bytes. Runs without escapes are found with memchr and copied at
+// once. dst may be src, unescaping happens in place then.
+int sexp_unescape(const char* src, size_t len, char* dst, size_t *dstlen) {
+  const char* end = src + len;
+  char* out = dst;
+  while (src < end) {
+    const char* bs = memchr(src, '\\', end - src);
+    size_t run = (bs ? bs : end) - src;
+    memmove(out, src, run);
+    out += run;
+    if (bs == NULL) break;
+    src = bs + 1;
+    if (src == end) return 0;
+    char ch = *src++;
+    uint32_t cp;
+    switch (ch) {
+      case 'a': *out++ = '\a'; break;
+      case 'b': *out++ = '\b'; break;
+      case 'e': *out++ = '\x1b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 'v': *out++ = '\v'; break;
+      case '\\': case '"': case '\'': case '?': *out++ = ch; break;
+      case '0': case '1': case '2': case '3':
+      case '4': case '5': case '6': case '7':
+        cp = ch - '0';
+        for (int i = 0; i < 2 && src < end && *src >= '0' && *src <= '7'; ++i) {
+          cp = cp * 8 + (*src++ - '0');
+        }
+        if (cp > 0xff) return 0;
+        *out++ = cp;
+        break;
+      case 'x':
+        if (!read_hex(src, end, 2, &cp)) return 0;
+        src += 2;
+        *out++ = cp;
+        break;
+      case 'u':
+      case 'U': {
+        int digits = ch == 'u' ? 4 : 8;
+        if (!read_hex(src, end, digits, &cp)) return 0;
+        if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return 0;
+        src += digits;
+        out += utf8_encode(cp, out);
+        break;
+      }
+      default:
+        return 0;
+    }
+  }
+  *dstlen = out - dst;
+  return 1;
+}
+
+typedef enum token_type {
+  TT_ERR,
+  TT_EOF,
+  TT_OPEN,
+  TT_CLOSE,
+  TT_STRING,
+  TT_ELSE,
+  TT_MACRO,                   // macro character, expanded when read
+  TT_VALUE                    // what a macro read
+} token_type;
+
+// Tokens start and end by the class of their characters, looked up in a
+// table instead of comparing against each delimiter. Readtables have a copy
+// of the table with their macro characters marked.
+
+enum {
+  LEX_ATOM,
+  LEX_WS,
+  LEX_COMMENT,
+  LEX_OPEN,
+  LEX_CLOSE,
+  LEX_QUOTE,
+  LEX_END,
+  LEX_MACRO,                  // ends atoms, starts a macro token
+  LEX_DISPATCH                // starts a macro token if the next one is set
+};
+
+static const unsigned char lex_class[256] = {
+  ['('] = LEX_OPEN, ['['] = LEX_OPEN, ['{'] = LEX_OPEN,
+  [')'] = LEX_CLOSE, [']'] = LEX_CLOSE, ['}'] = LEX_CLOSE,
+  ['"'] = LEX_QUOTE, [';'] = LEX_COMMENT, ['\0'] = LEX_END,
+  [' '] = LEX_WS, ['\t'] = LEX_WS, ['\f'] = LEX_WS, ['\n'] = LEX_WS,
+};
+
+typedef struct reader_macro_t {
+  sexp_macro_t fn;
+  void *ctx;
+} reader_macro_t;
+
+struct sexp_readtable_t {
+  unsigned char cls[256];
+  reader_macro_t macros[256];
+  reader_macro_t dispatch[256]; // by the character after '#'
+  const sexp_allocator_t *alloc;
+};
+
+typedef struct lexer {
+  token_type type;
+  const char* src;
+  const char* start;
+  const char* end;
+  const char* last;           // end of the previous token
+  const sexp_read_opts_t *opts;
+  const sexp_index_t *index;  // tokens come from here if set
+  size_t pos;                 // next token in index
+  const unsigned char *cls;
+  sexp_t *value;              // of TT_VALUE tokens
+} lexer;
+
+struct sexp_reader_t {
+  lexer *lex;
+  const char* pos;
+  int failed;
+};
+
+static const sexp_read_opts_t default_opts;
+
+static void lexer_init(lexer *lex, const char* src, const sexp_read_opts_t *opts) {
+  lex->type = TT_ERR;
+  lex->src = src;
+  lex->start = src;
+  lex->end = src;
+  lex->last = src;
+  lex->opts = opts ? opts : &default_opts;
+  lex->index = NULL;
+  lex->pos = 0;
+  lex->cls = lex->opts->readtable ? lex->opts->readtable->cls : lex_class;
+  lex->value = NULL;
+
+  // the index doesn't know about macro characters
+  const sexp_index_t *idx = lex->opts->readtable ? NULL : lex->opts->index;
+  if (idx != NULL && src >= idx->src && src <= idx->src + idx->len) {
+    size_t offset = src - idx->src;
+    size_t lo = 0, hi = idx->ntokens;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (idx->tokens[mid].start < offset) lo = mid + 1;
+      else hi = mid;
+    }
+    lex->index = idx;
+    lex->pos = lo;
+  }
+}
+
+// records the first error of a read, if the caller asked for errors
+static void lexer_error(lexer *lex, sexp_error_code_t code, const char* at) {
+  sexp_error_t *err = lex->opts->error;
+  lex->type = TT_ERR;
+  if (err != NULL && err->code == SEXP_ERR_NONE) {
+    err->code = code;
+    err->offset = at - lex->src;
+  }
+}
+
+static int lexer_valid_utf8(lexer *lex) {
+  size_t bad;
+  if (!lex->opts->validate_utf8) return 1;
+  if (sexp_utf8_valid(lex->start, lex->end - lex->start, &bad)) return 1;
+  lexer_error(lex, SEXP_ERR_UTF8, lex->start + bad);
+  return 0;
+}
+
+static int lexer_next_indexed(lexer *lex) {
+  const sexp_index_t *idx = lex->index;
+  if (lex->pos >= idx->ntokens) {
+    lex->type = TT_EOF;
+    lex->start = lex->end = idx->src + idx->len;
+    return 1;
+  }
+  const index_token_t *tok = &idx->tokens[lex->pos++];
+  if (tok->start == tok->end) {
+    lex->type = TT_ERR;
+    lex->start = idx->src + tok->start;
+    return 0;
+  }
+  lex->start = idx->src + tok->start;
+  lex->end = idx->src + tok->end;
+  switch (*lex->start) {
+    case '"': lex->type = TT_STRING; break;
+    case '(': case '[': case '{': lex->type = TT_OPEN; break;
+    case ')': case ']': case '}': lex->type = TT_CLOSE; break;
+    default: lex->type = TT_ELSE;
+  }
+  return 1;
+}
+
+static void lexer_print(lexer *lex) {
+  const char* rev[] = {
+    "TT_ERR", "TT_EOF", "TT_OPEN", "TT_CLOSE", "TT_STRING", "TT_ELSE",
+    "TT_MACRO", "TT_VALUE"
+  };
+  if (lex->type != TT_ERR && lex->type != TT_EOF) {
+    printf("type = %s, start = %zu, end = %zu, val = '%.*s'\n",
+        rev[lex->type], lex->start - lex->src, lex->end - lex->src, 
+        (int)(lex->end - lex->start), lex->start);
+  } else {
+    printf("type = %s, start = %zu, end = %zu, val = 'N/A'\n",
+        rev[lex->type], lex->start - lex->src, lex->end - lex->src);
+  }
+}
+
+static inline int is_constituent(const unsigned char *cls, char ch) {
+  return cls[(unsigned char)ch] == LEX_ATOM || cls[(unsigned char)ch] == LEX_DISPATCH;
+}
+
+static int lexer_next(lexer *lex) {
+  const unsigned char *cls = lex->cls;
+  const char* s = lex->end;
+  lex->last = s;
+  if (lex->value != NULL) {
+    sexp_free(lex->value);
+    lex->value = NULL;
+  }
+  if (lex->index) return lexer_next_indexed(lex);
+  while (1) {
+    if (cls[(unsigned char)*s] == LEX_WS) {
+      ++s;
+    } else if (cls[(unsigned char)*s] == LEX_COMMENT) {
+      while (*s != '\n' && *s != '\0') ++s;
+    } else {
+      break;
+    }
+  }
+
+  const char* start = s;
+
+  switch (cls[(unsigned char)*s]) {
+    case LEX_END:
+      lex->type = TT_EOF;
+      break;
+    case LEX_QUOTE:
+      ++s;
+      while (*s != '\0' && *s != '\n' && *s != '"') {
+        if (*s == '\\' && s[1] != '\0') ++s;
+        ++s;
+      }
+      if (*s != '"') {
+        lex->type = TT_ERR;
+        lex->start = start;
+        return 0;
+      }
+      ++s;
+      lex->type = TT_STRING;
+      break;
+    case LEX_OPEN:
+      ++s;
+      lex->type = TT_OPEN;
+      break;
+    case LEX_CLOSE:
+      ++s;
+      lex->type = TT_CLOSE;
+      break;
+    case LEX_MACRO:
+      ++s;
+      lex->type = TT_MACRO;
+      break;
+    case LEX_DISPATCH:
+      if (lex->opts->readtable->dispatch[(unsigned char)s[1]].fn != NULL) {
+        s += 2;
+        lex->type = TT_MACRO;
+        break;
+      }
+      // an atom otherwise
+      // fall through
+    default:
+      ++s;
+      while (is_constituent(cls, *s)) ++s;
+      lex->type = TT_ELSE;
+  }
+
+  lex->start = start;
   lex->end = s;
   return 1;
 }
 
+// Runs the macro of the current token. A macro that reads a value turns the
+// token into a TT_VALUE, those that read nothing are skipped like comments
+// and the token after them is expanded.
+static void lexer_expand(lexer *lex) {
+  while (lex->type == TT_MACRO) {
+    const char* start = lex->start;
+    unsigned char ch = lex->end[-1];
+    const sexp_readtable_t *t = lex->opts->readtable;
+    const reader_macro_t *m = lex->end - start == 2 ? &t->dispatch[ch] : &t->macros[ch];
+    sexp_reader_t r = { lex, lex->end, 0 };
+    sexp_t *val = m->fn(&r, ch, m->ctx);
+    if (r.failed) {
+      sexp_free(val);
+      lexer_error(lex, SEXP_ERR_SYNTAX, start);
+      lex->start = start;
+      return;
+    }
+    lex->end = r.pos;
+    if (val != NULL) {
+      lex->type = TT_VALUE;
+      lex->start = start;
+      lex->value = val;
+      return;
+    }
+    lexer_next(lex);
+  }
+}
+
 sexp_t *sexp_read_string(lexer *lex);
 sexp_t *sexp_read_symbol(lexer *lex);
 sexp_t *sexp_read_number(lexer *lex);
@@ -374,49 +2340,113 @@ sexp_t *sexp_read_list_items(lexer *lex);
 sexp_t *sexp_read_any(lexer *lex);
 
 sexp_t *sexp_read(const char* src, char** end) {
+  return sexp_read_opts(src, end, NULL);
+}
+
+sexp_t *sexp_read_opts(const char* src, char** end, const sexp_read_opts_t *opts) {
   lexer lex;
-  lexer_init(&lex, src);
+  lexer_init(&lex, src, opts);
+  const sexp_allocator_t *prev = current_allocator;
+  if (lex.opts->allocator) current_allocator = lex.opts->allocator;
+  if (lex.opts->error) {
+    lex.opts->error->code = SEXP_ERR_NONE;
+    lex.opts->error->offset = 0;
+  }
   lexer_next(&lex);
-  sexp_t *res = sexp_read_any(&lex);
-  if (end) *end = (char*)lex.end;
+  lexer_expand(&lex);
+  sexp_t *res = NULL;
+  if (lex.type != TT_EOF) {
+    res = sexp_read_any(&lex);
+    if (res == NULL) lexer_error(&lex, SEXP_ERR_SYNTAX, lex.start);
+  }
+  if (end) *end = (char*)(res != NULL ? lex.last : lex.end);
+  sexp_free(lex.value);
+  current_allocator = prev;
   return res;
 }
 
 sexp_t *sexp_read_any(lexer *lex) {
-  sexp_t *res;
+  sexp_t *res = NULL;
+  lexer_expand(lex);
   switch(lex->type) {
   case TT_EOF:
   case TT_ERR:
   case TT_CLOSE:
     return NULL;
+  case TT_VALUE:
+    res = lex->value;
+    lex->value = NULL;
+    lexer_next(lex);
+    break;
   case TT_OPEN:
-    return sexp_read_list(lex);
+    res = sexp_read_list(lex);
+    break;
   case TT_STRING:
-    return sexp_read_string(lex);
+    res = sexp_read_string(lex);
+    break;
   case TT_ELSE:
-    if ((res = sexp_read_number(lex)) != NULL) return res;
-    if ((res = sexp_read_symbol(lex)) != NULL) return res;
+    if (!lexer_valid_utf8(lex)) return NULL;
+    if ((res = sexp_read_number(lex)) != NULL) break;
+    if (lex->type == TT_ERR) return NULL;
+    if ((res = sexp_read_symbol(lex)) != NULL) break;
     return NULL;
+  default:
+    die("unreachable");
   }
-  die("unreachable");
+  if (res != NULL && lex->opts->intern != NULL) {
+    res = sexp_intern_node(lex->opts->intern, res);
+    if (res == NULL) lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
+  }
+  return res;
 }
 
 sexp_t *sexp_read_string(lexer *lex) {
   if (lex->type != TT_STRING) return NULL;
   const char* start = lex->start+1;
   const char* end = lex->end-1;
+  if (!lexer_valid_utf8(lex)) return NULL;
 
-  size_t len = unescaped_length(start, end-start);
-  sexp_t *e = sexp_new_string_len(start, len);
-  unescape(start, sexp_string_get_mut(e), end-start);
+  size_t cap = end - start;
+  sexp_string_t *e = (sexp_string_t*)sexp_alloc_string(cap);
+  if (e == NULL) {
+    lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
+    return NULL;
+  }
+  if (!sexp_unescape(start, cap, e->val, &e->len)) {
+    e->len = cap;
+    sexp_string_free((sexp_t*)e);
+    lexer_error(lex, SEXP_ERR_ESCAPE, lex->start);
+    return NULL;
+  }
+  // escapes always shrink the text, and \x or octal ones can make bytes the
+  // raw token didn't have
+  size_t bad;
+  if (lex->opts->validate_utf8 && e->len != cap && !sexp_utf8_valid(e->val, e->len, &bad)) {
+    e->len = cap;
+    sexp_string_free((sexp_t*)e);
+    lexer_error(lex, SEXP_ERR_UTF8, lex->start);
+    return NULL;
+  }
+  e->val[e->len] = '\0';
+  sexp_t *res = sexp_string_shrink((sexp_t*)e, cap);
+  if (res == NULL) {
+    e->len = cap;
+    sexp_string_free((sexp_t*)e);
+    lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
+    return NULL;
+  }
 
   lexer_next(lex);
-  return e;
+  return res;
 }
 
 sexp_t *sexp_read_symbol(lexer *lex) {
   if (lex->type != TT_ELSE) return NULL;
   sexp_t *e = sexp_new_symbol_len(lex->start, lex->end - lex->start);
+  if (e == NULL) {
+    lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
+    return NULL;
+  }
   lexer_next(lex);
   return e;
 }
@@ -424,12 +2454,14 @@ sexp_t *sexp_read_symbol(lexer *lex) {
 sexp_t *sexp_read_number(lexer *lex) {
   char* end;
   double val = strtod(lex->start, &end);
-  if (end != lex->start) {
-    lexer_next(lex);
-    return sexp_new_number(val);
-  } else {
+  if (end == lex->start) return NULL;
+  sexp_t *e = sexp_new_number(val);
+  if (e == NULL) {
+    lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
     return NULL;
   }
+  lexer_next(lex);
+  return e;
 }
 
 sexp_t *sexp_read_list(lexer *lex) {
@@ -440,7 +2472,9 @@ sexp_t *sexp_read_list(lexer *lex) {
   assert(term != 0);
   lexer_next(lex);
   sexp_t *list = sexp_read_list_items(lex);
-  if (list == NULL || lex->type != TT_CLOSE || *lex->start != term) {
+  if (list == NULL) return NULL;
+  if (lex->type != TT_CLOSE || *lex->start != term) {
+    sexp_free(list);
     return NULL;
   }
   lexer_next(lex);
@@ -449,9 +2483,26 @@ sexp_t *sexp_read_list(lexer *lex) {
 
 sexp_t *sexp_read_list_items(lexer *lex) {
   sexp_t *list = sexp_new_list();
+  if (list == NULL) {
+    lexer_error(lex, SEXP_ERR_NOMEM, lex->start);
+    return NULL;
+  }
+  lexer_expand(lex);
   while (lex->type != TT_CLOSE && lex->type != TT_EOF && lex->type != TT_ERR) {
+    const char* at = lex->start;
     sexp_t *item = sexp_read_any(lex);
-    list = sexp_list_append(list, item);
+    if (item == NULL) {
+      sexp_free(list);
+      return NULL;
+    }
+    sexp_t *res = sexp_list_append(list, item);
+    if (res == NULL) {
+      sexp_free(item);
+      lexer_error(lex, SEXP_ERR_NOMEM, at);
+      break;
+    }
+    list = res;
+    lexer_expand(lex);
   }
   if (lex->type != TT_CLOSE) {
     sexp_free(list);
@@ -461,21 +2512,409 @@ sexp_t *sexp_read_list_items(lexer *lex) {
   }
 }
 
+/******************************************************************************
+ * READER MACROS
+ *****************************************************************************/
+
+sexp_readtable_t *sexp_readtable_new() {
+  const sexp_allocator_t *a = current_allocator;
+  sexp_readtable_t *t = mem_alloc(a, sizeof(sexp_readtable_t));
+  if (t == NULL) return NULL;
+  memset(t, 0, sizeof(sexp_readtable_t));
+  memcpy(t->cls, lex_class, sizeof(lex_class));
+  t->cls['#'] = LEX_DISPATCH;
+  t->alloc = a;
+  sexp_readtable_set(t, '\'', sexp_macro_quote, NULL);
+  sexp_readtable_set(t, '`', sexp_macro_quote, NULL);
+  sexp_readtable_set(t, ',', sexp_macro_quote, NULL);
+  sexp_readtable_dispatch(t, 't', sexp_macro_boolean, NULL);
+  sexp_readtable_dispatch(t, 'f', sexp_macro_boolean, NULL);
+  sexp_readtable_dispatch(t, ';', sexp_macro_datum_comment, NULL);
+  sexp_readtable_dispatch(t, '|', sexp_macro_block_comment, NULL);
+  return t;
+}
+
+void sexp_readtable_free(sexp_readtable_t *t) {
+  if (t == NULL) return;
+  mem_free(t->alloc, t, sizeof(sexp_readtable_t));
+}
+
+int sexp_readtable_set(sexp_readtable_t *t, char ch, sexp_macro_t fn, void *ctx) {
+  unsigned char c = ch;
+  if (t->cls[c] != LEX_ATOM && t->cls[c] != LEX_MACRO) return 0;
+  t->cls[c] = fn != NULL ? LEX_MACRO : LEX_ATOM;
+  t->macros[c].fn = fn;
+  t->macros[c].ctx = ctx;
+  return 1;
+}
+
+int sexp_readtable_dispatch(sexp_readtable_t *t, char ch, sexp_macro_t fn, void *ctx) {
+  unsigned char c = ch;
+  if (c == '\0') return 0;
+  t->dispatch[c].fn = fn;
+  t->dispatch[c].ctx = ctx;
+  return 1;
+}
+
+const char* sexp_reader_text(const sexp_reader_t *r) {
+  return r->pos;
+}
+
+void sexp_reader_advance(sexp_reader_t *r, size_t n) {
+  r->pos += n;
+}
+
+void sexp_reader_fail(sexp_reader_t *r) {
+  r->failed = 1;
+}
+
+sexp_t *sexp_reader_read(sexp_reader_t *r) {
+  lexer *lex = r->lex;
+  if (r->failed) return NULL;
+  lex->end = r->pos;
+  lexer_next(lex);
+  sexp_t *res = sexp_read_any(lex);
+  if (res == NULL) {
+    r->failed = 1;
+    return NULL;
+  }
+  r->pos = lex->last;
+  return res;
+}
+
+// (head val), consumes val
+static sexp_t *reader_wrap(sexp_reader_t *r, const char* head, sexp_t *val) {
+  sexp_t *sym = sexp_new_symbol(head);
+  sexp_t *list = sym ? sexp_new_list() : NULL;
+  sexp_t *res = list ? sexp_list_append(list, sym) : NULL;
+  if (res != NULL) {
+    sym = NULL;
+    list = res;
+    res = sexp_list_append(list, val);
+  }
+  if (res == NULL) {
+    sexp_free(sym);
+    sexp_free(list);
+    sexp_free(val);
+    lexer_error(r->lex, SEXP_ERR_NOMEM, r->pos);
+    r->failed = 1;
+  }
+  return res;
+}
+
+sexp_t *sexp_macro_quote(sexp_reader_t *r, char ch, void *ctx) {
+  (void)ctx;
+  const char* head = ch == '`' ? "quasiquote" : ch == ',' ? "unquote" : "quote";
+  if (ch == ',' && *r->pos == '@') {
+    head = "unquote-splicing";
+    r->pos += 1;
+  }
+  sexp_t *val = sexp_reader_read(r);
+  if (val == NULL) return NULL;
+  return reader_wrap(r, head, val);
+}
+
+sexp_t *sexp_macro_boolean(sexp_reader_t *r, char ch, void *ctx) {
+  (void)ctx;
+  const char* s = r->pos;
+  while (is_constituent(r->lex->cls, *s)) ++s;
+  const char* rest = ch == 't' ? "rue" : "alse";
+  size_t len = s - r->pos;
+  if (len != 0 && (len != strlen(rest) || strncmp(r->pos, rest, len) != 0)) {
+    r->failed = 1;
+    return NULL;
+  }
+  r->pos = s;
+  sexp_t *res = sexp_new_symbol(ch == 't' ? "#t" : "#f");
+  if (res == NULL) {
+    lexer_error(r->lex, SEXP_ERR_NOMEM, r->pos);
+    r->failed = 1;
+  }
+  return res;
+}
+
+sexp_t *sexp_macro_datum_comment(sexp_reader_t *r, char ch, void *ctx) {
+  (void)ch;
+  (void)ctx;
+  sexp_free(sexp_reader_read(r));
+  return NULL;
+}
+
+sexp_t *sexp_macro_block_comment(sexp_reader_t *r, char ch, void *ctx) {
+  (void)ch;
+  (void)ctx;
+  const char* s = r->pos;
+  size_t depth = 1;
+  while (depth > 0) {
+    if (*s == '\0') {
+      r->failed = 1;
+      return NULL;
+    }
+    if (s[0] == '|' && s[1] == '#') {
+      depth -= 1;
+      s += 2;
+    } else if (s[0] == '#' && s[1] == '|') {
+      depth += 1;
+      s += 2;
+    } else {
+      ++s;
+    }
+  }
+  r->pos = s;
+  return NULL;
+}
+
+/******************************************************************************
+ * EVENT PARSER
+ *****************************************************************************/
+
+static const char* skip_value(const char* s);
+
+// sexp_token_t mirrors token_type, so tokens convert by casting
+
+static void parser_to_lexer(const sexp_parser_t *p, lexer *lex) {
+  lexer_init(lex, p->src, NULL);
+  lex->type = (token_type)p->type;
+  lex->start = p->start;
+  lex->end = p->end;
+}
+
+static sexp_token_t parser_from_lexer(sexp_parser_t *p, const lexer *lex) {
+  p->type = (sexp_token_t)lex->type;
+  p->start = lex->start;
+  p->end = lex->end;
+  return p->type;
+}
+
+void sexp_parser_init(sexp_parser_t *p, const char* src) {
+  p->type = SEXP_TOKEN_ERROR;
+  p->src = src;
+  p->start = src;
+  p->end = src;
+}
+
+sexp_token_t sexp_parser_next(sexp_parser_t *p) {
+  lexer lex;
+  parser_to_lexer(p, &lex);
+  lexer_next(&lex);
+  return parser_from_lexer(p, &lex);
+}
+
+int sexp_parser_skip(sexp_parser_t *p) {
+  if (p->type == SEXP_TOKEN_EOF || p->type == SEXP_TOKEN_ERROR ||
+      p->type == SEXP_TOKEN_CLOSE) {
+    return 0;
+  }
+  if (p->type == SEXP_TOKEN_OPEN) {
+    const char* end = skip_value(p->start);
+    if (end == NULL) return 0;
+    p->end = end;
+  }
+  sexp_parser_next(p);
+  return 1;
+}
+
+sexp_t *sexp_parser_read(sexp_parser_t *p) {
+  lexer lex;
+  parser_to_lexer(p, &lex);
+  sexp_t *res = sexp_read_any(&lex);
+  parser_from_lexer(p, &lex);
+  return res;
+}
+
+/******************************************************************************
+ * CURSORS
+ *****************************************************************************/
+
+// Cursors point into the source text and parse only what is asked for.
+// Values that are stepped over are skipped by matching brackets and quotes
+// without building anything, so they are not validated beyond that.
+
+enum { SKIP_OPEN = 1, SKIP_CLOSE, SKIP_QUOTE, SKIP_COMMENT, SKIP_END, SKIP_WS };
+
+static const unsigned char skip_class[256] = {
+  ['('] = SKIP_OPEN, ['['] = SKIP_OPEN, ['{'] = SKIP_OPEN,
+  [')'] = SKIP_CLOSE, [']'] = SKIP_CLOSE, ['}'] = SKIP_CLOSE,
+  ['"'] = SKIP_QUOTE, [';'] = SKIP_COMMENT, ['\0'] = SKIP_END,
+  [' '] = SKIP_WS, ['\t'] = SKIP_WS, ['\f'] = SKIP_WS, ['\n'] = SKIP_WS,
+};
+
+static const char* skip_ws(const char* s) {
+  while (1) {
+    while (isws(*s)) ++s;
+    if (*s != ';') return s;
+    while (*s != '\n' && *s != '\0') ++s;
+  }
+}
+
+// s points at the opening quote, returns NULL if the string is unterminated
+static const char* skip_string(const char* s) {
+  ++s;
+  while (1) {
+    switch (*s) {
+      case '"': return s + 1;
+      case '\0':
+      case '\n': return NULL;
+      case '\\':
+        if (s[1] == '\0') return NULL;
+        s += 2;
+        break;
+      default:
+        ++s;
+    }
+  }
+}
+
+// s points at the first character of a value, returns the end of the value
+static const char* skip_value(const char* s) {
+  switch (skip_class[(unsigned char)*s]) {
+    case SKIP_QUOTE:
+      return skip_string(s);
+    case SKIP_CLOSE:
+    case SKIP_END:
+      return NULL;
+    case SKIP_OPEN: {
+      size_t depth = 1;
+      ++s;
+      while (depth > 0) {
+        while (skip_class[(unsigned char)*s] == 0 ||
+            skip_class[(unsigned char)*s] == SKIP_WS) ++s;
+        switch (skip_class[(unsigned char)*s]) {
+          case SKIP_OPEN: depth += 1; ++s; break;
+          case SKIP_CLOSE: depth -= 1; ++s; break;
+          case SKIP_QUOTE:
+            s = skip_string(s);
+            if (s == NULL) return NULL;
+            break;
+          case SKIP_COMMENT:
+            while (*s != '\n' && *s != '\0') ++s;
+            break;
+          default:
+            return NULL;
+        }
+      }
+      return s;
+    }
+    default:
+      while (skip_class[(unsigned char)*s] == 0) ++s;
+      return s;
+  }
+}
+
+static sexp_cursor_t cursor_at(const char* s) {
+  sexp_cursor_t c;
+  c.start = s;
+  if (s != NULL) {
+    int cls = skip_class[(unsigned char)*s];
+    if (cls == SKIP_CLOSE || cls == SKIP_END) c.start = NULL;
+  }
+  return c;
+}
+
+sexp_cursor_t sexp_cursor_begin(const char* src) {
+  return cursor_at(skip_ws(src));
+}
+
+int sexp_cursor_ok(sexp_cursor_t c) {
+  return c.start != NULL;
+}
+
+const char* sexp_cursor_end(sexp_cursor_t c) {
+  if (c.start == NULL) return NULL;
+  return skip_value(c.start);
+}
+
+sexp_cursor_t sexp_cursor_next(sexp_cursor_t c) {
+  const char* end = sexp_cursor_end(c);
+  return cursor_at(end ? skip_ws(end) : NULL);
+}
+
+sexp_cursor_t sexp_cursor_child(sexp_cursor_t c) {
+  if (!sexp_cursor_is_list(c)) return cursor_at(NULL);
+  return cursor_at(skip_ws(c.start + 1));
+}
+
+sexp_cursor_t sexp_cursor_nth(sexp_cursor_t c, int n) {
+  c = sexp_cursor_child(c);
+  while (n-- > 0 && c.start != NULL) c = sexp_cursor_next(c);
+  return c;
+}
+
+size_t sexp_cursor_length(sexp_cursor_t c) {
+  size_t len = 0;
+  for (c = sexp_cursor_child(c); c.start != NULL; c = sexp_cursor_next(c)) ++len;
+  return len;
+}
+
+static int cursor_atom_eq(sexp_cursor_t c, const char* ref) {
+  size_t len = strlen(ref);
+  return c.start != NULL && skip_class[(unsigned char)*c.start] == 0 &&
+    strncmp(c.start, ref, len) == 0 &&
+    skip_class[(unsigned char)c.start[len]] != 0;
+}
+
+sexp_cursor_t sexp_cursor_get(sexp_cursor_t c, const char* keyword) {
+  for (c = sexp_cursor_child(c); c.start != NULL; c = sexp_cursor_next(c)) {
+    if (cursor_atom_eq(c, keyword)) return sexp_cursor_next(c);
+  }
+  return c;
+}
+
+int sexp_cursor_is_list(sexp_cursor_t c) {
+  return c.start != NULL && skip_class[(unsigned char)*c.start] == SKIP_OPEN;
+}
+
+int sexp_cursor_is_string(sexp_cursor_t c) {
+  return c.start != NULL && *c.start == '"';
+}
+
+int sexp_cursor_is_number(sexp_cursor_t c) {
+  if (c.start == NULL || skip_class[(unsigned char)*c.start] != 0) return 0;
+  char* end;
+  strtod(c.start, &end);
+  return end != c.start;
+}
+
+int sexp_cursor_is_symbol(sexp_cursor_t c) {
+  return c.start != NULL && skip_class[(unsigned char)*c.start] == 0 &&
+    !sexp_cursor_is_number(c);
+}
+
+double sexp_cursor_number(sexp_cursor_t c) {
+  if (c.start == NULL || skip_class[(unsigned char)*c.start] != 0) return NAN;
+  char* end;
+  double val = strtod(c.start, &end);
+  return end != c.start ? val : NAN;
+}
+
+int sexp_cursor_symbol_eq(sexp_cursor_t c, const char* ref) {
+  return cursor_atom_eq(c, ref) && sexp_cursor_is_symbol(c);
+}
+
+sexp_t *sexp_cursor_read(sexp_cursor_t c) {
+  if (c.start == NULL) return NULL;
+  return sexp_read(c.start, NULL);
+}
+
 /******************************************************************************
  * PRINTER
  *****************************************************************************/
 
+// output that doesn't fit after running out of memory is dropped and
+// failed is set
 typedef struct {
   size_t len;
   size_t cap;
+  int failed;
   char buf[];
 } printer_t;
 
 printer_t *printer_new() {
   printer_t *printer = malloc(sizeof(printer_t) + 64);
-  if (!printer) die("out of memory");
+  if (!printer) return NULL;
   printer->len = 0;
   printer->cap = 64;
+  printer->failed = 0;
   return printer;
 }
 
@@ -484,19 +2923,24 @@ void printer_free(printer_t *printer) {
 }
 
 printer_t *printer_ensure(printer_t *printer, size_t cap) {
-  if (printer->cap <= cap) {
+  if (printer->cap < cap) {
     size_t newcap = printer->cap;
     while (newcap < cap) newcap *= 1.5;
-    printer = realloc(printer, sizeof(printer_t) + newcap);
-    if (!printer) die("out of memory");
+    printer_t *res = realloc(printer, sizeof(printer_t) + newcap);
+    if (res == NULL) {
+      printer->failed = 1;
+      return printer;
+    }
+    printer = res;
     printer->cap = newcap;
   }
   return printer;
 }
 
 char* printer_cstr(printer_t *printer) {
+  if (printer->failed) return NULL;
   char* buf = malloc(printer->len+1);
-  if (!buf) die("out of memory");
+  if (!buf) return NULL;
   memcpy(buf, printer->buf, printer->len);
   buf[printer->len] = '\0';
   return buf;
@@ -504,13 +2948,15 @@ char* printer_cstr(printer_t *printer) {
 
 printer_t *printer_append_lpstring(printer_t *p, const char* str, size_t len) {
   p = printer_ensure(p, p->len + len);
+  if (p->failed) return p;
   memcpy(&(p->buf[p->len]), str, len);
   p->len += len;
   return p;
 }
 
 printer_t *printer_append_char(printer_t *printer, char ch) {
-  printer = printer_ensure(printer, printer->len);
+  printer = printer_ensure(printer, printer->len + 1);
+  if (printer->failed) return printer;
   printer->buf[printer->len] = ch;
   printer->len += 1;
   return printer;
@@ -518,43 +2964,106 @@ printer_t *printer_append_char(printer_t *printer, char ch) {
 
 static printer_t *printer_append_sexp(printer_t *p, const sexp_t *e);
 
-static printer_t *printer_append_sexp_string(printer_t *p, const sexp_t *e) {
-  sexp_string_t *s = (sexp_string_t*)e;
-  p = printer_append_char(p, '"');
-  const char* buf = s->val;
-  int len = s->len;
-  for (int i = 0; i < len; ++i) {
-    switch (buf[i]) {
-      case '\a': p = printer_append_lpstring(p, "\\a", 2); break;
-      case '\b': p = printer_append_lpstring(p, "\\b", 2); break;
-      case '\f': p = printer_append_lpstring(p, "\\f", 2); break;
-      case '\n': p = printer_append_lpstring(p, "\\n", 2); break;
-      case '\r': p = printer_append_lpstring(p, "\\r", 2); break;
-      case '\t': p = printer_append_lpstring(p, "\\t", 2); break;
-      case '\v': p = printer_append_lpstring(p, "\\v", 2); break;
-      case '\?': p = printer_append_lpstring(p, "\\?", 2); break;
-      case '\0': p = printer_append_lpstring(p, "\\0", 2); break;
-      case '\"': p = printer_append_lpstring(p, "\\\"", 2); break;
-      case '\'': p = printer_append_lpstring(p, "\\\'", 2); break;
-      default: printer_append_char(p, buf[i]); break;
+// characters that are printed escaped inside strings: 1 for named escapes,
+// 2 for hex escapes. bytes that aren't valid UTF-8 are hex escaped as well.
+static const unsigned char string_escapes[256] = {
+  [0x00] = 1, [0x01] = 2, [0x02] = 2, [0x03] = 2, [0x04] = 2, [0x05] = 2,
+  [0x06] = 2, ['\a'] = 1, ['\b'] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1,
+  ['\f'] = 1, ['\r'] = 1, [0x0e] = 2, [0x0f] = 2, [0x10] = 2, [0x11] = 2,
+  [0x12] = 2, [0x13] = 2, [0x14] = 2, [0x15] = 2, [0x16] = 2, [0x17] = 2,
+  [0x18] = 2, [0x19] = 2, [0x1a] = 2, [0x1b] = 1, [0x1c] = 2, [0x1d] = 2,
+  [0x1e] = 2, [0x1f] = 2, [0x7f] = 2,
+  ['"'] = 1, ['\''] = 1, ['?'] = 1, ['\\'] = 1,
+};
+
+// number of bytes at the start of buf that are printed as they are
+static size_t escape_run(const char* buf, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    unsigned char ch = buf[i];
+    if (ch < 0x80) {
+      if (string_escapes[ch] != 0) break;
+      ++i;
+      continue;
     }
+    // valid UTF-8 is printed as is, other bytes escaped
+    size_t n = utf8_sequence((const unsigned char*)buf + i, len - i);
+    if (n == 0) break;
+    i += n;
   }
+  return i;
+}
+
+// prints the escape for buf[i], which escape_run stopped at
+static printer_t *printer_append_escape(printer_t *p, const char* buf, size_t i, size_t len) {
+  unsigned char ch = buf[i];
+  if (ch >= 0x80 || string_escapes[ch] == 2 ||
+      (ch == 0 && i + 1 < len && buf[i+1] >= '0' && buf[i+1] <= '7')) {
+    char hex[5];
+    snprintf(hex, sizeof(hex), "\\x%02x", ch);
+    return printer_append_lpstring(p, hex, 4);
+  }
+  switch (ch) {
+    case '\a': return printer_append_lpstring(p, "\\a", 2);
+    case '\b': return printer_append_lpstring(p, "\\b", 2);
+    case '\x1b': return printer_append_lpstring(p, "\\e", 2);
+    case '\f': return printer_append_lpstring(p, "\\f", 2);
+    case '\n': return printer_append_lpstring(p, "\\n", 2);
+    case '\r': return printer_append_lpstring(p, "\\r", 2);
+    case '\t': return printer_append_lpstring(p, "\\t", 2);
+    case '\v': return printer_append_lpstring(p, "\\v", 2);
+    case '\?': return printer_append_lpstring(p, "\\?", 2);
+    case '\0': return printer_append_lpstring(p, "\\0", 2);
+    case '\"': return printer_append_lpstring(p, "\\\"", 2);
+    case '\'': return printer_append_lpstring(p, "\\\'", 2);
+    default: return printer_append_lpstring(p, "\\\\", 2);
+  }
+}
+
+static printer_t *printer_append_escaped(printer_t *p, const char* buf, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    size_t run = escape_run(buf + i, len - i);
+    p = printer_append_lpstring(p, buf + i, run);
+    i += run;
+    if (i == len) break;
+    p = printer_append_escape(p, buf, i, len);
+    i += 1;
+  }
+  return p;
+}
+
+static printer_t *printer_append_string(printer_t *p, const char* buf, size_t len) {
+  p = printer_append_char(p, '"');
+  p = printer_append_escaped(p, buf, len);
   p = printer_append_char(p, '"');
   return p;
 }
 
+static printer_t *printer_append_sexp_string(printer_t *p, const sexp_t *e) {
+  sexp_string_t *s = (sexp_string_t*)e;
+  return printer_append_string(p, s->val, s->len);
+}
+
 static printer_t *printer_append_sexp_symbol(printer_t *p, const sexp_t *e) {
   sexp_symbol_t *sym = (sexp_symbol_t*)e;
   p = printer_append_lpstring(p, sym->val, sym->len);
   return p;
 }
 
+// the shortest of 15 to 17 digits that reads back as val
+static printer_t *printer_append_number(printer_t *p, double val) {
+  char buf[32];               // 17 digits, sign, point and exponent
+  int len = snprintf(buf, sizeof(buf), "%.15lg", val);
+  if (val == val && strtod(buf, NULL) != val) {
+    len = snprintf(buf, sizeof(buf), "%.16lg", val);
+    if (strtod(buf, NULL) != val) len = snprintf(buf, sizeof(buf), "%.17lg", val);
+  }
+  return printer_append_lpstring(p, buf, len);
+}
+
 static printer_t *printer_append_sexp_number(printer_t *p, const sexp_t *e) {
-  double val = ((sexp_num_t*)e)->val;
-  char* res = NULL;
-  int len = asprintf(&res, "%lg", val);
-  p = printer_append_lpstring(p, res, len);
-  return p;
+  return printer_append_number(p, ((sexp_num_t*)e)->val);
 }
 
 static printer_t *printer_append_sexp_list(printer_t *p, const sexp_t *e) {
@@ -584,8 +3093,900 @@ static printer_t *printer_append_sexp(printer_t *p, const sexp_t *e) {
 
 char* sexp_display(sexp_t *e) {
   printer_t *p = printer_new();
+  if (p == NULL) return NULL;
   p = printer_append_sexp(p, e);
   char* res = printer_cstr(p);
   printer_free(p);
   return res;
 }
+
+/******************************************************************************
+ * WRITER
+ *****************************************************************************/
+
+// Writers print values as they are handed in, through the printer. With an
+// fd sink the printer is drained whenever it holds WRITER_CHUNK bytes.
+
+#define WRITER_CHUNK 4096
+
+struct sexp_writer_t {
+  printer_t *p;
+  int fd;                     // -1 to keep everything in p
+  size_t depth;
+  int first;                  // no space needed before the next value
+  int failed;
+};
+
+static sexp_writer_t *writer_new(int fd) {
+  sexp_writer_t *w = malloc(sizeof(sexp_writer_t));
+  if (w == NULL) return NULL;
+  w->p = printer_new();
+  if (w->p == NULL) {
+    free(w);
+    return NULL;
+  }
+  w->fd = fd;
+  w->depth = 0;
+  w->first = 1;
+  w->failed = 0;
+  return w;
+}
+
+sexp_writer_t *sexp_writer_new_buffer() {
+  return writer_new(-1);
+}
+
+sexp_writer_t *sexp_writer_new_fd(int fd) {
+  return writer_new(fd);
+}
+
+int sexp_writer_flush(sexp_writer_t *w) {
+  if (w->p->failed) w->failed = 1;
+  if (w->fd < 0 || w->failed) return !w->failed;
+  size_t done = 0;
+  while (done < w->p->len) {
+    ssize_t n = write(w->fd, w->p->buf + done, w->p->len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      w->failed = 1;
+      break;
+    }
+    done += n;
+  }
+  w->p->len = 0;
+  return !w->failed;
+}
+
+int sexp_writer_free(sexp_writer_t *w) {
+  if (w == NULL) return 0;
+  int ok = sexp_writer_flush(w) && w->depth == 0;
+  printer_free(w->p);
+  free(w);
+  return ok;
+}
+
+const char* sexp_writer_text(sexp_writer_t *w, size_t *len) {
+  w->p = printer_ensure(w->p, w->p->len + 1);
+  if (w->p->failed || w->fd >= 0) return NULL;
+  w->p->buf[w->p->len] = '\0';
+  if (len) *len = w->p->len;
+  return w->p->buf;
+}
+
+static void writer_begin_value(sexp_writer_t *w) {
+  if (!w->first) w->p = printer_append_char(w->p, ' ');
+  w->first = 0;
+}
+
+// top level values go on lines of their own
+static void writer_end_value(sexp_writer_t *w) {
+  if (w->depth == 0) {
+    w->p = printer_append_char(w->p, '\n');
+    w->first = 1;
+  }
+  if (w->fd >= 0 && w->p->len >= WRITER_CHUNK) sexp_writer_flush(w);
+}
+
+void sexp_writer_begin_list(sexp_writer_t *w) {
+  writer_begin_value(w);
+  w->p = printer_append_char(w->p, '(');
+  w->depth += 1;
+  w->first = 1;
+}
+
+void sexp_writer_end_list(sexp_writer_t *w) {
+  if (w->depth == 0) {
+    w->failed = 1;
+    return;
+  }
+  w->p = printer_append_char(w->p, ')');
+  w->depth -= 1;
+  w->first = 0;
+  writer_end_value(w);
+}
+
+void sexp_writer_symbol(sexp_writer_t *w, const char* s) {
+  sexp_writer_symbol_len(w, s, strlen(s));
+}
+
+void sexp_writer_symbol_len(sexp_writer_t *w, const char* s, size_t len) {
+  writer_begin_value(w);
+  w->p = printer_append_lpstring(w->p, s, len);
+  writer_end_value(w);
+}
+
+void sexp_writer_string(sexp_writer_t *w, const char* s) {
+  sexp_writer_string_len(w, s, strlen(s));
+}
+
+void sexp_writer_string_len(sexp_writer_t *w, const char* s, size_t len) {
+  writer_begin_value(w);
+  w->p = printer_append_string(w->p, s, len);
+  writer_end_value(w);
+}
+
+void sexp_writer_number(sexp_writer_t *w, double val) {
+  writer_begin_value(w);
+  w->p = printer_append_number(w->p, val);
+  writer_end_value(w);
+}
+
+void sexp_writer_value(sexp_writer_t *w, const sexp_t *e) {
+  writer_begin_value(w);
+  w->p = printer_append_sexp(w->p, e);
+  writer_end_value(w);
+}
+
+/******************************************************************************
+ * VECTORED OUTPUT
+ *****************************************************************************/
+
+// Payloads of at least IOV_REF bytes are referenced from the nodes, shorter
+// ones and everything generated are copied into one scratch printer. Scratch
+// segments are kept as offsets until the iovecs are built, because the
+// scratch buffer moves as it grows.
+
+#define IOV_REF 64
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct iov_seg_t {
+  const char* ext;            // NULL for scratch segments
+  size_t off;
+  size_t len;
+} iov_seg_t;
+
+struct sexp_iov_t {
+  printer_t *scratch;
+  size_t nsegs;
+  size_t cap;
+  iov_seg_t *segs;
+  struct iovec *iov;          // built by sexp_iov_get
+  size_t total;
+  int failed;
+};
+
+static void iov_push(sexp_iov_t *v, const char* ext, size_t off, size_t len) {
+  if (len == 0 || v->failed) return;
+  iov_seg_t *last = v->nsegs > 0 ? &v->segs[v->nsegs-1] : NULL;
+  v->total += len;
+  if (ext == NULL && last != NULL && last->ext == NULL && last->off + last->len == off) {
+    last->len += len;
+    return;
+  }
+  if (v->nsegs == v->cap) {
+    size_t cap = v->cap < 16 ? 16 : v->cap * 2;
+    iov_seg_t *segs = realloc(v->segs, sizeof(iov_seg_t) * cap);
+    if (segs == NULL) {
+      v->failed = 1;
+      return;
+    }
+    v->segs = segs;
+    v->cap = cap;
+  }
+  v->segs[v->nsegs].ext = ext;
+  v->segs[v->nsegs].off = off;
+  v->segs[v->nsegs].len = len;
+  v->nsegs += 1;
+}
+
+// everything appended to the scratch printer since off becomes a segment
+static void iov_scratch(sexp_iov_t *v, size_t off) {
+  iov_push(v, NULL, off, v->scratch->len - off);
+}
+
+static void iov_copy(sexp_iov_t *v, const char* buf, size_t len) {
+  size_t off = v->scratch->len;
+  v->scratch = printer_append_lpstring(v->scratch, buf, len);
+  iov_scratch(v, off);
+}
+
+static void iov_payload(sexp_iov_t *v, const char* buf, size_t len) {
+  if (len >= IOV_REF) iov_push(v, buf, 0, len);
+  else iov_copy(v, buf, len);
+}
+
+static void iov_append_escaped(sexp_iov_t *v, const char* buf, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    size_t run = escape_run(buf + i, len - i);
+    iov_payload(v, buf + i, run);
+    i += run;
+    if (i == len) break;
+    size_t off = v->scratch->len;
+    v->scratch = printer_append_escape(v->scratch, buf, i, len);
+    iov_scratch(v, off);
+    i += 1;
+  }
+}
+
+static void iov_append_sexp(sexp_iov_t *v, const sexp_t *e) {
+  if (sexp_is_string(e)) {
+    iov_copy(v, "\"", 1);
+    iov_append_escaped(v, sexp_string_get(e), sexp_string_length(e));
+    iov_copy(v, "\"", 1);
+  } else if (sexp_is_symbol(e)) {
+    iov_payload(v, sexp_symbol_get(e), sexp_symbol_length(e));
+  } else if (sexp_is_number(e)) {
+    size_t off = v->scratch->len;
+    v->scratch = printer_append_sexp_number(v->scratch, e);
+    iov_scratch(v, off);
+  } else if (sexp_is_list(e)) {
+    iov_copy(v, "(", 1);
+    size_t len = sexp_list_length(e);
+    for (size_t i = 0; i < len; ++i) {
+      if (i > 0) iov_copy(v, " ", 1);
+      iov_append_sexp(v, sexp_list_nth(e, i));
+    }
+    iov_copy(v, ")", 1);
+  } else {
+    die("invalid sexp type");
+  }
+}
+
+sexp_iov_t *sexp_display_iov(const sexp_t *e) {
+  sexp_iov_t *v = calloc(1, sizeof(sexp_iov_t));
+  if (v == NULL) return NULL;
+  v->scratch = printer_new();
+  if (v->scratch == NULL) {
+    free(v);
+    return NULL;
+  }
+  iov_append_sexp(v, e);
+  if (v->failed || v->scratch->failed) {
+    sexp_iov_free(v);
+    return NULL;
+  }
+  return v;
+}
+
+void sexp_iov_free(sexp_iov_t *v) {
+  if (v == NULL) return;
+  printer_free(v->scratch);
+  free(v->segs);
+  free(v->iov);
+  free(v);
+}
+
+size_t sexp_iov_length(const sexp_iov_t *v) {
+  return v->total;
+}
+
+const struct iovec *sexp_iov_get(sexp_iov_t *v, int *count) {
+  *count = v->nsegs;
+  if (v->iov == NULL && v->nsegs > 0) {
+    v->iov = malloc(sizeof(struct iovec) * v->nsegs);
+    if (v->iov == NULL) return NULL;
+    for (size_t i = 0; i < v->nsegs; ++i) {
+      const iov_seg_t *seg = &v->segs[i];
+      const char* base = seg->ext ? seg->ext : v->scratch->buf + seg->off;
+      v->iov[i].iov_base = (void*)base;
+      v->iov[i].iov_len = seg->len;
+    }
+  }
+  return v->iov;
+}
+
+int sexp_iov_write(sexp_iov_t *v, int fd) {
+  int count;
+  const struct iovec *iov = sexp_iov_get(v, &count);
+  if (iov == NULL) return count == 0;
+  int next = 0;
+  size_t skip = 0;            // bytes of iov[next] already written
+  while (next < count) {
+    ssize_t written;
+    int n = 1;
+    if (skip > 0) {
+      // finish a segment written in part before going on with whole ones
+      written = write(fd, (const char*)iov[next].iov_base + skip, iov[next].iov_len - skip);
+    } else {
+      n = count - next < IOV_MAX ? count - next : IOV_MAX;
+      written = writev(fd, iov + next, n);
+    }
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return 0;
+    written += skip;
+    skip = 0;
+    for (int i = 0; i < n && written >= (ssize_t)iov[next].iov_len; ++i) {
+      written -= iov[next].iov_len;
+      next += 1;
+    }
+    skip = written;
+  }
+  return 1;
+}
+
+/******************************************************************************
+ * IMAGES
+ *****************************************************************************/
+
+// An image is a header followed by the payload, the nodes of a document as
+// 8 byte aligned records in post order. Records of lists hold the offsets of
+// their elements relative to themselves, so the payload can be used wherever
+// it is mapped. Equal atoms are stored once and shared by the lists that
+// contain them. Compressed images store the payload in blocks of IMAGE_BLOCK
+// bytes, each behind a word with its stored length, and blocks that don't
+// shrink are stored raw.
+
+#define IMAGE_BLOCK 65536
+#define IMAGE_RAW 0x80000000u
+#define IMAGE_ORDER 0x01020304u
+#define IMAGE_PAD(n) (((n) + 7) & ~(size_t)7)
+
+static const char image_magic[8] = "SEXPIMG1";
+
+typedef struct image_header_t {
+  char magic[8];
+  uint32_t order;             // IMAGE_ORDER as the writer saw it
+  uint32_t codec;             // 0 if the payload is stored as is
+  uint32_t word;              // sizeof(size_t) of the writer, for the hashes
+  uint32_t block;             // IMAGE_BLOCK
+  uint64_t source_hash;
+  uint64_t size;              // of the payload
+  uint64_t stored;            // bytes after the header
+  uint64_t root;              // offset of the root record in the payload
+  uint64_t reserved;
+} image_header_t;
+
+typedef struct image_rec_t {
+  uint64_t tag;               // sexp_type_t, bytes of text or elements << 8
+  uint64_t hash;              // hash cached in the node, 0 if there was none
+} image_rec_t;
+// followed by the text and a NUL, a double, or int64_t element offsets
+
+#define REC_TYPE(rec) ((sexp_type_t)((rec)->tag & 0xff))
+#define REC_LEN(rec) ((size_t)((rec)->tag >> 8))
+
+struct sexp_image_t {
+  void *map;
+  size_t maplen;
+  char* inflated;             // payload of compressed images, NULL otherwise
+  const char* payload;
+  uint64_t size;
+  uint64_t root;
+  uint64_t source_hash;
+};
+
+uint64_t sexp_source_hash(const char* src, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ull ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, src + i, 8);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+  }
+  for (; i < len; ++i) {
+    h ^= (unsigned char)src[i];
+    h *= 0x100000001b3ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+typedef struct image_buf_t {
+  char* buf;
+  size_t len;
+  size_t cap;
+  int failed;
+  size_t *atoms;              // offset + 1 of atom records, by hash
+  size_t atomcap;             // power of two
+  size_t natoms;
+} image_buf_t;
+
+// appends size zeroed bytes and returns their offset
+static size_t image_reserve(image_buf_t *b, size_t size) {
+  if (b->failed) return 0;
+  if (b->len + size > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + size) cap *= 2;
+    char* buf = realloc(b->buf, cap);
+    if (buf == NULL) {
+      b->failed = 1;
+      return 0;
+    }
+    b->buf = buf;
+    b->cap = cap;
+  }
+  size_t off = b->len;
+  memset(b->buf + off, 0, size);
+  b->len += size;
+  return off;
+}
+
+static size_t image_put_rec(image_buf_t *b, const sexp_t *e, uint64_t len, size_t extra) {
+  size_t off = image_reserve(b, sizeof(image_rec_t) + extra);
+  if (b->failed) return 0;
+  image_rec_t *rec = (image_rec_t*)(b->buf + off);
+  rec->tag = (uint64_t)len << 8 | e->type;
+  rec->hash = e->hash;
+  return off;
+}
+
+// payload of the atom e as it is stored after its record
+static const char* image_atom_data(const sexp_t *e, size_t *len) {
+  switch (e->type) {
+    case SEXP_STRING: *len = sexp_string_length(e); return sexp_string_get(e);
+    case SEXP_SYMBOL: *len = sexp_symbol_length(e); return sexp_symbol_get(e);
+    default: *len = sizeof(double); return (const char*)&((sexp_num_t*)e)->val;
+  }
+}
+
+// slot of the atom table that holds e or is free for it
+static size_t *image_atom_slot(image_buf_t *b, const sexp_t *e) {
+  size_t len;
+  const char* data = image_atom_data(e, &len);
+  size_t mask = b->atomcap - 1;
+  for (size_t i = sexp_hash(e) & mask;; i = (i + 1) & mask) {
+    size_t off = b->atoms[i];
+    if (off == 0) return &b->atoms[i];
+    const image_rec_t *rec = (const image_rec_t*)(b->buf + off - 1);
+    size_t reclen = REC_TYPE(rec) == SEXP_NUMBER ? sizeof(double) : REC_LEN(rec);
+    if (REC_TYPE(rec) == e->type && rec->hash == e->hash && reclen == len &&
+        memcmp(rec + 1, data, len) == 0) {
+      return &b->atoms[i];
+    }
+  }
+}
+
+static int image_atoms_grow(image_buf_t *b) {
+  size_t oldcap = b->atomcap;
+  size_t *old = b->atoms;
+  b->atomcap = oldcap ? oldcap * 2 : 256;
+  b->atoms = calloc(b->atomcap, sizeof(size_t));
+  if (b->atoms == NULL) {
+    b->atoms = old;
+    b->atomcap = oldcap;
+    return 0;
+  }
+  for (size_t i = 0; i < oldcap; ++i) {
+    if (old[i] == 0) continue;
+    const image_rec_t *rec = (const image_rec_t*)(b->buf + old[i] - 1);
+    size_t mask = b->atomcap - 1, j = rec->hash & mask;
+    while (b->atoms[j] != 0) j = (j + 1) & mask;
+    b->atoms[j] = old[i];
+  }
+  free(old);
+  return 1;
+}
+
+// appends e and everything below it, returns the offset of its record
+static size_t image_put(image_buf_t *b, const sexp_t *e) {
+  size_t *slot = NULL;
+  if (e->type != SEXP_LIST) {
+    if (b->natoms * 2 >= b->atomcap && !image_atoms_grow(b)) {
+      b->failed = 1;
+      return 0;
+    }
+    slot = image_atom_slot(b, e);
+    if (*slot != 0) return *slot - 1;
+    b->natoms += 1;
+  }
+  switch (e->type) {
+    case SEXP_STRING:
+    case SEXP_SYMBOL: {
+      int str = e->type == SEXP_STRING;
+      size_t len = str ? sexp_string_length(e) : sexp_symbol_length(e);
+      size_t off = image_put_rec(b, e, len, IMAGE_PAD(len + 1));
+      if (b->failed) return 0;
+      memcpy(b->buf + off + sizeof(image_rec_t),
+          str ? sexp_string_get(e) : sexp_symbol_get(e), len);
+      *slot = off + 1;
+      return off;
+    }
+    case SEXP_NUMBER: {
+      double val = sexp_number_get(e);
+      size_t off = image_put_rec(b, e, 0, sizeof(double));
+      if (b->failed) return 0;
+      memcpy(b->buf + off + sizeof(image_rec_t), &val, sizeof(double));
+      *slot = off + 1;
+      return off;
+    }
+    case SEXP_LIST: {
+      size_t len = sexp_list_length(e);
+      size_t *items = malloc(sizeof(size_t) * (len ? len : 1));
+      if (items == NULL) {
+        b->failed = 1;
+        return 0;
+      }
+      for (size_t i = 0; i < len && !b->failed; ++i) {
+        items[i] = image_put(b, sexp_list_nth(e, i));
+      }
+      size_t off = image_put_rec(b, e, len, sizeof(int64_t) * len);
+      if (!b->failed) {
+        int64_t *rel = (int64_t*)(b->buf + off + sizeof(image_rec_t));
+        for (size_t i = 0; i < len; ++i) rel[i] = (int64_t)items[i] - (int64_t)off;
+      }
+      free(items);
+      return off;
+    }
+    default: die("invalid S-Expression");
+  }
+}
+
+static int image_write_all(int fd, const char* buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
+}
+
+// compresses the payload block wise into out
+static void image_deflate(const image_buf_t *in, image_buf_t *out,
+    const sexp_codec_t *codec) {
+  size_t bound = codec->bound(IMAGE_BLOCK);
+  for (size_t pos = 0; pos < in->len && !out->failed; pos += IMAGE_BLOCK) {
+    size_t n = in->len - pos < IMAGE_BLOCK ? in->len - pos : IMAGE_BLOCK;
+    size_t off = image_reserve(out, sizeof(uint32_t) + bound);
+    if (out->failed) return;
+    char* dst = out->buf + off + sizeof(uint32_t);
+    uint32_t word = codec->compress(in->buf + pos, n, dst);
+    if (word == 0 || word >= n) {
+      memcpy(dst, in->buf + pos, n);
+      word = n | IMAGE_RAW;
+    }
+    memcpy(out->buf + off, &word, sizeof(uint32_t));
+    out->len = off + sizeof(uint32_t) + (word & ~IMAGE_RAW);
+  }
+}
+
+int sexp_image_write(int fd, const sexp_t *e, uint64_t source_hash,
+    const sexp_codec_t *codec) {
+  if (e == NULL) return 0;
+  image_buf_t payload = { NULL, 0, 0, 0, NULL, 0, 0 };
+  image_buf_t packed = { NULL, 0, 0, 0, NULL, 0, 0 };
+  size_t root = image_put(&payload, e);
+
+  image_header_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, image_magic, sizeof(h.magic));
+  h.order = IMAGE_ORDER;
+  h.codec = codec ? codec->id : 0;
+  h.word = sizeof(size_t);
+  h.block = IMAGE_BLOCK;
+  h.source_hash = source_hash;
+  h.size = payload.len;
+  h.root = root;
+  const image_buf_t *body = &payload;
+  if (codec && !payload.failed) {
+    image_deflate(&payload, &packed, codec);
+    body = &packed;
+  }
+  h.stored = body->len;
+
+  int ok = !payload.failed && !packed.failed &&
+    image_write_all(fd, (const char*)&h, sizeof(h)) &&
+    image_write_all(fd, body->buf, body->len);
+  free(payload.buf);
+  free(payload.atoms);
+  free(packed.buf);
+  return ok;
+}
+
+static char* image_inflate(const image_header_t *h, const char* src,
+    const sexp_codec_t *codec) {
+  char* dst = malloc(h->size ? h->size : 1);
+  if (dst == NULL) return NULL;
+  uint64_t in = 0;
+  for (uint64_t pos = 0; pos < h->size; pos += IMAGE_BLOCK) {
+    size_t n = h->size - pos < IMAGE_BLOCK ? h->size - pos : IMAGE_BLOCK;
+    uint32_t word;
+    if (h->stored - in < sizeof(word)) goto fail;
+    memcpy(&word, src + in, sizeof(word));
+    in += sizeof(word);
+    size_t len = word & ~IMAGE_RAW;
+    if (len > h->stored - in) goto fail;
+    if (word & IMAGE_RAW) {
+      if (len != n) goto fail;
+      memcpy(dst + pos, src + in, n);
+    } else if (!codec->decompress(src + in, len, dst + pos, n)) {
+      goto fail;
+    }
+    in += len;
+  }
+  if (in == h->stored) return dst;
+fail:
+  free(dst);
+  return NULL;
+}
+
+sexp_image_t *sexp_image_open(const char* path, const sexp_codec_t *codec) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(image_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  size_t maplen = st.st_size;
+  void *map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  image_header_t h;
+  memcpy(&h, map, sizeof(h));
+  const char* body = (const char*)map + sizeof(h);
+  if (memcmp(h.magic, image_magic, sizeof(h.magic)) != 0 ||
+      h.order != IMAGE_ORDER || h.word != sizeof(size_t) ||
+      h.block != IMAGE_BLOCK || h.stored != maplen - sizeof(h) ||
+      h.root % 8 != 0 || h.size < sizeof(image_rec_t) ||
+      h.root > h.size - sizeof(image_rec_t) ||
+      (h.codec == 0 && h.size != h.stored) ||
+      (h.codec != 0 && (codec == NULL || codec->id != h.codec))) {
+    munmap(map, maplen);
+    return NULL;
+  }
+
+  sexp_image_t *img = malloc(sizeof(sexp_image_t));
+  char* inflated = NULL;
+  if (img && h.codec != 0) {
+    inflated = image_inflate(&h, body, codec);
+    munmap(map, maplen);
+    map = NULL;
+    maplen = 0;
+    if (inflated == NULL) {
+      free(img);
+      return NULL;
+    }
+  }
+  if (img == NULL) {
+    if (map) munmap(map, maplen);
+    return NULL;
+  }
+  img->map = map;
+  img->maplen = maplen;
+  img->inflated = inflated;
+  img->payload = inflated ? inflated : body;
+  img->size = h.size;
+  img->root = h.root;
+  img->source_hash = h.source_hash;
+  return img;
+}
+
+void sexp_image_close(sexp_image_t *img) {
+  if (img == NULL) return;
+  if (img->map) munmap(img->map, img->maplen);
+  free(img->inflated);
+  free(img);
+}
+
+uint64_t sexp_image_source_hash(const sexp_image_t *img) {
+  return img->source_hash;
+}
+
+sexp_view_t sexp_image_root(const sexp_image_t *img) {
+  sexp_view_t v = { img->payload + img->root };
+  return v;
+}
+
+static const image_rec_t *view_rec(sexp_view_t v) {
+  return (const image_rec_t*)v.rec;
+}
+
+static const char* view_data(sexp_view_t v) {
+  return v.rec + sizeof(image_rec_t);
+}
+
+static sexp_view_t view_none() {
+  sexp_view_t v = { NULL };
+  return v;
+}
+
+int sexp_view_ok(sexp_view_t v) {
+  return v.rec != NULL;
+}
+
+int sexp_view_is_list(sexp_view_t v) {
+  return v.rec != NULL && REC_TYPE(view_rec(v)) == SEXP_LIST;
+}
+
+int sexp_view_is_string(sexp_view_t v) {
+  return v.rec != NULL && REC_TYPE(view_rec(v)) == SEXP_STRING;
+}
+
+int sexp_view_is_symbol(sexp_view_t v) {
+  return v.rec != NULL && REC_TYPE(view_rec(v)) == SEXP_SYMBOL;
+}
+
+int sexp_view_is_number(sexp_view_t v) {
+  return v.rec != NULL && REC_TYPE(view_rec(v)) == SEXP_NUMBER;
+}
+
+size_t sexp_view_length(sexp_view_t v) {
+  return v.rec == NULL ? 0 : REC_LEN(view_rec(v));
+}
+
+sexp_view_t sexp_view_nth(sexp_view_t v, size_t n) {
+  if (!sexp_view_is_list(v) || n >= REC_LEN(view_rec(v))) return view_none();
+  int64_t rel;
+  memcpy(&rel, view_data(v) + sizeof(int64_t) * n, sizeof(rel));
+  sexp_view_t res = { v.rec + rel };
+  return res;
+}
+
+const char* sexp_view_text(sexp_view_t v) {
+  if (!sexp_view_is_string(v) && !sexp_view_is_symbol(v)) return NULL;
+  return view_data(v);
+}
+
+double sexp_view_number(sexp_view_t v) {
+  if (!sexp_view_is_number(v)) return NAN;
+  double val;
+  memcpy(&val, view_data(v), sizeof(val));
+  return val;
+}
+
+sexp_view_t sexp_view_get(sexp_view_t v, const char* keyword) {
+  size_t len = sexp_view_length(v), klen = strlen(keyword);
+  for (size_t i = 0; sexp_view_is_list(v) && i + 1 < len; ++i) {
+    sexp_view_t item = sexp_view_nth(v, i);
+    if (sexp_view_is_symbol(item) && sexp_view_length(item) == klen &&
+        memcmp(sexp_view_text(item), keyword, klen) == 0) {
+      return sexp_view_nth(v, i + 1);
+    }
+  }
+  return view_none();
+}
+
+sexp_t *sexp_view_load(sexp_view_t v) {
+  if (v.rec == NULL) return NULL;
+  const image_rec_t *rec = view_rec(v);
+  sexp_t *e;
+  size_t len = REC_LEN(rec);
+  switch (REC_TYPE(rec)) {
+    case SEXP_STRING: e = sexp_new_string_len(view_data(v), len); break;
+    case SEXP_SYMBOL: e = sexp_new_symbol_len(view_data(v), len); break;
+    case SEXP_NUMBER: e = sexp_new_number(sexp_view_number(v)); break;
+    case SEXP_LIST: {
+      sexp_list_t *list = sexp_list_alloc(len);
+      if (list == NULL) return NULL;
+      for (size_t i = 0; i < len; ++i) {
+        sexp_t *item = sexp_view_load(sexp_view_nth(v, i));
+        if (item == NULL) {
+          sexp_free((sexp_t*)list);
+          return NULL;
+        }
+        list->elements[list->len++] = item;
+      }
+      e = (sexp_t*)list;
+      break;
+    }
+    default: return NULL;
+  }
+  if (e) e->hash = rec->hash;
+  return e;
+}
+
+/******************************************************************************
+ * LZ CODEC
+ *****************************************************************************/
+
+// LZ77 with the sequence format of LZ4: a token with the literal count in
+// the high and the match length - LZ_MIN in the low nibble, nibbles of 15
+// continued by bytes that are added up until one isn't 255, the literals, and
+// a 16 bit little endian match offset. The last sequence has no match.
+// Matches are found through a hash table of the last position of every 4 byte
+// prefix.
+
+#define LZ_MIN 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static size_t lz_bound(size_t len) {
+  return len + len / 255 + 16;
+}
+
+static char* lz_put_count(char* op, size_t n) {
+  for (; n >= 255; n -= 255) *op++ = (char)255;
+  *op++ = (char)n;
+  return op;
+}
+
+static char* lz_put_sequence(char* op, const char* lit, size_t nlit,
+    size_t offset, size_t mlen) {
+  size_t m = mlen ? mlen - LZ_MIN : 0;
+  *op++ = (char)(((nlit < 15 ? nlit : 15) << 4) | (m < 15 ? m : 15));
+  if (nlit >= 15) op = lz_put_count(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0) return op;
+  *op++ = (char)(offset & 0xff);
+  *op++ = (char)(offset >> 8);
+  if (m >= 15) op = lz_put_count(op, m - 15);
+  return op;
+}
+
+static size_t lz_compress(const char* src, size_t len, char* dst) {
+  size_t table[1 << LZ_HASH_BITS];  // position + 1, 0 if unused
+  memset(table, 0, sizeof(table));
+  char* op = dst;
+  size_t ip = 0, anchor = 0;
+  while (ip + LZ_MIN <= len) {
+    uint32_t seq;
+    memcpy(&seq, src + ip, sizeof(seq));
+    uint32_t slot = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t ref = table[slot];
+    table[slot] = ip + 1;
+    if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET ||
+        memcmp(src + ref - 1, src + ip, LZ_MIN) != 0) {
+      ip += 1;
+      continue;
+    }
+    ref -= 1;
+    size_t mlen = LZ_MIN;
+    while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) mlen += 1;
+    op = lz_put_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+    ip += mlen;
+    anchor = ip;
+  }
+  op = lz_put_sequence(op, src + anchor, len - anchor, 0, 0);
+  return op - dst;
+}
+
+// adds the continuation bytes of a count to n, 0 if src ends first
+static int lz_get_count(const unsigned char* src, size_t len, size_t *ip, size_t *n) {
+  unsigned char b;
+  do {
+    if (*ip >= len) return 0;
+    b = src[(*ip)++];
+    *n += b;
+  } while (b == 255);
+  return 1;
+}
+
+static int lz_decompress(const char* in, size_t len, char* dst, size_t dstlen) {
+  const unsigned char* src = (const unsigned char*)in;
+  size_t ip = 0, op = 0;
+  for (;;) {
+    if (ip >= len) return 0;  // the last sequence has literals only
+    unsigned token = src[ip++];
+    size_t nlit = token >> 4;
+    if (nlit == 15 && !lz_get_count(src, len, &ip, &nlit)) return 0;
+    if (nlit > len - ip || nlit > dstlen - op) return 0;
+    memcpy(dst + op, src + ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == len) break;
+    if (len - ip < 2) return 0;
+    size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && !lz_get_count(src, len, &ip, &mlen)) return 0;
+    mlen += LZ_MIN;
+    if (offset == 0 || offset > op || mlen > dstlen - op) return 0;
+    // byte wise, matches may overlap the bytes they produce
+    for (size_t i = 0; i < mlen; ++i) dst[op + i] = dst[op - offset + i];
+    op += mlen;
+  }
+  return op == dstlen;
+}
+
+const sexp_codec_t sexp_codec_lz = { 1, lz_bound, lz_compress, lz_decompress };
@@ -10,9 +10,61 @@
 #define __RUB_SEXP_
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct sexp_t sexp_t;
 
+// allocator hooks. realloc and free are passed the size the block was
+// allocated with, alloc and realloc return NULL when out of memory.
+typedef struct sexp_allocator_t {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *p, size_t old_size, size_t size);
+  void (*free)(void *ctx, void *p, size_t size);
+  void *ctx;
+} sexp_allocator_t;
+
+// sets the allocator for what is created on the calling thread and returns
+// the previous one, NULL selects malloc. nodes are returned to the allocator
+// they came from, whichever thread frees them. functions that allocate
+// return NULL when out of memory.
+//
+// the allocator covers nodes and the tables the reader and tree functions
+// keep: intern tables, indexes, readtables and iterators. text the printers
+// return is freed by the caller with free, so it comes from malloc, as do
+// writers, iov lists and the modules' own state: queries, schemas, diffs,
+// programs, pipelines and workers. nodes they create use the allocator.
+const sexp_allocator_t *sexp_set_allocator(const sexp_allocator_t *a);
+
+// the default allocator keeps freed small blocks in per-thread pools for
+// reuse. threads that are done with the library should hand them back with
+// this, so that other threads can reuse them. building with -DSEXP_NO_POOL
+// makes the default allocator plain malloc.
+void sexp_pool_release();
+
+// allocation accounting: a counting allocator passes everything on to
+// another one, NULL for the default, and keeps track of what is live.
+// comparing the stats before and after a call tells what it allocated and
+// left behind. the counters are updated atomically, so nodes can be freed
+// from any thread.
+typedef struct sexp_alloc_stats_t {
+  size_t live_bytes;          // allocated and not freed yet
+  size_t live_blocks;
+  size_t peak_bytes;          // most live_bytes at any time
+  size_t allocs;              // calls of alloc and realloc
+  size_t frees;
+} sexp_alloc_stats_t;
+
+typedef struct sexp_counting_t {
+  sexp_allocator_t allocator; // select this one to count
+  const sexp_allocator_t *inner;
+  sexp_alloc_stats_t stats;
+} sexp_counting_t;
+
+void sexp_counting_init(sexp_counting_t *c, const sexp_allocator_t *inner);
+sexp_alloc_stats_t sexp_counting_stats(const sexp_counting_t *c);
+
+// nodes are reference counted, sexp_free drops one reference
+sexp_t *sexp_ref(sexp_t *e);
 void sexp_free(sexp_t *e);
 
 sexp_t *sexp_new_string(const char* s);
@@ -46,12 +98,344 @@ void sexp_list_free(sexp_t *e);
 int sexp_is_list(const sexp_t *e);
 size_t sexp_list_length(const sexp_t *e);
 sexp_t *sexp_list_nth(const sexp_t *e, int n);
-sexp_t *sexp_list_append(sexp_t *list, sexp_t *val); // consumes list and returns new
+// consumes list and returns new. if out of memory, returns NULL and list and
+// val still belong to the caller. appending in place to a list nested in
+// others leaves their cached hashes stale, call sexp_rehash on the root
+// before comparing, diffing or interning the tree then.
+sexp_t *sexp_list_append(sexp_t *list, sexp_t *val);
+
+// persistent updates, the input list is left untouched and the result shares
+// unchanged structure with it. O(log n) per call on the versions these
+// return. flat lists, as read or built by append, are copied in O(n) by
+// every call, so a list that is updated many times should be turned into a
+// version first, e.g. with sexp_list_slice(list, 0, len). values passed in
+// are consumed, also when running out of memory.
+//
+// reference counts aren't atomic, and these take references to the input's
+// elements. threads that derive versions from a shared list, or free nodes
+// that are shared between them, need to hold a lock for it.
+sexp_t *sexp_list_set(const sexp_t *list, int n, sexp_t *val);
+sexp_t *sexp_list_insert(const sexp_t *list, int n, sexp_t *val);
+sexp_t *sexp_list_remove(const sexp_t *list, int n);
+sexp_t *sexp_list_concat(const sexp_t *a, const sexp_t *b);
+sexp_t *sexp_list_slice(const sexp_t *list, int from, int to); // [from, to)
+
+// lookup by value. position of the first element equal to val, -1 if there
+// is none. this scans the list, unless it opted in to a hash index with
+// sexp_list_index. the index is built there and appends keep it current, so
+// lookups don't write. versions returned by the persistent updates don't have
+// one. elements changed in place, like a nested list appended to, leave the
+// index stale, call sexp_rehash and then sexp_list_index again to rebuild it.
+// returns 0 if out of memory.
+int sexp_list_index(sexp_t *list);
+int sexp_list_find(const sexp_t *list, const sexp_t *val);
+int sexp_list_contains(const sexp_t *list, const sexp_t *val);
+
+
+
+// memory held by the nodes of a tree. nodes reached more than once are
+// counted once. wasted bytes are allocated but unused: spare capacity of
+// lists, element arrays of lists that moved to the shared representation,
+// and rounding by the allocator.
+typedef struct sexp_memory_kind_t {
+  size_t count;               // nodes
+  size_t bytes;               // allocated for them, including wasted
+  size_t wasted;
+} sexp_memory_kind_t;
+
+typedef struct sexp_memory_t {
+  sexp_memory_kind_t strings, symbols, numbers, lists;
+  size_t blocks;              // separate allocations, a compacted tree is one
+  size_t bytes;               // totals of the kinds
+  size_t wasted;
+} sexp_memory_t;
+
+sexp_memory_t sexp_memory_usage(const sexp_t *e);
+
+// moves a tree into a single allocation, with each list followed by its
+// elements in preorder and no spare capacity. subtrees shared within the
+// tree stay shared. the block is freed with the last of its nodes, nodes
+// that are changed in place afterwards move out of it. consumes e, returns
+// NULL if out of memory and leaves e alone then.
+sexp_t *sexp_compact(sexp_t *e);
+// the same for a copy of e, which shares nothing with it. e isn't changed,
+// not even its reference count.
+sexp_t *sexp_compact_copy(const sexp_t *e);
+
+
+
+// preorder traversal without recursion, the path to the current node is kept
+// on a stack of its own. the tree must not change while it is traversed.
+typedef struct sexp_iter_t sexp_iter_t;
+
+sexp_iter_t *sexp_iter_new(const sexp_t *root); // NULL if out of memory
+void sexp_iter_free(sexp_iter_t *it);
+// starts over at another root, keeping the stack
+void sexp_iter_reset(sexp_iter_t *it, const sexp_t *root);
+// the next node, root first. NULL after the last one, or if out of memory,
+// which leaves the depth above 0.
+const sexp_t *sexp_iter_next(sexp_iter_t *it);
+// number of lists the last node returned is nested in, 0 for the root
+size_t sexp_iter_depth(const sexp_iter_t *it);
+// continues after the last node returned without visiting its elements
+void sexp_iter_skip(sexp_iter_t *it);
+
+// structural comparison of whole trees. hashes are cached in the nodes, so
+// repeated hashing and comparing of unequal trees is O(1) after the first call.
+// the cache is updated atomically, threads can hash and compare shared trees.
+int sexp_equal(const sexp_t *a, const sexp_t *b);
+size_t sexp_hash(const sexp_t *e);
+// drops the cached hashes of all lists in e and hashes it again, O(n)
+size_t sexp_rehash(sexp_t *e);
+
+
+
+// hash-consing: a table of canonical nodes. interning returns the canonical
+// node equal to e, so equal trees interned through the same table share
+// structure and compare equal by pointer. the table keeps its nodes alive
+// until it is freed. shared lists are copied when appended to.
+typedef struct sexp_intern_t sexp_intern_t;
+
+sexp_intern_t *sexp_intern_new();
+void sexp_intern_free(sexp_intern_t *t);
+size_t sexp_intern_size(const sexp_intern_t *t);
+sexp_t *sexp_intern(sexp_intern_t *t, sexp_t *e); // consumes e
+
+
+
+// structural index: the positions of all tokens in a buffer, found in one
+// vectorized pass. reading from inside an indexed buffer with the index set
+// in the reader options takes tokens from the index instead of scanning.
+typedef struct sexp_index_t sexp_index_t;
+
+sexp_index_t *sexp_index_new(const char* src, size_t len); // NULL if too large
+void sexp_index_free(sexp_index_t *idx);
+
+
+
+// returns 0 and the offset of the first bad byte if s is not valid UTF-8
+int sexp_utf8_valid(const char* s, size_t len, size_t *bad);
 
 
 
+typedef enum sexp_error_code_t {
+  SEXP_ERR_NONE,
+  SEXP_ERR_SYNTAX,
+  SEXP_ERR_ESCAPE,
+  SEXP_ERR_UTF8,
+  SEXP_ERR_NOMEM,
+  SEXP_ERR_IO,                // reading the input failed
+} sexp_error_code_t;
+
+typedef struct sexp_error_t {
+  sexp_error_code_t code;
+  size_t offset;              // from the start of the read
+} sexp_error_t;
+
+// Reader macros. A readtable assigns functions to characters that read
+// whatever follows the character when it starts a token. Macro characters
+// end atoms like brackets do, dispatch macros are two character sequences
+// #c and leave other atoms starting with # alone. sexp_readtable_new comes
+// with the standard macros:
+//   'x `x ,x ,@x   (quote x) (quasiquote x) (unquote x) (unquote-splicing x)
+//   #t #f          the symbols #t and #f, also written #true and #false
+//   #;x            comments out the value x
+//   #| ... |#      block comment, they nest
+typedef struct sexp_readtable_t sexp_readtable_t;
+typedef struct sexp_reader_t sexp_reader_t;
+
+// reads what follows the macro character ch. returns the value read, or
+// NULL for nothing like comments do, unless the macro failed the read.
+typedef sexp_t *(*sexp_macro_t)(sexp_reader_t *r, char ch, void *ctx);
+
+sexp_readtable_t *sexp_readtable_new(); // NULL if out of memory
+void sexp_readtable_free(sexp_readtable_t *t);
+// brackets, quotes, ';', '#' and whitespace can't be macro characters and
+// '\0' can't follow '#', the setters return 0 for them and leave t as is.
+// a NULL fn makes ch a plain character again.
+int sexp_readtable_set(sexp_readtable_t *t, char ch, sexp_macro_t fn, void *ctx);
+int sexp_readtable_dispatch(sexp_readtable_t *t, char ch, sexp_macro_t fn, void *ctx);
+
+// for macros: the text after the macro character, moving past what was used
+const char* sexp_reader_text(const sexp_reader_t *r);
+void sexp_reader_advance(sexp_reader_t *r, size_t n);
+// reads the next value with the same readtable, NULL fails the read
+sexp_t *sexp_reader_read(sexp_reader_t *r);
+void sexp_reader_fail(sexp_reader_t *r);
+
+// the standard macros, for binding to other characters
+sexp_t *sexp_macro_quote(sexp_reader_t *r, char ch, void *ctx);
+sexp_t *sexp_macro_boolean(sexp_reader_t *r, char ch, void *ctx);
+sexp_t *sexp_macro_datum_comment(sexp_reader_t *r, char ch, void *ctx);
+sexp_t *sexp_macro_block_comment(sexp_reader_t *r, char ch, void *ctx);
+
+// reader options, a zero initialized struct gives the sexp_read behavior
+typedef struct sexp_read_opts_t {
+  sexp_intern_t *intern;      // hash-cons everything read through this table
+  const sexp_index_t *index;  // tokens of the buffer being read
+  int validate_utf8;          // fail on strings and symbols that aren't UTF-8
+  sexp_error_t *error;        // receives the first error of a failed read
+  const sexp_allocator_t *allocator; // for this read instead of the thread's
+  const sexp_readtable_t *readtable; // reader macros, index isn't used then
+} sexp_read_opts_t;
+
+// decodes the escape sequences in the string body src into dst, which must
+// have room for len bytes and may be src. returns 0 on invalid escapes.
+int sexp_unescape(const char* src, size_t len, char* dst, size_t *dstlen);
+
+// reads share no state, separate threads can read concurrently as long as
+// they don't share an intern table
 sexp_t *sexp_read(const char* src, char** end);
+sexp_t *sexp_read_opts(const char* src, char** end, const sexp_read_opts_t *opts);
+
+// pull parser over the token stream, for walking documents without building
+// them. after sexp_parser_init, call sexp_parser_next to get the first token.
+typedef enum sexp_token_t {
+  SEXP_TOKEN_ERROR,
+  SEXP_TOKEN_EOF,
+  SEXP_TOKEN_OPEN,
+  SEXP_TOKEN_CLOSE,
+  SEXP_TOKEN_STRING,          // text includes the quotes and escapes
+  SEXP_TOKEN_ATOM,            // symbols and numbers
+} sexp_token_t;
+
+typedef struct sexp_parser_t {
+  sexp_token_t type;
+  const char* src;
+  const char* start;          // text of the current token is [start, end)
+  const char* end;
+} sexp_parser_t;
+
+void sexp_parser_init(sexp_parser_t *p, const char* src);
+sexp_token_t sexp_parser_next(sexp_parser_t *p);
+// skips the whole value starting at the current token, returns 0 on errors
+int sexp_parser_skip(sexp_parser_t *p);
+// builds the value starting at the current token and moves past it
+sexp_t *sexp_parser_read(sexp_parser_t *p);
+
+
+
+// on-demand access: cursors point at a value in the source text and parse
+// only what is accessed. values that are stepped over are skipped by matching
+// brackets and quotes, without allocating or validating them. navigating
+// past the end of a list or the input gives a cursor that is not ok.
+typedef struct sexp_cursor_t {
+  const char* start;          // first character of the value, or NULL
+} sexp_cursor_t;
 
+sexp_cursor_t sexp_cursor_begin(const char* src);
+int sexp_cursor_ok(sexp_cursor_t c);
+const char* sexp_cursor_end(sexp_cursor_t c);
+sexp_cursor_t sexp_cursor_next(sexp_cursor_t c);
+sexp_cursor_t sexp_cursor_child(sexp_cursor_t c);
+sexp_cursor_t sexp_cursor_nth(sexp_cursor_t c, int n);
+size_t sexp_cursor_length(sexp_cursor_t c);
+// the value following the element keyword, e.g. "name:"
+sexp_cursor_t sexp_cursor_get(sexp_cursor_t c, const char* keyword);
+int sexp_cursor_is_list(sexp_cursor_t c);
+int sexp_cursor_is_string(sexp_cursor_t c);
+int sexp_cursor_is_number(sexp_cursor_t c);
+int sexp_cursor_is_symbol(sexp_cursor_t c);
+// NAN when the cursor isn't ok or not on a number
+double sexp_cursor_number(sexp_cursor_t c);
+int sexp_cursor_symbol_eq(sexp_cursor_t c, const char* ref);
+// builds the value under the cursor
+sexp_t *sexp_cursor_read(sexp_cursor_t c);
+
+
+
+// the result is allocated with malloc
 char *sexp_display(sexp_t *e);
 
+// streaming output: values are printed as they are written, without building
+// nodes. top level values end with a newline, list items are separated by
+// spaces and strings escaped like sexp_display does. errors, such as
+// unbalanced lists, failed writes or running out of memory, are sticky.
+typedef struct sexp_writer_t sexp_writer_t;
+
+sexp_writer_t *sexp_writer_new_buffer();
+sexp_writer_t *sexp_writer_new_fd(int fd);
+// flushes, returns 0 if any call failed or lists are left open
+int sexp_writer_free(sexp_writer_t *w);
+int sexp_writer_flush(sexp_writer_t *w);
+// everything written to a buffer writer so far, NULL for fd writers
+const char* sexp_writer_text(sexp_writer_t *w, size_t *len);
+
+void sexp_writer_begin_list(sexp_writer_t *w);
+void sexp_writer_end_list(sexp_writer_t *w);
+void sexp_writer_symbol(sexp_writer_t *w, const char* s);
+void sexp_writer_symbol_len(sexp_writer_t *w, const char* s, size_t len);
+void sexp_writer_string(sexp_writer_t *w, const char* s);
+void sexp_writer_string_len(sexp_writer_t *w, const char* s, size_t len);
+void sexp_writer_number(sexp_writer_t *w, double val);
+void sexp_writer_value(sexp_writer_t *w, const sexp_t *e);
+
+// vectored output, for writev. prints like sexp_display, but large string
+// and symbol payloads are referenced from the nodes instead of copied, so e
+// must outlive the result. only delimiters, numbers, escapes and short
+// payloads are copied.
+struct iovec;
+typedef struct sexp_iov_t sexp_iov_t;
+
+sexp_iov_t *sexp_display_iov(const sexp_t *e);
+void sexp_iov_free(sexp_iov_t *v);
+size_t sexp_iov_length(const sexp_iov_t *v); // total bytes
+const struct iovec *sexp_iov_get(sexp_iov_t *v, int *count);
+// writes all of it, passing up to IOV_MAX segments to each writev call
+int sexp_iov_write(sexp_iov_t *v, int fd);
+
+// Images: a parsed document stored for reloading without parsing it again.
+// Nodes are kept as records that refer to each other by relative offsets, so
+// an uncompressed image is used right where it is mapped. Compressed images
+// are decompressed block wise into memory when opened. Images record a hash
+// of the source they were made from, to tell when they are stale, and are
+// only readable on machines with the writer's byte order and word size.
+// Images are trusted, only their header is checked when they are opened.
+typedef struct sexp_codec_t {
+  uint32_t id;                // nonzero, recorded in the image
+  size_t (*bound)(size_t len); // room compress needs for len bytes
+  // returns the compressed size, 0 if the block is better stored as is
+  size_t (*compress)(const char* src, size_t len, char* dst);
+  // returns 0 unless src decompresses to exactly dstlen bytes
+  int (*decompress)(const char* src, size_t len, char* dst, size_t dstlen);
+} sexp_codec_t;
+
+// fast LZ77 in the block format of LZ4
+extern const sexp_codec_t sexp_codec_lz;
+
+typedef struct sexp_image_t sexp_image_t;
+
+uint64_t sexp_source_hash(const char* src, size_t len);
+// writes an image of e to fd, compressed if codec is set. write to a
+// temporary file and rename it to replace images atomically.
+int sexp_image_write(int fd, const sexp_t *e, uint64_t source_hash,
+    const sexp_codec_t *codec);
+// NULL if the file isn't an image or needs a codec other than the given one
+sexp_image_t *sexp_image_open(const char* path, const sexp_codec_t *codec);
+void sexp_image_close(sexp_image_t *img);
+uint64_t sexp_image_source_hash(const sexp_image_t *img);
+
+// views are read-only nodes inside an image, valid until it is closed.
+// navigating to values that don't exist gives a view that is not ok.
+typedef struct sexp_view_t {
+  const char* rec;
+} sexp_view_t;
+
+sexp_view_t sexp_image_root(const sexp_image_t *img);
+int sexp_view_ok(sexp_view_t v);
+int sexp_view_is_list(sexp_view_t v);
+int sexp_view_is_string(sexp_view_t v);
+int sexp_view_is_symbol(sexp_view_t v);
+int sexp_view_is_number(sexp_view_t v);
+// elements of lists, bytes of strings and symbols
+size_t sexp_view_length(sexp_view_t v);
+sexp_view_t sexp_view_nth(sexp_view_t v, size_t n);
+// NUL terminated text of strings and symbols
+const char* sexp_view_text(sexp_view_t v);
+double sexp_view_number(sexp_view_t v);
+// the value following the element keyword, e.g. "name:"
+sexp_view_t sexp_view_get(sexp_view_t v, const char* keyword);
+// builds the nodes, with the hashes they had when the image was written
+sexp_t *sexp_view_load(sexp_view_t v);
+
 #endif
@@ -0,0 +1,411 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_corpus.h"
+#include "sexp_diff.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+/******************************************************************************
+ * GENERATOR
+ *****************************************************************************/
+
+typedef struct gen_t {
+  char* buf;
+  size_t len;
+  size_t cap;
+  uint64_t state;
+  int flags;
+} gen_t;
+
+// xorshift64*
+static uint64_t gen_next(gen_t *g) {
+  g->state ^= g->state >> 12;
+  g->state ^= g->state << 25;
+  g->state ^= g->state >> 27;
+  return g->state * 0x2545f4914f6cdd1dull;
+}
+
+static size_t gen_below(gen_t *g, size_t n) {
+  return (gen_next(g) >> 11) % n;
+}
+
+static void gen_put(gen_t *g, const char* s, size_t len) {
+  if (g->len + len + 1 > g->cap) {
+    size_t cap = g->cap ? g->cap : 256;
+    while (cap < g->len + len + 1) cap *= 2;
+    g->buf = realloc(g->buf, cap);
+    if (g->buf == NULL) die("out of memory");
+    g->cap = cap;
+  }
+  memcpy(g->buf + g->len, s, len);
+  g->len += len;
+}
+
+static void gen_puts(gen_t *g, const char* s) {
+  gen_put(g, s, strlen(s));
+}
+
+static void gen_pick(gen_t *g, const char* const* choices, size_t n) {
+  gen_puts(g, choices[gen_below(g, n)]);
+}
+
+#define GEN_PICK(g, ...) do { \
+    static const char* const choices_[] = { __VA_ARGS__ }; \
+    gen_pick(g, choices_, sizeof(choices_) / sizeof(choices_[0])); \
+  } while (0)
+
+static void gen_space(gen_t *g) {
+  switch (gen_below(g, 12)) {
+    case 0: gen_puts(g, "\n  "); break;
+    case 1: gen_puts(g, "\t"); break;
+    case 2: gen_puts(g, " ; comment ( \" ]\n"); break;
+    case 3: gen_puts(g, "\f "); break;
+    default: gen_puts(g, " "); break;
+  }
+}
+
+static void gen_symbol(gen_t *g) {
+  static const char first[] = "abcdefghijklmnopqrstuvwxyzABCXYZ_*!?<>=/&%$~^@";
+  static const char rest[] = "abcdefghijklmnopqrstuvwxyz0123456789-_.+*!?:<>=/#',`|";
+  char c = first[gen_below(g, sizeof(first) - 1)];
+  gen_put(g, &c, 1);
+  size_t n = gen_below(g, 12);
+  for (size_t i = 0; i < n; ++i) {
+    c = rest[gen_below(g, sizeof(rest) - 1)];
+    gen_put(g, &c, 1);
+  }
+  if (gen_below(g, 6) == 0) GEN_PICK(g, ":", "\xc3\xa9t\xc3\xa9", "-\xe2\x86\x92", "#");
+}
+
+static void gen_number(gen_t *g) {
+  char buf[64];
+  uint64_t r = gen_next(g);
+  switch (gen_below(g, 8)) {
+    case 0: snprintf(buf, sizeof(buf), "%d", (int)(r % 2000) - 1000); break;
+    case 1: snprintf(buf, sizeof(buf), "%.*f", (int)(r % 12), (double)(r % 100000) / 7); break;
+    case 2: snprintf(buf, sizeof(buf), "%.17g", (double)(int64_t)r / 3.0); break;
+    case 3: snprintf(buf, sizeof(buf), "%de%d", (int)(r % 90) - 45, (int)(r >> 32) % 700 - 350); break;
+    case 4: snprintf(buf, sizeof(buf), ".%u", (unsigned)(r % 1000)); break;
+    case 5: snprintf(buf, sizeof(buf), "0x%x", (unsigned)(r % 65536)); break;
+    case 6: snprintf(buf, sizeof(buf), "-0"); break;
+    default: snprintf(buf, sizeof(buf), "%llu", (unsigned long long)(r >> 4)); break;
+  }
+  gen_puts(g, buf);
+}
+
+static void gen_string(gen_t *g) {
+  gen_puts(g, "\"");
+  size_t n = gen_below(g, 24);
+  for (size_t i = 0; i < n; ++i) {
+    switch (gen_below(g, 10)) {
+      case 0:
+        GEN_PICK(g, "\\n", "\\t", "\\\\", "\\\"", "\\x41", "\\101", "\\e", "\\0",
+            "\\u00e9", "\\U0001F600", "\\a", "\\r");
+        break;
+      case 1: GEN_PICK(g, "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\t"); break;
+      case 2: GEN_PICK(g, "(", ")", "]", "{", ";", "'", "#|", "|#"); break;
+      default: {
+        char c = ' ' + gen_below(g, 95);
+        if (c == '"' || c == '\\') c = '.';
+        gen_put(g, &c, 1);
+      }
+    }
+  }
+  gen_puts(g, "\"");
+}
+
+static void gen_value(gen_t *g, int depth);
+
+static void gen_macro(gen_t *g, int depth) {
+  switch (gen_below(g, 7)) {
+    case 0: GEN_PICK(g, "'", "`", ",", ",@"); gen_value(g, depth + 1); break;
+    case 1: GEN_PICK(g, "#t", "#f", "#true", "#false"); break;
+    case 2: gen_puts(g, "#;"); gen_value(g, depth + 1); break;
+    case 3: gen_puts(g, "#| block ( \" |# "); break;
+    case 4: gen_puts(g, "#| outer #| inner |# ) |# "); break;
+    default: gen_value(g, depth + 1); break;
+  }
+}
+
+static void gen_list(gen_t *g, int depth) {
+  static const char* const open[] = { "(", "[", "{" };
+  static const char* const close[] = { ")", "]", "}" };
+  size_t kind = gen_below(g, 3);
+  gen_puts(g, open[kind]);
+  if (gen_below(g, 3) == 0) {
+    // a record of keywords
+    gen_symbol(g);
+    size_t n = gen_below(g, 6);
+    for (size_t i = 0; i < n; ++i) {
+      gen_space(g);
+      GEN_PICK(g, "name:", "sources:", "weight:", "flags:", "type:");
+      gen_space(g);
+      gen_value(g, depth + 1);
+    }
+  } else {
+    size_t n = gen_below(g, depth < 2 ? 10 : 4);
+    for (size_t i = 0; i < n; ++i) {
+      if (i > 0 || gen_below(g, 4) == 0) gen_space(g);
+      if (g->flags & SEXP_CORPUS_MACROS) gen_macro(g, depth);
+      else gen_value(g, depth + 1);
+    }
+  }
+  gen_puts(g, close[kind]);
+}
+
+static void gen_value(gen_t *g, int depth) {
+  size_t r = gen_below(g, 10);
+  if (r < 3 && depth < 8) gen_list(g, depth);
+  else if (r < 5) gen_symbol(g);
+  else if (r < 7) gen_number(g);
+  else gen_string(g);
+}
+
+// random edits that break the document in the ways real inputs break
+static void gen_damage(gen_t *g) {
+  size_t edits = 1 + gen_below(g, 1 + g->len / 64);
+  for (size_t i = 0; i < edits && g->len > 0; ++i) {
+    size_t at = gen_below(g, g->len);
+    switch (gen_below(g, 5)) {
+      case 0:
+        g->buf[at] = (char)gen_below(g, 256);
+        break;
+      case 1: {
+        static const char delims[] = "()[]{}\";\\ \n#'|";
+        char c = delims[gen_below(g, sizeof(delims) - 1)];
+        gen_put(g, &c, 1);
+        memmove(g->buf + at + 1, g->buf + at, g->len - at - 1);
+        g->buf[at] = c;
+        break;
+      }
+      case 2: {
+        size_t n = gen_below(g, 1 + (g->len - at) / 4);
+        memmove(g->buf + at, g->buf + at + n, g->len - at - n);
+        g->len -= n;
+        break;
+      }
+      case 3: {
+        // the range is copied first, gen_put may move the buffer
+        size_t n = gen_below(g, 1 + (g->len - at) / 8);
+        char* range = malloc(n + 1);
+        if (range == NULL) die("out of memory");
+        memcpy(range, g->buf + at, n);
+        gen_put(g, range, n);
+        free(range);
+        break;
+      }
+      default:
+        if (gen_below(g, 4) == 0) g->len = at;
+        break;
+    }
+  }
+}
+
+char* sexp_corpus_generate(uint64_t seed, size_t size, int flags, size_t *len) {
+  gen_t g = { NULL, 0, 0, seed * 0x9e3779b97f4a7c15ull + 1, flags };
+  gen_put(&g, "", 0);
+  while (g.len < size) {
+    gen_value(&g, 0);
+    if ((flags & SEXP_CORPUS_MACROS) && gen_below(&g, 8) == 0) gen_macro(&g, 0);
+    gen_space(&g);
+    if (gen_below(&g, 3) == 0) gen_puts(&g, "\n");
+  }
+  if (flags & SEXP_CORPUS_NOISE) gen_damage(&g);
+  gen_put(&g, "", 0);
+  g.buf[g.len] = '\0';
+  if (len) *len = g.len;
+  return g.buf;
+}
+
+/******************************************************************************
+ * CHECKS
+ *****************************************************************************/
+
+static int same_error(const sexp_error_t *a, const sexp_error_t *b) {
+  return a->code == b->code && a->offset == b->offset;
+}
+
+// whether cursor c sees the structure and atoms of e
+static int cursor_matches(sexp_cursor_t c, const sexp_t *e) {
+  if (sexp_is_list(e)) {
+    size_t len = sexp_list_length(e);
+    if (!sexp_cursor_is_list(c) || sexp_cursor_length(c) != len) return 0;
+    sexp_cursor_t child = sexp_cursor_child(c);
+    for (size_t i = 0; i < len; ++i) {
+      if (!cursor_matches(child, sexp_list_nth(e, i))) return 0;
+      child = sexp_cursor_next(child);
+    }
+    return 1;
+  }
+  if (sexp_is_number(e)) {
+    double x = sexp_cursor_number(c), y = sexp_number_get(e);
+    return sexp_cursor_is_number(c) && (x == y || (x != x && y != y));
+  }
+  if (sexp_is_symbol(e)) {
+    return sexp_cursor_is_symbol(c) && sexp_cursor_symbol_eq(c, sexp_symbol_get(e));
+  }
+  if (!sexp_cursor_is_string(c)) return 0;
+  sexp_t *s = sexp_cursor_read(c);
+  int res = sexp_equal(s, e);
+  sexp_free(s);
+  return res;
+}
+
+// whether a and b print the same, which sexp_equal doesn't tell for -0 and 0
+static int same_text(sexp_t *a, sexp_t *b) {
+  if (a == NULL || b == NULL) return a == b;
+  char* ta = sexp_display(a);
+  char* tb = sexp_display(b);
+  int res = ta != NULL && tb != NULL && strcmp(ta, tb) == 0;
+  free(ta);
+  free(tb);
+  return res;
+}
+
+// whether printing e all ways gives the same text, which reads back as e
+static const char* check_print(sexp_t *e) {
+  const char* failed = NULL;
+  char* text = sexp_display(e);
+  char* end;
+  sexp_t *back = sexp_read(text, &end);
+  if (!sexp_equal(back, e) || *end != '\0') failed = "display round trip";
+  sexp_free(back);
+
+  sexp_writer_t *w = sexp_writer_new_buffer();
+  sexp_writer_value(w, e);
+  size_t len;
+  const char* written = sexp_writer_text(w, &len);
+  if (!failed && (len != strlen(text) + 1 || memcmp(written, text, len - 1) != 0)) {
+    failed = "writer output";
+  }
+  sexp_writer_free(w);
+
+  sexp_iov_t *v = sexp_display_iov(e);
+  int count;
+  const struct iovec *iov = sexp_iov_get(v, &count);
+  size_t off = 0;
+  for (int i = 0; i < count && !failed; ++i) {
+    if (off + iov[i].iov_len > strlen(text) ||
+        memcmp(text + off, iov[i].iov_base, iov[i].iov_len) != 0) {
+      failed = "iov output";
+    }
+    off += iov[i].iov_len;
+  }
+  if (!failed && off != strlen(text)) failed = "iov output";
+  sexp_iov_free(v);
+  free(text);
+  return failed;
+}
+
+// the standard readtable, checked by printing what it reads
+static const char* check_macros(const char* buf, const sexp_readtable_t *t) {
+  sexp_read_opts_t opts = { .readtable = t };
+  const char* pos = buf;
+  for (;;) {
+    char* end;
+    sexp_t *e = sexp_read_opts(pos, &end, &opts);
+    if (e == NULL) return NULL;
+    char* text = sexp_display(e);
+    sexp_t *back = sexp_read(text, NULL);
+    int ok = sexp_equal(back, e);
+    sexp_free(back);
+    free(text);
+    sexp_free(e);
+    if (!ok) return "readtable round trip";
+    pos = end;
+  }
+}
+
+const char* sexp_corpus_check(const char* src, size_t len) {
+  char* buf = malloc(len + 1);
+  if (buf == NULL) die("out of memory");
+  memcpy(buf, src, len);
+  buf[len] = '\0';
+
+  const char* failed = NULL;
+  sexp_index_t *idx = sexp_index_new(buf, len);
+  sexp_intern_t *intern = sexp_intern_new();
+  sexp_readtable_t *plain = sexp_readtable_new();
+  sexp_readtable_t *macros = sexp_readtable_new();
+  const char* chars = "'`,";
+  for (const char* c = chars; *c; ++c) sexp_readtable_set(plain, *c, NULL, NULL);
+  for (int c = 1; c < 256; ++c) sexp_readtable_dispatch(plain, c, NULL, NULL);
+
+  sexp_error_t err, err_idx, err_rt;
+  sexp_read_opts_t opts = { .error = &err };
+  sexp_read_opts_t opts_idx = { .index = idx, .error = &err_idx };
+  sexp_read_opts_t opts_rt = { .readtable = plain, .error = &err_rt };
+  sexp_read_opts_t opts_intern = { .intern = intern };
+  sexp_parser_t p;
+  sexp_parser_init(&p, buf);
+  sexp_parser_next(&p);
+
+  sexp_t *prev = NULL;
+  const char* pos = buf;
+  for (;;) {
+    char *end, *end_idx, *end_rt, *end_intern;
+    memset(&err, 0, sizeof(err));
+    memset(&err_idx, 0, sizeof(err_idx));
+    memset(&err_rt, 0, sizeof(err_rt));
+    sexp_t *e = sexp_read_opts(pos, &end, &opts);
+    sexp_t *e_idx = idx ? sexp_read_opts(pos, &end_idx, &opts_idx) : sexp_ref(e);
+    sexp_t *e_rt = sexp_read_opts(pos, &end_rt, &opts_rt);
+    sexp_t *e_intern = sexp_read_opts(pos, &end_intern, &opts_intern);
+    sexp_t *e_parser = sexp_parser_read(&p);
+    if (idx == NULL) {
+      end_idx = end;
+      err_idx = err;
+    }
+
+    if (!sexp_equal(e, e_idx) || (e ? end != end_idx : !same_error(&err, &err_idx))) {
+      failed = "indexed reader";
+    } else if (!sexp_equal(e, e_rt) || (e ? end != end_rt : !same_error(&err, &err_rt))) {
+      failed = "readtable reader";
+    } else if (!sexp_equal(e, e_intern) || (e && end != end_intern) ||
+        sexp_hash(e) != sexp_hash(e_intern) || !same_text(e, e_intern)) {
+      failed = "interning reader";
+    } else if (!sexp_equal(e, e_parser)) {
+      failed = "event parser";
+    } else if (e != NULL) {
+      sexp_cursor_t c = sexp_cursor_begin(pos);
+      if (!cursor_matches(c, e) || sexp_cursor_end(c) != end) failed = "cursor";
+      if (!failed) failed = check_print(e);
+      if (!failed && prev != NULL) {
+        sexp_t *script = sexp_diff(prev, e);
+        sexp_t *patched = sexp_patch(prev, script);
+        if (!sexp_equal(patched, e)) failed = "diff and patch";
+        sexp_free(patched);
+        sexp_free(script);
+      }
+    }
+    sexp_free(e_idx);
+    sexp_free(e_rt);
+    sexp_free(e_intern);
+    sexp_free(e_parser);
+    sexp_free(prev);
+    prev = e;
+    if (e == NULL || failed) break;
+    pos = end;
+  }
+  sexp_free(prev);
+  if (!failed) failed = check_macros(buf, macros);
+
+  sexp_readtable_free(macros);
+  sexp_readtable_free(plain);
+  sexp_intern_free(intern);
+  sexp_index_free(idx);
+  free(buf);
+  return failed;
+}
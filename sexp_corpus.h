@@ -0,0 +1,46 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_CORPUS_
+#define __RUB_SEXP_CORPUS_
+
+#include "sexp.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Test inputs and the checks run over them, shared by the tests, the fuzz
+// target and the benchmarks.
+
+typedef enum sexp_corpus_flags_t {
+  SEXP_CORPUS_VALID = 0,      // well formed documents
+  SEXP_CORPUS_MACROS = 1,     // with quotes, booleans and datum and block comments
+  SEXP_CORPUS_NOISE = 2,      // damaged by random edits
+} sexp_corpus_flags_t;
+
+// a random document of about size bytes with records, nested lists and all
+// kinds of atoms, escapes and comments. the same seed gives the same
+// document. allocated with malloc and NUL terminated, len may be NULL.
+char* sexp_corpus_generate(uint64_t seed, size_t size, int flags, size_t *len);
+
+// Runs every reader and printer mode over the top level forms of src and
+// compares them with the plain reader and each other:
+//   indexed reading, a readtable without macros, interning and the event
+//   parser read the same values, ends and errors as the plain reader
+//   sexp_display output reads back as the value, sexp_writer_value and
+//   sexp_display_iov print the same text as sexp_display
+//   cursors see the same structure and atoms
+//   sexp_patch applied to the sexp_diff of consecutive forms gives the
+//   second one
+//   values read with the standard readtable print as text that the plain
+//   reader reads back
+// returns NULL if everything agrees, otherwise the name of the first check
+// that failed. src doesn't need to be NUL terminated.
+const char* sexp_corpus_check(const char* src, size_t len);
+
+#endif
@@ -0,0 +1,407 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_diff.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+/******************************************************************************
+ * ALIGNMENT
+ *****************************************************************************/
+
+// Children of two lists are aligned like patience diff does it: common
+// prefixes and suffixes are matched first, comparing by cached hashes, then
+// elements that occur exactly once on both sides anchor the ranges between
+// them. Ranges without anchors are paired up by position, which matches the
+// values of keywords that anchored the ranges around them.
+
+typedef enum edit_kind {
+  EDIT_KEEP,
+  EDIT_CHANGE,
+  EDIT_DELETE,
+  EDIT_INSERT,                // before element a of the old list
+} edit_kind;
+
+typedef struct edit_t {
+  edit_kind kind;
+  size_t a;
+  size_t b;
+} edit_t;
+
+typedef struct edits_t {
+  size_t len;
+  size_t cap;
+  edit_t *items;
+  int failed;
+} edits_t;
+
+static void edits_push(edits_t *out, edit_kind kind, size_t a, size_t b) {
+  if (out->failed) return;
+  if (out->len == out->cap) {
+    size_t cap = out->cap < 16 ? 16 : out->cap * 2;
+    edit_t *items = realloc(out->items, sizeof(edit_t) * cap);
+    if (items == NULL) {
+      out->failed = 1;
+      return;
+    }
+    out->items = items;
+    out->cap = cap;
+  }
+  out->items[out->len].kind = kind;
+  out->items[out->len].a = a;
+  out->items[out->len].b = b;
+  out->len += 1;
+}
+
+typedef struct range_t {
+  const sexp_t *a;
+  size_t alo, ahi;
+  const sexp_t *b;
+  size_t blo, bhi;
+} range_t;
+
+typedef struct occurrence_t {
+  const sexp_t *e;            // NULL for free slots
+  int count_a, count_b;
+  size_t pos_a, pos_b;
+} occurrence_t;
+
+static occurrence_t *occurrence(occurrence_t *table, size_t cap, const sexp_t *e) {
+  size_t p = sexp_hash(e) & (cap - 1);
+  while (table[p].e != NULL && !sexp_equal(table[p].e, e)) p = (p + 1) & (cap - 1);
+  if (table[p].e == NULL) table[p].e = e;
+  return &table[p];
+}
+
+// pairs of positions of elements unique on both sides, the longest run of
+// them that is increasing on both sides. returns -1 if out of memory.
+static long unique_anchors(const range_t *r, size_t **anchors) {
+  size_t na = r->ahi - r->alo, nb = r->bhi - r->blo;
+  size_t cap = 16;
+  while (cap < 2 * (na + nb)) cap *= 2;
+  occurrence_t *table = calloc(cap, sizeof(occurrence_t));
+  size_t *cand = malloc(sizeof(size_t) * 2 * na);
+  size_t *tails = malloc(sizeof(size_t) * na);
+  size_t *prev = malloc(sizeof(size_t) * na);
+  long res = -1;
+  if (table == NULL || cand == NULL || tails == NULL || prev == NULL) goto done;
+
+  for (size_t i = r->alo; i < r->ahi; ++i) {
+    occurrence_t *o = occurrence(table, cap, sexp_list_nth(r->a, i));
+    o->count_a += 1;
+    o->pos_a = i;
+  }
+  for (size_t j = r->blo; j < r->bhi; ++j) {
+    occurrence_t *o = occurrence(table, cap, sexp_list_nth(r->b, j));
+    o->count_b += 1;
+    o->pos_b = j;
+  }
+  size_t n = 0;
+  for (size_t i = r->alo; i < r->ahi; ++i) {
+    occurrence_t *o = occurrence(table, cap, sexp_list_nth(r->a, i));
+    if (o->count_a == 1 && o->count_b == 1) {
+      cand[2*n] = i;
+      cand[2*n+1] = o->pos_b;
+      n += 1;
+    }
+  }
+
+  // longest increasing subsequence of the b positions, by patience sorting
+  size_t piles = 0;
+  for (size_t k = 0; k < n; ++k) {
+    size_t lo = 0, hi = piles;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (cand[2*tails[mid]+1] < cand[2*k+1]) lo = mid + 1;
+      else hi = mid;
+    }
+    prev[k] = lo > 0 ? tails[lo-1] : (size_t)-1;
+    tails[lo] = k;
+    if (lo == piles) piles += 1;
+  }
+  *anchors = malloc(sizeof(size_t) * 2 * (piles + 1));
+  if (*anchors == NULL) goto done;
+  size_t k = piles > 0 ? tails[piles-1] : 0;
+  for (size_t i = piles; i > 0; --i) {
+    (*anchors)[2*(i-1)] = cand[2*k];
+    (*anchors)[2*(i-1)+1] = cand[2*k+1];
+    k = prev[k];
+  }
+  res = piles;
+
+done:
+  free(table);
+  free(cand);
+  free(tails);
+  free(prev);
+  return res;
+}
+
+static void align(range_t r, edits_t *out);
+
+static void align_positional(const range_t *r, edits_t *out) {
+  size_t na = r->ahi - r->alo, nb = r->bhi - r->blo;
+  size_t common = na < nb ? na : nb;
+  for (size_t k = 0; k < common; ++k) edits_push(out, EDIT_CHANGE, r->alo + k, r->blo + k);
+  for (size_t i = r->alo + common; i < r->ahi; ++i) edits_push(out, EDIT_DELETE, i, 0);
+  for (size_t j = r->blo + common; j < r->bhi; ++j) edits_push(out, EDIT_INSERT, r->ahi, j);
+}
+
+static void align_middle(const range_t *r, edits_t *out) {
+  size_t *anchors = NULL;
+  long n = 0;
+  if (r->ahi > r->alo && r->bhi > r->blo) n = unique_anchors(r, &anchors);
+  if (n < 0) out->failed = 1;
+  if (n <= 0) {
+    free(anchors);
+    align_positional(r, out);
+    return;
+  }
+  range_t sub = *r;
+  for (long k = 0; k < n; ++k) {
+    sub.ahi = anchors[2*k];
+    sub.bhi = anchors[2*k+1];
+    align(sub, out);
+    edits_push(out, EDIT_KEEP, sub.ahi, sub.bhi);
+    sub.alo = sub.ahi + 1;
+    sub.blo = sub.bhi + 1;
+  }
+  sub.ahi = r->ahi;
+  sub.bhi = r->bhi;
+  align(sub, out);
+  free(anchors);
+}
+
+// appends the edits for r to out, in order of the positions
+static void align(range_t r, edits_t *out) {
+  while (r.alo < r.ahi && r.blo < r.bhi &&
+      sexp_equal(sexp_list_nth(r.a, r.alo), sexp_list_nth(r.b, r.blo))) {
+    edits_push(out, EDIT_KEEP, r.alo++, r.blo++);
+  }
+  size_t suffix = 0;
+  while (r.alo + suffix < r.ahi && r.blo + suffix < r.bhi &&
+      sexp_equal(sexp_list_nth(r.a, r.ahi - suffix - 1),
+                 sexp_list_nth(r.b, r.bhi - suffix - 1))) {
+    suffix += 1;
+  }
+  range_t mid = r;
+  mid.ahi -= suffix;
+  mid.bhi -= suffix;
+  align_middle(&mid, out);
+  for (size_t k = suffix; k > 0; --k) edits_push(out, EDIT_KEEP, r.ahi - k, r.bhi - k);
+}
+
+/******************************************************************************
+ * DIFF
+ *****************************************************************************/
+
+// Edits of a list are emitted from its end to its start, so the positions
+// of the edits still to come aren't moved by those before them.
+
+typedef struct diff_t {
+  size_t nops, cap;
+  sexp_t **ops;
+  size_t depth, pathcap;
+  size_t *path;
+  int failed;
+} diff_t;
+
+static sexp_t *make_path(diff_t *d, int with_index, size_t index) {
+  sexp_t *path = sexp_new_list();
+  for (size_t i = 0; path != NULL && i < d->depth + with_index; ++i) {
+    sexp_t *n = sexp_new_number(i < d->depth ? d->path[i] : index);
+    sexp_t *res = n ? sexp_list_append(path, n) : NULL;
+    if (res == NULL) {
+      sexp_free(n);
+      sexp_free(path);
+    }
+    path = res;
+  }
+  return path;
+}
+
+// builds (kind path value) from the current path, consumes value. deletes
+// have no value.
+static void emit(diff_t *d, const char* kind, int with_index, size_t index, sexp_t *value) {
+  sexp_t *parts[3] = { sexp_new_symbol(kind), make_path(d, with_index, index), value };
+  sexp_t *op = d->failed ? NULL : sexp_new_list();
+  for (int i = 0; i < (value != NULL ? 3 : 2); ++i) {
+    sexp_t *res = op && parts[i] ? sexp_list_append(op, parts[i]) : NULL;
+    if (res == NULL) {
+      sexp_free(op);
+      op = NULL;
+      break;
+    }
+    parts[i] = NULL;
+    op = res;
+  }
+  for (int i = 0; i < 3; ++i) sexp_free(parts[i]);
+  if (op != NULL && d->nops == d->cap) {
+    size_t cap = d->cap < 16 ? 16 : d->cap * 2;
+    sexp_t **ops = realloc(d->ops, sizeof(sexp_t*) * cap);
+    if (ops == NULL) {
+      sexp_free(op);
+      op = NULL;
+    } else {
+      d->ops = ops;
+      d->cap = cap;
+    }
+  }
+  if (op == NULL) {
+    d->failed = 1;
+    return;
+  }
+  d->ops[d->nops++] = op;
+}
+
+static void diff_lists(diff_t *d, const sexp_t *a, const sexp_t *b);
+
+// diffs two lists at index of the current list, unless a plain replace is
+// about as small
+static void diff_nested(diff_t *d, const sexp_t *a, const sexp_t *b, size_t index) {
+  if (d->depth == d->pathcap) {
+    size_t cap = d->pathcap < 16 ? 16 : d->pathcap * 2;
+    size_t *path = realloc(d->path, sizeof(size_t) * cap);
+    if (path == NULL) {
+      d->failed = 1;
+      return;
+    }
+    d->path = path;
+    d->pathcap = cap;
+  }
+  size_t before = d->nops;
+  d->path[d->depth++] = index;
+  diff_lists(d, a, b);
+  d->depth -= 1;
+  if (d->nops - before > sexp_list_length(b) / 2 + 1) {
+    while (d->nops > before) sexp_free(d->ops[--d->nops]);
+    emit(d, "replace", 1, index, sexp_ref((sexp_t*)b));
+  }
+}
+
+static void diff_lists(diff_t *d, const sexp_t *a, const sexp_t *b) {
+  edits_t edits = { 0, 0, NULL, 0 };
+  range_t r = { a, 0, sexp_list_length(a), b, 0, sexp_list_length(b) };
+  align(r, &edits);
+  if (edits.failed) d->failed = 1;
+  for (size_t k = edits.len; k > 0 && !d->failed; --k) {
+    const edit_t *e = &edits.items[k-1];
+    const sexp_t *ea = e->kind == EDIT_INSERT ? NULL : sexp_list_nth(a, e->a);
+    const sexp_t *eb = e->kind == EDIT_DELETE ? NULL : sexp_list_nth(b, e->b);
+    switch (e->kind) {
+      case EDIT_KEEP:
+        break;
+      case EDIT_CHANGE:
+        if (sexp_equal(ea, eb)) break;
+        if (sexp_is_list(ea) && sexp_is_list(eb)) diff_nested(d, ea, eb, e->a);
+        else emit(d, "replace", 1, e->a, sexp_ref((sexp_t*)eb));
+        break;
+      case EDIT_DELETE:
+        emit(d, "delete", 1, e->a, NULL);
+        break;
+      case EDIT_INSERT:
+        emit(d, "insert", 1, e->a, sexp_ref((sexp_t*)eb));
+        break;
+    }
+  }
+  free(edits.items);
+}
+
+sexp_t *sexp_diff(const sexp_t *a, const sexp_t *b) {
+  diff_t d;
+  memset(&d, 0, sizeof(diff_t));
+  if (sexp_equal(a, b)) {
+    // nothing to do
+  } else if (sexp_is_list(a) && sexp_is_list(b)) {
+    diff_lists(&d, a, b);
+  } else {
+    emit(&d, "replace", 0, 0, sexp_ref((sexp_t*)b));
+  }
+  sexp_t *script = d.failed ? NULL : sexp_new_list();
+  for (size_t i = 0; i < d.nops; ++i) {
+    sexp_t *res = script ? sexp_list_append(script, d.ops[i]) : NULL;
+    if (res == NULL) {
+      sexp_free(d.ops[i]);
+      sexp_free(script);
+    }
+    script = res;
+  }
+  free(d.ops);
+  free(d.path);
+  return script;
+}
+
+/******************************************************************************
+ * PATCH
+ *****************************************************************************/
+
+typedef enum patch_kind {
+  PATCH_REPLACE,
+  PATCH_INSERT,
+  PATCH_DELETE,
+} patch_kind;
+
+// index n of path if it is a valid position in e, -1 otherwise
+static long path_index(const sexp_t *path, size_t n, const sexp_t *e, int end_ok) {
+  const sexp_t *step = sexp_list_nth(path, n);
+  if (!sexp_is_number(step) || !sexp_is_list(e)) return -1;
+  double val = sexp_number_get(step);
+  size_t len = sexp_list_length(e);
+  // the range check comes first, nan and huge values can't be cast
+  if (!(val >= 0 && val <= len) || val != (long)val || (val == len && !end_ok)) return -1;
+  return (long)val;
+}
+
+// the version of e with the edit applied at the rest of path from step n
+static sexp_t *apply(const sexp_t *e, patch_kind kind, const sexp_t *path,
+    size_t n, sexp_t *value) {
+  size_t depth = sexp_list_length(path);
+  if (n == depth) return kind == PATCH_REPLACE ? sexp_ref(value) : NULL;
+  long i = path_index(path, n, e, kind == PATCH_INSERT && n + 1 == depth);
+  if (i < 0) return NULL;
+  if (n + 1 == depth) {
+    switch (kind) {
+      case PATCH_REPLACE: return sexp_list_set(e, i, sexp_ref(value));
+      case PATCH_INSERT: return sexp_list_insert(e, i, sexp_ref(value));
+      case PATCH_DELETE: return sexp_list_remove(e, i);
+    }
+  }
+  sexp_t *child = apply(sexp_list_nth(e, i), kind, path, n + 1, value);
+  if (child == NULL) return NULL;
+  return sexp_list_set(e, i, child);
+}
+
+sexp_t *sexp_patch(const sexp_t *e, const sexp_t *script) {
+  if (!sexp_is_list(script)) return NULL;
+  sexp_t *cur = sexp_ref((sexp_t*)e);
+  size_t len = sexp_list_length(script);
+  for (size_t i = 0; i < len && cur != NULL; ++i) {
+    const sexp_t *op = sexp_list_nth(script, i);
+    size_t oplen = sexp_is_list(op) ? sexp_list_length(op) : 0;
+    const sexp_t *kind = oplen > 0 ? sexp_list_nth(op, 0) : NULL;
+    const sexp_t *path = oplen > 1 ? sexp_list_nth(op, 1) : NULL;
+    sexp_t *next = NULL;
+    if (!sexp_is_symbol(kind) || !sexp_is_list(path)) {
+      // malformed
+    } else if (sexp_symbol_eq(kind, "replace") && oplen == 3) {
+      next = apply(cur, PATCH_REPLACE, path, 0, sexp_list_nth(op, 2));
+    } else if (sexp_symbol_eq(kind, "insert") && oplen == 3) {
+      next = apply(cur, PATCH_INSERT, path, 0, sexp_list_nth(op, 2));
+    } else if (sexp_symbol_eq(kind, "delete") && oplen == 2) {
+      next = apply(cur, PATCH_DELETE, path, 0, NULL);
+    }
+    sexp_free(cur);
+    cur = next;
+  }
+  return cur;
+}
@@ -0,0 +1,32 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_DIFF_
+#define __RUB_SEXP_DIFF_
+
+#include "sexp.h"
+
+// Tree diffs. An edit script is itself an S-Expression, a list of edits
+//   (replace PATH VALUE)  replaces the value at PATH
+//   (insert PATH VALUE)   inserts VALUE before the element at PATH, or at
+//                         the end if PATH is one past the last element
+//   (delete PATH)         removes the element at PATH
+// where PATH is a list of indices from the root, () is the root itself.
+// Edits apply in order, each path refers to the tree as the edits before it
+// left it. Example: ((replace (0 2) "t2") (insert (3) (flags: ())))
+
+// edit script that turns a into b, () if they are equal. identical subtrees
+// are skipped by their hashes, elements that occur once on both sides, like
+// keywords, anchor the matching of the lists in between.
+sexp_t *sexp_diff(const sexp_t *a, const sexp_t *b);
+
+// applies script to e and returns the result, e is left untouched and shares
+// all unchanged structure with it. NULL if the script doesn't fit e.
+sexp_t *sexp_patch(const sexp_t *e, const sexp_t *script);
+
+#endif
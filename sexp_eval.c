@@ -0,0 +1,998 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_eval.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+#define MAX_STACK 256
+#define MAX_NESTING 1024
+
+/******************************************************************************
+ * VALUES
+ *****************************************************************************/
+
+sexp_value_t sexp_value_bool(int b) {
+  sexp_value_t v = { SEXP_VAL_BOOL, b != 0, NULL };
+  return v;
+}
+
+sexp_value_t sexp_value_number(double num) {
+  sexp_value_t v = { SEXP_VAL_NUMBER, num, NULL };
+  return v;
+}
+
+sexp_value_t sexp_value_node(const sexp_t *e) {
+  if (sexp_is_number(e)) return sexp_value_number(sexp_number_get(e));
+  if (sexp_symbol_eq(e, "#t")) return sexp_value_bool(1);
+  if (sexp_symbol_eq(e, "#f")) return sexp_value_bool(0);
+  sexp_value_t v = { e ? SEXP_VAL_NODE : SEXP_VAL_NIL, 0, e };
+  return v;
+}
+
+int sexp_value_truthy(sexp_value_t v) {
+  return v.kind != SEXP_VAL_NIL && !(v.kind == SEXP_VAL_BOOL && v.num == 0);
+}
+
+int sexp_value_eq(sexp_value_t a, sexp_value_t b) {
+  if (a.kind != b.kind) return 0;
+  switch (a.kind) {
+    case SEXP_VAL_NIL: return 1;
+    case SEXP_VAL_BOOL:
+    case SEXP_VAL_NUMBER: return a.num == b.num;
+    case SEXP_VAL_NODE: return sexp_equal(a.node, b.node);
+  }
+  return 0;
+}
+
+/******************************************************************************
+ * ENVIRONMENT
+ *****************************************************************************/
+
+typedef struct native_t {
+  char* name;
+  int arity;
+  sexp_native_t fn;
+  void *ctx;
+} native_t;
+
+struct sexp_env_t {
+  char** vars;
+  int nvars, varcap;
+  native_t *natives;
+  int nnatives, nativecap;
+};
+
+static char* copy_name(const char* name) {
+  size_t len = strlen(name);
+  char* res = malloc(len + 1);
+  if (res) memcpy(res, name, len + 1);
+  return res;
+}
+
+sexp_env_t *sexp_env_new() {
+  sexp_env_t *env = malloc(sizeof(sexp_env_t));
+  if (env) memset(env, 0, sizeof(sexp_env_t));
+  return env;
+}
+
+void sexp_env_free(sexp_env_t *env) {
+  if (env == NULL) return;
+  for (int i = 0; i < env->nvars; ++i) free(env->vars[i]);
+  for (int i = 0; i < env->nnatives; ++i) free(env->natives[i].name);
+  free(env->vars);
+  free(env->natives);
+  free(env);
+}
+
+static int env_find_var(const sexp_env_t *env, const char* name) {
+  for (int i = 0; i < env->nvars; ++i) {
+    if (strcmp(env->vars[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+static const native_t *env_find_native(const sexp_env_t *env, const char* name) {
+  for (int i = 0; i < env->nnatives; ++i) {
+    if (strcmp(env->natives[i].name, name) == 0) return &env->natives[i];
+  }
+  return NULL;
+}
+
+int sexp_env_var(sexp_env_t *env, const char* name) {
+  int slot = env_find_var(env, name);
+  if (slot >= 0) return slot;
+  if (env->nvars == env->varcap) {
+    int cap = env->varcap < 8 ? 8 : env->varcap * 2;
+    char** vars = realloc(env->vars, sizeof(char*) * cap);
+    if (vars == NULL) return -1;
+    env->vars = vars;
+    env->varcap = cap;
+  }
+  if ((env->vars[env->nvars] = copy_name(name)) == NULL) return -1;
+  return env->nvars++;
+}
+
+int sexp_env_native(sexp_env_t *env, const char* name, int arity,
+    sexp_native_t fn, void *ctx) {
+  native_t *n = (native_t*)env_find_native(env, name);
+  if (n == NULL) {
+    if (env->nnatives == env->nativecap) {
+      int cap = env->nativecap < 8 ? 8 : env->nativecap * 2;
+      native_t *natives = realloc(env->natives, sizeof(native_t) * cap);
+      if (natives == NULL) return 0;
+      env->natives = natives;
+      env->nativecap = cap;
+    }
+    n = &env->natives[env->nnatives];
+    if ((n->name = copy_name(name)) == NULL) return 0;
+    env->nnatives += 1;
+  }
+  n->arity = arity;
+  n->fn = fn;
+  n->ctx = ctx;
+  return 1;
+}
+
+/******************************************************************************
+ * BYTECODE
+ *****************************************************************************/
+
+// Instructions are an opcode followed by its operands. Jump targets are
+// absolute positions in the code.
+typedef enum opcode {
+  OP_CONST,                   // index into consts
+  OP_VAR,                     // slot
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NEG,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_NUM_EQ,
+  OP_EQ,
+  OP_NOT,
+  OP_JUMP,                    // target
+  OP_JUMP_UNLESS,             // target, pops the condition
+  OP_AND,                     // target, jumps if the top is false, pops it otherwise
+  OP_OR,                      // target, jumps if the top is true, pops it otherwise
+  OP_CALL,                    // index into calls, argc
+  OP_RETURN,
+} opcode;
+
+typedef struct call_t {
+  sexp_native_t fn;
+  void *ctx;
+} call_t;
+
+struct sexp_program_t {
+  int32_t *code;
+  size_t ncode, codecap;
+  sexp_value_t *consts;       // holds a reference to node constants
+  size_t nconsts, constcap;
+  call_t *calls;
+  size_t ncalls, callcap;
+  int max_depth;              // of the stack
+};
+
+void sexp_program_free(sexp_program_t *p) {
+  if (p == NULL) return;
+  for (size_t i = 0; i < p->nconsts; ++i) {
+    if (p->consts[i].kind == SEXP_VAL_NODE) sexp_free((sexp_t*)p->consts[i].node);
+  }
+  free(p->code);
+  free(p->consts);
+  free(p->calls);
+  free(p);
+}
+
+#define NUMBERS(a, b) ((a).kind == SEXP_VAL_NUMBER && (b).kind == SEXP_VAL_NUMBER)
+
+static int run(const sexp_program_t *p, size_t pc, const sexp_value_t *vars,
+    sexp_value_t *res) {
+  sexp_value_t stack[MAX_STACK];
+  sexp_value_t *sp = stack;
+  const int32_t *code = p->code;
+  while (1) {
+    switch ((opcode)code[pc]) {
+      case OP_CONST:
+        *sp++ = p->consts[code[pc+1]];
+        pc += 2;
+        break;
+      case OP_VAR:
+        *sp++ = vars[code[pc+1]];
+        pc += 2;
+        break;
+      case OP_ADD:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2].num += sp[-1].num;
+        --sp;
+        pc += 1;
+        break;
+      case OP_SUB:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2].num -= sp[-1].num;
+        --sp;
+        pc += 1;
+        break;
+      case OP_MUL:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2].num *= sp[-1].num;
+        --sp;
+        pc += 1;
+        break;
+      case OP_DIV:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2].num /= sp[-1].num;
+        --sp;
+        pc += 1;
+        break;
+      case OP_NEG:
+        if (sp[-1].kind != SEXP_VAL_NUMBER) return 0;
+        sp[-1].num = -sp[-1].num;
+        pc += 1;
+        break;
+      case OP_LT:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2] = sexp_value_bool(sp[-2].num < sp[-1].num);
+        --sp;
+        pc += 1;
+        break;
+      case OP_LE:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2] = sexp_value_bool(sp[-2].num <= sp[-1].num);
+        --sp;
+        pc += 1;
+        break;
+      case OP_GT:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2] = sexp_value_bool(sp[-2].num > sp[-1].num);
+        --sp;
+        pc += 1;
+        break;
+      case OP_GE:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2] = sexp_value_bool(sp[-2].num >= sp[-1].num);
+        --sp;
+        pc += 1;
+        break;
+      case OP_NUM_EQ:
+        if (!NUMBERS(sp[-2], sp[-1])) return 0;
+        sp[-2] = sexp_value_bool(sp[-2].num == sp[-1].num);
+        --sp;
+        pc += 1;
+        break;
+      case OP_EQ:
+        sp[-2] = sexp_value_bool(sexp_value_eq(sp[-2], sp[-1]));
+        --sp;
+        pc += 1;
+        break;
+      case OP_NOT:
+        sp[-1] = sexp_value_bool(!sexp_value_truthy(sp[-1]));
+        pc += 1;
+        break;
+      case OP_JUMP:
+        pc = code[pc+1];
+        break;
+      case OP_JUMP_UNLESS:
+        --sp;
+        pc = sexp_value_truthy(*sp) ? pc + 2 : (size_t)code[pc+1];
+        break;
+      case OP_AND:
+        if (!sexp_value_truthy(sp[-1])) {
+          pc = code[pc+1];
+        } else {
+          --sp;
+          pc += 2;
+        }
+        break;
+      case OP_OR:
+        if (sexp_value_truthy(sp[-1])) {
+          pc = code[pc+1];
+        } else {
+          --sp;
+          pc += 2;
+        }
+        break;
+      case OP_CALL: {
+        const call_t *call = &p->calls[code[pc+1]];
+        int argc = code[pc+2];
+        sexp_value_t out;
+        if (!call->fn(sp - argc, argc, &out, call->ctx)) return 0;
+        sp -= argc;
+        *sp++ = out;
+        pc += 3;
+        break;
+      }
+      case OP_RETURN:
+        *res = sp[-1];
+        return 1;
+      default:
+        die("invalid opcode");
+    }
+  }
+}
+
+int sexp_eval(const sexp_program_t *p, const sexp_value_t *vars, sexp_value_t *res) {
+  return run(p, 0, vars, res);
+}
+
+/******************************************************************************
+ * COMPILER
+ *****************************************************************************/
+
+// Subexpressions without variables or native calls are constant. Once one
+// is compiled, its code is run right away and replaced by the result.
+
+typedef struct compiler_t {
+  const sexp_env_t *env;
+  sexp_program_t *p;
+  int depth;                  // of the stack when the code so far runs
+  int nesting;
+  int failed;
+} compiler_t;
+
+static void emit(compiler_t *c, int32_t word) {
+  sexp_program_t *p = c->p;
+  if (c->failed) return;
+  if (p->ncode == p->codecap) {
+    size_t cap = p->codecap < 64 ? 64 : p->codecap * 2;
+    int32_t *code = realloc(p->code, sizeof(int32_t) * cap);
+    if (code == NULL) {
+      c->failed = 1;
+      return;
+    }
+    p->code = code;
+    p->codecap = cap;
+  }
+  p->code[p->ncode++] = word;
+}
+
+// adjusts the stack depth by the effect of the last instruction
+static void stack_effect(compiler_t *c, int n) {
+  c->depth += n;
+  if (c->depth > MAX_STACK) c->failed = 1;
+  if (c->depth > c->p->max_depth) c->p->max_depth = c->depth;
+}
+
+static void emit_const(compiler_t *c, sexp_value_t v) {
+  sexp_program_t *p = c->p;
+  if (c->failed) return;
+  if (p->nconsts == p->constcap) {
+    size_t cap = p->constcap < 16 ? 16 : p->constcap * 2;
+    sexp_value_t *consts = realloc(p->consts, sizeof(sexp_value_t) * cap);
+    if (consts == NULL) {
+      c->failed = 1;
+      return;
+    }
+    p->consts = consts;
+    p->constcap = cap;
+  }
+  if (v.kind == SEXP_VAL_NODE) {
+    // a private copy, hashed now, so that running the program only reads it
+    // and the caller's nodes aren't referenced
+    sexp_t *copy = sexp_compact_copy(v.node);
+    if (copy == NULL) {
+      c->failed = 1;
+      return;
+    }
+    sexp_hash(copy);
+    v.node = copy;
+  }
+  p->consts[p->nconsts] = v;
+  emit(c, OP_CONST);
+  emit(c, p->nconsts++);
+  stack_effect(c, 1);
+}
+
+static void emit_call(compiler_t *c, const native_t *n, int argc) {
+  sexp_program_t *p = c->p;
+  if (c->failed) return;
+  if (p->ncalls == p->callcap) {
+    size_t cap = p->callcap < 8 ? 8 : p->callcap * 2;
+    call_t *calls = realloc(p->calls, sizeof(call_t) * cap);
+    if (calls == NULL) {
+      c->failed = 1;
+      return;
+    }
+    p->calls = calls;
+    p->callcap = cap;
+  }
+  p->calls[p->ncalls].fn = n->fn;
+  p->calls[p->ncalls].ctx = n->ctx;
+  emit(c, OP_CALL);
+  emit(c, p->ncalls++);
+  emit(c, argc);
+  stack_effect(c, 1 - argc);
+}
+
+static void patch_jump(compiler_t *c, size_t at) {
+  if (!c->failed) c->p->code[at] = c->p->ncode;
+}
+
+typedef struct builtin_t {
+  const char* name;
+  opcode op;
+  int arity;                  // -1 for folding any number of arguments
+} builtin_t;
+
+static const builtin_t builtins[] = {
+  { "+", OP_ADD, -1 },
+  { "-", OP_SUB, -1 },
+  { "*", OP_MUL, -1 },
+  { "/", OP_DIV, -1 },
+  { "<", OP_LT, 2 },
+  { "<=", OP_LE, 2 },
+  { ">", OP_GT, 2 },
+  { ">=", OP_GE, 2 },
+  { "=", OP_NUM_EQ, 2 },
+  { "eq", OP_EQ, 2 },
+  { "not", OP_NOT, 1 },
+};
+
+static int compile(compiler_t *c, const sexp_t *e);
+
+// compiles e and folds it if it is constant. returns whether it was.
+static int compile_folded(compiler_t *c, const sexp_t *e) {
+  size_t start = c->p->ncode;
+  int depth = c->depth;
+  if (++c->nesting > MAX_NESTING) c->failed = 1;
+  int constant = compile(c, e);
+  if (constant && !c->failed && c->p->ncode - start > 2) {
+    sexp_value_t v;
+    emit(c, OP_RETURN);
+    int ok = !c->failed && run(c->p, start, NULL, &v);
+    c->p->ncode = start;
+    c->depth = depth;
+    if (ok) {
+      emit_const(c, v);
+    } else {
+      // leave the error to the evaluation
+      compile(c, e);
+      constant = 0;
+    }
+  }
+  c->nesting -= 1;
+  return constant;
+}
+
+static int compile_args(compiler_t *c, const sexp_t *e, size_t from) {
+  int constant = 1;
+  size_t len = sexp_list_length(e);
+  for (size_t i = from; i < len; ++i) constant &= compile_folded(c, sexp_list_nth(e, i));
+  return constant;
+}
+
+// (and a b ...) and (or a b ...), the value of the last argument evaluated
+static int compile_logic(compiler_t *c, const sexp_t *e, opcode op) {
+  size_t len = sexp_list_length(e);
+  if (len == 1) {
+    emit_const(c, sexp_value_bool(op == OP_AND));
+    return 1;
+  }
+  // the jump targets are patched once the end is known. until then they
+  // link the jumps into a chain, ending in -1.
+  int32_t chain = -1;
+  int constant = 1;
+  for (size_t i = 1; i < len; ++i) {
+    constant &= compile_folded(c, sexp_list_nth(e, i));
+    if (i + 1 < len) {
+      emit(c, op);
+      size_t at = c->p->ncode;
+      emit(c, chain);
+      chain = at;
+      stack_effect(c, -1);
+    }
+  }
+  while (!c->failed && chain >= 0) {
+    int32_t next = c->p->code[chain];
+    patch_jump(c, chain);
+    chain = next;
+  }
+  return constant;
+}
+
+static int compile_if(compiler_t *c, const sexp_t *e) {
+  size_t len = sexp_list_length(e);
+  if (len != 3 && len != 4) {
+    c->failed = 1;
+    return 0;
+  }
+  size_t start = c->p->ncode;
+  if (compile_folded(c, sexp_list_nth(e, 1)) && !c->failed) {
+    // only the branch taken is compiled
+    int taken = sexp_value_truthy(c->p->consts[c->p->code[start+1]]);
+    c->p->ncode = start;
+    c->depth -= 1;
+    if (taken) return compile_folded(c, sexp_list_nth(e, 2));
+    if (len == 4) return compile_folded(c, sexp_list_nth(e, 3));
+    emit_const(c, sexp_value_bool(0));
+    return 1;
+  }
+  emit(c, OP_JUMP_UNLESS);
+  size_t to_else = c->p->ncode;
+  emit(c, 0);
+  stack_effect(c, -1);
+  compile_folded(c, sexp_list_nth(e, 2));
+  emit(c, OP_JUMP);
+  size_t to_end = c->p->ncode;
+  emit(c, 0);
+  stack_effect(c, -1);
+  patch_jump(c, to_else);
+  if (len == 4) compile_folded(c, sexp_list_nth(e, 3));
+  else emit_const(c, sexp_value_bool(0));
+  patch_jump(c, to_end);
+  return 0;
+}
+
+static int compile_builtin(compiler_t *c, const sexp_t *e, const builtin_t *b) {
+  int argc = sexp_list_length(e) - 1;
+  if (b->arity >= 0) {
+    if (argc != b->arity) {
+      c->failed = 1;
+      return 0;
+    }
+    int constant = compile_args(c, e, 1);
+    emit(c, b->op);
+    stack_effect(c, 1 - argc);
+    return constant;
+  }
+  if (argc == 0) {
+    if (b->op == OP_SUB || b->op == OP_DIV) c->failed = 1;
+    emit_const(c, sexp_value_number(b->op == OP_MUL));
+    return 1;
+  }
+  if (argc == 1 && b->op == OP_DIV) emit_const(c, sexp_value_number(1));
+  int constant = compile_folded(c, sexp_list_nth(e, 1));
+  if (argc == 1 && b->op == OP_SUB) {
+    emit(c, OP_NEG);
+  } else if (argc == 1 && b->op == OP_DIV) {
+    emit(c, OP_DIV);
+    stack_effect(c, -1);
+  }
+  for (int i = 2; i <= argc; ++i) {
+    constant &= compile_folded(c, sexp_list_nth(e, i));
+    emit(c, b->op);
+    stack_effect(c, -1);
+  }
+  return constant;
+}
+
+static int compile(compiler_t *c, const sexp_t *e) {
+  if (c->failed) return 0;
+  if (!sexp_is_list(e) || sexp_list_length(e) == 0) {
+    int slot = sexp_is_symbol(e) ? env_find_var(c->env, sexp_symbol_get(e)) : -1;
+    if (slot < 0) {
+      emit_const(c, sexp_value_node(e));
+      return 1;
+    }
+    emit(c, OP_VAR);
+    emit(c, slot);
+    stack_effect(c, 1);
+    return 0;
+  }
+  const sexp_t *head = sexp_list_nth(e, 0);
+  if (!sexp_is_symbol(head)) {
+    c->failed = 1;
+    return 0;
+  }
+  const char* name = sexp_symbol_get(head);
+  int argc = sexp_list_length(e) - 1;
+  const native_t *n = env_find_native(c->env, name);
+  if (n != NULL) {
+    if (n->arity >= 0 && n->arity != argc) c->failed = 1;
+    compile_args(c, e, 1);
+    emit_call(c, n, argc);
+    return 0;
+  }
+  if (strcmp(name, "quote") == 0) {
+    if (argc != 1) {
+      c->failed = 1;
+      return 0;
+    }
+    emit_const(c, sexp_value_node(sexp_list_nth(e, 1)));
+    return 1;
+  }
+  if (strcmp(name, "if") == 0) return compile_if(c, e);
+  if (strcmp(name, "and") == 0) return compile_logic(c, e, OP_AND);
+  if (strcmp(name, "or") == 0) return compile_logic(c, e, OP_OR);
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+    if (strcmp(name, builtins[i].name) == 0) return compile_builtin(c, e, &builtins[i]);
+  }
+  c->failed = 1;
+  return 0;
+}
+
+sexp_program_t *sexp_compile(const sexp_env_t *env, const sexp_t *e) {
+  sexp_program_t *p = malloc(sizeof(sexp_program_t));
+  if (p == NULL) return NULL;
+  memset(p, 0, sizeof(sexp_program_t));
+  compiler_t c = { env, p, 0, 0, 0 };
+  compile_folded(&c, e);
+  emit(&c, OP_RETURN);
+  if (c.failed) {
+    sexp_program_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+/******************************************************************************
+ * BATCH EVALUATION
+ *****************************************************************************/
+
+// Rows are evaluated in blocks of BATCH_ROWS. Every stack entry holds a
+// whole block, and instructions loop over the rows that are still selected.
+// Branches narrow the selection: the code after an and/or runs only for the
+// rows that don't short circuit, the branches of an if for the rows that
+// take them, and their results are merged back by row. Entries are numbers
+// or bools that the loops work on directly, or values of any kind.
+// Everything else, like natives or blocks whose rows disagree on the kind of
+// a value, makes the block fall back to evaluating row by row.
+
+#define BATCH_ROWS 1024
+
+enum { VEC_NUM, VEC_BOOL, VEC_VALUES };
+
+typedef struct vec_t {
+  int kind;
+  const double *num;          // rows of numbers and bools, buf or a column
+  const sexp_value_t *vals;   // rows of values, vbuf or a column
+  double *buf;
+  sexp_value_t *vbuf;         // allocated when needed
+} vec_t;
+
+// the selected rows of a block, all n first ones if rows is NULL
+typedef struct sel_t {
+  const uint32_t *rows;
+  size_t n;
+} sel_t;
+
+#define EACH_ROW(sel, i, ...) do { \
+  if ((sel)->rows == NULL) { \
+    for (size_t i = 0; i < (sel)->n; ++i) { __VA_ARGS__ } \
+  } else { \
+    for (size_t k_ = 0; k_ < (sel)->n; ++k_) { \
+      size_t i = (sel)->rows[k_]; \
+      __VA_ARGS__ \
+    } \
+  } \
+} while (0)
+
+typedef struct batch_t {
+  const sexp_program_t *p;
+  const sexp_column_t *cols;
+  size_t base;                // first row of the block
+  vec_t *stack;
+  size_t sp;
+  uint32_t *rows;             // selections are taken from here like a stack
+  size_t nrows;
+} batch_t;
+
+static size_t op_length(opcode op) {
+  switch (op) {
+    case OP_CONST: case OP_VAR: case OP_JUMP: case OP_JUMP_UNLESS:
+    case OP_AND: case OP_OR:
+      return 2;
+    case OP_CALL:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+static sexp_value_t lane_value(const vec_t *v, size_t i) {
+  switch (v->kind) {
+    case VEC_NUM: return sexp_value_number(v->num[i]);
+    case VEC_BOOL: return sexp_value_bool(v->num[i] != 0);
+    default: return v->vals[i];
+  }
+}
+
+static int lane_truthy(const vec_t *v, size_t i) {
+  switch (v->kind) {
+    case VEC_NUM: return 1;
+    case VEC_BOOL: return v->num[i] != 0;
+    default: return sexp_value_truthy(v->vals[i]);
+  }
+}
+
+static int vec_values(vec_t *v) {
+  if (v->vbuf == NULL) v->vbuf = malloc(sizeof(sexp_value_t) * BATCH_ROWS);
+  return v->vbuf != NULL;
+}
+
+// splits sel by the truthiness of v into rows where it is true and false
+static void vec_split(batch_t *b, const sel_t *sel, const vec_t *v, sel_t *t, sel_t *f) {
+  uint32_t *trows = b->rows + b->nrows;
+  uint32_t *frows = trows + BATCH_ROWS;
+  b->nrows += 2 * BATCH_ROWS;
+  size_t nt = 0, nf = 0;
+  EACH_ROW(sel, i,
+    if (lane_truthy(v, i)) trows[nt++] = i;
+    else frows[nf++] = i;
+  );
+  t->rows = trows;
+  t->n = nt;
+  f->rows = frows;
+  f->n = nf;
+}
+
+// moves the rows of src selected by from into dst, which keeps its other
+// rows. dst has no rows yet if it is empty.
+static int vec_merge(vec_t *dst, vec_t *src, const sel_t *from, const sel_t *keep) {
+  if (keep->n == 0) {
+    vec_t tmp = *dst;
+    *dst = *src;
+    *src = tmp;
+    return 1;
+  }
+  if (dst->kind != src->kind) return 0;
+  if (dst->kind == VEC_VALUES) {
+    if (dst->vals != dst->vbuf) {
+      if (!vec_values(dst)) return 0;
+      EACH_ROW(keep, i, dst->vbuf[i] = dst->vals[i];);
+      dst->vals = dst->vbuf;
+    }
+    EACH_ROW(from, i, dst->vbuf[i] = src->vals[i];);
+  } else {
+    if (dst->num != dst->buf) {
+      EACH_ROW(keep, i, dst->buf[i] = dst->num[i];);
+      dst->num = dst->buf;
+    }
+    EACH_ROW(from, i, dst->buf[i] = src->num[i];);
+  }
+  return 1;
+}
+
+static int vec_run(batch_t *b, size_t pc, size_t end, const sel_t *sel);
+
+static int vec_const(batch_t *b, const sel_t *sel, sexp_value_t c) {
+  vec_t *v = &b->stack[b->sp++];
+  if (c.kind == SEXP_VAL_NUMBER || c.kind == SEXP_VAL_BOOL) {
+    v->kind = c.kind == SEXP_VAL_NUMBER ? VEC_NUM : VEC_BOOL;
+    double *out = v->buf;
+    double num = c.num;
+    EACH_ROW(sel, i, out[i] = num;);
+    v->num = out;
+    return 1;
+  }
+  if (!vec_values(v)) return 0;
+  sexp_value_t *out = v->vbuf;
+  EACH_ROW(sel, i, out[i] = c;);
+  v->kind = VEC_VALUES;
+  v->vals = out;
+  return 1;
+}
+
+static void vec_var(batch_t *b, int slot) {
+  vec_t *v = &b->stack[b->sp++];
+  const sexp_column_t *col = &b->cols[slot];
+  if (col->num != NULL) {
+    v->kind = VEC_NUM;
+    v->num = col->num + b->base;
+  } else {
+    v->kind = VEC_VALUES;
+    v->vals = col->vals + b->base;
+  }
+}
+
+static int vec_arith(batch_t *b, opcode op, const sel_t *sel) {
+  vec_t *x = &b->stack[b->sp-2], *y = &b->stack[b->sp-1];
+  if (x->kind != VEC_NUM || y->kind != VEC_NUM) return 0;
+  const double *xs = x->num, *ys = y->num;
+  double *out = x->buf;
+  switch (op) {
+    case OP_ADD: EACH_ROW(sel, i, out[i] = xs[i] + ys[i];); break;
+    case OP_SUB: EACH_ROW(sel, i, out[i] = xs[i] - ys[i];); break;
+    case OP_MUL: EACH_ROW(sel, i, out[i] = xs[i] * ys[i];); break;
+    case OP_DIV: EACH_ROW(sel, i, out[i] = xs[i] / ys[i];); break;
+    case OP_LT: EACH_ROW(sel, i, out[i] = xs[i] < ys[i];); break;
+    case OP_LE: EACH_ROW(sel, i, out[i] = xs[i] <= ys[i];); break;
+    case OP_GT: EACH_ROW(sel, i, out[i] = xs[i] > ys[i];); break;
+    case OP_GE: EACH_ROW(sel, i, out[i] = xs[i] >= ys[i];); break;
+    case OP_NUM_EQ: EACH_ROW(sel, i, out[i] = xs[i] == ys[i];); break;
+    default: die("invalid opcode");
+  }
+  x->kind = op >= OP_LT ? VEC_BOOL : VEC_NUM;
+  x->num = out;
+  b->sp -= 1;
+  return 1;
+}
+
+static void vec_eq(batch_t *b, const sel_t *sel) {
+  vec_t *x = &b->stack[b->sp-2], *y = &b->stack[b->sp-1];
+  const double *xs = x->num, *ys = y->num;
+  double *out = x->buf;
+  if (x->kind == y->kind && x->kind != VEC_VALUES) {
+    EACH_ROW(sel, i, out[i] = xs[i] == ys[i];);
+  } else {
+    EACH_ROW(sel, i, out[i] = sexp_value_eq(lane_value(x, i), lane_value(y, i)););
+  }
+  x->kind = VEC_BOOL;
+  x->num = out;
+  b->sp -= 1;
+}
+
+// (and a b) and (or a b) at pc, a is on top of the stack
+static int vec_logic(batch_t *b, size_t pc, const sel_t *sel) {
+  const int32_t *code = b->p->code;
+  size_t mark = b->nrows;
+  sel_t t, f;
+  vec_split(b, sel, &b->stack[b->sp-1], &t, &f);
+  const sel_t *next = code[pc] == OP_AND ? &t : &f;
+  const sel_t *done = code[pc] == OP_AND ? &f : &t;
+  int ok = 1;
+  if (next->n > 0) {
+    ok = vec_run(b, pc + 2, code[pc+1], next);
+    ok = ok && vec_merge(&b->stack[b->sp-2], &b->stack[b->sp-1], next, done);
+    b->sp -= 1;
+  }
+  b->nrows = mark;
+  return ok;
+}
+
+// (if c x y) with the condition on top of the stack, at its jump
+static int vec_if(batch_t *b, size_t pc, const sel_t *sel) {
+  const int32_t *code = b->p->code;
+  size_t to_else = code[pc+1];
+  size_t to_end = code[to_else-1];
+  size_t mark = b->nrows;
+  sel_t t, f;
+  vec_split(b, sel, &b->stack[b->sp-1], &t, &f);
+  b->sp -= 1;
+  int ok = 1;
+  if (t.n > 0) ok = vec_run(b, pc + 2, to_else - 2, &t);
+  if (ok && f.n > 0) {
+    ok = vec_run(b, to_else, to_end, &f);
+    if (ok && t.n > 0) {
+      ok = vec_merge(&b->stack[b->sp-2], &b->stack[b->sp-1], &f, &t);
+      b->sp -= 1;
+    }
+  }
+  b->nrows = mark;
+  return ok;
+}
+
+// runs [pc, end) for the rows in sel, 0 if the block has to be evaluated
+// row by row
+static int vec_run(batch_t *b, size_t pc, size_t end, const sel_t *sel) {
+  const sexp_program_t *p = b->p;
+  const int32_t *code = p->code;
+  while (pc < end) {
+    vec_t *top = b->sp > 0 ? &b->stack[b->sp-1] : NULL;
+    switch ((opcode)code[pc]) {
+      case OP_CONST:
+        if (!vec_const(b, sel, p->consts[code[pc+1]])) return 0;
+        break;
+      case OP_VAR:
+        vec_var(b, code[pc+1]);
+        break;
+      case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+      case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_NUM_EQ:
+        if (!vec_arith(b, (opcode)code[pc], sel)) return 0;
+        break;
+      case OP_NEG: {
+        if (top->kind != VEC_NUM) return 0;
+        const double *xs = top->num;
+        double *out = top->buf;
+        EACH_ROW(sel, i, out[i] = -xs[i];);
+        top->num = out;
+        break;
+      }
+      case OP_EQ:
+        vec_eq(b, sel);
+        break;
+      case OP_NOT: {
+        double *out = top->buf;
+        EACH_ROW(sel, i, out[i] = !lane_truthy(top, i););
+        top->kind = VEC_BOOL;
+        top->num = out;
+        break;
+      }
+      case OP_AND:
+      case OP_OR:
+        if (!vec_logic(b, pc, sel)) return 0;
+        pc = code[pc+1];
+        continue;
+      case OP_JUMP_UNLESS:
+        if (!vec_if(b, pc, sel)) return 0;
+        pc = code[code[pc+1]-1];
+        continue;
+      default:
+        return 0;
+    }
+    pc += op_length((opcode)code[pc]);
+  }
+  return 1;
+}
+
+static int scalar_row(const sexp_program_t *p, const sexp_column_t *cols,
+    sexp_value_t *vars, int nvars, size_t row, sexp_value_t *res) {
+  for (int slot = 0; slot < nvars; ++slot) {
+    if (cols[slot].num != NULL) vars[slot] = sexp_value_number(cols[slot].num[row]);
+    else vars[slot] = cols[slot].vals[row];
+  }
+  return run(p, 0, vars, res);
+}
+
+// evaluates n rows, collecting the true ones into rows or all values into
+// res. returns the number of true rows, -1 on errors.
+static long batch_eval(const sexp_program_t *p, const sexp_column_t *cols,
+    size_t n, size_t *rows, sexp_value_t *res) {
+  int nvars = 0, nsplits = 0;
+  for (size_t pc = 0; pc < p->ncode; pc += op_length((opcode)p->code[pc])) {
+    opcode op = (opcode)p->code[pc];
+    if (op == OP_VAR && p->code[pc+1] >= nvars) nvars = p->code[pc+1] + 1;
+    if (op == OP_AND || op == OP_OR || op == OP_JUMP_UNLESS) nsplits += 1;
+  }
+  // merges keep one more entry on the stack per branch
+  size_t depth = p->max_depth + nsplits + 1;
+  batch_t b;
+  b.p = p;
+  b.cols = cols;
+  b.stack = calloc(depth, sizeof(vec_t));
+  b.rows = malloc(sizeof(uint32_t) * 2 * BATCH_ROWS * (nsplits + 1));
+  double *bufs = malloc(sizeof(double) * BATCH_ROWS * depth);
+  sexp_value_t *vars = malloc(sizeof(sexp_value_t) * (nvars + 1));
+  long count = -1;
+  if (b.stack == NULL || b.rows == NULL || bufs == NULL || vars == NULL) goto done;
+  for (size_t i = 0; i < depth; ++i) b.stack[i].buf = bufs + i * BATCH_ROWS;
+
+  count = 0;
+  for (b.base = 0; b.base < n; b.base += BATCH_ROWS) {
+    size_t len = n - b.base < BATCH_ROWS ? n - b.base : BATCH_ROWS;
+    sel_t all = { NULL, len };
+    b.sp = 0;
+    b.nrows = 0;
+    if (vec_run(&b, 0, p->ncode - 1, &all)) {
+      const vec_t *v = &b.stack[0];
+      for (size_t i = 0; i < len; ++i) {
+        if (rows && lane_truthy(v, i)) rows[count++] = b.base + i;
+        if (res) res[b.base + i] = lane_value(v, i);
+      }
+      continue;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      sexp_value_t v;
+      if (!scalar_row(p, cols, vars, nvars, b.base + i, &v)) {
+        count = -1;
+        goto done;
+      }
+      if (rows && sexp_value_truthy(v)) rows[count++] = b.base + i;
+      if (res) res[b.base + i] = v;
+    }
+  }
+
+done:
+  for (size_t i = 0; b.stack != NULL && i < depth; ++i) free(b.stack[i].vbuf);
+  free(b.stack);
+  free(b.rows);
+  free(bufs);
+  free(vars);
+  return count;
+}
+
+long sexp_eval_filter(const sexp_program_t *p, const sexp_column_t *cols,
+    size_t n, size_t *rows) {
+  return batch_eval(p, cols, n, rows, NULL);
+}
+
+int sexp_eval_batch(const sexp_program_t *p, const sexp_column_t *cols,
+    size_t n, sexp_value_t *res) {
+  return batch_eval(p, cols, n, NULL, res) >= 0;
+}
@@ -0,0 +1,96 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_EVAL_
+#define __RUB_SEXP_EVAL_
+
+#include "sexp.h"
+
+// Evaluation of expressions like (and (> load 0.8) (eq region us-east)).
+// An expression is compiled once into bytecode, with its variables resolved
+// to slots and constant subexpressions folded, and then run any number of
+// times over an array of variable values. Builtins:
+//   + - * /              numbers, any number of arguments, (- x) negates
+//   < <= > >= =          two numbers
+//   eq                   two values of any kind
+//   and or not           #f and unset variables are false, all else is true
+//   (if c x y)           y may be left out and is #f then
+//   (quote x)            x itself
+// Symbols that are neither variables nor functions stand for themselves,
+// #t and #f are booleans.
+
+typedef enum sexp_value_kind_t {
+  SEXP_VAL_NIL,               // unset
+  SEXP_VAL_BOOL,
+  SEXP_VAL_NUMBER,
+  SEXP_VAL_NODE,              // strings, symbols and lists
+} sexp_value_kind_t;
+
+typedef struct sexp_value_t {
+  sexp_value_kind_t kind;
+  double num;                 // bools are 0 or 1
+  const sexp_t *node;         // borrowed from the caller or the program
+} sexp_value_t;
+
+sexp_value_t sexp_value_bool(int b);
+sexp_value_t sexp_value_number(double num);
+// number nodes and the symbols #t and #f give numbers and bools
+sexp_value_t sexp_value_node(const sexp_t *e);
+int sexp_value_truthy(sexp_value_t v);
+int sexp_value_eq(sexp_value_t a, sexp_value_t b);
+
+// native functions get their arguments evaluated. returning 0 fails the
+// evaluation.
+typedef int (*sexp_native_t)(const sexp_value_t *args, int argc,
+    sexp_value_t *res, void *ctx);
+
+// names of variables and functions that expressions can use
+typedef struct sexp_env_t sexp_env_t;
+
+sexp_env_t *sexp_env_new();
+void sexp_env_free(sexp_env_t *env);
+// slot of the variable name, which is added if new. -1 if out of memory.
+int sexp_env_var(sexp_env_t *env, const char* name);
+// fn takes arity arguments, or any number for -1. natives shadow builtins.
+// returns 0 if out of memory.
+int sexp_env_native(sexp_env_t *env, const char* name, int arity,
+    sexp_native_t fn, void *ctx);
+
+typedef struct sexp_program_t sexp_program_t;
+
+// NULL if e is malformed, calls unknown functions, nests too deep or memory
+// runs out. the program doesn't depend on env or e afterwards, it keeps
+// hashed copies of the nodes it needs.
+sexp_program_t *sexp_compile(const sexp_env_t *env, const sexp_t *e);
+void sexp_program_free(sexp_program_t *p);
+
+// runs p over vars, indexed by slot. returns 0 if values have the wrong
+// kind or a native failed. running a program only reads it, so threads can
+// share one, as long as the natives it calls allow that.
+int sexp_eval(const sexp_program_t *p, const sexp_value_t *vars, sexp_value_t *res);
+
+// Batch evaluation, for running one program over many rows at once. Column
+// slot holds the values of the variable in slot for every row, as an array
+// of numbers if num is set. Rows are evaluated in blocks with a loop over
+// the block per instruction, and/or/if narrow the rows that the code after
+// them runs for with selection vectors. Blocks with natives or values of
+// mixed kinds are evaluated row by row.
+typedef struct sexp_column_t {
+  const double *num;
+  const sexp_value_t *vals;   // used if num is NULL
+} sexp_column_t;
+
+// writes the indices of the rows in [0, n) for which p is true to rows, in
+// order. returns how many there were, -1 if the evaluation of a row fails.
+long sexp_eval_filter(const sexp_program_t *p, const sexp_column_t *cols,
+    size_t n, size_t *rows);
+// evaluates p for each of the n rows into res. 0 if a row fails.
+int sexp_eval_batch(const sexp_program_t *p, const sexp_column_t *cols,
+    size_t n, sexp_value_t *res);
+
+#endif
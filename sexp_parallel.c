@@ -0,0 +1,338 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "sexp_parallel.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+#define PAR_GRAIN 512           // elements a task maps without splitting
+#define PAR_LINE 64             // accumulators are this far apart at least
+
+/******************************************************************************
+ * DEQUES
+ *****************************************************************************/
+
+// Every worker has a deque of tasks, ranges of the elements of a list. The
+// owner pushes and pops at the tail, so it works depth first on the ranges
+// it split off last, while thieves take the oldest and largest ranges from
+// the head. Tasks are coarse, so a lock per deque is cheap enough.
+
+typedef struct par_task_t {
+  const sexp_t *list;
+  size_t from;
+  size_t to;
+} par_task_t;
+
+typedef struct par_deque_t {
+  pthread_mutex_t lock;
+  par_task_t *tasks;
+  size_t head;                // tasks are [head, tail)
+  size_t tail;
+  size_t cap;
+} par_deque_t;
+
+// returns 0 if out of memory
+static int deque_push(par_deque_t *d, par_task_t t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->cap) {
+    size_t len = d->tail - d->head;
+    if (d->head > 0 && len < d->cap / 2) {
+      memmove(d->tasks, d->tasks + d->head, sizeof(par_task_t) * len);
+    } else {
+      size_t cap = d->cap ? d->cap * 2 : 64;
+      par_task_t *tasks = realloc(d->tasks, sizeof(par_task_t) * cap);
+      if (tasks == NULL) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+      }
+      memmove(tasks, tasks + d->head, sizeof(par_task_t) * len);
+      d->tasks = tasks;
+      d->cap = cap;
+    }
+    d->head = 0;
+    d->tail = len;
+  }
+  d->tasks[d->tail++] = t;
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+static int deque_pop(par_deque_t *d, par_task_t *t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    *t = d->tasks[--d->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int deque_steal(par_deque_t *d, par_task_t *t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    *t = d->tasks[d->head++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+/******************************************************************************
+ * WORKERS
+ *****************************************************************************/
+
+struct sexp_workers_t {
+  int n;
+  pthread_t *threads;         // n - 1, the caller is worker 0
+  par_deque_t *deques;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned long job;          // incremented for every call
+  int busy;                   // threads still working on the job
+  int stop;
+
+  // the current job
+  const sexp_map_reduce_t *mr;
+  char *accs;
+  size_t stride;              // between accumulators
+  size_t pending;             // tasks pushed and not finished
+  int failed;
+};
+
+typedef struct par_worker_t {
+  sexp_workers_t *w;
+  int id;
+  void *acc;
+  sexp_iter_t *it;
+} par_worker_t;
+
+// hands t to the worker's deque, returns 0 if out of memory
+static int par_push(par_worker_t *pw, par_task_t t) {
+  __atomic_add_fetch(&pw->w->pending, 1, __ATOMIC_RELAXED);
+  if (deque_push(&pw->w->deques[pw->id], t)) return 1;
+  __atomic_sub_fetch(&pw->w->pending, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void par_fail(sexp_workers_t *w) {
+  __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+}
+
+// maps e and everything nested in it. large lists are handed to the deque
+// instead of being walked here.
+static void par_walk(par_worker_t *pw, const sexp_t *e) {
+  const sexp_map_reduce_t *mr = pw->w->mr;
+  if (pw->it == NULL && (pw->it = sexp_iter_new(NULL)) == NULL) {
+    par_fail(pw->w);
+    return;
+  }
+  sexp_iter_reset(pw->it, e);
+  const sexp_t *x;
+  while ((x = sexp_iter_next(pw->it)) != NULL) {
+    mr->map(pw->acc, x, mr->ctx);
+    size_t len = sexp_is_list(x) ? sexp_list_length(x) : 0;
+    if (len > PAR_GRAIN) {
+      // walked here if out of memory
+      par_task_t t = { x, 0, len };
+      if (par_push(pw, t)) sexp_iter_skip(pw->it);
+    }
+  }
+  if (sexp_iter_depth(pw->it) > 0) par_fail(pw->w);
+}
+
+static void par_run_task(par_worker_t *pw, par_task_t t) {
+  const sexp_map_reduce_t *mr = pw->w->mr;
+  // split off the upper halves for others to steal
+  while (t.to - t.from > PAR_GRAIN) {
+    size_t mid = t.from + (t.to - t.from) / 2;
+    par_task_t upper = { t.list, mid, t.to };
+    if (!par_push(pw, upper)) break;
+    t.to = mid;
+  }
+  for (size_t i = t.from; i < t.to; ++i) {
+    const sexp_t *e = sexp_list_nth(t.list, i);
+    if (mr->deep) par_walk(pw, e);
+    else mr->map(pw->acc, e, mr->ctx);
+  }
+}
+
+// works on the job until all tasks are done
+static void par_run(sexp_workers_t *w, int id) {
+  par_worker_t pw = { w, id, w->accs + w->stride * id, NULL };
+  int victim = id;
+  while (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) > 0) {
+    par_task_t t;
+    int found = deque_pop(&w->deques[id], &t);
+    for (int i = 1; i < w->n && !found; ++i) {
+      victim = (victim + 1) % w->n;
+      if (victim != id) found = deque_steal(&w->deques[victim], &t);
+    }
+    if (!found) {
+      sched_yield();
+      continue;
+    }
+    par_run_task(&pw, t);
+    __atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELEASE);
+  }
+  sexp_iter_free(pw.it);
+}
+
+typedef struct par_thread_t {
+  sexp_workers_t *w;
+  int id;
+} par_thread_t;
+
+static void *worker_main(void *arg) {
+  par_thread_t *pt = arg;
+  sexp_workers_t *w = pt->w;
+  int id = pt->id;
+  free(pt);
+  unsigned long job = 0;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->job == job && !w->stop) pthread_cond_wait(&w->start, &w->lock);
+    if (w->stop) break;
+    job = w->job;
+    pthread_mutex_unlock(&w->lock);
+    par_run(w, id);
+    pthread_mutex_lock(&w->lock);
+    if (--w->busy == 0) pthread_cond_signal(&w->done);
+  }
+  pthread_mutex_unlock(&w->lock);
+  sexp_pool_release();
+  return NULL;
+}
+
+static void workers_stop(sexp_workers_t *w, int started) {
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->start);
+  pthread_mutex_unlock(&w->lock);
+  for (int i = 0; i < started; ++i) pthread_join(w->threads[i], NULL);
+}
+
+// frees everything once the threads are stopped
+static void workers_destroy(sexp_workers_t *w) {
+  for (int i = 0; i < w->n; ++i) {
+    pthread_mutex_destroy(&w->deques[i].lock);
+    free(w->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->start);
+  pthread_cond_destroy(&w->done);
+  free(w->threads);
+  free(w->deques);
+  free(w);
+}
+
+sexp_workers_t *sexp_workers_new(int n) {
+  if (n <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cores > 0 ? cores : 1;
+  }
+  sexp_workers_t *w = calloc(1, sizeof(sexp_workers_t));
+  if (w == NULL) return NULL;
+  w->n = n;
+  w->threads = malloc(sizeof(pthread_t) * n);
+  w->deques = calloc(n, sizeof(par_deque_t));
+  if (w->threads == NULL || w->deques == NULL) {
+    free(w->threads);
+    free(w->deques);
+    free(w);
+    return NULL;
+  }
+  for (int i = 0; i < n; ++i) pthread_mutex_init(&w->deques[i].lock, NULL);
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->start, NULL);
+  pthread_cond_init(&w->done, NULL);
+  for (int i = 1; i < n; ++i) {
+    par_thread_t *pt = malloc(sizeof(par_thread_t));
+    if (pt != NULL) {
+      pt->w = w;
+      pt->id = i;
+    }
+    if (pt == NULL || pthread_create(&w->threads[i - 1], NULL, worker_main, pt) != 0) {
+      free(pt);
+      workers_stop(w, i - 1);
+      workers_destroy(w);
+      return NULL;
+    }
+  }
+  return w;
+}
+
+void sexp_workers_free(sexp_workers_t *w) {
+  if (w == NULL) return;
+  workers_stop(w, w->n - 1);
+  workers_destroy(w);
+}
+
+int sexp_workers_count(const sexp_workers_t *w) {
+  return w->n;
+}
+
+/******************************************************************************
+ * MAP/REDUCE
+ *****************************************************************************/
+
+static void acc_init(const sexp_map_reduce_t *mr, void *acc) {
+  if (mr->init) mr->init(acc, mr->ctx);
+  else memset(acc, 0, mr->acc_size);
+}
+
+int sexp_map_reduce(sexp_workers_t *w, const sexp_t *list,
+    const sexp_map_reduce_t *mr, void *result) {
+  size_t len = sexp_is_list(list) ? sexp_list_length(list) : 0;
+  acc_init(mr, result);
+  if (len == 0) return 1;
+
+  w->stride = (mr->acc_size + PAR_LINE - 1) / PAR_LINE * PAR_LINE;
+  if (w->stride == 0) w->stride = PAR_LINE;
+  // aligned, so that no two workers write to the same cache line
+  void *accs;
+  if (posix_memalign(&accs, PAR_LINE, w->stride * w->n) != 0) return 0;
+  w->accs = accs;
+  for (int i = 0; i < w->n; ++i) acc_init(mr, w->accs + w->stride * i);
+  w->mr = mr;
+  w->failed = 0;
+  par_task_t all = { list, 0, len };
+  if (!deque_push(&w->deques[0], all)) {
+    free(w->accs);
+    return 0;
+  }
+  w->pending = 1;
+
+  pthread_mutex_lock(&w->lock);
+  w->job += 1;
+  w->busy = w->n - 1;
+  pthread_cond_broadcast(&w->start);
+  pthread_mutex_unlock(&w->lock);
+  par_run(w, 0);
+  pthread_mutex_lock(&w->lock);
+  while (w->busy > 0) pthread_cond_wait(&w->done, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+
+  for (int i = 0; i < w->n; ++i) mr->reduce(result, w->accs + w->stride * i, mr->ctx);
+  free(w->accs);
+  w->accs = NULL;
+  return !w->failed;
+}
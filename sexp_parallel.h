@@ -0,0 +1,53 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_PARALLEL_
+#define __RUB_SEXP_PARALLEL_
+
+#include "sexp.h"
+
+// Parallel map/reduce over large trees, like counting nodes, summing numbers
+// or collecting symbols. A pool of worker threads splits the elements of a
+// list into ranges, and every worker accumulates what it visits into an
+// accumulator of its own, which are reduced into one result at the end.
+// Idle workers steal ranges from the others, and lists that are found to be
+// large while walking a subtree are split up too, so uneven trees still keep
+// all workers busy.
+//
+// The tree must not change during a call, and nothing in it is referenced
+// or freed by the workers. map runs on many threads at once, so it must not
+// reference, free or intern the nodes it is passed either. Hashing and
+// comparing them is fine, the hash cache is updated atomically.
+
+typedef struct sexp_workers_t sexp_workers_t;
+
+// starts n - 1 threads, the calling thread is the n-th worker. n = 0 uses
+// one worker per core. NULL if the threads can't be started.
+sexp_workers_t *sexp_workers_new(int n);
+void sexp_workers_free(sexp_workers_t *w);
+int sexp_workers_count(const sexp_workers_t *w);
+
+typedef struct sexp_map_reduce_t {
+  size_t acc_size;            // bytes of an accumulator
+  // sets up an accumulator, they start out zeroed if this is NULL
+  void (*init)(void *acc, void *ctx);
+  // accumulates e into the worker's acc
+  void (*map)(void *acc, const sexp_t *e, void *ctx);
+  // merges other into acc. accumulators are merged in no particular order.
+  void (*reduce)(void *acc, const void *other, void *ctx);
+  void *ctx;
+  int deep;                   // map all nodes below the list, not only its elements
+} sexp_map_reduce_t;
+
+// maps the elements of list, and with deep set all nodes nested in them, and
+// reduces the accumulators into result, which must hold acc_size bytes.
+// returns 0 if out of memory. calls must not overlap on the same workers.
+int sexp_map_reduce(sexp_workers_t *w, const sexp_t *list,
+    const sexp_map_reduce_t *mr, void *result);
+
+#endif
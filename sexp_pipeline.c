@@ -0,0 +1,542 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_pipeline.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+#define PIPE_CHUNK (64 * 1024)
+#define PIPE_BUDGET (16 * 1024 * 1024)
+#define PIPE_BATCHES 16         // capacity of the queue to the builder
+#define PIPE_FORMS 1024         // capacity of the queue to the consumer
+#define PIPE_SPIN 256           // polls before going to sleep
+#define PIPE_WAKE 256           // forms that wake the consumer
+
+/******************************************************************************
+ * QUEUES
+ *****************************************************************************/
+
+// Bounded single producer, single consumer rings. Each side owns one index
+// and only reads the other's, so pushing and popping need no locks. Threads
+// that find a ring full or empty poll a while and then sleep on a condition
+// variable of their own. Producers sleep until their ring is half empty and
+// consumers until enough has arrived, so stages that run at different speeds
+// wake each other once per batch of items instead of once per item.
+
+typedef struct pipe_item_t {
+  void *ptr;                  // NULL marks the end of the stream
+  size_t bytes;               // source text of the item
+} pipe_item_t;
+
+typedef struct ring_t {
+  pipe_item_t *items;
+  size_t cap;                 // power of two
+  size_t head;                // next to pop, written by the consumer
+  size_t tail;                // next to push, written by the producer
+} ring_t;
+
+static int ring_init(ring_t *r, size_t cap) {
+  r->items = malloc(sizeof(pipe_item_t) * cap);
+  r->cap = cap;
+  r->head = 0;
+  r->tail = 0;
+  return r->items != NULL;
+}
+
+static int ring_push(ring_t *r, pipe_item_t item) {
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->cap) return 0;
+  r->items[tail & (r->cap - 1)] = item;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static int ring_pop(ring_t *r, pipe_item_t *item) {
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return 0;
+  *item = r->items[head & (r->cap - 1)];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static size_t ring_count(ring_t *r) {
+  return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * PIPELINE
+ *****************************************************************************/
+
+// a run of complete top level forms
+typedef struct batch_t {
+  char* text;                 // NUL terminated
+  size_t len;
+  size_t nforms;
+  size_t offset;              // of the text in the stream
+  sexp_index_t *idx;          // NULL if indexing failed
+} batch_t;
+
+enum { STAGE_READER, STAGE_BUILDER, STAGE_CONSUMER, STAGES };
+
+struct sexp_pipeline_t {
+  int fd;
+  size_t chunk;
+  size_t budget;
+  sexp_read_opts_t read_opts;
+  sexp_error_t *error;
+
+  ring_t batches;             // reader to builder
+  ring_t forms;               // builder to consumer, ptr is a sexp_t
+  size_t inflight;            // source bytes pushed but not taken by next
+  int halt;                   // the reader should stop, the builder failed
+  int stop;                   // everyone should stop, the pipeline is freed
+  int done;                   // next got the end of the stream
+
+  sexp_error_t read_err;      // written by the reader before its end marker
+  sexp_error_t err;           // written by the builder before its end marker
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake[STAGES];
+  int sleeping[STAGES];
+  pthread_t reader;
+  pthread_t builder;
+};
+
+static int pipe_flag(int *flag) {
+  return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+// sleeping flags are only written by read-modify-writes, which form one
+// release sequence. a waker reading 0 is then seen by the next sleeper, whose
+// check of ready comes after the change that preceded the wake.
+static int pipe_sleeping(sexp_pipeline_t *pl, int stage, int val) {
+  return __atomic_exchange_n(&pl->sleeping[stage], val, __ATOMIC_SEQ_CST);
+}
+
+// wakes stage if it sleeps, after a change it may be waiting for
+static void pipe_wake(sexp_pipeline_t *pl, int stage) {
+  if (!__atomic_fetch_or(&pl->sleeping[stage], 0, __ATOMIC_SEQ_CST)) return;
+  pthread_mutex_lock(&pl->lock);
+  // only the first waker signals, the rest see the flag cleared
+  if (pipe_sleeping(pl, stage, 0)) pthread_cond_signal(&pl->wake[stage]);
+  pthread_mutex_unlock(&pl->lock);
+}
+
+static void pipe_set(sexp_pipeline_t *pl, int *flag) {
+  __atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < STAGES; ++i) pipe_wake(pl, i);
+}
+
+typedef int (*pipe_ready_t)(sexp_pipeline_t *pl);
+
+// waits until ready returns nonzero, which it must once stop is set
+static void pipe_wait(sexp_pipeline_t *pl, int stage, pipe_ready_t ready) {
+  for (int i = 0; i < PIPE_SPIN; ++i) {
+    if (ready(pl)) return;
+  }
+  pthread_mutex_lock(&pl->lock);
+  for (;;) {
+    pipe_sleeping(pl, stage, 1);
+    if (ready(pl)) break;
+    pthread_cond_wait(&pl->wake[stage], &pl->lock);
+  }
+  pipe_sleeping(pl, stage, 0);
+  pthread_mutex_unlock(&pl->lock);
+}
+
+static int reader_may_read(sexp_pipeline_t *pl) {
+  return pipe_flag(&pl->stop) || pipe_flag(&pl->halt) ||
+    __atomic_load_n(&pl->inflight, __ATOMIC_ACQUIRE) <= pl->budget / 2;
+}
+
+static int reader_may_push(sexp_pipeline_t *pl) {
+  return pipe_flag(&pl->stop) || pipe_flag(&pl->halt) ||
+    ring_count(&pl->batches) <= PIPE_BATCHES / 2;
+}
+
+static int builder_may_pop(sexp_pipeline_t *pl) {
+  return pipe_flag(&pl->stop) || ring_count(&pl->batches) > 0;
+}
+
+static int builder_may_push(sexp_pipeline_t *pl) {
+  return pipe_flag(&pl->stop) || ring_count(&pl->forms) <= PIPE_FORMS / 2;
+}
+
+static int consumer_may_pop(sexp_pipeline_t *pl) {
+  return pipe_flag(&pl->stop) || ring_count(&pl->forms) > 0;
+}
+
+// pushes to r, waking the stage that pops from it and waiting while it is
+// full. 0 if the pipeline stopped first.
+static int pipe_push(sexp_pipeline_t *pl, ring_t *r, pipe_item_t item,
+    int stage, pipe_ready_t may_push) {
+  while (!ring_push(r, item)) {
+    pipe_wake(pl, stage + 1);
+    pipe_wait(pl, stage, may_push);
+    if (pipe_flag(&pl->stop) || (stage == STAGE_READER && pipe_flag(&pl->halt))) return 0;
+  }
+  return 1;
+}
+
+static void batch_free(batch_t *b) {
+  if (b == NULL) return;
+  sexp_index_free(b->idx);
+  free(b->text);
+  free(b);
+}
+
+/******************************************************************************
+ * READER STAGE
+ *****************************************************************************/
+
+// Splits the input into top level forms with a scan that only tracks
+// nesting, strings and comments. The scan state carries over between
+// chunks, so every byte is looked at once. Malformed input is passed on as
+// it is, for the builder to report.
+
+typedef struct splitter_t {
+  char* buf;
+  size_t len;                 // bytes in buf
+  size_t cap;
+  size_t scanned;             // bytes of buf the state describes
+  size_t split;               // end of the last complete form in buf
+  size_t nforms;              // complete forms in [0, split)
+  size_t offset;              // of buf in the stream
+  size_t depth;
+  int in_string;
+  int escape;
+  int in_comment;
+  int in_atom;
+} splitter_t;
+
+// characters that end atoms
+static const unsigned char split_delim[256] = {
+  [' '] = 1, ['\t'] = 1, ['\f'] = 1, ['\n'] = 1,
+  ['('] = 1, ['['] = 1, ['{'] = 1, [')'] = 1, [']'] = 1, ['}'] = 1,
+  ['"'] = 1, [';'] = 1, ['\0'] = 1,
+};
+
+// characters that change the state inside lists
+static const unsigned char split_special[256] = {
+  ['('] = 1, ['['] = 1, ['{'] = 1, [')'] = 1, [']'] = 1, ['}'] = 1,
+  ['"'] = 1, [';'] = 1,
+};
+
+static void split_form_end(splitter_t *s, size_t end) {
+  s->split = end;
+  s->nforms += 1;
+}
+
+static void split_scan(splitter_t *s) {
+  const unsigned char* buf = (const unsigned char*)s->buf;
+  size_t i = s->scanned, len = s->len;
+  while (i < len) {
+    if (s->in_comment) {
+      const unsigned char* nl = memchr(buf + i, '\n', len - i);
+      if (nl == NULL) break;
+      i = nl - buf + 1;
+      s->in_comment = 0;
+      continue;
+    }
+    if (s->in_string) {
+      if (s->escape) {
+        s->escape = 0;
+        i += 1;
+        continue;
+      }
+      while (i < len && buf[i] != '"' && buf[i] != '\\') ++i;
+      if (i == len) break;
+      if (buf[i++] == '\\') {
+        s->escape = 1;
+        continue;
+      }
+      s->in_string = 0;
+      if (s->depth == 0) split_form_end(s, i);
+      continue;
+    }
+    if (s->in_atom) {
+      while (i < len && !split_delim[buf[i]]) ++i;
+      if (i == len) break;
+      s->in_atom = 0;
+      if (s->depth == 0) split_form_end(s, i);
+    }
+    // inside lists atoms and whitespace don't matter
+    if (s->depth > 0) {
+      while (i < len && !split_special[buf[i]]) ++i;
+      if (i == len) break;
+    }
+    switch (buf[i++]) {
+      case ' ': case '\t': case '\f': case '\n':
+        break;
+      case ';':
+        s->in_comment = 1;
+        break;
+      case '"':
+        s->in_string = 1;
+        break;
+      case '(': case '[': case '{':
+        s->depth += 1;
+        break;
+      case ')': case ']': case '}':
+        // a stray closer is a form of its own that fails to read
+        if (s->depth > 0) s->depth -= 1;
+        if (s->depth == 0) split_form_end(s, i);
+        break;
+      default:
+        s->in_atom = 1;
+        break;
+    }
+  }
+  s->scanned = len;
+}
+
+// whether the unsplit rest of buf holds the start of a form
+static int split_pending(const splitter_t *s) {
+  return s->depth > 0 || s->in_string || s->in_atom;
+}
+
+// hands [0, split) over as a batch and keeps the rest in a new buffer
+static batch_t *split_take(splitter_t *s) {
+  batch_t *b = malloc(sizeof(batch_t));
+  size_t rest = s->len - s->split;
+  size_t cap = rest + 1 > s->cap / 2 ? rest + 1 : s->cap / 2;
+  char* buf = malloc(cap);
+  if (b == NULL || buf == NULL) {
+    free(b);
+    free(buf);
+    return NULL;
+  }
+  memcpy(buf, s->buf + s->split, rest);
+  b->text = s->buf;
+  b->text[s->split] = '\0';
+  b->len = s->split;
+  b->nforms = s->nforms;
+  b->offset = s->offset;
+  b->idx = sexp_index_new(b->text, b->len);
+
+  s->offset += s->split;
+  s->buf = buf;
+  s->cap = cap;
+  s->len = rest;
+  s->scanned = rest;
+  s->split = 0;
+  s->nforms = 0;
+  return b;
+}
+
+static void reader_fail(sexp_pipeline_t *pl, sexp_error_code_t code, size_t offset) {
+  pl->read_err.code = code;
+  pl->read_err.offset = offset;
+}
+
+static void *reader_main(void *arg) {
+  sexp_pipeline_t *pl = arg;
+  splitter_t s;
+  memset(&s, 0, sizeof(s));
+  int eof = 0;
+  while (!eof) {
+    if (__atomic_load_n(&pl->inflight, __ATOMIC_ACQUIRE) >= pl->budget) {
+      pipe_wait(pl, STAGE_READER, reader_may_read);
+    }
+    if (pipe_flag(&pl->stop) || pipe_flag(&pl->halt)) break;
+
+    if (s.cap - s.len < pl->chunk + 1) {
+      size_t cap = s.cap ? s.cap : pl->chunk + 1;
+      while (cap - s.len < pl->chunk + 1) cap *= 2;
+      char* buf = realloc(s.buf, cap);
+      if (buf == NULL) {
+        reader_fail(pl, SEXP_ERR_NOMEM, s.offset + s.len);
+        break;
+      }
+      s.buf = buf;
+      s.cap = cap;
+    }
+    ssize_t n = read(pl->fd, s.buf + s.len, pl->chunk);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      reader_fail(pl, SEXP_ERR_IO, s.offset + s.len);
+      break;
+    }
+    if (n == 0) eof = 1;
+    s.len += n;
+    split_scan(&s);
+    if (eof && split_pending(&s)) split_form_end(&s, s.len);
+    if (s.nforms == 0) continue;
+
+    batch_t *b = split_take(&s);
+    if (b == NULL) {
+      reader_fail(pl, SEXP_ERR_NOMEM, s.offset);
+      break;
+    }
+    __atomic_fetch_add(&pl->inflight, b->len, __ATOMIC_ACQ_REL);
+    pipe_item_t item = { b, b->len };
+    if (!pipe_push(pl, &pl->batches, item, STAGE_READER, reader_may_push)) {
+      batch_free(b);
+      break;
+    }
+    pipe_wake(pl, STAGE_BUILDER);
+  }
+  free(s.buf);
+  pipe_item_t end = { NULL, 0 };
+  pipe_push(pl, &pl->batches, end, STAGE_READER, reader_may_push);
+  pipe_wake(pl, STAGE_BUILDER);
+  sexp_pool_release();
+  return NULL;
+}
+
+/******************************************************************************
+ * BUILDER STAGE
+ *****************************************************************************/
+
+// reads the forms of b and pushes them, 0 if reading failed or the
+// pipeline stopped
+static int builder_batch(sexp_pipeline_t *pl, batch_t *b) {
+  sexp_read_opts_t opts = pl->read_opts;
+  sexp_error_t err = { SEXP_ERR_NONE, 0 };
+  opts.index = b->idx;
+  opts.error = &err;
+  const char* pos = b->text;
+  for (size_t i = 0; i < b->nforms; ++i) {
+    char* end;
+    sexp_t *e = sexp_read_opts(pos, &end, &opts);
+    if (e == NULL) {
+      pl->err.code = err.code == SEXP_ERR_NONE ? SEXP_ERR_SYNTAX : err.code;
+      pl->err.offset = b->offset + (pos - b->text) + err.offset;
+      return 0;
+    }
+    // the last form accounts for the whole rest, so the batch adds up
+    size_t bytes = i + 1 == b->nforms ? b->len - (pos - b->text) : (size_t)(end - pos);
+    pipe_item_t item = { e, bytes };
+    if (!pipe_push(pl, &pl->forms, item, STAGE_BUILDER, builder_may_push)) {
+      sexp_free(e);
+      return 0;
+    }
+    if (ring_count(&pl->forms) >= PIPE_WAKE) pipe_wake(pl, STAGE_CONSUMER);
+    pos = end;
+  }
+  return 1;
+}
+
+static void *builder_main(void *arg) {
+  sexp_pipeline_t *pl = arg;
+  for (;;) {
+    pipe_item_t item;
+    while (!ring_pop(&pl->batches, &item)) {
+      pipe_wait(pl, STAGE_BUILDER, builder_may_pop);
+      if (pipe_flag(&pl->stop)) goto out;
+    }
+    if (ring_count(&pl->batches) == PIPE_BATCHES / 2) pipe_wake(pl, STAGE_READER);
+    batch_t *b = item.ptr;
+    if (b == NULL) {
+      pl->err = pl->read_err;
+      break;
+    }
+    int ok = builder_batch(pl, b);
+    batch_free(b);
+    pipe_wake(pl, STAGE_CONSUMER);
+    if (!ok) {
+      pipe_set(pl, &pl->halt);
+      break;
+    }
+  }
+  pipe_item_t end = { NULL, 0 };
+  pipe_push(pl, &pl->forms, end, STAGE_BUILDER, builder_may_push);
+  pipe_wake(pl, STAGE_CONSUMER);
+out:
+  sexp_pool_release();
+  return NULL;
+}
+
+/******************************************************************************
+ * CONSUMER
+ *****************************************************************************/
+
+sexp_pipeline_t *sexp_pipeline_new(int fd, const sexp_pipeline_opts_t *opts) {
+  sexp_pipeline_t *pl = calloc(1, sizeof(sexp_pipeline_t));
+  if (pl == NULL) return NULL;
+  pl->fd = fd;
+  pl->chunk = opts && opts->chunk ? opts->chunk : PIPE_CHUNK;
+  pl->budget = opts && opts->budget ? opts->budget : PIPE_BUDGET;
+  if (opts) {
+    pl->read_opts.validate_utf8 = opts->validate_utf8;
+    pl->read_opts.allocator = opts->allocator;
+    pl->error = opts->error;
+  }
+  if (!ring_init(&pl->batches, PIPE_BATCHES) || !ring_init(&pl->forms, PIPE_FORMS)) {
+    free(pl->batches.items);
+    free(pl->forms.items);
+    free(pl);
+    return NULL;
+  }
+  pthread_mutex_init(&pl->lock, NULL);
+  for (int i = 0; i < STAGES; ++i) pthread_cond_init(&pl->wake[i], NULL);
+  if (pthread_create(&pl->reader, NULL, reader_main, pl) != 0) goto fail;
+  if (pthread_create(&pl->builder, NULL, builder_main, pl) != 0) {
+    pipe_set(pl, &pl->stop);
+    pthread_join(pl->reader, NULL);
+    goto fail;
+  }
+  return pl;
+fail:
+  for (int i = 0; i < STAGES; ++i) pthread_cond_destroy(&pl->wake[i]);
+  pthread_mutex_destroy(&pl->lock);
+  pipe_item_t item;
+  while (ring_pop(&pl->batches, &item)) batch_free(item.ptr);
+  free(pl->batches.items);
+  free(pl->forms.items);
+  free(pl);
+  return NULL;
+}
+
+sexp_t *sexp_pipeline_next(sexp_pipeline_t *pl) {
+  if (pl->done) return NULL;
+  pipe_item_t item;
+  while (!ring_pop(&pl->forms, &item)) pipe_wait(pl, STAGE_CONSUMER, consumer_may_pop);
+  if (item.ptr == NULL) {
+    pl->done = 1;
+    return NULL;
+  }
+  // producers wait for the half mark, and don't move while they wait
+  if (ring_count(&pl->forms) == PIPE_FORMS / 2) pipe_wake(pl, STAGE_BUILDER);
+  size_t inflight = __atomic_sub_fetch(&pl->inflight, item.bytes, __ATOMIC_ACQ_REL);
+  if (inflight <= pl->budget / 2 && inflight + item.bytes > pl->budget / 2) {
+    pipe_wake(pl, STAGE_READER);
+  }
+  return item.ptr;
+}
+
+int sexp_pipeline_free(sexp_pipeline_t *pl) {
+  if (pl == NULL) return 0;
+  pipe_set(pl, &pl->stop);
+  pthread_join(pl->reader, NULL);
+  pthread_join(pl->builder, NULL);
+
+  pipe_item_t item;
+  while (ring_pop(&pl->batches, &item)) batch_free(item.ptr);
+  while (ring_pop(&pl->forms, &item)) sexp_free(item.ptr);
+  // an error isn't known unless the builder got to the end
+  sexp_error_t err = pl->err;
+  if (!pl->done && err.code == SEXP_ERR_NONE) err = pl->read_err;
+  if (pl->error) *pl->error = err;
+
+  for (int i = 0; i < STAGES; ++i) pthread_cond_destroy(&pl->wake[i]);
+  pthread_mutex_destroy(&pl->lock);
+  free(pl->batches.items);
+  free(pl->forms.items);
+  free(pl);
+  return err.code == SEXP_ERR_NONE;
+}
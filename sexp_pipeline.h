@@ -0,0 +1,45 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_PIPELINE_
+#define __RUB_SEXP_PIPELINE_
+
+#include "sexp.h"
+
+// Pipelined reading of a stream of top level forms, like a log or a feed on
+// a socket. Two threads work ahead of the consumer: the first reads the
+// input in chunks, splits it at the ends of top level forms and indexes
+// them, the second builds the forms from the index. Completed forms are
+// handed over through lock-free single producer, single consumer queues, so
+// reading, lexing, building and consuming overlap.
+//
+// The stages stop working ahead once the forms waiting for the consumer
+// take up budget bytes of source text. Forms larger than the budget are
+// still read whole.
+
+typedef struct sexp_pipeline_opts_t {
+  size_t chunk;               // bytes per read, 64 KiB if 0
+  size_t budget;              // source bytes in flight, 16 MiB if 0
+  int validate_utf8;          // like in the reader options
+  const sexp_allocator_t *allocator; // forms are built with this
+  sexp_error_t *error;        // set to the first error by sexp_pipeline_free,
+                              // offsets are from the start of the stream
+} sexp_pipeline_opts_t;
+
+typedef struct sexp_pipeline_t sexp_pipeline_t;
+
+// starts reading fd, opts may be NULL. NULL if the threads can't be started.
+sexp_pipeline_t *sexp_pipeline_new(int fd, const sexp_pipeline_opts_t *opts);
+// the next top level form, NULL at the end of the input or on errors. must
+// be called from one thread at a time.
+sexp_t *sexp_pipeline_next(sexp_pipeline_t *pl);
+// stops the threads and frees forms that weren't taken, waiting for a read
+// in progress to return. returns 0 if reading or parsing failed.
+int sexp_pipeline_free(sexp_pipeline_t *pl);
+
+#endif
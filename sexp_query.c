@@ -0,0 +1,387 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_query.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+// Queries run as a nondeterministic automaton over the tree. Every list that
+// is visited carries the set of steps that its children are matched against,
+// stored as a bitmask, so a visited list is never walked twice.
+
+#define MAX_STEPS 63
+
+typedef uint64_t state_set;
+
+typedef enum step_kind {
+  STEP_INDEX,
+  STEP_ANY,
+  STEP_DESCEND,
+  STEP_NAME,
+} step_kind;
+
+typedef struct query_pred_t {
+  const char* key;
+  size_t keylen;
+  sexp_t *value;              // NULL only tests that the keyword exists
+} query_pred_t;
+
+typedef struct query_step_t {
+  step_kind kind;
+  int keyword_only;
+  size_t index;
+  const char* name;
+  size_t namelen;
+  int npreds;
+  query_pred_t *preds;
+} query_step_t;
+
+struct sexp_query_t {
+  char *text;                 // names point into this copy of the path
+  int nsteps;
+  query_step_t steps[];
+};
+
+/******************************************************************************
+ * COMPILER
+ *****************************************************************************/
+
+static char* copy_path(const char* path) {
+  size_t len = strlen(path);
+  char* res = malloc(len + 1);
+  if (res) memcpy(res, path, len + 1);
+  return res;
+}
+
+static int is_name_char(char ch) {
+  return ch != '\0' && strchr("/[]*:= \t\n\f", ch) == NULL;
+}
+
+static const char* parse_name(const char* p, const char** name, size_t *len) {
+  const char* start = p;
+  while (is_name_char(*p)) ++p;
+  *name = start;
+  *len = p - start;
+  return p;
+}
+
+// the value of a pred that fails to parse is freed, it isn't counted yet
+static const char* parse_pred(const char* p, query_pred_t *pred) {
+  p = parse_name(p, &pred->key, &pred->keylen);
+  if (pred->keylen == 0 || *p != ':') return NULL;
+  ++p;
+  pred->value = NULL;
+  if (*p == '=') {
+    char* end;
+    pred->value = sexp_read(p + 1, &end);
+    if (pred->value == NULL || sexp_is_list(pred->value)) goto fail;
+    p = end;
+  }
+  while (*p == ' ') ++p;
+  if (*p != ']') goto fail;
+  return p + 1;
+
+fail:
+  sexp_free(pred->value);
+  pred->value = NULL;
+  return NULL;
+}
+
+static const char* parse_step(const char* p, query_step_t *step) {
+  memset(step, 0, sizeof(query_step_t));
+  if (p[0] == '*' && p[1] == '*') {
+    step->kind = STEP_DESCEND;
+    return p + 2;
+  } else if (p[0] == '*') {
+    step->kind = STEP_ANY;
+    ++p;
+  } else if (*p >= '0' && *p <= '9') {
+    char* end;
+    step->kind = STEP_INDEX;
+    step->index = strtoul(p, &end, 10);
+    p = end;
+  } else {
+    step->kind = STEP_NAME;
+    p = parse_name(p, &step->name, &step->namelen);
+    if (step->namelen == 0) return NULL;
+    if (*p == ':') {
+      step->keyword_only = 1;
+      ++p;
+    }
+  }
+  while (*p == '[') {
+    query_pred_t *preds = realloc(step->preds, sizeof(query_pred_t) * (step->npreds + 1));
+    if (preds == NULL) return NULL;
+    step->preds = preds;
+    p = parse_pred(p + 1, &step->preds[step->npreds]);
+    if (p == NULL) return NULL;
+    step->npreds += 1;
+  }
+  return p;
+}
+
+sexp_query_t *sexp_query_compile(const char* path) {
+  int nsteps = 1;
+  for (const char* p = path; *p != '\0'; ++p) {
+    if (*p == '/') nsteps += 1;
+  }
+  if (nsteps > MAX_STEPS) return NULL;
+
+  sexp_query_t *q = calloc(1, sizeof(sexp_query_t) + sizeof(query_step_t) * nsteps);
+  if (q == NULL) return NULL;
+  q->text = copy_path(path);
+  if (q->text == NULL) {
+    free(q);
+    return NULL;
+  }
+
+  const char* p = q->text;
+  while (1) {
+    p = parse_step(p, &q->steps[q->nsteps]);
+    q->nsteps += 1;
+    if (p == NULL || (*p != '/' && *p != '\0')) {
+      sexp_query_free(q);
+      return NULL;
+    }
+    if (*p == '\0') break;
+    ++p;
+  }
+  return q;
+}
+
+void sexp_query_free(sexp_query_t *q) {
+  if (q == NULL) return;
+  for (int i = 0; i < q->nsteps; ++i) {
+    for (int j = 0; j < q->steps[i].npreds; ++j) {
+      sexp_free(q->steps[i].preds[j].value);
+    }
+    free(q->steps[i].preds);
+  }
+  free(q->text);
+  free(q);
+}
+
+/******************************************************************************
+ * MATCHING
+ *****************************************************************************/
+
+// what a step can see of a child value. tree is NULL while streaming, steps
+// with predicates need it and set needs_tree instead of matching.
+typedef struct child_t {
+  size_t index;
+  const char* keyword;        // the preceding sibling, if it is a keyword
+  size_t keywordlen;
+  const char* head;           // the first symbol, if the child is a list
+  size_t headlen;
+  int is_list;
+  const sexp_t *tree;
+} child_t;
+
+static state_set final_state(const sexp_query_t *q) {
+  return (state_set)1 << q->nsteps;
+}
+
+static int is_keyword(const char* s, size_t len) {
+  return len > 1 && s[len-1] == ':';
+}
+
+static int step_selects(const query_step_t *step, const child_t *c) {
+  switch (step->kind) {
+    case STEP_INDEX:
+      return c->index == step->index;
+    case STEP_ANY:
+      return 1;
+    case STEP_NAME:
+      if (c->keyword != NULL && c->keywordlen == step->namelen + 1 &&
+          memcmp(c->keyword, step->name, step->namelen) == 0) {
+        return 1;
+      }
+      return !step->keyword_only && c->head != NULL &&
+        c->headlen == step->namelen &&
+        memcmp(c->head, step->name, step->namelen) == 0;
+    default:
+      return 0;
+  }
+}
+
+static int pred_holds(const query_pred_t *pred, const sexp_t *e) {
+  if (!sexp_is_list(e)) return 0;
+  size_t len = sexp_list_length(e);
+  for (size_t i = 0; i < len; ++i) {
+    const sexp_t *key = sexp_list_nth(e, i);
+    if (!sexp_is_symbol(key) || sexp_symbol_length(key) != pred->keylen + 1) continue;
+    const char* s = sexp_symbol_get(key);
+    if (s[pred->keylen] != ':' || memcmp(s, pred->key, pred->keylen) != 0) continue;
+    if (pred->value == NULL) return 1;
+    return i + 1 < len && sexp_equal(sexp_list_nth(e, i + 1), pred->value);
+  }
+  return 0;
+}
+
+static state_set closure(const sexp_query_t *q, state_set set) {
+  for (int s = 0; s < q->nsteps; ++s) {
+    if ((set & ((state_set)1 << s)) && q->steps[s].kind == STEP_DESCEND) {
+      set |= (state_set)1 << (s + 1);
+    }
+  }
+  return set;
+}
+
+static state_set advance(const sexp_query_t *q, state_set set,
+    const child_t *c, int *needs_tree) {
+  state_set res = 0;
+  for (int s = 0; s < q->nsteps; ++s) {
+    if (!(set & ((state_set)1 << s))) continue;
+    const query_step_t *step = &q->steps[s];
+    if (step->kind == STEP_DESCEND) {
+      if (c->is_list) res |= (state_set)1 << s;
+      continue;
+    }
+    if (!step_selects(step, c)) continue;
+    if (step->npreds > 0 && c->tree == NULL) {
+      *needs_tree = 1;
+      continue;
+    }
+    int ok = 1;
+    for (int i = 0; ok && i < step->npreds; ++i) {
+      ok = pred_holds(&step->preds[i], c->tree);
+    }
+    if (ok) res |= (state_set)1 << (s + 1);
+  }
+  return closure(q, res);
+}
+
+typedef struct run_t {
+  const sexp_query_t *q;
+  sexp_query_cb cb;
+  void *ctx;
+  long count;
+  int stop;
+} run_t;
+
+static void emit(run_t *r, const sexp_t *e) {
+  r->count += 1;
+  if (!r->cb(e, r->ctx)) r->stop = 1;
+}
+
+static void run_children(run_t *r, const sexp_t *list, state_set set) {
+  state_set final = final_state(r->q);
+  size_t len = sexp_list_length(list);
+  child_t c;
+  memset(&c, 0, sizeof(child_t));
+  for (size_t i = 0; i < len && !r->stop; ++i) {
+    const sexp_t *e = sexp_list_nth(list, i);
+    c.index = i;
+    c.head = NULL;
+    c.is_list = sexp_is_list(e);
+    c.tree = e;
+    if (c.is_list && sexp_list_length(e) > 0 && sexp_is_symbol(sexp_list_nth(e, 0))) {
+      c.head = sexp_symbol_get(sexp_list_nth(e, 0));
+      c.headlen = sexp_symbol_length(sexp_list_nth(e, 0));
+    }
+    int needs_tree = 0;
+    state_set next = advance(r->q, set, &c, &needs_tree);
+    if (next & final) emit(r, e);
+    if ((next & ~final) && c.is_list && !r->stop) run_children(r, e, next & ~final);
+
+    c.keyword = NULL;
+    if (sexp_is_symbol(e) && is_keyword(sexp_symbol_get(e), sexp_symbol_length(e))) {
+      c.keyword = sexp_symbol_get(e);
+      c.keywordlen = sexp_symbol_length(e);
+    }
+  }
+}
+
+static int stream_children(run_t *r, sexp_parser_t *p, state_set set, int toplevel) {
+  state_set final = final_state(r->q);
+  child_t c;
+  memset(&c, 0, sizeof(child_t));
+  for (size_t i = 0; !r->stop; ++i) {
+    switch (p->type) {
+      case SEXP_TOKEN_ERROR: return 0;
+      case SEXP_TOKEN_EOF: return toplevel;
+      case SEXP_TOKEN_CLOSE: return !toplevel;
+      default: break;
+    }
+    sexp_token_t type = p->type;
+    const char* tok = p->start;
+    size_t toklen = p->end - p->start;
+
+    c.index = i;
+    c.head = NULL;
+    c.is_list = type == SEXP_TOKEN_OPEN;
+    c.tree = NULL;
+    if (c.is_list) {
+      sexp_parser_t peek = *p;
+      if (sexp_parser_next(&peek) == SEXP_TOKEN_ATOM) {
+        c.head = peek.start;
+        c.headlen = peek.end - peek.start;
+      }
+    }
+
+    int needs_tree = 0;
+    state_set next = advance(r->q, set, &c, &needs_tree);
+    if (needs_tree || (next & final)) {
+      sexp_t *e = sexp_parser_read(p);
+      if (e == NULL) return 0;
+      c.tree = e;
+      next = advance(r->q, set, &c, &needs_tree);
+      if (next & final) emit(r, e);
+      if ((next & ~final) && c.is_list && !r->stop) run_children(r, e, next & ~final);
+      sexp_free(e);
+    } else if (next && c.is_list) {
+      sexp_parser_next(p);
+      if (!stream_children(r, p, next, 0)) return 0;
+      if (r->stop) break;
+      sexp_parser_next(p);
+    } else if (!sexp_parser_skip(p)) {
+      return 0;
+    }
+
+    c.keyword = NULL;
+    if (type == SEXP_TOKEN_ATOM && is_keyword(tok, toklen)) {
+      c.keyword = tok;
+      c.keywordlen = toklen;
+    }
+  }
+  return 1;
+}
+
+long sexp_query_run(const sexp_query_t *q, const sexp_t *root,
+    sexp_query_cb cb, void *ctx) {
+  run_t r = { q, cb, ctx, 0, 0 };
+  if (sexp_is_list(root)) run_children(&r, root, closure(q, 1));
+  return r.count;
+}
+
+static int first_cb(const sexp_t *match, void *ctx) {
+  *(const sexp_t**)ctx = match;
+  return 0;
+}
+
+sexp_t *sexp_query_first(const sexp_query_t *q, const sexp_t *root) {
+  const sexp_t *res = NULL;
+  sexp_query_run(q, root, first_cb, &res);
+  return (sexp_t*)res;
+}
+
+long sexp_query_stream(const sexp_query_t *q, const char* src,
+    sexp_query_cb cb, void *ctx) {
+  run_t r = { q, cb, ctx, 0, 0 };
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  sexp_parser_next(&p);
+  if (!stream_children(&r, &p, closure(q, 1), 1)) return -1;
+  return r.count;
+}
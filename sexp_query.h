@@ -0,0 +1,46 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_QUERY_
+#define __RUB_SEXP_QUERY_
+
+#include "sexp.h"
+
+// Path queries over S-Expressions. A path is a list of steps separated by
+// '/', each step selects among the children of the lists selected so far:
+//   3         the fourth child
+//   *         every child
+//   **        the list itself and all lists below it
+//   name      lists starting with the symbol name, and values following the
+//             keyword name:
+//   name:     only values following the keyword name:
+// Steps can be followed by predicates on the selected lists:
+//   [key:=v]  the value following key: equals the atom v
+//   [key:]    the list contains the keyword key:
+// Example: target[name:="t1"]/sources/*
+typedef struct sexp_query_t sexp_query_t;
+
+// returns NULL if path is malformed or out of memory
+sexp_query_t *sexp_query_compile(const char* path);
+void sexp_query_free(sexp_query_t *q);
+
+// called for every match, returning 0 stops the query
+typedef int (*sexp_query_cb)(const sexp_t *match, void *ctx);
+
+// matches the children of root against the first step
+long sexp_query_run(const sexp_query_t *q, const sexp_t *root,
+    sexp_query_cb cb, void *ctx);
+sexp_t *sexp_query_first(const sexp_query_t *q, const sexp_t *root);
+
+// matches the top level values in src against the first step, without
+// building anything but the matches and lists that predicates are tested on.
+// matches are freed when cb returns. returns -1 on malformed input.
+long sexp_query_stream(const sexp_query_t *q, const char* src,
+    sexp_query_cb cb, void *ctx);
+
+#endif
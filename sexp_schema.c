@@ -0,0 +1,547 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+
+#include "sexp_schema.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#define die(...) do{fprintf(stderr,__VA_ARGS__);abort();}while(0)
+
+/******************************************************************************
+ * KEYWORD LOOKUP
+ *****************************************************************************/
+
+// A perfect hash maps every keyword of a schema to its own slot, so a lookup
+// is one hash and one comparison. Seeds are tried on growing tables until
+// one is collision free, with at most 64 keywords a table of four times the
+// size almost always works within a few seeds. Schemas where none is found
+// fall back to comparing every keyword.
+
+#define MAX_SEED 1024
+
+static uint32_t key_hash(const char* s, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+static int key_eq(const char* keyword, const char* s, size_t len) {
+  return strncmp(keyword, s, len) == 0 && keyword[len] == '\0';
+}
+
+static int try_seed(sexp_schema_t *schema, unsigned seed, unsigned mask) {
+  memset(schema->slots, 0, sizeof(schema->slots));
+  for (int i = 0; i < schema->nfields; ++i) {
+    const char* kw = schema->fields[i].keyword;
+    unsigned slot = key_hash(kw, strlen(kw), seed) & mask;
+    if (schema->slots[slot] != 0) return 0;
+    schema->slots[slot] = i + 1;
+  }
+  return 1;
+}
+
+void sexp_schema_prepare(sexp_schema_t *schema) {
+  if (schema->prepared) return;
+  if (schema->nfields > 64) die("too many fields in schema");
+  schema->mask = 0;
+  unsigned size = 2;
+  while (size < 2 * (unsigned)schema->nfields) size *= 2;
+  for (; size <= sizeof(schema->slots) && schema->mask == 0; size *= 2) {
+    for (unsigned seed = 0; seed < MAX_SEED; ++seed) {
+      if (try_seed(schema, seed, size - 1)) {
+        schema->seed = seed;
+        schema->mask = size - 1;
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < schema->nfields; ++i) {
+    if (schema->fields[i].kind == SEXP_KIND_RECORD) {
+      sexp_schema_prepare(schema->fields[i].schema);
+    }
+  }
+  schema->prepared = 1;
+}
+
+static const sexp_field_t *schema_field(const sexp_schema_t *schema,
+    const char* key, size_t len) {
+  if (schema->mask != 0) {
+    unsigned slot = schema->slots[key_hash(key, len, schema->seed) & schema->mask];
+    if (slot == 0) return NULL;
+    const sexp_field_t *f = &schema->fields[slot - 1];
+    return key_eq(f->keyword, key, len) ? f : NULL;
+  }
+  for (int i = 0; i < schema->nfields; ++i) {
+    if (key_eq(schema->fields[i].keyword, key, len)) return &schema->fields[i];
+  }
+  return NULL;
+}
+
+/******************************************************************************
+ * DECODER
+ *****************************************************************************/
+
+static size_t token_length(const sexp_parser_t *p) {
+  return p->end - p->start;
+}
+
+static char* decode_string(const sexp_parser_t *p) {
+  size_t len = token_length(p) - 2;
+  char* res = malloc(len + 1);
+  if (res == NULL) return NULL;
+  if (!sexp_unescape(p->start + 1, len, res, &len)) {
+    free(res);
+    return NULL;
+  }
+  res[len] = '\0';
+  return res;
+}
+
+static char* decode_symbol(const sexp_parser_t *p) {
+  size_t len = token_length(p);
+  char* res = malloc(len + 1);
+  if (res == NULL) return NULL;
+  memcpy(res, p->start, len);
+  res[len] = '\0';
+  return res;
+}
+
+// atoms are numbers if all of them parses as one
+static int decode_number(const sexp_parser_t *p, double *val) {
+  char* end;
+  *val = strtod(p->start, &end);
+  return end == p->end && end != p->start;
+}
+
+static void free_strings(char** strings) {
+  if (strings == NULL) return;
+  for (char** s = strings; *s != NULL; ++s) free(*s);
+  free(strings);
+}
+
+static char** decode_strings(sexp_parser_t *p) {
+  size_t len = 0, cap = 4;
+  char** res = malloc(sizeof(char*) * cap);
+  if (res == NULL) return NULL;
+  res[0] = NULL;
+  sexp_parser_next(p);
+  while (p->type == SEXP_TOKEN_STRING) {
+    if (len + 2 > cap) {
+      char** grown = realloc(res, sizeof(char*) * cap * 2);
+      if (grown == NULL) break;
+      res = grown;
+      cap *= 2;
+    }
+    if ((res[len] = decode_string(p)) == NULL) break;
+    res[++len] = NULL;
+    sexp_parser_next(p);
+  }
+  if (p->type != SEXP_TOKEN_CLOSE) {
+    free_strings(res);
+    return NULL;
+  }
+  return res;
+}
+
+static int decode_record(sexp_schema_t *schema, sexp_parser_t *p, void *obj);
+
+static void release_field(const sexp_field_t *f, char* member) {
+  switch (f->kind) {
+    case SEXP_KIND_STRING:
+    case SEXP_KIND_SYMBOL:
+      free(*(char**)member);
+      *(char**)member = NULL;
+      break;
+    case SEXP_KIND_STRINGS:
+      free_strings(*(char***)member);
+      *(char***)member = NULL;
+      break;
+    case SEXP_KIND_RECORD:
+      sexp_schema_release(f->schema, member);
+      break;
+    case SEXP_KIND_VALUE:
+      sexp_free(*(sexp_t**)member);
+      *(sexp_t**)member = NULL;
+      break;
+    default:
+      break;
+  }
+}
+
+static int decode_value(const sexp_field_t *f, sexp_parser_t *p, char* member) {
+  double num;
+  switch (f->kind) {
+    case SEXP_KIND_NUMBER:
+      if (p->type != SEXP_TOKEN_ATOM || !decode_number(p, &num)) return 0;
+      *(double*)member = num;
+      return 1;
+    case SEXP_KIND_INT:
+      if (p->type != SEXP_TOKEN_ATOM || !decode_number(p, &num)) return 0;
+      // nan, inf and values out of range can't be cast
+      if (!(num >= LONG_MIN && num < -(double)LONG_MIN) || num != (long)num) return 0;
+      *(long*)member = (long)num;
+      return 1;
+    case SEXP_KIND_STRING:
+      if (p->type != SEXP_TOKEN_STRING) return 0;
+      return (*(char**)member = decode_string(p)) != NULL;
+    case SEXP_KIND_SYMBOL:
+      if (p->type != SEXP_TOKEN_ATOM || decode_number(p, &num)) return 0;
+      return (*(char**)member = decode_symbol(p)) != NULL;
+    case SEXP_KIND_STRINGS:
+      if (p->type != SEXP_TOKEN_OPEN) return 0;
+      return (*(char***)member = decode_strings(p)) != NULL;
+    case SEXP_KIND_RECORD:
+      memset(member, 0, f->schema->size);
+      return decode_record(f->schema, p, member);
+    default:
+      die("invalid field kind");
+  }
+}
+
+// decodes the value at the current token and moves past it. a keyword given
+// twice keeps the last value.
+static int decode_field(const sexp_field_t *f, sexp_parser_t *p, char* member) {
+  release_field(f, member);
+  if (f->kind == SEXP_KIND_VALUE) {
+    return (*(sexp_t**)member = sexp_parser_read(p)) != NULL;
+  }
+  if (!decode_value(f, p, member)) return 0;
+  sexp_parser_next(p);
+  return 1;
+}
+
+static int is_keyword(const sexp_parser_t *p) {
+  return p->type == SEXP_TOKEN_ATOM && token_length(p) > 1 && p->end[-1] == ':';
+}
+
+// decodes the list at the current token into obj, which is zeroed. leaves the
+// parser on the closing token.
+static int decode_record(sexp_schema_t *schema, sexp_parser_t *p, void *obj) {
+  if (p->type != SEXP_TOKEN_OPEN) return 0;
+  sexp_parser_next(p);
+  if (schema->head != NULL) {
+    if (p->type != SEXP_TOKEN_ATOM || !key_eq(schema->head, p->start, token_length(p))) {
+      return 0;
+    }
+    sexp_parser_next(p);
+  }
+  while (p->type != SEXP_TOKEN_CLOSE) {
+    if (!is_keyword(p)) return 0;
+    const sexp_field_t *f = schema_field(schema, p->start, token_length(p));
+    sexp_parser_next(p);
+    if (f == NULL) {
+      if (!sexp_parser_skip(p)) return 0;
+      continue;
+    }
+    if (!decode_field(f, p, (char*)obj + f->offset)) return 0;
+  }
+  return 1;
+}
+
+int sexp_schema_read(sexp_schema_t *schema, const char* src, char** end, void *obj) {
+  sexp_schema_prepare(schema);
+  memset(obj, 0, schema->size);
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  sexp_parser_next(&p);
+  if (p.type == SEXP_TOKEN_EOF) {
+    if (end) *end = (char*)p.start;
+    return 0;
+  }
+  int ok = decode_record(schema, &p, obj);
+  if (end) *end = (char*)(ok ? p.end : p.start);
+  if (!ok) {
+    sexp_schema_release(schema, obj);
+    memset(obj, 0, schema->size);
+    return -1;
+  }
+  return 1;
+}
+
+void sexp_schema_release(sexp_schema_t *schema, void *obj) {
+  for (int i = 0; i < schema->nfields; ++i) {
+    const sexp_field_t *f = &schema->fields[i];
+    release_field(f, (char*)obj + f->offset);
+  }
+}
+
+/******************************************************************************
+ * COLUMNAR DECODING
+ *****************************************************************************/
+
+// Columns are looked up through a schema whose field offsets are column
+// indices, so keywords get the same perfect hash as records do.
+
+static void table_lookup(sexp_table_t *t) {
+  if (t->ncolumns > 64) die("too many columns in table");
+  for (int i = 0; i < t->ncolumns; ++i) {
+    t->fields[i].keyword = t->columns[i].keyword;
+    t->fields[i].kind = SEXP_KIND_VALUE;
+    t->fields[i].offset = i;
+    t->fields[i].schema = NULL;
+  }
+  memset(&t->lookup, 0, sizeof(sexp_schema_t));
+  t->lookup.fields = t->fields;
+  t->lookup.nfields = t->ncolumns;
+  sexp_schema_prepare(&t->lookup);
+}
+
+void sexp_table_init(sexp_table_t *t, const char* head,
+    sexp_table_column_t *columns, int ncolumns) {
+  memset(t, 0, sizeof(sexp_table_t));
+  t->head = head;
+  t->columns = columns;
+  t->ncolumns = ncolumns;
+  for (int i = 0; i < ncolumns; ++i) {
+    sexp_table_column_t *col = &columns[i];
+    col->f64 = NULL;
+    col->i64 = NULL;
+    col->offsets = NULL;
+    col->text = NULL;
+    col->valid = NULL;
+    col->textcap = 0;
+  }
+  table_lookup(t);
+}
+
+static int is_integer(const sexp_parser_t *p) {
+  const char* s = p->start;
+  if (*s == '-' || *s == '+') ++s;
+  if (s == p->end) return 0;
+  for (; s < p->end; ++s) {
+    if (*s < '0' || *s > '9') return 0;
+  }
+  return 1;
+}
+
+int sexp_table_detect(sexp_table_t *t, const char* src) {
+  memset(t, 0, sizeof(sexp_table_t));
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  if (sexp_parser_next(&p) != SEXP_TOKEN_OPEN) return 0;
+  if (sexp_parser_next(&p) == SEXP_TOKEN_OPEN) sexp_parser_next(&p);
+  t->detected = 1;
+  t->columns = calloc(64, sizeof(sexp_table_column_t));
+  if (t->columns == NULL) return 0;
+  if (p.type == SEXP_TOKEN_ATOM && !is_keyword(&p)) {
+    if ((t->head = decode_symbol(&p)) == NULL) goto fail;
+    sexp_parser_next(&p);
+  }
+  while (p.type != SEXP_TOKEN_CLOSE) {
+    if (!is_keyword(&p) || t->ncolumns == 64) goto fail;
+    sexp_table_column_t *col = &t->columns[t->ncolumns];
+    sexp_parser_t key = p;
+    sexp_parser_next(&p);
+    double num;
+    if (p.type == SEXP_TOKEN_STRING) {
+      col->kind = SEXP_COLUMN_STRING;
+    } else if (p.type == SEXP_TOKEN_ATOM && is_integer(&p)) {
+      col->kind = SEXP_COLUMN_INT64;
+    } else if (p.type == SEXP_TOKEN_ATOM && decode_number(&p, &num)) {
+      col->kind = SEXP_COLUMN_DOUBLE;
+    } else if (p.type == SEXP_TOKEN_ATOM) {
+      col->kind = SEXP_COLUMN_STRING;
+    } else {
+      if (!sexp_parser_skip(&p)) goto fail;
+      continue;
+    }
+    if ((col->keyword = decode_symbol(&key)) == NULL) goto fail;
+    t->ncolumns += 1;
+    sexp_parser_next(&p);
+  }
+  table_lookup(t);
+  return 1;
+
+fail:
+  sexp_table_release(t);
+  return 0;
+}
+
+void sexp_table_release(sexp_table_t *t) {
+  for (int i = 0; i < t->ncolumns; ++i) {
+    sexp_table_column_t *col = &t->columns[i];
+    free(col->f64);
+    free(col->i64);
+    free(col->offsets);
+    free(col->text);
+    free(col->valid);
+    if (t->detected) free((char*)col->keyword);
+  }
+  if (t->detected) {
+    free((char*)t->head);
+    free(t->columns);
+  }
+  memset(t, 0, sizeof(sexp_table_t));
+}
+
+static int grow(void *ptr, size_t size) {
+  void *res = realloc(*(void**)ptr, size);
+  if (res == NULL) return 0;
+  *(void**)ptr = res;
+  return 1;
+}
+
+// makes room for one more row
+static int table_reserve(sexp_table_t *t) {
+  if (t->nrows < t->cap) return 1;
+  size_t cap = t->cap < 1024 ? 1024 : t->cap * 2;
+  for (int i = 0; i < t->ncolumns; ++i) {
+    sexp_table_column_t *col = &t->columns[i];
+    if (!grow(&col->valid, cap)) return 0;
+    switch (col->kind) {
+      case SEXP_COLUMN_DOUBLE:
+        if (!grow(&col->f64, sizeof(double) * cap)) return 0;
+        break;
+      case SEXP_COLUMN_INT64:
+        if (!grow(&col->i64, sizeof(int64_t) * cap)) return 0;
+        break;
+      case SEXP_COLUMN_STRING:
+        if (!grow(&col->offsets, sizeof(size_t) * (cap + 1))) return 0;
+        if (t->cap == 0) col->offsets[0] = 0;
+        break;
+    }
+  }
+  t->cap = cap;
+  return 1;
+}
+
+static int column_text(sexp_table_column_t *col, size_t row, const sexp_parser_t *p) {
+  size_t at = col->offsets[row];
+  size_t len = token_length(p);
+  if (at + len > col->textcap) {
+    size_t cap = col->textcap < 4096 ? 4096 : col->textcap;
+    while (cap < at + len) cap *= 2;
+    if (!grow(&col->text, cap)) return 0;
+    col->textcap = cap;
+  }
+  if (p->type == SEXP_TOKEN_ATOM) {
+    memcpy(col->text + at, p->start, len);
+  } else if (!sexp_unescape(p->start + 1, len - 2, col->text + at, &len)) {
+    return 0;
+  }
+  col->offsets[row+1] = at + len;
+  return 1;
+}
+
+// turns an int64 column into a double one
+static int column_widen(sexp_table_t *t, sexp_table_column_t *col) {
+  double *f64 = malloc(sizeof(double) * t->cap);
+  if (f64 == NULL) return 0;
+  for (size_t i = 0; i <= t->nrows; ++i) {
+    f64[i] = col->valid[i] ? col->i64[i] : NAN;
+  }
+  free(col->i64);
+  col->i64 = NULL;
+  col->f64 = f64;
+  col->kind = SEXP_COLUMN_DOUBLE;
+  return 1;
+}
+
+static int column_value(sexp_table_t *t, sexp_table_column_t *col, size_t row,
+    const sexp_parser_t *p) {
+  double num;
+  char* end;
+  switch (col->kind) {
+    case SEXP_COLUMN_DOUBLE:
+      if (p->type != SEXP_TOKEN_ATOM || !decode_number(p, &num)) return 0;
+      col->f64[row] = num;
+      break;
+    case SEXP_COLUMN_INT64:
+      if (p->type != SEXP_TOKEN_ATOM) return 0;
+      if (is_integer(p)) {
+        errno = 0;
+        col->i64[row] = strtoll(p->start, &end, 10);
+        if (errno == 0) break;
+      }
+      if (!t->detected || !decode_number(p, &num) || !column_widen(t, col)) return 0;
+      col->f64[row] = num;
+      break;
+    case SEXP_COLUMN_STRING:
+      if (p->type != SEXP_TOKEN_ATOM && p->type != SEXP_TOKEN_STRING) return 0;
+      if (!column_text(col, row, p)) return 0;
+      break;
+  }
+  col->valid[row] = 1;
+  return 1;
+}
+
+// decodes the record after its opening token into a new row
+static int table_row(sexp_table_t *t, sexp_parser_t *p) {
+  if (!table_reserve(t)) return 0;
+  size_t row = t->nrows;
+  for (int i = 0; i < t->ncolumns; ++i) {
+    sexp_table_column_t *col = &t->columns[i];
+    col->valid[row] = 0;
+    switch (col->kind) {
+      case SEXP_COLUMN_DOUBLE: col->f64[row] = NAN; break;
+      case SEXP_COLUMN_INT64: col->i64[row] = 0; break;
+      case SEXP_COLUMN_STRING: col->offsets[row+1] = col->offsets[row]; break;
+    }
+  }
+  if (t->head != NULL) {
+    if (p->type != SEXP_TOKEN_ATOM || !key_eq(t->head, p->start, token_length(p))) {
+      return 0;
+    }
+    sexp_parser_next(p);
+  }
+  while (p->type != SEXP_TOKEN_CLOSE) {
+    if (!is_keyword(p)) return 0;
+    const sexp_field_t *f = schema_field(&t->lookup, p->start, token_length(p));
+    sexp_parser_next(p);
+    if (f == NULL) {
+      if (!sexp_parser_skip(p)) return 0;
+      continue;
+    }
+    sexp_table_column_t *col = &t->columns[f->offset];
+    if (col->kind == SEXP_COLUMN_STRING) col->offsets[row+1] = col->offsets[row];
+    if (!column_value(t, col, row, p)) return 0;
+    sexp_parser_next(p);
+  }
+  t->nrows += 1;
+  return 1;
+}
+
+long sexp_table_read(sexp_table_t *t, const char* src, char** end) {
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  size_t first = t->nrows;
+  int enclosed = 0;
+  const char* at = src;
+  int ok = 1;
+  sexp_parser_next(&p);
+  while (p.type == SEXP_TOKEN_OPEN) {
+    at = p.start;
+    sexp_parser_next(&p);
+    if (!enclosed && t->nrows == first && p.type == SEXP_TOKEN_OPEN) {
+      enclosed = 1;
+      continue;
+    }
+    if (!(ok = table_row(t, &p))) break;
+    at = p.end;
+    sexp_parser_next(&p);
+  }
+  if (ok && enclosed) {
+    ok = p.type == SEXP_TOKEN_CLOSE;
+    if (ok) at = p.end;
+  } else if (ok) {
+    ok = p.type == SEXP_TOKEN_EOF;
+    if (ok) at = p.start;
+  }
+  if (end) *end = (char*)at;
+  return ok ? (long)(t->nrows - first) : -1;
+}
@@ -0,0 +1,139 @@
+/******************************************************************************
+ * Copyright 2018 by Alexander Matz
+ *
+ * This work is licensed under
+ * Creative Commons Attribution 4.0 International (CC BY 4.0)
+ *
+ * For more info, visit:  https://creativecommons.org/licenses/by/4.0/
+ *****************************************************************************/
+#ifndef __RUB_SEXP_SCHEMA_
+#define __RUB_SEXP_SCHEMA_
+
+#include "sexp.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Decoding of records like (target name: "t1" sources: ("a.c")) straight
+// from text into C structs, without building nodes. A schema lists the
+// keywords of a record and where their values go:
+//
+//   typedef struct target_t { char* name; char** sources; double weight; } target_t;
+//   SEXP_SCHEMA(target_schema, target_t, "target",
+//     SEXP_FIELD(target_t, name, SEXP_KIND_STRING),
+//     SEXP_FIELD(target_t, sources, SEXP_KIND_STRINGS),
+//     SEXP_FIELD(target_t, weight, SEXP_KIND_NUMBER));
+//
+// Keywords that aren't in the schema are skipped, missing ones leave their
+// member zeroed. Keywords are looked up through a perfect hash that is built
+// when the schema is first used.
+typedef enum sexp_field_kind_t {
+  SEXP_KIND_NUMBER,           // double
+  SEXP_KIND_INT,              // long, from numbers without fraction
+  SEXP_KIND_STRING,           // char*, unescaped
+  SEXP_KIND_SYMBOL,           // char*
+  SEXP_KIND_STRINGS,          // char**, NULL terminated, from a list of strings
+  SEXP_KIND_RECORD,           // struct member decoded with another schema
+  SEXP_KIND_VALUE,            // sexp_t*, whatever the value is
+} sexp_field_kind_t;
+
+typedef struct sexp_schema_t sexp_schema_t;
+
+typedef struct sexp_field_t {
+  const char* keyword;
+  sexp_field_kind_t kind;
+  size_t offset;
+  sexp_schema_t *schema;      // SEXP_KIND_RECORD only
+} sexp_field_t;
+
+struct sexp_schema_t {
+  const char* head;           // symbol the record starts with, NULL for none
+  size_t size;
+  sexp_field_t *fields;
+  int nfields;                // at most 64
+
+  // keyword lookup, filled in on first use
+  int prepared;
+  unsigned seed;
+  unsigned mask;              // 0 if no perfect hash was found
+  unsigned char slots[256];   // field index + 1
+};
+
+#define SEXP_FIELD_KEY(keyword, type, member, kind) \
+  { keyword, kind, offsetof(type, member), NULL }
+#define SEXP_FIELD(type, member, kind) \
+  SEXP_FIELD_KEY(#member ":", type, member, kind)
+#define SEXP_FIELD_RECORD(type, member, schema) \
+  { #member ":", SEXP_KIND_RECORD, offsetof(type, member), &schema }
+
+#define SEXP_SCHEMA(name, type, keyword, ...) \
+  static sexp_field_t name##_fields[] = { __VA_ARGS__ }; \
+  sexp_schema_t name = { .head = keyword, .size = sizeof(type), \
+    .fields = name##_fields, \
+    .nfields = (int)(sizeof(name##_fields) / sizeof(sexp_field_t)) }
+
+// builds the keyword lookup of schema and the schemas it uses. happens on
+// first use otherwise, call this before sharing a schema between threads.
+void sexp_schema_prepare(sexp_schema_t *schema);
+
+// decodes the record at the start of src into obj and sets end past it.
+// returns 1 on success, 0 at the end of the input and -1 on malformed input
+// or values of the wrong kind, obj is left zeroed then.
+int sexp_schema_read(sexp_schema_t *schema, const char* src, char** end, void *obj);
+
+// frees the strings, arrays and values that decoding allocated in obj
+void sexp_schema_release(sexp_schema_t *schema, void *obj);
+
+// Columnar decoding of many records of one shape, like
+//   (sample ts: 1 cpu: 0.5 host: "a") (sample ts: 2 cpu: 0.7 host: "b") ...
+// into one contiguous array per keyword, without building nodes. The shape
+// is given as a list of columns or detected from the first record. The
+// records can also be the elements of one enclosing list.
+typedef enum sexp_column_kind_t {
+  SEXP_COLUMN_DOUBLE,
+  SEXP_COLUMN_INT64,          // numbers without fraction
+  SEXP_COLUMN_STRING,         // unescaped strings or the text of symbols
+} sexp_column_kind_t;
+
+typedef struct sexp_table_column_t {
+  const char* keyword;        // with the colon, like "cpu:"
+  sexp_column_kind_t kind;
+
+  // one entry per row, filled in by sexp_table_read
+  double *f64;                // NaN for missing values
+  int64_t *i64;
+  size_t *offsets;            // row i is text[offsets[i], offsets[i+1])
+  char* text;
+  unsigned char *valid;       // 0 where the record didn't have the keyword
+  size_t textcap;
+} sexp_table_column_t;
+
+typedef struct sexp_table_t {
+  const char* head;           // symbol the records start with, NULL for none
+  sexp_table_column_t *columns;
+  int ncolumns;               // at most 64
+  size_t nrows;
+
+  // internal
+  size_t cap;
+  int detected;               // columns belong to the table, may be widened
+  sexp_field_t fields[64];
+  sexp_schema_t lookup;
+} sexp_table_t;
+
+// sets up t for decoding into the given columns
+void sexp_table_init(sexp_table_t *t, const char* head,
+    sexp_table_column_t *columns, int ncolumns);
+// sets up t with the columns of the first record in src. numbers give
+// int64 columns if they have no fraction, those are widened to doubles
+// when a later record has one. values that are lists are skipped. returns
+// 0 if src doesn't start with a record or out of memory.
+int sexp_table_detect(sexp_table_t *t, const char* src);
+// appends the rows of all records in src and sets end past the last one.
+// returns the number of rows read, -1 on malformed records or values of the
+// wrong kind. rows before the bad record are kept.
+long sexp_table_read(sexp_table_t *t, const char* src, char** end);
+// frees the rows, and the columns if they were detected
+void sexp_table_release(sexp_table_t *t);
+
+#endif
@@ -1,8 +1,21 @@
 #include "minunit.h"
 
 #include "sexp.h"
+#include "sexp_query.h"
+#include "sexp_schema.h"
+#include "sexp_diff.h"
+#include "sexp_eval.h"
+#include "sexp_pipeline.h"
+#include "sexp_corpus.h"
+#include "sexp_parallel.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 MU_TEST(test_string) {
   mu_check(!sexp_is_string(NULL));
@@ -78,6 +91,118 @@ MU_TEST(test_list) {
   sexp_free(l);
 }
 
+MU_TEST(test_list_shared_append) {
+  sexp_t *a = sexp_new_list();
+  a = sexp_list_append(a, sexp_new_number(1));
+  sexp_t *b = sexp_list_append(sexp_ref(a), sexp_new_number(2));
+  mu_check(a != b);
+  mu_check(sexp_list_length(a) == 1);
+  mu_check(sexp_list_length(b) == 2);
+  mu_check(sexp_list_nth(a, 0) == sexp_list_nth(b, 0));
+  sexp_free(a);
+  mu_check(sexp_number_get(sexp_list_nth(b, 0)) == 1);
+  sexp_free(b);
+}
+
+MU_TEST(test_list_persistent) {
+  sexp_t *base = sexp_new_list();
+  for (int i = 0; i < 5; ++i) {
+    base = sexp_list_append(base, sexp_new_number(i));
+  }
+
+  // appends and inserts on versions fill up leaves instead of adding tiny ones
+  sexp_t *v = sexp_list_set(base, 0, sexp_new_number(0));
+  for (int i = 0; i < 1000; ++i) v = sexp_list_append(v, sexp_new_number(i));
+  for (int i = 0; i < 100; ++i) {
+    sexp_t *next = sexp_list_insert(v, 500, sexp_new_number(i));
+    sexp_free(v);
+    v = next;
+  }
+  mu_check(sexp_list_length(v) == 1105);
+  mu_check(sexp_number_get(sexp_list_nth(v, 500)) == 99);
+  mu_check(sexp_number_get(sexp_list_nth(v, 1104)) == 999);
+  // the numbers, the list and the leaves and nodes of the rope
+  mu_check(sexp_memory_usage(v).blocks < 1105 + 1 + 1105 / 12);
+  sexp_free(v);
+
+  sexp_memory_t before = sexp_memory_usage(base);
+  sexp_t *e = sexp_list_set(base, 2, sexp_new_symbol("x"));
+  // the flat input isn't converted
+  mu_check(sexp_memory_usage(base).blocks == before.blocks);
+  mu_check(sexp_list_length(e) == 5);
+  mu_check(sexp_symbol_eq(sexp_list_nth(e, 2), "x"));
+  mu_check(sexp_number_get(sexp_list_nth(base, 2)) == 2);
+  mu_check(sexp_list_nth(e, 3) == sexp_list_nth(base, 3));
+  sexp_free(e);
+
+  e = sexp_list_insert(base, 0, sexp_new_number(-1));
+  mu_check(sexp_list_length(e) == 6);
+  mu_check(sexp_number_get(sexp_list_nth(e, 0)) == -1);
+  mu_check(sexp_number_get(sexp_list_nth(e, 5)) == 4);
+  sexp_free(e);
+
+  e = sexp_list_remove(base, 4);
+  mu_check(sexp_list_length(e) == 4);
+  mu_check(sexp_number_get(sexp_list_nth(e, 3)) == 3);
+  sexp_free(e);
+
+  e = sexp_list_slice(base, 1, 3);
+  mu_check(sexp_list_length(e) == 2);
+  mu_check(sexp_number_get(sexp_list_nth(e, 0)) == 1);
+  mu_check(sexp_number_get(sexp_list_nth(e, 1)) == 2);
+  sexp_t *c = sexp_list_concat(e, base);
+  sexp_free(e);
+  mu_check(sexp_list_length(c) == 7);
+  mu_check(sexp_number_get(sexp_list_nth(c, 1)) == 2);
+  mu_check(sexp_number_get(sexp_list_nth(c, 2)) == 0);
+  c = sexp_list_append(c, sexp_new_number(5));
+  mu_check(sexp_number_get(sexp_list_nth(c, 7)) == 5);
+  sexp_free(c);
+
+  mu_check(sexp_list_length(base) == 5);
+  for (int i = 0; i < 5; ++i) {
+    mu_check(sexp_number_get(sexp_list_nth(base, i)) == i);
+  }
+  sexp_free(base);
+}
+
+MU_TEST(test_list_persistent_large) {
+  enum { N = 2000 };
+  double ref[N + 1];
+  sexp_t *e = sexp_new_list();
+  for (int i = 0; i < N; ++i) {
+    e = sexp_list_append(e, sexp_new_number(i));
+    ref[i] = i;
+  }
+  int len = N;
+  unsigned seed = 1;
+  for (int step = 0; step < 3000; ++step) {
+    seed = seed * 1103515245 + 12345;
+    int n = (seed >> 8) % len;
+    sexp_t *next;
+    if (step % 3 == 0) {
+      next = sexp_list_set(e, n, sexp_new_number(-step));
+      ref[n] = -step;
+    } else if (step % 3 == 1) {
+      next = sexp_list_remove(e, n);
+      memmove(&ref[n], &ref[n+1], sizeof(double) * (len - n - 1));
+      len -= 1;
+    } else {
+      next = sexp_list_insert(e, n, sexp_new_number(step));
+      memmove(&ref[n+1], &ref[n], sizeof(double) * (len - n));
+      ref[n] = step;
+      len += 1;
+    }
+    sexp_free(e);
+    e = next;
+  }
+  mu_check(sexp_list_length(e) == len);
+  for (int i = 0; i < len; ++i) {
+    mu_check(sexp_number_get(sexp_list_nth(e, i)) == ref[i]);
+  }
+  sexp_free(e);
+}
+
 MU_TEST_SUITE(test_sexp_types) {
   MU_RUN_TEST(test_string);
   MU_RUN_TEST(test_string2);
@@ -85,6 +210,9 @@ MU_TEST_SUITE(test_sexp_types) {
   MU_RUN_TEST(test_symbol2);
   MU_RUN_TEST(test_number);
   MU_RUN_TEST(test_list);
+  MU_RUN_TEST(test_list_shared_append);
+  MU_RUN_TEST(test_list_persistent);
+  MU_RUN_TEST(test_list_persistent_large);
 }
 
 MU_TEST(test_read_string) {
@@ -128,6 +256,107 @@ MU_TEST(test_read_string) {
   sexp_free(e);
 }
 
+MU_TEST(test_read_string_escapes) {
+  sexp_t *e;
+
+  e = sexp_read("\"\\x41\\101\\e\\\\\\'\\?\"", NULL);
+  mu_check(sexp_is_string(e));
+  mu_assert_string_eq("AA\x1b\\'?", sexp_string_get(e));
+  sexp_free(e);
+
+  e = sexp_read("\"a\\0b\\012\"", NULL);
+  mu_check(sexp_string_length(e) == 4);
+  mu_check(memcmp(sexp_string_get(e), "a\0b\n", 4) == 0);
+  sexp_free(e);
+
+  e = sexp_read("\"caf\\u00e9 \\U0001F600\"", NULL);
+  mu_assert_string_eq("caf\xc3\xa9 \xf0\x9f\x98\x80", sexp_string_get(e));
+  sexp_free(e);
+
+  mu_check(sexp_read("\"\\q\"", NULL) == NULL);
+  mu_check(sexp_read("\"\\x4\"", NULL) == NULL);
+  mu_check(sexp_read("\"\\777\"", NULL) == NULL);
+  mu_check(sexp_read("\"\\ud800\"", NULL) == NULL);
+  mu_check(sexp_read("\"\\U00110000\"", NULL) == NULL);
+  mu_check(sexp_read("(a \"\\q\" b)", NULL) == NULL);
+}
+
+MU_TEST(test_utf8_valid) {
+  size_t bad = 0;
+  mu_check(sexp_utf8_valid("", 0, &bad));
+  mu_check(sexp_utf8_valid("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", 14, &bad));
+  mu_check(!sexp_utf8_valid("ab\xc3", 3, &bad) && bad == 2);
+  mu_check(!sexp_utf8_valid("\xc0\x80", 2, &bad) && bad == 0);          // overlong
+  mu_check(!sexp_utf8_valid("\xed\xa0\x80", 3, &bad) && bad == 0);      // surrogate
+  mu_check(!sexp_utf8_valid("\xf4\x90\x80\x80", 4, &bad) && bad == 0);  // > U+10FFFF
+  mu_check(!sexp_utf8_valid("\x80", 1, &bad) && bad == 0);
+
+  char buf[100];
+  memset(buf, 'a', sizeof(buf));
+  buf[70] = '\xff';
+  mu_check(!sexp_utf8_valid(buf, sizeof(buf), &bad) && bad == 70);
+  buf[70] = 'a';
+  mu_check(sexp_utf8_valid(buf, sizeof(buf), &bad));
+}
+
+MU_TEST(test_read_errors) {
+  sexp_error_t err;
+  sexp_read_opts_t opts = {0};
+  opts.validate_utf8 = 1;
+  opts.error = &err;
+  sexp_t *e;
+
+  e = sexp_read_opts("(a \"caf\xc3\xa9\" b\xc3\xa9)", NULL, &opts);
+  mu_check(sexp_is_list(e));
+  mu_check(err.code == SEXP_ERR_NONE);
+  sexp_free(e);
+
+  mu_check(sexp_read_opts("(a \"ok\" \"b\xffz\")", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_UTF8);
+  mu_check(err.offset == 10);
+
+  mu_check(sexp_read_opts("(a sym\xc3)", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_UTF8);
+  mu_check(err.offset == 6);
+
+  // escaped bytes are checked after unescaping
+  mu_check(sexp_read_opts("(a \"\\xff\\xfe\")", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_UTF8);
+  mu_check(err.offset == 3);
+  e = sexp_read_opts("(a \"\\xc3\\xa9\\u00e9\")", NULL, &opts);
+  mu_check(sexp_is_list(e));
+  mu_check(err.code == SEXP_ERR_NONE);
+  sexp_free(e);
+
+  mu_check(sexp_read_opts("(a \"\\q\")", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_ESCAPE);
+  mu_check(err.offset == 3);
+
+  mu_check(sexp_read_opts("(a \"open", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_SYNTAX);
+  mu_check(err.offset == 3);
+
+  mu_check(sexp_read_opts("(a \"open\\", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_SYNTAX);
+  mu_check(err.offset == 3);
+
+  mu_check(sexp_read_opts("  ", NULL, &opts) == NULL);
+  mu_check(err.code == SEXP_ERR_NONE);
+
+  // raw bytes are printed as escapes, so the text is valid UTF-8 and reads
+  // back, but not with validation, the string still isn't UTF-8
+  e = sexp_new_string_len("\xff\xc3\xa9\xc3", 4);
+  char* buf = sexp_display(e);
+  mu_assert_string_eq("\"\\xff\xc3\xa9\\xc3\"", buf);
+  mu_check(sexp_utf8_valid(buf, strlen(buf), NULL));
+  mu_check(sexp_read_opts(buf, NULL, &opts) == NULL);
+  sexp_t *back = sexp_read(buf, NULL);
+  mu_check(sexp_equal(e, back));
+  free(buf);
+  sexp_free(back);
+  sexp_free(e);
+}
+
 MU_TEST(test_read_symbol) {
   sexp_t *e;
 
@@ -192,6 +421,18 @@ MU_TEST(test_read_list) {
   e = sexp_read("( 123", NULL);
   mu_check(e == NULL);
 
+  const char* ref = "(1) (2)";
+  char* end;
+  e = sexp_read(ref, &end);
+  mu_check(sexp_is_list(e));
+  mu_check(end - ref == 3);
+  sexp_free(e);
+  e = sexp_read(end, &end);
+  mu_check(sexp_is_list(e));
+  mu_check(sexp_number_get(sexp_list_nth(e, 0)) == 2);
+  mu_check(*end == '\0');
+  sexp_free(e);
+
   e = sexp_read("( 123 asdf \"asdf fdsa\" (321))", NULL);
   mu_check(sexp_is_list(e));
   mu_check(sexp_list_length(e) == 4);
@@ -218,12 +459,286 @@ MU_TEST(test_read_comment) {
   sexp_free(e);
 }
 
+static sexp_t *read_with(const char* src, const sexp_readtable_t *t, char** end) {
+  sexp_read_opts_t opts = {0};
+  opts.readtable = t;
+  return sexp_read_opts(src, end, &opts);
+}
+
+static int reads_as(const char* src, const sexp_readtable_t *t, const char* expected) {
+  sexp_t *e = read_with(src, t, NULL);
+  char* str = e ? sexp_display(e) : NULL;
+  int ok = str != NULL && strcmp(str, expected) == 0;
+  free(str);
+  sexp_free(e);
+  return ok;
+}
+
+// $name reads as (env name)
+static sexp_t *macro_env(sexp_reader_t *r, char ch, void *ctx) {
+  sexp_t *name = sexp_reader_read(r);
+  if (!sexp_is_symbol(name)) {
+    sexp_free(name);
+    sexp_reader_fail(r);
+    return NULL;
+  }
+  sexp_t *list = sexp_list_append(sexp_new_list(), sexp_new_symbol(ctx));
+  return sexp_list_append(list, name);
+}
+
+MU_TEST(test_read_macros) {
+  sexp_readtable_t *t = sexp_readtable_new();
+
+  mu_check(reads_as("'a", t, "(quote a)"));
+  mu_check(reads_as("(a 'b `(c ,d ,@e))", t,
+      "(a (quote b) (quasiquote (c (unquote d) (unquote-splicing e))))"));
+  mu_check(reads_as("''(1)", t, "(quote (quote (1)))"));
+  mu_check(reads_as("(#t #f #true #false)", t, "(#t #f #t #f)"));
+  mu_check(reads_as("(a #;b c #; (d e) f #;g)", t, "(a c f)"));
+  mu_check(reads_as("(a #| b ( #| c |# \" |# d)", t, "(a d)"));
+  mu_check(reads_as("#;x #| y |# z", t, "z"));
+  mu_check(reads_as("(a#b #hash don't)", t, "(a#b #hash don (quote t))"));
+
+  // without a readtable nothing changes
+  mu_check(reads_as("(a 'b #t #|c|#)", NULL, "(a 'b #t #|c|#)"));
+
+  // the end is right after the value
+  char* end;
+  sexp_t *e = read_with("'x 'y", t, &end);
+  mu_check(strcmp(end, " 'y") == 0);
+  sexp_free(e);
+  mu_check(read_with("#;x #| y |#  ", t, &end) == NULL);
+
+  sexp_error_t err;
+  sexp_read_opts_t opts = {0};
+  opts.readtable = t;
+  opts.error = &err;
+  const char* bad[] = { "(a ')", "'", "(#| a b)", "#tru", "(a #;)", "(a ,@)" };
+  size_t offsets[] = { 3, 0, 1, 0, 3, 3 };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    mu_check(sexp_read_opts(bad[i], NULL, &opts) == NULL);
+    mu_check(err.code == SEXP_ERR_SYNTAX);
+    mu_check(err.offset == offsets[i]);
+  }
+
+  // user macros
+  sexp_readtable_set(t, '$', macro_env, "env");
+  sexp_readtable_dispatch(t, 'q', sexp_macro_quote, NULL);
+  mu_check(reads_as("(cc $CC #q(x) a$b)", t, "(cc (env CC) (quote (x)) a (env b))"));
+  mu_check(read_with("($\"x\")", t, NULL) == NULL);
+  sexp_readtable_set(t, '$', NULL, NULL);
+  mu_check(reads_as("$CC", t, "$CC"));
+
+  // reserved characters are refused
+  const char* reserved = "()[]{}\";# \t\n";
+  for (const char* c = reserved; *c; ++c) {
+    mu_check(!sexp_readtable_set(t, *c, macro_env, "env"));
+  }
+  mu_check(!sexp_readtable_dispatch(t, '\0', sexp_macro_quote, NULL));
+  mu_check(sexp_readtable_set(t, '!', NULL, NULL));
+  mu_check(reads_as("(a \"b\" #t 'c)", t, "(a \"b\" #t (quote c))"));
+
+  sexp_readtable_free(t);
+}
+
+MU_TEST(test_cursor) {
+  const char* src =
+    "; tenants\n"
+    "(tenant name: \"a\" (limits (cpu 2) \")(\" [mem {4}]) ; ) \n"
+    "        weight: 1.5 tags: (x y))\n"
+    "(tenant name: \"b\")";
+  sexp_cursor_t c = sexp_cursor_begin(src);
+  mu_check(sexp_cursor_ok(c));
+  mu_check(sexp_cursor_is_list(c));
+  mu_check(sexp_cursor_length(c) == 8);
+  mu_check(sexp_cursor_symbol_eq(sexp_cursor_nth(c, 0), "tenant"));
+  mu_check(!sexp_cursor_symbol_eq(sexp_cursor_nth(c, 0), "ten"));
+  mu_check(sexp_cursor_is_string(sexp_cursor_get(c, "name:")));
+
+  sexp_cursor_t w = sexp_cursor_get(c, "weight:");
+  mu_check(sexp_cursor_is_number(w));
+  mu_check(sexp_cursor_number(w) == 1.5);
+  double missing = sexp_cursor_number(
+    sexp_cursor_get(sexp_cursor_begin("(x a: 1)"), "weight:"));
+  mu_check(missing != missing);
+  double str = sexp_cursor_number(sexp_cursor_get(c, "name:"));
+  mu_check(str != str);
+
+  sexp_t *tags = sexp_cursor_read(sexp_cursor_get(c, "tags:"));
+  mu_check(sexp_is_list(tags));
+  mu_check(sexp_list_length(tags) == 2);
+  sexp_free(tags);
+
+  mu_check(!sexp_cursor_ok(sexp_cursor_get(c, "missing:")));
+  mu_check(!sexp_cursor_ok(sexp_cursor_nth(c, 8)));
+
+  c = sexp_cursor_next(c);
+  mu_check(sexp_cursor_is_list(c));
+  sexp_t *name = sexp_cursor_read(sexp_cursor_get(c, "name:"));
+  mu_check(strcmp(sexp_string_get(name), "b") == 0);
+  sexp_free(name);
+  mu_check(!sexp_cursor_ok(sexp_cursor_next(c)));
+
+  c = sexp_cursor_begin("(a \"unterminated)");
+  mu_check(!sexp_cursor_ok(sexp_cursor_next(c)));
+  mu_check(sexp_cursor_end(c) == NULL);
+}
+
+// reads all values from src with and without the index and compares them
+static int indexed_matches_plain(const char* src) {
+  sexp_read_opts_t opts = {0};
+  opts.index = sexp_index_new(src, strlen(src));
+  const char* a = src;
+  const char* b = src;
+  int ok = 1;
+  while (ok) {
+    char *enda, *endb;
+    sexp_t *ea = sexp_read(a, &enda);
+    sexp_t *eb = sexp_read_opts(b, &endb, &opts);
+    ok = sexp_equal(ea, eb) && (ea == NULL || enda == endb);
+    sexp_free(ea);
+    sexp_free(eb);
+    if (ea == NULL) break;
+    a = enda;
+    b = endb;
+  }
+  sexp_index_free((sexp_index_t*)opts.index);
+  return ok;
+}
+
+MU_TEST(test_read_indexed) {
+  mu_check(indexed_matches_plain("( 123 asdf \"asdf fdsa\" (321))"));
+  mu_check(indexed_matches_plain("(1 ;asdf 2\n3) [a]{b} \"x\\\"y\" z"));
+  mu_check(indexed_matches_plain("a;b\nc\"d\"e(f)"));
+  mu_check(indexed_matches_plain("(a \"unterminated\n b)"));
+  mu_check(indexed_matches_plain("(a \"unterminated"));
+  mu_check(indexed_matches_plain("(target name: \"t1\"\n"
+                                 "  sources: (\"source1.c\" \"source2.c\")\n"
+                                 "  flags: (\"-flag1\" \"-flag2\"))\n"
+                                 "(log level: 3 \"text \\t with \\n escapes\")"));
+
+  const char alphabet[] = "()[]{}\"\\\\\\; \n\tab12:.";
+  char buf[400];
+  unsigned seed = 7;
+  for (int round = 0; round < 2000; ++round) {
+    seed = seed * 1103515245 + 12345;
+    size_t len = (seed >> 8) % (sizeof(buf) - 2);
+    for (size_t i = 0; i < len; ++i) {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = alphabet[(seed >> 8) % (sizeof(alphabet) - 1)];
+    }
+    buf[len] = ' ';
+    buf[len+1] = '\0';
+    mu_assert(indexed_matches_plain(buf), buf);
+  }
+}
+
+// a tmpfile holding text, positioned at its start
+static FILE *pipeline_input(const char* text) {
+  FILE *f = tmpfile();
+  fwrite(text, 1, strlen(text), f);
+  fflush(f);
+  lseek(fileno(f), 0, SEEK_SET);
+  return f;
+}
+
+MU_TEST(test_pipeline) {
+  // forms of all kinds, with delimiters in strings and comments
+  size_t cap = 1 << 18, len = 0;
+  char* text = malloc(cap);
+  for (int i = 0; len < cap - 200; ++i) {
+    switch (i % 6) {
+      case 0: len += sprintf(text + len, "(sample ts: %d cpu: 0.%d)\n", i, i % 10); break;
+      case 1: len += sprintf(text + len, "atom%d ", i); break;
+      case 2: len += sprintf(text + len, "\"str ) \\\" ( %d\"", i); break;
+      case 3: len += sprintf(text + len, "; comment ( \" %d\n", i); break;
+      case 4: len += sprintf(text + len, "[a {b (c \"]\")} ; )\n d]"); break;
+      case 5: len += sprintf(text + len, "%d", i); break;
+    }
+  }
+  text[len] = '\0';
+
+  size_t chunks[] = { 1, 7, 4096, 0 };
+  size_t budgets[] = { 1, 100, 0 };
+  for (int k = 0; k < 4; ++k) {
+    for (int j = 0; j < 3; ++j) {
+      if (chunks[k] == 1 && budgets[j] != 1) continue;
+      FILE *f = pipeline_input(k == 0 ? "(a \"b)\" c) d (e) 12" : text);
+      sexp_pipeline_opts_t opts = { .chunk = chunks[k], .budget = budgets[j] };
+      sexp_pipeline_t *pl = sexp_pipeline_new(fileno(f), &opts);
+      mu_check(pl != NULL);
+      char* pos = k == 0 ? "(a \"b)\" c) d (e) 12" : text;
+      size_t count = 0;
+      for (;;) {
+        sexp_t *expected = sexp_read(pos, &pos);
+        sexp_t *e = sexp_pipeline_next(pl);
+        if (!sexp_equal(e, expected)) {
+          mu_fail("pipeline and reader disagree");
+        }
+        sexp_free(expected);
+        if (e == NULL) break;
+        sexp_free(e);
+        count += 1;
+      }
+      mu_check(count > (k == 0 ? 3 : 5000));
+      mu_check(sexp_pipeline_next(pl) == NULL);
+      mu_check(sexp_pipeline_free(pl));
+      fclose(f);
+    }
+  }
+
+  // stopping early frees what the stages built ahead
+  FILE *f = pipeline_input(text);
+  sexp_pipeline_t *pl = sexp_pipeline_new(fileno(f), NULL);
+  sexp_free(sexp_pipeline_next(pl));
+  mu_check(sexp_pipeline_free(pl));
+  fclose(f);
+  free(text);
+
+  // forms before an error are still delivered
+  sexp_error_t err;
+  sexp_pipeline_opts_t opts = { .chunk = 3, .error = &err };
+  f = pipeline_input("(a) b (c ; x\n");
+  pl = sexp_pipeline_new(fileno(f), &opts);
+  sexp_t *e = sexp_pipeline_next(pl);
+  mu_check(sexp_is_list(e));
+  sexp_free(e);
+  e = sexp_pipeline_next(pl);
+  mu_check(sexp_is_symbol(e));
+  sexp_free(e);
+  mu_check(sexp_pipeline_next(pl) == NULL);
+  mu_check(!sexp_pipeline_free(pl));
+  mu_check(err.code == SEXP_ERR_SYNTAX);
+  mu_check(err.offset >= 6);
+  fclose(f);
+
+  f = pipeline_input("(a) ) (b)");
+  pl = sexp_pipeline_new(fileno(f), &opts);
+  sexp_free(sexp_pipeline_next(pl));
+  mu_check(sexp_pipeline_next(pl) == NULL);
+  mu_check(!sexp_pipeline_free(pl));
+  mu_check(err.code == SEXP_ERR_SYNTAX && err.offset >= 4);
+  fclose(f);
+
+  pl = sexp_pipeline_new(-1, &opts);
+  mu_check(sexp_pipeline_next(pl) == NULL);
+  mu_check(!sexp_pipeline_free(pl));
+  mu_check(err.code == SEXP_ERR_IO);
+}
+
 MU_TEST_SUITE(test_sexp_read) {
   MU_RUN_TEST(test_read_string);
+  MU_RUN_TEST(test_read_string_escapes);
+  MU_RUN_TEST(test_utf8_valid);
+  MU_RUN_TEST(test_read_errors);
   MU_RUN_TEST(test_read_symbol);
   MU_RUN_TEST(test_read_number);
   MU_RUN_TEST(test_read_list);
   MU_RUN_TEST(test_read_comment);
+  MU_RUN_TEST(test_read_macros);
+  MU_RUN_TEST(test_cursor);
+  MU_RUN_TEST(test_read_indexed);
+  MU_RUN_TEST(test_pipeline);
 }
 
 
@@ -242,6 +757,17 @@ MU_TEST(test_sexp_print_number) {
   mu_check(strcmp(buf, "-1") == 0);
   free(buf);
   sexp_free(e);
+
+  // as few digits as needed to read back the same number
+  double vals[] = { 0.1, 1.0 / 3, 0.1 + 0.2, 1e300, -2.5e-310, 123456789012345678.0 };
+  for (int i = 0; i < 6; ++i) {
+    e = sexp_new_number(vals[i]);
+    buf = sexp_display(e);
+    mu_check(strtod(buf, NULL) == vals[i]);
+    if (i == 0) mu_check(strcmp(buf, "0.1") == 0);
+    free(buf);
+    sexp_free(e);
+  }
 }
 
 MU_TEST(test_sexp_print_symbol) {
@@ -272,6 +798,29 @@ MU_TEST(test_sexp_print_string) {
   sexp_free(e);
 }
 
+MU_TEST(test_sexp_print_string_escapes) {
+  sexp_t *e;
+  char* buf;
+
+  e = sexp_new_string_len("\x1b\x01\\\0" "1\x7f", 6);
+  buf = sexp_display(e);
+  mu_assert_string_eq("\"\\e\\x01\\\\\\x001\\x7f\"", buf);
+  free(buf);
+  sexp_free(e);
+
+  // every byte survives a round trip, also past the initial printer size
+  char all[255 * 2];
+  for (int i = 0; i < 255 * 2; ++i) all[i] = (char)(i % 255 + 1);
+  all[100] = '\0';
+  e = sexp_new_string_len(all, sizeof(all));
+  buf = sexp_display(e);
+  sexp_t *back = sexp_read(buf, NULL);
+  mu_check(sexp_equal(e, back));
+  free(buf);
+  sexp_free(back);
+  sexp_free(e);
+}
+
 MU_TEST(test_sexp_print_list) {
   sexp_t *e;
   char* buf;
@@ -316,17 +865,1633 @@ MU_TEST(test_sexp_print_list) {
   sexp_free(e);
 }
 
+MU_TEST(test_writer) {
+  sexp_writer_t *w = sexp_writer_new_buffer();
+  sexp_writer_begin_list(w);
+  sexp_writer_symbol(w, "target");
+  sexp_writer_symbol(w, "name:");
+  sexp_writer_string(w, "t\t1");
+  sexp_writer_begin_list(w);
+  sexp_writer_end_list(w);
+  sexp_writer_number(w, -1.5);
+  sexp_t *e = sexp_read("(a \"b\")", NULL);
+  sexp_writer_value(w, e);
+  sexp_free(e);
+  sexp_writer_end_list(w);
+  sexp_writer_number(w, 2);
+  size_t len;
+  const char* text = sexp_writer_text(w, &len);
+  mu_assert_string_eq("(target name: \"t\\t1\" () -1.5 (a \"b\"))\n2\n", text);
+  mu_check(len == strlen(text));
+  mu_check(sexp_writer_free(w));
+
+  w = sexp_writer_new_buffer();
+  sexp_writer_end_list(w);
+  mu_check(!sexp_writer_free(w));
+  w = sexp_writer_new_buffer();
+  sexp_writer_begin_list(w);
+  mu_check(!sexp_writer_free(w));
+
+  // output larger than the writer's buffer goes through the fd in pieces
+  FILE *f = tmpfile();
+  w = sexp_writer_new_fd(fileno(f));
+  mu_check(sexp_writer_text(w, NULL) == NULL);
+  sexp_writer_begin_list(w);
+  for (int i = 0; i < 5000; ++i) sexp_writer_number(w, i);
+  sexp_writer_end_list(w);
+  mu_check(sexp_writer_free(w));
+  long size = lseek(fileno(f), 0, SEEK_END);
+  mu_check(size > 5000);
+  char* buf = malloc(size + 1);
+  lseek(fileno(f), 0, SEEK_SET);
+  mu_check(fread(buf, 1, size, f) == size);
+  buf[size] = '\0';
+  e = sexp_read(buf, NULL);
+  mu_check(sexp_list_length(e) == 5000);
+  mu_check(sexp_number_get(sexp_list_nth(e, 4999)) == 4999);
+  sexp_free(e);
+  free(buf);
+  fclose(f);
+}
+
+static char* iov_concat(sexp_iov_t *v) {
+  int count;
+  const struct iovec *iov = sexp_iov_get(v, &count);
+  char* buf = malloc(sexp_iov_length(v) + 1);
+  size_t len = 0;
+  for (int i = 0; i < count; ++i) {
+    memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+MU_TEST(test_display_iov) {
+  char big[300];
+  memset(big, 'a', sizeof(big));
+  big[150] = '\n';
+  sexp_t *e = sexp_new_list();
+  sexp_t *str = sexp_new_string_len(big, sizeof(big));
+  e = sexp_list_append(e, str);
+  e = sexp_list_append(e, sexp_new_symbol_len(big, 100));
+  e = sexp_list_append(e, sexp_new_number(1.5));
+  e = sexp_list_append(e, sexp_new_string("short\t"));
+  sexp_iov_t *v = sexp_display_iov(e);
+  char* ref = sexp_display(e);
+  char* buf = iov_concat(v);
+  mu_assert_string_eq(ref, buf);
+  mu_check(sexp_iov_length(v) == strlen(ref));
+  free(buf);
+
+  // both halves of the big string are referenced in place
+  int count, refs = 0;
+  const struct iovec *iov = sexp_iov_get(v, &count);
+  for (int i = 0; i < count; ++i) {
+    const char* base = iov[i].iov_base;
+    if (base == sexp_string_get(str) || base == sexp_string_get(str) + 151) refs += 1;
+  }
+  mu_check(refs == 2);
+  mu_check(count == 7);
+  sexp_iov_free(v);
+
+  // more segments than a single writev takes
+  for (int i = 0; i < 2000; ++i) e = sexp_list_append(e, sexp_ref(str));
+  v = sexp_display_iov(e);
+  FILE *f = tmpfile();
+  mu_check(sexp_iov_write(v, fileno(f)));
+  long size = lseek(fileno(f), 0, SEEK_CUR);
+  mu_check(size == sexp_iov_length(v));
+  buf = malloc(size + 1);
+  lseek(fileno(f), 0, SEEK_SET);
+  mu_check(fread(buf, 1, size, f) == size);
+  buf[size] = '\0';
+  free(ref);
+  ref = sexp_display(e);
+  mu_assert_string_eq(ref, buf);
+  free(buf);
+  free(ref);
+  fclose(f);
+  sexp_iov_free(v);
+  sexp_free(e);
+}
+
+static sexp_image_t *image_roundtrip(const sexp_t *e, uint64_t hash,
+    const sexp_codec_t *write_codec, const sexp_codec_t *read_codec) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/sexp_image_%d", (int)getpid());
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return NULL;
+  int ok = sexp_image_write(fd, e, hash, write_codec);
+  close(fd);
+  sexp_image_t *img = ok ? sexp_image_open(path, read_codec) : NULL;
+  unlink(path);
+  return img;
+}
+
+MU_TEST(test_image) {
+  const char* src = "(target name: \"t1\" weight: 2.5 sources: (\"a.c\" \"b.c\") () x)";
+  sexp_t *e = sexp_read(src, NULL);
+  uint64_t hash = sexp_source_hash(src, strlen(src));
+  mu_check(hash != sexp_source_hash(src, strlen(src) - 1));
+  sexp_hash(e);
+
+  for (int compressed = 0; compressed < 2; ++compressed) {
+    const sexp_codec_t *codec = compressed ? &sexp_codec_lz : NULL;
+    sexp_image_t *img = image_roundtrip(e, hash, codec, codec);
+    mu_check(img != NULL);
+    mu_check(sexp_image_source_hash(img) == hash);
+    sexp_view_t root = sexp_image_root(img);
+    mu_check(sexp_view_is_list(root));
+    mu_check(sexp_view_length(root) == 9);
+    mu_assert_string_eq("target", sexp_view_text(sexp_view_nth(root, 0)));
+    mu_assert_string_eq("t1", sexp_view_text(sexp_view_get(root, "name:")));
+    mu_check(sexp_view_is_string(sexp_view_get(root, "name:")));
+    mu_check(sexp_view_number(sexp_view_get(root, "weight:")) == 2.5);
+    sexp_view_t sources = sexp_view_get(root, "sources:");
+    mu_check(sexp_view_length(sources) == 2);
+    mu_assert_string_eq("b.c", sexp_view_text(sexp_view_nth(sources, 1)));
+    mu_check(sexp_view_length(sexp_view_nth(root, 7)) == 0);
+    mu_check(!sexp_view_ok(sexp_view_nth(root, 9)));
+    mu_check(!sexp_view_ok(sexp_view_get(root, "flags:")));
+    mu_check(!sexp_view_ok(sexp_view_nth(sexp_view_nth(root, 0), 0)));
+
+    sexp_t *loaded = sexp_view_load(root);
+    mu_check(sexp_equal(e, loaded));
+    mu_check(sexp_hash(loaded) == sexp_hash(e));
+    sexp_free(loaded);
+    sexp_image_close(img);
+  }
+
+  // compressed images need their codec
+  mu_check(image_roundtrip(e, hash, &sexp_codec_lz, NULL) == NULL);
+  sexp_free(e);
+
+  // a document large enough for several blocks
+  e = sexp_new_list();
+  for (int i = 0; i < 20000; ++i) {
+    sexp_t *item = sexp_new_list();
+    item = sexp_list_append(item, sexp_new_symbol("sample"));
+    item = sexp_list_append(item, sexp_new_symbol("ts:"));
+    item = sexp_list_append(item, sexp_new_number(i));
+    item = sexp_list_append(item, sexp_new_string(i % 3 ? "ok" : "degraded"));
+    e = sexp_list_append(e, item);
+  }
+  sexp_image_t *img = image_roundtrip(e, 0, &sexp_codec_lz, &sexp_codec_lz);
+  mu_check(img != NULL);
+  sexp_view_t root = sexp_image_root(img);
+  mu_check(sexp_view_length(root) == 20000);
+  mu_check(sexp_view_number(sexp_view_get(sexp_view_nth(root, 12345), "ts:")) == 12345);
+  sexp_t *loaded = sexp_view_load(root);
+  mu_check(sexp_equal(e, loaded));
+  sexp_free(loaded);
+  sexp_image_close(img);
+  sexp_free(e);
+
+  // files that aren't images
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/sexp_image_%d", (int)getpid());
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  mu_check(write(fd, src, strlen(src)) == strlen(src));
+  close(fd);
+  mu_check(sexp_image_open(path, NULL) == NULL);
+  unlink(path);
+  mu_check(sexp_image_open(path, NULL) == NULL);
+}
+
+MU_TEST(test_codec_lz) {
+  size_t len = 200000;
+  char* src = malloc(len);
+  srand(47);
+  for (size_t i = 0; i < len; ++i) {
+    // runs, repeats at all distances and noise
+    if (i < 1000) src[i] = 'a';
+    else if (i % 7000 < 3000) src[i] = rand();
+    else src[i] = src[i - 1 - rand() % (i < 70000 ? i / 2 : 70000)];
+  }
+  char* packed = malloc(sexp_codec_lz.bound(len));
+  char* out = malloc(len);
+  size_t sizes[] = { 0, 1, 4, 5, 17, 1000, 65536, len };
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+    size_t n = sizes[k];
+    size_t plen = sexp_codec_lz.compress(src, n, packed);
+    mu_check(plen <= sexp_codec_lz.bound(n));
+    mu_check(sexp_codec_lz.decompress(packed, plen, out, n));
+    mu_check(memcmp(src, out, n) == 0);
+    if (n > 0) mu_check(!sexp_codec_lz.decompress(packed, plen, out, n - 1));
+    if (plen > 1) mu_check(!sexp_codec_lz.decompress(packed, plen - 1, out, n));
+  }
+  mu_check(sexp_codec_lz.compress(src, 1000, packed) < 50);
+  free(src);
+  free(packed);
+  free(out);
+}
+
 MU_TEST_SUITE(test_sexp_print) {
   MU_RUN_TEST(test_sexp_print_number);
   MU_RUN_TEST(test_sexp_print_symbol);
   MU_RUN_TEST(test_sexp_print_string);
+  MU_RUN_TEST(test_sexp_print_string_escapes);
   MU_RUN_TEST(test_sexp_print_list);
+  MU_RUN_TEST(test_writer);
+  MU_RUN_TEST(test_display_iov);
+  MU_RUN_TEST(test_image);
+  MU_RUN_TEST(test_codec_lz);
+}
+
+MU_TEST(test_sexp_equal_atoms) {
+  sexp_t *a = sexp_new_string("asdf");
+  sexp_t *b = sexp_new_string("asdf");
+  sexp_t *c = sexp_new_symbol("asdf");
+  mu_check(sexp_equal(a, b));
+  mu_check(sexp_hash(a) == sexp_hash(b));
+  mu_check(!sexp_equal(a, c));
+  mu_check(!sexp_equal(a, NULL));
+  mu_check(sexp_equal(NULL, NULL));
+  sexp_free(a);
+  sexp_free(b);
+  sexp_free(c);
+
+  a = sexp_new_number(0.0);
+  b = sexp_new_number(-0.0);
+  mu_check(sexp_equal(a, b));
+  mu_check(sexp_hash(a) == sexp_hash(b));
+  sexp_free(a);
+  sexp_free(b);
+}
+
+MU_TEST(test_sexp_equal_lists) {
+  sexp_t *a = sexp_read("(target name: \"t1\" sources: (\"a.c\" \"b.c\"))", NULL);
+  sexp_t *b = sexp_read("(target name: \"t1\" sources: (\"a.c\" \"b.c\"))", NULL);
+  sexp_t *c = sexp_read("(target name: \"t1\" sources: (\"a.c\" \"c.c\"))", NULL);
+  mu_check(sexp_equal(a, b));
+  mu_check(sexp_hash(a) == sexp_hash(b));
+  mu_check(!sexp_equal(a, c));
+  mu_check(sexp_hash(a) != sexp_hash(c));
+
+  // cached hashes follow appends
+  size_t h = sexp_hash(a);
+  a = sexp_list_append(a, sexp_new_number(1));
+  mu_check(sexp_hash(a) != h);
+  mu_check(!sexp_equal(a, b));
+  b = sexp_list_append(b, sexp_new_number(1));
+  mu_check(sexp_equal(a, b));
+
+  // appending in place to a nested list leaves the outer hash stale
+  sexp_t *inner = sexp_list_append(sexp_new_list(), sexp_new_symbol("b"));
+  sexp_t *outer = sexp_list_append(sexp_new_list(), inner);
+  sexp_t *want = sexp_read("((b c))", NULL);
+  sexp_hash(outer);
+  mu_check(sexp_list_append(inner, sexp_new_symbol("c")) == inner);
+  mu_check(!sexp_equal(outer, want));
+  mu_check(sexp_rehash(outer) == sexp_hash(want));
+  mu_check(sexp_equal(outer, want));
+  sexp_free(outer);
+  sexp_free(want);
+
+  // and don't depend on the list representation
+  sexp_t *d = sexp_list_slice(b, 0, sexp_list_length(b));
+  mu_check(sexp_equal(a, d));
+  mu_check(sexp_hash(a) == sexp_hash(d));
+  sexp_free(a);
+  sexp_free(b);
+  sexp_free(c);
+  sexp_free(d);
+}
+
+static void *hash_thread(void *arg) {
+  return (void*)sexp_hash(arg);
+}
+
+MU_TEST(test_sexp_hash_threads) {
+  // threads hashing the same fresh tree agree, and run clean under tsan
+  sexp_t *a = sexp_read("(target name: \"t1\" sources: (\"a.c\" \"b.c\") n: 1)", NULL);
+  sexp_t *b = sexp_read("(target name: \"t1\" sources: (\"a.c\" \"b.c\") n: 1)", NULL);
+  pthread_t threads[4];
+  void *res[4];
+  for (int i = 0; i < 4; ++i) pthread_create(&threads[i], NULL, hash_thread, a);
+  for (int i = 0; i < 4; ++i) pthread_join(threads[i], &res[i]);
+  for (int i = 0; i < 4; ++i) mu_check((size_t)res[i] == sexp_hash(b));
+  sexp_free(a);
+  sexp_free(b);
+}
+
+MU_TEST(test_sexp_read_interned) {
+  sexp_read_opts_t opts = {0};
+  opts.intern = sexp_intern_new();
+  sexp_t *a = sexp_read_opts(
+      "(target flags: (\"-f1\" \"-f2\") deps: (\"-f1\" \"-f2\"))", NULL, &opts);
+  sexp_t *b = sexp_read_opts("(\"-f1\" \"-f2\")", NULL, &opts);
+  mu_check(sexp_is_list(a));
+  mu_check(sexp_list_nth(a, 2) == sexp_list_nth(a, 4));
+  mu_check(sexp_list_nth(a, 2) == b);
+  // target, flags:, deps:, "-f1", "-f2", the flags list and the whole form
+  mu_check(sexp_intern_size(opts.intern) == 7);
+
+  // appending to a shared list leaves the other users alone
+  b = sexp_list_append(b, sexp_new_number(1));
+  mu_check(sexp_list_length(b) == 3);
+  mu_check(sexp_list_length(sexp_list_nth(a, 2)) == 2);
+  sexp_free(b);
+
+  // interning doesn't change values, -0 stays apart from 0
+  b = sexp_read_opts("(0 -0 0 -0)", NULL, &opts);
+  char* text = sexp_display(b);
+  mu_assert_string_eq("(0 -0 0 -0)", text);
+  free(text);
+  mu_check(sexp_list_nth(b, 0) == sexp_list_nth(b, 2));
+  mu_check(sexp_list_nth(b, 1) == sexp_list_nth(b, 3));
+  mu_check(sexp_list_nth(b, 0) != sexp_list_nth(b, 1));
+  sexp_free(b);
+
+  sexp_intern_free(opts.intern);
+  mu_check(sexp_list_length(sexp_list_nth(a, 4)) == 2);
+  sexp_free(a);
+}
+
+MU_TEST(test_sexp_intern) {
+  sexp_intern_t *t = sexp_intern_new();
+  sexp_t *a = sexp_intern(t, sexp_read("(1 (2 3) x)", NULL));
+  sexp_t *b = sexp_intern(t, sexp_read("(1 (2 3) x)", NULL));
+  mu_check(a == b);
+  sexp_t *c = sexp_intern(t, sexp_read("(2 3)", NULL));
+  mu_check(c == sexp_list_nth(a, 1));
+  sexp_free(a);
+  sexp_free(b);
+  sexp_free(c);
+  sexp_intern_free(t);
+}
+
+MU_TEST(test_list_find) {
+  char name[16];
+  sexp_t *l = sexp_new_list();
+  for (int i = 0; i < 3000; ++i) {
+    snprintf(name, sizeof(name), "sym%d", i % 2000);
+    l = sexp_list_append(l, sexp_new_symbol(name));
+  }
+  l = sexp_list_append(l, sexp_new_number(NAN));
+  sexp_t *sym = sexp_new_symbol("sym1234");
+  sexp_t *missing = sexp_new_symbol("sym2000");
+  sexp_t *nan = sexp_new_number(NAN);
+
+  for (int indexed = 0; indexed < 2; ++indexed) {
+    if (indexed) mu_check(sexp_list_index(l));
+    mu_check(sexp_list_find(l, sym) == 1234);
+    mu_check(!sexp_list_contains(l, missing));
+    mu_check(sexp_list_find(l, nan) == 3000);
+  }
+
+  // appending keeps the index current
+  l = sexp_list_append(l, sexp_ref(missing));
+  mu_check(sexp_list_find(l, missing) == 3001);
+  sexp_t *shared = sexp_list_append(sexp_ref(l), sexp_new_number(1));
+  mu_check(shared != l);
+  mu_check(sexp_list_find(shared, nan) == 3000);
+  mu_check(sexp_list_contains(shared, sexp_list_nth(shared, 3002)));
+  mu_check(!sexp_list_contains(l, sexp_list_nth(shared, 3002)));
+
+  sexp_t *v = sexp_list_set(l, 1234, sexp_new_number(0));
+  mu_check(sexp_list_find(v, sym) == -1);
+  mu_check(sexp_list_index(v));
+  mu_check(sexp_list_find(v, missing) == 3001);
+  v = sexp_list_append(v, sexp_ref(sym));
+  mu_check(sexp_list_find(v, sym) == 3002);
+
+  sexp_t *empty = sexp_new_list();
+  mu_check(sexp_list_index(empty));
+  mu_check(sexp_list_find(empty, sym) == -1);
+  for (int i = 0; i < 100; ++i) empty = sexp_list_append(empty, sexp_new_number(i));
+  mu_check(sexp_list_find(empty, sexp_list_nth(empty, 99)) == 99);
+  sexp_free(empty);
+
+  // elements changed in place need a rebuild
+  sexp_t *outer = sexp_read("((a) (b))", NULL);
+  mu_check(sexp_list_index(outer));
+  sexp_t *inner = sexp_list_nth(outer, 0);
+  mu_check(sexp_list_append(inner, sexp_new_symbol("c")) == inner);
+  sexp_t *ac = sexp_read("(a c)", NULL);
+  sexp_rehash(outer);
+  mu_check(sexp_list_index(outer));
+  mu_check(sexp_list_find(outer, ac) == 0);
+  sexp_free(ac);
+  sexp_free(outer);
+  sexp_free(v);
+  sexp_free(shared);
+  sexp_free(l);
+  sexp_free(sym);
+  sexp_free(missing);
+  sexp_free(nan);
+}
+
+MU_TEST_SUITE(test_sexp_equality) {
+  MU_RUN_TEST(test_sexp_equal_atoms);
+  MU_RUN_TEST(test_sexp_equal_lists);
+  MU_RUN_TEST(test_sexp_hash_threads);
+  MU_RUN_TEST(test_sexp_read_interned);
+  MU_RUN_TEST(test_sexp_intern);
+  MU_RUN_TEST(test_list_find);
+}
+
+static const char* query_doc =
+  "(target name: \"t1\"\n"
+  "        sources: (\"source1.c\" \"source2.c\")\n"
+  "        flags: (\"-flag1\" \"-flag2\"))\n"
+  "(target name: \"target2\"\n"
+  "        sources: (\"source1.c\" \"t1\")\n"
+  "        (deps (target name: \"inner\" sources: (\"x.c\"))))\n"
+  "(log level: 3 \"text\")\n";
+
+typedef struct {
+  int n;
+  char buf[256];
+} matches_t;
+
+static int collect(const sexp_t *match, void *ctx) {
+  matches_t *m = ctx;
+  char* s = sexp_display((sexp_t*)match);
+  if (m->n++ > 0) strcat(m->buf, " ");
+  strcat(m->buf, s);
+  free(s);
+  return 1;
+}
+
+static const char* run_query(const char* path, int stream) {
+  static matches_t m;
+  memset(&m, 0, sizeof(m));
+  sexp_query_t *q = sexp_query_compile(path);
+  if (q == NULL) return "<invalid>";
+  if (stream) {
+    if (sexp_query_stream(q, query_doc, collect, &m) != m.n) strcpy(m.buf, "<count>");
+  } else {
+    sexp_t *doc = sexp_new_list();
+    const char* src = query_doc;
+    char* end;
+    sexp_t *e;
+    while ((e = sexp_read(src, &end)) != NULL) {
+      doc = sexp_list_append(doc, e);
+      src = end;
+    }
+    if (sexp_query_run(q, doc, collect, &m) != m.n) strcpy(m.buf, "<count>");
+    sexp_free(doc);
+  }
+  sexp_query_free(q);
+  return m.buf;
+}
+
+MU_TEST(test_query_compile) {
+  sexp_query_t *q;
+  mu_check((q = sexp_query_compile("target[name:=\"t1\"]/sources/*")) != NULL);
+  sexp_query_free(q);
+  mu_check((q = sexp_query_compile("**/log/2")) != NULL);
+  sexp_query_free(q);
+  mu_check(sexp_query_compile("target[name]") == NULL);
+  mu_check(sexp_query_compile("target/") == NULL);
+  mu_check(sexp_query_compile("a[b:=\"c]") == NULL);
+  // malformed preds after a parsed value, leak-free under asan
+  mu_check(sexp_query_compile("a[k:=1") == NULL);
+  mu_check(sexp_query_compile("a[k:=(x y)]") == NULL);
+  mu_check(sexp_query_compile("a[j:=2][k:=1 b") == NULL);
+}
+
+MU_TEST(test_query_run) {
+  for (int stream = 0; stream < 2; ++stream) {
+    mu_assert_string_eq("\"source1.c\" \"source2.c\"",
+        run_query("target[name:=\"t1\"]/sources/*", stream));
+    mu_assert_string_eq("(\"source1.c\" \"t1\")",
+        run_query("target[name:=\"target2\"]/sources:", stream));
+    mu_assert_string_eq("\"t1\" \"target2\" \"inner\"",
+        run_query("**/target/name", stream));
+    mu_assert_string_eq("3", run_query("log/level", stream));
+    mu_assert_string_eq("\"text\"", run_query("2/3", stream));
+    mu_assert_string_eq("(log level: 3 \"text\")", run_query("*[level:]", stream));
+    mu_assert_string_eq("", run_query("target[name:=t1]", stream));
+  }
+}
+
+MU_TEST(test_query_first) {
+  sexp_t *e = sexp_read("(a (b 1) (c 2) (b 3))", NULL);
+  sexp_query_t *q = sexp_query_compile("b/1");
+  sexp_t *m = sexp_query_first(q, e);
+  mu_check(sexp_is_number(m) && sexp_number_get(m) == 1);
+  sexp_query_free(q);
+  sexp_free(e);
+}
+
+MU_TEST_SUITE(test_sexp_query) {
+  MU_RUN_TEST(test_query_compile);
+  MU_RUN_TEST(test_query_run);
+  MU_RUN_TEST(test_query_first);
+}
+
+// allocator that fails once more than budget bytes are live
+typedef struct budget_t {
+  size_t live;
+  size_t budget;
+  long allocs;
+} budget_t;
+
+static void *budget_alloc(void *ctx, size_t size) {
+  budget_t *b = ctx;
+  if (b->live + size > b->budget) return NULL;
+  b->live += size;
+  b->allocs += 1;
+  return malloc(size);
+}
+
+static void *budget_realloc(void *ctx, void *p, size_t old, size_t size) {
+  budget_t *b = ctx;
+  if (b->live - old + size > b->budget) return NULL;
+  void *res = realloc(p, size);
+  if (res != NULL) b->live = b->live - old + size;
+  return res;
+}
+
+static void budget_free(void *ctx, void *p, size_t size) {
+  budget_t *b = ctx;
+  b->live -= size;
+  free(p);
+}
+
+static const char* budget_doc =
+  "(target name: \"t\\x31\" sources: (\"a.c\" \"b\\n.c\") (1 2 3) (1 2 3) -4.5)";
+
+MU_TEST(test_allocator) {
+  budget_t b = { 0, (size_t)-1, 0 };
+  sexp_allocator_t a = { budget_alloc, budget_realloc, budget_free, &b };
+  sexp_read_opts_t opts = {0};
+  opts.allocator = &a;
+
+  sexp_t *e = sexp_read_opts(budget_doc, NULL, &opts);
+  mu_check(sexp_is_list(e));
+  mu_check(b.live > 0);
+  mu_assert_string_eq("t1", sexp_string_get(sexp_list_nth(e, 2)));
+  sexp_t *plain = sexp_new_number(1);
+  long allocs = b.allocs;
+  sexp_free(plain);
+
+  mu_check(sexp_set_allocator(&a) == NULL);
+  sexp_t *f = sexp_list_insert(e, 1, sexp_new_symbol("x"));
+  sexp_intern_t *t = sexp_intern_new();
+  f = sexp_intern(t, f);
+  sexp_index_t *idx = sexp_index_new(budget_doc, strlen(budget_doc));
+  mu_check(sexp_set_allocator(NULL) == &a);
+  mu_check(b.allocs > allocs);
+
+  sexp_free(f);
+  sexp_intern_free(t);
+  sexp_index_free(idx);
+  sexp_free(e);
+  mu_check(b.live == 0);
+}
+
+MU_TEST(test_out_of_memory) {
+  sexp_t *ref = sexp_read(budget_doc, NULL);
+  sexp_error_t err;
+  budget_t b = { 0, 0, 0 };
+  sexp_allocator_t a = { budget_alloc, budget_realloc, budget_free, &b };
+  sexp_read_opts_t opts = {0};
+  opts.allocator = &a;
+  opts.error = &err;
+
+  int failed = 0, done = 0;
+  for (b.budget = 0; !done; b.budget += 8) {
+    sexp_set_allocator(&a);
+    opts.intern = sexp_intern_new();
+    opts.index = sexp_index_new(budget_doc, strlen(budget_doc));
+    sexp_set_allocator(NULL);
+    sexp_t *e = NULL;
+    if (opts.intern && opts.index) {
+      e = sexp_read_opts(budget_doc, NULL, &opts);
+      if (e == NULL) mu_check(err.code == SEXP_ERR_NOMEM);
+      else mu_check(sexp_equal(e, ref));
+      done = e != NULL;
+    }
+    failed += e == NULL;
+    sexp_free(e);
+    sexp_intern_free(opts.intern);
+    sexp_index_free((sexp_index_t*)opts.index);
+    mu_check(b.live == 0);
+  }
+  mu_check(failed > 10);
+
+  // persistent updates on a list large enough to need inner nodes
+  sexp_t *base = sexp_new_list();
+  for (int i = 0; i < 100; ++i) base = sexp_list_append(base, sexp_new_number(i));
+  sexp_free(sexp_list_slice(base, 0, 0)); // converts base outside the budget
+  sexp_set_allocator(&a);
+  for (int op = 0; op < 5; ++op) {
+    done = 0;
+    for (b.budget = 0; !done; b.budget += 16) {
+      sexp_t *e = NULL;
+      sexp_t *val = sexp_new_number(-1);
+      if (op == 0) e = sexp_list_set(base, 50, val);
+      else if (op == 1) e = sexp_list_insert(base, 40, val);
+      else if (op == 2) e = sexp_list_remove(base, 40);
+      else if (op == 3) e = sexp_list_concat(base, base);
+      else e = sexp_list_slice(base, 10, 90);
+      if (op >= 2) sexp_free(val);
+      if (e != NULL) {
+        size_t len[] = { 100, 101, 99, 200, 80 };
+        mu_check(sexp_list_length(e) == len[op]);
+        mu_check(sexp_number_get(sexp_list_nth(e, 41)) == (op == 1 ? 40 : op == 4 ? 51 : 41 + (op == 2)));
+        sexp_t *tmp = sexp_new_number(0);
+        sexp_t *grown = tmp ? sexp_list_append(e, tmp) : NULL;
+        if (grown == NULL) sexp_free(tmp);
+        else e = grown;
+        done = grown != NULL;
+      }
+      sexp_free(e);
+      mu_check(b.live == 0);
+    }
+  }
+  sexp_set_allocator(NULL);
+  mu_check(sexp_list_length(base) == 100);
+  for (int i = 0; i < 100; ++i) mu_check(sexp_number_get(sexp_list_nth(base, i)) == i);
+  sexp_free(base);
+  sexp_free(ref);
+}
+
+// reads src in all reader modes and frees the results
+static void read_all_modes(const char* src, const sexp_readtable_t *t) {
+  sexp_read_opts_t opts = {0};
+  char* pos = (char*)src;
+  sexp_t *e;
+  while ((e = sexp_read_opts(pos, &pos, &opts)) != NULL) sexp_free(e);
+
+  opts.readtable = t;
+  pos = (char*)src;
+  while ((e = sexp_read_opts(pos, &pos, &opts)) != NULL) sexp_free(e);
+
+  sexp_read_opts_t opts_idx = {0};
+  opts_idx.index = sexp_index_new(src, strlen(src));
+  opts_idx.intern = sexp_intern_new();
+  pos = (char*)src;
+  while ((e = sexp_read_opts(pos, &pos, &opts_idx)) != NULL) sexp_free(e);
+  sexp_index_free((sexp_index_t*)opts_idx.index);
+  sexp_intern_free(opts_idx.intern);
+
+  sexp_parser_t p;
+  sexp_parser_init(&p, src);
+  sexp_parser_next(&p);
+  while ((e = sexp_parser_read(&p)) != NULL) sexp_free(e);
+}
+
+MU_TEST(test_counting) {
+  sexp_counting_t c;
+  sexp_counting_init(&c, NULL);
+  sexp_set_allocator(&c.allocator);
+
+  sexp_t *e = sexp_read("(a \"b\" (1 2))", NULL);
+  sexp_alloc_stats_t s = sexp_counting_stats(&c);
+  mu_check(s.live_bytes > 0 && s.live_blocks >= 6 && s.allocs >= s.live_blocks);
+  sexp_free(e);
+  s = sexp_counting_stats(&c);
+  mu_check(s.live_bytes == 0 && s.live_blocks == 0 && s.peak_bytes > 0);
+  mu_check(s.frees > 0);
+
+  // failing reads give back everything, and so does every call of a
+  // build, print and free cycle
+  sexp_readtable_t *t = sexp_readtable_new();
+  size_t base = sexp_counting_stats(&c).live_bytes;
+  const char* inputs[] = {
+    "[(a]", "((a] b)", "{(a) [b) c}", "(a (b", "(a \"x", "(a \"x\\", "(a \"\\q\")",
+    "(a #| b)", "('a ,b", "(#;", "(a #;(b c) 'd)", "(1 2 (3 4 [5 6} 7) 8)",
+  };
+  for (int i = 0; i < 12; ++i) {
+    read_all_modes(inputs[i], t);
+    if (sexp_counting_stats(&c).live_bytes != base) mu_fail(inputs[i]);
+  }
+  for (uint64_t seed = 0; seed < 50; ++seed) {
+    char* src = sexp_corpus_generate(seed, 1024, SEXP_CORPUS_MACROS | SEXP_CORPUS_NOISE, NULL);
+    read_all_modes(src, t);
+    free(src);
+    mu_check(sexp_counting_stats(&c).live_bytes == base);
+  }
+
+  e = sexp_read(budget_doc, NULL);
+  sexp_t *f = sexp_list_set(e, 1, sexp_new_symbol("x"));
+  sexp_t *script = sexp_diff(e, f);
+  sexp_t *g = sexp_patch(e, script);
+  mu_check(sexp_equal(f, g));
+  char* text = sexp_display(g);
+  sexp_iov_free(sexp_display_iov(g));
+  sexp_writer_t *w = sexp_writer_new_buffer();
+  sexp_writer_value(w, g);
+  sexp_writer_free(w);
+  free(text);
+  sexp_free(g);
+  sexp_free(script);
+  sexp_free(f);
+  sexp_free(e);
+  mu_check(sexp_counting_stats(&c).live_bytes == base);
+
+  sexp_readtable_free(t);
+  mu_check(sexp_set_allocator(NULL) == &c.allocator);
+  s = sexp_counting_stats(&c);
+  mu_check(s.live_bytes == 0 && s.live_blocks == 0);
+}
+
+// a list of n records with spare capacity left from appending
+static sexp_t *compact_doc(int n) {
+  sexp_t *e = sexp_new_list();
+  for (int i = 0; i < n; ++i) {
+    sexp_t *item = sexp_new_list();
+    item = sexp_list_append(item, sexp_new_symbol("item"));
+    item = sexp_list_append(item, sexp_new_number(i));
+    item = sexp_list_append(item, sexp_new_string("some text"));
+    e = sexp_list_append(e, item);
+  }
+  return e;
+}
+
+MU_TEST(test_compact) {
+  sexp_t *e = compact_doc(100);
+  sexp_t *ref = compact_doc(100);
+  sexp_memory_t m = sexp_memory_usage(e);
+  mu_check(m.lists.count == 101 && m.symbols.count == 100 && m.numbers.count == 100);
+  mu_check(m.strings.count == 100);
+  mu_check(m.bytes == m.strings.bytes + m.symbols.bytes + m.numbers.bytes + m.lists.bytes);
+  mu_check(m.lists.wasted >= 41 * sizeof(sexp_t*)); // capacity 141
+  mu_check(m.blocks == 401);
+
+  e = sexp_compact(e);
+  mu_check(sexp_equal(e, ref));
+  sexp_memory_t mc = sexp_memory_usage(e);
+  mu_check(mc.blocks == 1);
+  mu_check(mc.lists.count == 101 && mc.strings.count == 100 && mc.numbers.count == 100);
+  mu_check(mc.wasted < 8 * 401);  // only alignment
+#ifndef SEXP_NO_POOL
+  mu_check(mc.bytes < m.bytes && mc.wasted < m.wasted);
+#endif
+
+  // preorder, each list followed by its elements
+  const char* first = (const char*)sexp_list_nth(e, 0);
+  mu_check((const char*)e < first);
+  mu_check(first < (const char*)sexp_list_nth(sexp_list_nth(e, 0), 0));
+  mu_check((const char*)sexp_list_nth(sexp_list_nth(e, 0), 2) < (const char*)sexp_list_nth(e, 1));
+  sexp_free(e);
+
+  // ropes are flattened
+  sexp_t *f = sexp_list_set(ref, 5, sexp_new_number(5));
+  m = sexp_memory_usage(f);
+  mu_check(m.lists.count == 100 && m.numbers.count == 100 && m.blocks > 400);
+  f = sexp_compact(f);
+  mu_check(sexp_list_length(f) == 100 && sexp_number_get(sexp_list_nth(f, 5)) == 5);
+  mu_check(sexp_memory_usage(f).blocks == 1);
+  sexp_free(f);
+  sexp_free(ref);
+
+  // the block lives as long as any of its nodes, nodes changed in place move
+  // out of it
+  sexp_counting_t c;
+  sexp_counting_init(&c, NULL);
+  sexp_set_allocator(&c.allocator);
+  e = sexp_compact(compact_doc(20));
+  sexp_alloc_stats_t s = sexp_counting_stats(&c);
+  mu_check(s.live_blocks == 1);
+  sexp_t *item = sexp_ref(sexp_list_nth(e, 7));
+  sexp_t *g = sexp_list_append(sexp_ref(e), sexp_new_number(1));
+  mu_check(g != e && sexp_list_length(g) == 21);
+  sexp_free(e);
+  item = sexp_list_append(item, sexp_new_symbol("more"));
+  sexp_free(g);
+  mu_check(sexp_counting_stats(&c).live_blocks > 0);
+  mu_check(sexp_list_length(item) == 4 && sexp_number_get(sexp_list_nth(item, 1)) == 7);
+  sexp_free(item);
+  mu_check(sexp_counting_stats(&c).live_bytes == 0);
+
+  // shared subtrees stay shared, indexes are kept
+  sexp_intern_t *t = sexp_intern_new();
+  sexp_read_opts_t opts = { .intern = t };
+  e = sexp_read_opts("((1 2 3) x (1 2 3) x \"x\")", NULL, &opts);
+  sexp_intern_free(t);
+  mu_check(sexp_list_index(e));
+  m = sexp_memory_usage(e);
+  mu_check(m.lists.count == 2 && m.symbols.count == 1);
+  e = sexp_compact(e);
+  mu_check(sexp_list_nth(e, 0) == sexp_list_nth(e, 2));
+  mu_check(sexp_list_nth(e, 1) == sexp_list_nth(e, 3));
+  mu_check(sexp_list_find(e, sexp_list_nth(e, 4)) == 4);
+  mu_check(sexp_memory_usage(e).lists.count == 2);
+  sexp_free(e);
+
+  // more shared nodes than the first size of the map
+  e = sexp_new_list();
+  for (int i = 0; i < 200; ++i) e = sexp_list_append(e, sexp_new_number(i));
+  for (int i = 0; i < 200; ++i) e = sexp_list_append(e, sexp_ref(sexp_list_nth(e, i)));
+  e = sexp_compact(e);
+  for (int i = 0; i < 200; ++i) mu_check(sexp_list_nth(e, i) == sexp_list_nth(e, i + 200));
+  mu_check(sexp_number_get(sexp_list_nth(e, 399)) == 199);
+  sexp_free(e);
+
+  mu_check(sexp_set_allocator(NULL) == &c.allocator);
+  mu_check(sexp_counting_stats(&c).live_bytes == 0);
+  mu_check(sexp_compact(NULL) == NULL);
+}
+
+MU_TEST(test_pool) {
+  // freed nodes are recycled right away
+  sexp_t *e = sexp_new_number(1);
+  uintptr_t freed = (uintptr_t)e;
+  sexp_free(e);
+  e = sexp_new_number(2);
+#ifndef SEXP_NO_POOL
+  mu_check((uintptr_t)e == freed);
+#endif
+  sexp_free(e);
+
+  // blocks of all sizes survive going through the shared pool and back
+  enum { N = 3000 };
+  static sexp_t *nodes[N];
+  char buf[400];
+  memset(buf, 'x', sizeof(buf));
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < N; ++i) {
+      nodes[i] = sexp_new_symbol_len(buf, (i * 7 + round) % sizeof(buf));
+    }
+    sexp_t *list = sexp_new_list();
+    for (int i = 0; i < 100; ++i) list = sexp_list_append(list, sexp_new_number(i));
+    for (int i = 0; i < N; ++i) {
+      mu_check(sexp_symbol_length(nodes[i]) == (i * 7 + round) % sizeof(buf));
+      sexp_free(nodes[i]);
+    }
+    mu_check(sexp_number_get(sexp_list_nth(list, 99)) == 99);
+    sexp_free(list);
+    sexp_pool_release();
+  }
+}
+
+MU_TEST_SUITE(test_sexp_alloc) {
+  MU_RUN_TEST(test_allocator);
+  MU_RUN_TEST(test_out_of_memory);
+  MU_RUN_TEST(test_counting);
+  MU_RUN_TEST(test_compact);
+  MU_RUN_TEST(test_pool);
+}
+
+typedef struct log_opts_t {
+  long level;
+  char* sink;
+} log_opts_t;
+
+typedef struct target_t {
+  char* name;
+  char** sources;
+  char** flags;
+  char* type;
+  double weight;
+  log_opts_t log;
+  sexp_t *extra;
+} target_t;
+
+SEXP_SCHEMA(log_opts_schema, log_opts_t, NULL,
+  SEXP_FIELD(log_opts_t, level, SEXP_KIND_INT),
+  SEXP_FIELD(log_opts_t, sink, SEXP_KIND_STRING));
+
+SEXP_SCHEMA(target_schema, target_t, "target",
+  SEXP_FIELD(target_t, name, SEXP_KIND_STRING),
+  SEXP_FIELD(target_t, sources, SEXP_KIND_STRINGS),
+  SEXP_FIELD(target_t, flags, SEXP_KIND_STRINGS),
+  SEXP_FIELD(target_t, type, SEXP_KIND_SYMBOL),
+  SEXP_FIELD(target_t, weight, SEXP_KIND_NUMBER),
+  SEXP_FIELD_RECORD(target_t, log, log_opts_schema),
+  SEXP_FIELD_KEY("x-extra:", target_t, extra, SEXP_KIND_VALUE));
+
+MU_TEST(test_schema_read) {
+  const char* src =
+    "; two targets\n"
+    "(target name: \"t\\x31\" sources: (\"a.c\" \"b.c\") type: archive\n"
+    "        unknown: (skipped (entirely)) weight: 2.5 x-extra: (1 (2))\n"
+    "        log: (level: 3 sink: \"out\"))\n"
+    "(target name: \"t2\" sources: () name: \"t3\")\n";
+  target_t t;
+  char* end;
+  mu_check(sexp_schema_read(&target_schema, src, &end, &t) == 1);
+  mu_assert_string_eq("t1", t.name);
+  mu_assert_string_eq("a.c", t.sources[0]);
+  mu_assert_string_eq("b.c", t.sources[1]);
+  mu_check(t.sources[2] == NULL);
+  mu_check(t.flags == NULL);
+  mu_assert_string_eq("archive", t.type);
+  mu_check(t.weight == 2.5);
+  mu_check(t.log.level == 3);
+  mu_assert_string_eq("out", t.log.sink);
+  char* buf = sexp_display(t.extra);
+  mu_assert_string_eq("(1 (2))", buf);
+  free(buf);
+  mu_check(*end == '\n');
+  sexp_schema_release(&target_schema, &t);
+
+  mu_check(sexp_schema_read(&target_schema, end, &end, &t) == 1);
+  mu_assert_string_eq("t3", t.name);
+  mu_check(t.sources != NULL && t.sources[0] == NULL);
+  sexp_schema_release(&target_schema, &t);
+  mu_check(sexp_schema_read(&target_schema, end, &end, &t) == 0);
+
+  // every keyword has a slot of its own
+  mu_check(target_schema.mask != 0);
+  for (int i = 0; i < target_schema.nfields; ++i) {
+    int found = 0;
+    for (int j = 0; j <= target_schema.mask; ++j) found += target_schema.slots[j] == i + 1;
+    mu_check(found == 1);
+  }
+
+  const char* bad[] = {
+    "(log name: \"x\")",
+    "(target name: x)",
+    "(target name: \"x\" weight: \"heavy\")",
+    "(target name: \"x\" log: (level: 1.5))",
+    "(target name: \"x\" log: (level: nan))",
+    "(target name: \"x\" log: (level: -inf))",
+    "(target name: \"x\" log: (level: 1e300))",
+    "(target name: \"x\" sources: (\"a\" b))",
+    "(target name: \"x\" type: 12)",
+    "(target \"positional\")",
+    "(target name: \"x\" log: (sink: \"a\" level: 1)",
+    "(target name: \"bad \\q\")",
+  };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    mu_check(sexp_schema_read(&target_schema, bad[i], NULL, &t) == -1);
+    mu_check(t.name == NULL && t.log.sink == NULL);
+  }
+}
+
+MU_TEST(test_table_read) {
+  const char* src =
+    "(sample ts: 1 cpu: 0.5 host: \"a\" tags: (x y))\n"
+    "(sample cpu: 0.75 ts: 2 host: b\\x)\n"
+    "(sample ts: 3 host: \"c\\n\" extra: 9)\n";
+  sexp_table_t t;
+  mu_check(sexp_table_detect(&t, src));
+  mu_check(t.ncolumns == 3);
+  mu_check(strcmp(t.head, "sample") == 0);
+  mu_check(strcmp(t.columns[0].keyword, "ts:") == 0 && t.columns[0].kind == SEXP_COLUMN_INT64);
+  mu_check(strcmp(t.columns[1].keyword, "cpu:") == 0 && t.columns[1].kind == SEXP_COLUMN_DOUBLE);
+  mu_check(strcmp(t.columns[2].keyword, "host:") == 0 && t.columns[2].kind == SEXP_COLUMN_STRING);
+
+  char* end;
+  mu_check(sexp_table_read(&t, src, &end) == 3);
+  mu_check(*end == '\0');
+  mu_check(t.nrows == 3);
+  const sexp_table_column_t *ts = &t.columns[0], *cpu = &t.columns[1], *host = &t.columns[2];
+  mu_check(ts->i64[0] == 1 && ts->i64[1] == 2 && ts->i64[2] == 3);
+  mu_check(cpu->f64[0] == 0.5 && cpu->f64[1] == 0.75 && isnan(cpu->f64[2]));
+  mu_check(cpu->valid[1] && !cpu->valid[2]);
+  mu_check(host->offsets[1] == 1 && host->offsets[2] == 4 && host->offsets[3] == 6);
+  mu_check(memcmp(host->text, "ab\\xc\n", 6) == 0);
+
+  // fractions widen detected integer columns
+  mu_check(sexp_table_read(&t, "((sample ts: 4.5) (sample ts: 5))", &end) == 2);
+  mu_check(*end == '\0');
+  mu_check(ts->kind == SEXP_COLUMN_DOUBLE && ts->i64 == NULL);
+  mu_check(ts->f64[0] == 1 && ts->f64[3] == 4.5 && ts->f64[4] == 5);
+  mu_check(t.nrows == 5);
+
+  // bad records stop the read, the rows before stay
+  const char* bad = "(sample ts: 6) (sample cpu: x) (sample ts: 7)";
+  mu_check(sexp_table_read(&t, bad, &end) == -1);
+  mu_check(end == bad + 15);
+  mu_check(t.nrows == 6);
+  mu_check(sexp_table_read(&t, "(other ts: 1)", NULL) == -1);
+  mu_check(sexp_table_read(&t, "(sample ts: 1", NULL) == -1);
+  sexp_table_release(&t);
+
+  // given columns, many rows
+  sexp_table_column_t cols[] = {
+    { "id:", SEXP_COLUMN_INT64 },
+    { "load:", SEXP_COLUMN_DOUBLE },
+  };
+  sexp_table_init(&t, NULL, cols, 2);
+  sexp_writer_t *w = sexp_writer_new_buffer();
+  for (int i = 0; i < 5000; ++i) {
+    sexp_writer_begin_list(w);
+    sexp_writer_symbol(w, "load:");
+    sexp_writer_number(w, i / 4.0);
+    sexp_writer_symbol(w, "id:");
+    sexp_writer_number(w, i);
+    sexp_writer_end_list(w);
+  }
+  mu_check(sexp_table_read(&t, sexp_writer_text(w, NULL), NULL) == 5000);
+  int ok = 1;
+  for (int i = 0; i < 5000; ++i) ok &= cols[0].i64[i] == i && cols[1].f64[i] == i / 4.0;
+  mu_check(ok);
+  mu_check(sexp_table_read(&t, "(id: 1.5)", NULL) == -1);
+  sexp_writer_free(w);
+  sexp_table_release(&t);
+}
+
+MU_TEST_SUITE(test_sexp_schema) {
+  MU_RUN_TEST(test_schema_read);
+  MU_RUN_TEST(test_table_read);
+}
+
+/******************************************************************************
+ * DIFF
+ *****************************************************************************/
+
+static int diff_roundtrip(const sexp_t *a, const sexp_t *b) {
+  sexp_t *script = sexp_diff(a, b);
+  sexp_t *res = sexp_patch(a, script);
+  int ok = res != NULL && sexp_equal(res, b);
+  sexp_free(res);
+  sexp_free(script);
+  return ok;
+}
+
+MU_TEST(test_diff) {
+  sexp_t *a = sexp_read("(project name: \"p\" targets: ((target name: \"t1\" "
+      "sources: (\"a.c\" \"b.c\")) (target name: \"t2\" sources: (\"c.c\"))))", NULL);
+  sexp_t *b = sexp_read("(project name: \"p\" targets: ((target name: \"t1\" "
+      "sources: (\"a.c\" \"b.c\" \"d.c\")) (target name: \"t3\" sources: (\"c.c\"))))", NULL);
+
+  sexp_t *script = sexp_diff(a, a);
+  mu_check(sexp_is_list(script) && sexp_list_length(script) == 0);
+  sexp_free(script);
+
+  // edits are nested as deep as the changes
+  script = sexp_diff(a, b);
+  char* str = sexp_display(script);
+  mu_assert_string_eq("((replace (4 1 2) \"t3\") (insert (4 0 4 2) \"d.c\"))", str);
+  free(str);
+  sexp_t *res = sexp_patch(a, script);
+  mu_check(sexp_equal(res, b));
+  sexp_free(res);
+  sexp_free(script);
+
+  // atoms at the root are replaced as a whole
+  sexp_t *n = sexp_new_number(1);
+  script = sexp_diff(a, n);
+  str = sexp_display(script);
+  mu_assert_string_eq("((replace () 1))", str);
+  free(str);
+  sexp_free(script);
+
+  mu_check(diff_roundtrip(a, b));
+  mu_check(diff_roundtrip(b, a));
+  mu_check(diff_roundtrip(n, a));
+  sexp_free(n);
+
+  // scripts that don't fit
+  const char* bad[] = {
+    "((replace (9) 1))",
+    "((delete ()))",
+    "((insert (4 0 4 4) 1))",
+    "((replace (1 0) 1))",
+    "((replace (-1) 1))",
+    "((replace (0.5) 1))",
+    "((replace (nan) 1))",
+    "((replace (inf) 1))",
+    "((replace (1e300) 1))",
+    "((frobnicate (0) 1))",
+    "((delete (0) 1))",
+    "(1)",
+    "x",
+  };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    sexp_t *s = sexp_read(bad[i], NULL);
+    mu_check(sexp_patch(a, s) == NULL);
+    sexp_free(s);
+  }
+
+  // patching shares structure and leaves the original alone
+  sexp_t *s = sexp_read("((insert (1) x:) (delete (0)))", NULL);
+  res = sexp_patch(a, s);
+  str = sexp_display(res);
+  mu_assert_string_eq("(x: name: \"p\" targets: ((target name: \"t1\" sources: (\"a.c\" \"b.c\")) "
+      "(target name: \"t2\" sources: (\"c.c\"))))", str);
+  free(str);
+  mu_check(sexp_list_nth(res, 4) == sexp_list_nth(a, 4));
+  mu_check(sexp_list_length(a) == 5);
+  sexp_free(res);
+  sexp_free(s);
+
+  sexp_free(a);
+  sexp_free(b);
+}
+
+static sexp_t *random_tree(int depth) {
+  if (depth == 0 || rand() % 3 == 0) return sexp_new_number(rand() % 8);
+  sexp_t *e = sexp_new_list();
+  int len = rand() % 8;
+  for (int i = 0; i < len; ++i) e = sexp_list_append(e, random_tree(depth - 1));
+  return e;
+}
+
+// one random insert, delete or replace somewhere in e
+static sexp_t *random_edit(const sexp_t *e, int depth) {
+  size_t len = sexp_list_length(e);
+  int i = len > 0 ? rand() % len : 0;
+  const sexp_t *child = len > 0 ? sexp_list_nth(e, i) : NULL;
+  if (sexp_is_list(child) && rand() % 2 == 0) {
+    return sexp_list_set(e, i, random_edit(child, depth - 1));
+  }
+  switch (len > 0 ? rand() % 3 : 0) {
+    case 0: return sexp_list_insert(e, i, random_tree(depth));
+    case 1: return sexp_list_remove(e, i);
+    default: return sexp_list_set(e, i, random_tree(depth));
+  }
+}
+
+MU_TEST(test_diff_random) {
+  srand(40);
+  for (int round = 0; round < 500; ++round) {
+    sexp_t *a = sexp_new_list();
+    for (int i = 0; i < 20; ++i) a = sexp_list_append(a, random_tree(3));
+    sexp_t *b = sexp_ref(a);
+    int edits = rand() % 6;
+    for (int k = 0; k < edits; ++k) {
+      sexp_t *next = random_edit(b, 3);
+      sexp_free(b);
+      b = next;
+    }
+    mu_check(diff_roundtrip(a, b));
+    mu_check(diff_roundtrip(b, a));
+
+    // scripts stay about as short as the edits made
+    sexp_t *script = sexp_diff(a, b);
+    mu_check(sexp_list_length(script) <= 2 * (size_t)edits);
+    sexp_free(script);
+    sexp_free(a);
+    sexp_free(b);
+  }
+}
+
+MU_TEST_SUITE(test_sexp_diff) {
+  MU_RUN_TEST(test_diff);
+  MU_RUN_TEST(test_diff_random);
+}
+
+/******************************************************************************
+ * EVAL
+ *****************************************************************************/
+
+static int native_max(const sexp_value_t *args, int argc, sexp_value_t *res, void *ctx) {
+  *(int*)ctx += 1;
+  if (argc == 0) return 0;
+  *res = args[0];
+  for (int i = 0; i < argc; ++i) {
+    if (args[i].kind != SEXP_VAL_NUMBER) return 0;
+    if (args[i].num > res->num) *res = args[i];
+  }
+  return 1;
+}
+
+static int eval_str(const sexp_env_t *env, const char* src, const sexp_value_t *vars,
+    sexp_value_t *res) {
+  sexp_t *e = sexp_read(src, NULL);
+  sexp_program_t *p = sexp_compile(env, e);
+  int ok = p != NULL && sexp_eval(p, vars, res);
+  sexp_program_free(p);
+  sexp_free(e);
+  return ok;
+}
+
+MU_TEST(test_eval) {
+  sexp_env_t *env = sexp_env_new();
+  int load = sexp_env_var(env, "load");
+  int region = sexp_env_var(env, "region");
+  mu_check(load == 0 && region == 1);
+  mu_check(sexp_env_var(env, "load") == load);
+  int calls = 0;
+  mu_check(sexp_env_native(env, "max", -1, native_max, &calls));
+
+  sexp_t *us_east = sexp_new_symbol("us-east");
+  sexp_value_t vars[2] = { sexp_value_number(0.9), sexp_value_node(us_east) };
+  sexp_value_t v;
+
+  mu_check(eval_str(env, "(+ 1 2 (* 3 4) (- 5) (/ 2))", vars, &v));
+  mu_check(v.kind == SEXP_VAL_NUMBER && v.num == 1 + 2 + 12 - 5 + 0.5);
+  mu_check(eval_str(env, "(- 10 load 1)", vars, &v) && v.num == 10 - 0.9 - 1);
+  mu_check(eval_str(env, "(and (> load 0.8) (eq region us-east))", vars, &v));
+  mu_check(v.kind == SEXP_VAL_BOOL && v.num == 1);
+  mu_check(eval_str(env, "(and (> load 0.95) (eq region us-east))", vars, &v));
+  mu_check(v.kind == SEXP_VAL_BOOL && v.num == 0);
+  mu_check(eval_str(env, "(or (< load 0.5) region)", vars, &v));
+  mu_check(v.kind == SEXP_VAL_NODE && v.node == us_east);
+  mu_check(eval_str(env, "(if (not (= load 0.9)) 1 2)", vars, &v) && v.num == 2);
+  mu_check(eval_str(env, "(if #f 1)", vars, &v) && v.kind == SEXP_VAL_BOOL && v.num == 0);
+  mu_check(eval_str(env, "(eq (quote (a 1)) (quote (a 1)))", vars, &v) && v.num == 1);
+  mu_check(eval_str(env, "(and)", vars, &v) && v.num == 1);
+  mu_check(eval_str(env, "(or)", vars, &v) && v.num == 0);
+
+  // constant parts are folded, natives are always called
+  mu_check(eval_str(env, "(max 1 (* 2 3) load)", vars, &v) && v.num == 6);
+  mu_check(eval_str(env, "(if (< 1 2) (max 3) (max 4))", vars, &v) && v.num == 3);
+  mu_check(calls == 2);
+
+  // unset variables are false
+  vars[1].kind = SEXP_VAL_NIL;
+  mu_check(eval_str(env, "(not region)", vars, &v) && v.num == 1);
+
+  // evaluation errors
+  mu_check(!eval_str(env, "(+ 1 region)", vars, &v));
+  mu_check(!eval_str(env, "(< \"a\" 1)", vars, &v));
+  mu_check(!eval_str(env, "(max)", vars, &v));
+
+  // compile errors
+  const char* bad[] = { "(frob 1)", "(< 1)", "(-)", "((a) 1)", "(if 1)", "(quote)", "(not 1 2)" };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    sexp_t *e = sexp_read(bad[i], NULL);
+    mu_check(sexp_compile(env, e) == NULL);
+    sexp_free(e);
+  }
+
+  // programs keep their constants
+  sexp_t *e = sexp_read("(or (< load 0) \"high\")", NULL);
+  sexp_program_t *p = sexp_compile(env, e);
+  sexp_free(e);
+  vars[0] = sexp_value_number(2);
+  mu_check(sexp_eval(p, vars, &v) && strcmp(sexp_string_get(v.node), "high") == 0);
+  sexp_program_free(p);
+
+  sexp_free(us_east);
+  sexp_env_free(env);
+}
+
+MU_TEST(test_eval_rules) {
+  // evaluating a rule compiled once agrees with evaluating it by hand
+  sexp_env_t *env = sexp_env_new();
+  sexp_env_var(env, "x");
+  sexp_env_var(env, "y");
+  sexp_t *e = sexp_read("(if (and (> x 10) (or (< y 0) (= y 5))) (* x (- y 1)) (+ x y 0.5))", NULL);
+  sexp_program_t *p = sexp_compile(env, e);
+  mu_check(p != NULL);
+  for (int x = 0; x < 20; ++x) {
+    for (int y = -5; y < 10; ++y) {
+      sexp_value_t vars[2] = { sexp_value_number(x), sexp_value_number(y) };
+      sexp_value_t v;
+      double expected = (x > 10 && (y < 0 || y == 5)) ? x * (y - 1.0) : x + y + 0.5;
+      mu_check(sexp_eval(p, vars, &v) && v.num == expected);
+    }
+  }
+  sexp_program_free(p);
+  sexp_free(e);
+
+  // deep nesting
+  const int depth = 5000;
+  char* src = malloc(depth * 6 + 16);
+  char* s = src;
+  for (int i = 0; i < depth; ++i) s += sprintf(s, "(not ");
+  s += sprintf(s, "x");
+  for (int i = 0; i < depth; ++i) *s++ = ')';
+  *s = '\0';
+  e = sexp_read(src, NULL);
+  mu_check(sexp_compile(env, e) == NULL);
+  sexp_free(e);
+  free(src);
+
+  // wide, more jumps than fit on the stack
+  e = sexp_new_list();
+  e = sexp_list_append(e, sexp_new_symbol("and"));
+  sexp_t *x = sexp_new_symbol("x");
+  for (int i = 0; i < 1 << 21; ++i) e = sexp_list_append(e, sexp_ref(x));
+  sexp_free(x);
+  p = sexp_compile(env, e);
+  sexp_free(e);
+  mu_check(p != NULL);
+  sexp_value_t vars[2] = { sexp_value_number(1), sexp_value_number(0) };
+  sexp_value_t v;
+  mu_check(sexp_eval(p, vars, &v) && v.num == 1);
+  vars[0] = sexp_value_bool(0);
+  mu_check(sexp_eval(p, vars, &v) && v.kind == SEXP_VAL_BOOL && v.num == 0);
+  sexp_program_free(p);
+  sexp_env_free(env);
+}
+
+typedef struct eval_thread_t {
+  const sexp_program_t *p;
+  const sexp_t *x;
+  int matches;
+} eval_thread_t;
+
+static void *eval_thread(void *arg) {
+  eval_thread_t *t = arg;
+  sexp_value_t vars[1] = { sexp_value_node(t->x) };
+  sexp_value_t v;
+  for (int i = 0; i < 100; ++i) {
+    t->matches += sexp_eval(t->p, vars, &v) && v.num == 1;
+  }
+  return NULL;
+}
+
+MU_TEST(test_eval_shared) {
+  // threads run one program, which doesn't hold on to the caller's nodes
+  sexp_env_t *env = sexp_env_new();
+  sexp_env_var(env, "x");
+  sexp_t *e = sexp_read("(eq x (quote (a b c)))", NULL);
+  sexp_program_t *p = sexp_compile(env, e);
+  sexp_free(e);
+  mu_check(p != NULL);
+  pthread_t threads[4];
+  eval_thread_t ts[4];
+  for (int i = 0; i < 4; ++i) {
+    ts[i].p = p;
+    ts[i].x = sexp_read("(a b c)", NULL);
+    ts[i].matches = 0;
+    pthread_create(&threads[i], NULL, eval_thread, &ts[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    pthread_join(threads[i], NULL);
+    mu_check(ts[i].matches == 100);
+    sexp_free((sexp_t*)ts[i].x);
+  }
+  sexp_program_free(p);
+  sexp_env_free(env);
+}
+
+MU_TEST(test_eval_batch) {
+  sexp_env_t *env = sexp_env_new();
+  int x = sexp_env_var(env, "x");
+  int y = sexp_env_var(env, "y");
+  int region = sexp_env_var(env, "region");
+  int calls = 0;
+  sexp_env_native(env, "max", -1, native_max, &calls);
+
+  enum { N = 5000 };
+  double *xs = malloc(sizeof(double) * N);
+  double *ys = malloc(sizeof(double) * N);
+  sexp_value_t *regions = malloc(sizeof(sexp_value_t) * N);
+  sexp_t *names[3] = { sexp_new_symbol("us-east"), sexp_new_symbol("eu"), sexp_new_string("x") };
+  srand(43);
+  for (int i = 0; i < N; ++i) {
+    xs[i] = rand() % 100;
+    ys[i] = rand() % 20 - 10;
+    regions[i] = i % 50 == 0 ? sexp_value_number(i) : sexp_value_node(names[rand() % 3]);
+  }
+  sexp_column_t cols[3];
+  cols[x].num = xs;
+  cols[y].num = ys;
+  cols[region].num = NULL;
+  cols[region].vals = regions;
+
+  const char* exprs[] = {
+    "(> x 50)",
+    "(and (> x 20) (< y 0) (eq region us-east))",
+    "(or (= y 3) (and (< x 10) (not (eq region eu))))",
+    "(if (> y 0) (* x y) (- x (/ y 2)))",
+    "(if (eq region eu) (> x 90) (or (< x 5) (> y 8)))",
+    "(if (> x 50) 1 #f)",
+    "(or (> x 98) region)",
+    "(> (max x y) 95)",
+    "(and (> x 95) (< (+ x region) 0))",
+    "#t",
+  };
+  size_t *rows = malloc(sizeof(size_t) * N);
+  sexp_value_t *res = malloc(sizeof(sexp_value_t) * N);
+  for (size_t k = 0; k < sizeof(exprs) / sizeof(exprs[0]); ++k) {
+    sexp_t *e = sexp_read(exprs[k], NULL);
+    sexp_program_t *p = sexp_compile(env, e);
+    mu_check(p != NULL);
+    long count = sexp_eval_filter(p, cols, N, rows);
+    mu_check(sexp_eval_batch(p, cols, N, res) == (count >= 0));
+
+    // agrees with evaluating row by row
+    long expected = 0;
+    int failed = 0;
+    for (int i = 0; i < N && !failed; ++i) {
+      sexp_value_t vars[3] = { sexp_value_number(xs[i]), sexp_value_number(ys[i]), regions[i] };
+      sexp_value_t v;
+      if (!sexp_eval(p, vars, &v)) {
+        failed = 1;
+        break;
+      }
+      if (sexp_value_truthy(v)) {
+        mu_check(expected < count && rows[expected] == (size_t)i);
+        expected += 1;
+      }
+      mu_check(sexp_value_eq(v, res[i]));
+    }
+    mu_check(failed ? count == -1 : count == expected);
+    sexp_program_free(p);
+    sexp_free(e);
+  }
+  mu_check(calls > 0);
+
+  free(rows);
+  free(res);
+  for (int i = 0; i < 3; ++i) sexp_free(names[i]);
+  free(regions);
+  free(xs);
+  free(ys);
+  sexp_env_free(env);
+}
+
+MU_TEST_SUITE(test_sexp_eval) {
+  MU_RUN_TEST(test_eval);
+  MU_RUN_TEST(test_eval_rules);
+  MU_RUN_TEST(test_eval_shared);
+  MU_RUN_TEST(test_eval_batch);
+}
+
+/******************************************************************************
+ * TRAVERSAL
+ *****************************************************************************/
+
+MU_TEST(test_iter) {
+  sexp_t *e = sexp_read("(a (b (c)) () \"s\" 1)", NULL);
+  const char* order[] = { "(a (b (c)) () \"s\" 1)", "a", "(b (c))", "b", "(c)", "c",
+    "()", "\"s\"", "1" };
+  size_t depths[] = { 0, 1, 1, 2, 2, 3, 1, 1, 1 };
+  sexp_iter_t *it = sexp_iter_new(e);
+  const sexp_t *x;
+  int n = 0;
+  while ((x = sexp_iter_next(it)) != NULL) {
+    char* text = sexp_display((sexp_t*)x);
+    mu_check(n < 9 && strcmp(text, order[n]) == 0 && sexp_iter_depth(it) == depths[n]);
+    free(text);
+    n += 1;
+  }
+  mu_check(n == 9);
+  mu_check(sexp_iter_next(it) == NULL && sexp_iter_depth(it) == 0);
+
+  // skipping the elements of (b (c))
+  sexp_iter_reset(it, e);
+  n = 0;
+  while ((x = sexp_iter_next(it)) != NULL) {
+    if (sexp_is_list(x) && sexp_list_length(x) == 2) sexp_iter_skip(it);
+    n += 1;
+  }
+  mu_check(n == 6);
+  sexp_iter_reset(it, sexp_list_nth(e, 1));
+  sexp_iter_skip(it);
+  mu_check(sexp_iter_next(it) == sexp_list_nth(e, 1));
+  sexp_free(e);
+
+  // ropes, and nesting deeper than the initial stack
+  e = sexp_new_list();
+  for (int i = 0; i < 100; ++i) e = sexp_list_append(e, sexp_new_number(i));
+  sexp_t *f = sexp_list_remove(e, 0);
+  for (int i = 0; i < 1000; ++i) f = sexp_list_append(sexp_new_list(), f);
+  sexp_iter_reset(it, f);
+  n = 0;
+  double sum = 0;
+  size_t deepest = 0;
+  while ((x = sexp_iter_next(it)) != NULL) {
+    if (sexp_is_number(x)) sum += sexp_number_get(x);
+    if (sexp_iter_depth(it) > deepest) deepest = sexp_iter_depth(it);
+    n += 1;
+  }
+  mu_check(n == 1001 + 99 && sum == 4950 && deepest == 1001);
+  sexp_iter_free(it);
+  sexp_free(f);
+  sexp_free(e);
+
+  it = sexp_iter_new(NULL);
+  mu_check(sexp_iter_next(it) == NULL);
+  sexp_iter_free(it);
+}
+
+typedef struct tally_t {
+  size_t nodes;
+  size_t lists;
+  double sum;
+} tally_t;
+
+static void tally_map(void *acc, const sexp_t *e, void *ctx) {
+  tally_t *t = acc;
+  t->nodes += 1;
+  if (sexp_is_list(e)) t->lists += 1;
+  if (sexp_is_number(e)) t->sum += sexp_number_get(e);
+}
+
+static void tally_reduce(void *acc, const void *other, void *ctx) {
+  tally_t *t = acc;
+  const tally_t *o = other;
+  t->nodes += o->nodes;
+  t->lists += o->lists;
+  t->sum += o->sum;
+}
+
+MU_TEST(test_map_reduce) {
+  // records, a large nested list and a rope, so that all ways of splitting
+  // are taken
+  sexp_t *e = compact_doc(5000);
+  sexp_t *big = sexp_new_list();
+  for (int i = 0; i < 3000; ++i) big = sexp_list_append(big, sexp_new_number(1));
+  sexp_t *inner = sexp_new_list();
+  inner = sexp_list_append(inner, big);
+  e = sexp_list_append(e, inner);
+  sexp_t *f = sexp_list_insert(e, 3, sexp_new_number(0.5));
+  sexp_free(e);
+
+  tally_t serial = { 0, 0, 0 };
+  sexp_iter_t *it = sexp_iter_new(f);
+  const sexp_t *x;
+  sexp_iter_next(it);         // only what is below f
+  while ((x = sexp_iter_next(it)) != NULL) tally_map(&serial, x, NULL);
+  sexp_iter_free(it);
+  mu_check(serial.nodes == 5000 * 4 + 3002 + 1);
+
+  sexp_map_reduce_t mr = { sizeof(tally_t), NULL, tally_map, tally_reduce, NULL, 1 };
+  int counts[] = { 1, 2, 4, 0 };
+  for (int k = 0; k < 4; ++k) {
+    sexp_workers_t *w = sexp_workers_new(counts[k]);
+    mu_check(w != NULL && sexp_workers_count(w) >= 1);
+    for (int rep = 0; rep < 3; ++rep) {
+      tally_t t;
+      mr.deep = 1;
+      mu_check(sexp_map_reduce(w, f, &mr, &t));
+      mu_check(t.nodes == serial.nodes && t.lists == serial.lists && t.sum == serial.sum);
+
+      // only the elements
+      mr.deep = 0;
+      mu_check(sexp_map_reduce(w, f, &mr, &t));
+      mu_check(t.nodes == 5002 && t.lists == 5001 && t.sum == 0.5);
+    }
+    tally_t t = { 1, 1, 1 };
+    mu_check(sexp_map_reduce(w, sexp_list_nth(f, 0), &mr, &t));
+    mu_check(t.nodes == 3);
+    mu_check(sexp_map_reduce(w, sexp_list_nth(sexp_list_nth(f, 0), 0), &mr, &t));
+    mu_check(t.nodes == 0 && t.sum == 0);
+    sexp_workers_free(w);
+  }
+  sexp_free(f);
+}
+
+MU_TEST_SUITE(test_sexp_traversal) {
+  MU_RUN_TEST(test_iter);
+  MU_RUN_TEST(test_map_reduce);
+}
+
+/******************************************************************************
+ * CORPUS
+ *****************************************************************************/
+
+MU_TEST(test_corpus_generate) {
+  size_t len, len2;
+  char* a = sexp_corpus_generate(42, 4096, SEXP_CORPUS_VALID, &len);
+  char* b = sexp_corpus_generate(42, 4096, SEXP_CORPUS_VALID, &len2);
+  mu_check(len == len2 && len == strlen(a) && memcmp(a, b, len) == 0);
+  mu_check(len >= 4096 && len < 8192);
+
+  // reads as forms up to the end
+  char* pos = a;
+  size_t count = 0;
+  sexp_t *e;
+  while ((e = sexp_read(pos, &pos)) != NULL) {
+    sexp_free(e);
+    count += 1;
+  }
+  mu_check(count > 1);
+  mu_check(sexp_read(pos, NULL) == NULL && *pos == '\0');
+  free(a);
+  free(b);
+
+  a = sexp_corpus_generate(42, 4096, SEXP_CORPUS_NOISE, &len);
+  mu_check(len > 0 && len == strlen(a));
+  free(a);
+}
+
+MU_TEST(test_corpus_check) {
+  for (uint64_t seed = 0; seed < 300; ++seed) {
+    size_t len;
+    char* src = sexp_corpus_generate(seed, 64 + seed * 8, SEXP_CORPUS_VALID, &len);
+    const char* failed = sexp_corpus_check(src, len);
+    if (failed != NULL) {
+      free(src);
+      mu_fail(failed);
+    }
+    free(src);
+  }
+
+  // with reader macros and damaged, which also finds errors that the
+  // readers report differently
+  for (uint64_t seed = 0; seed < 300; ++seed) {
+    int flags = seed % 3 + 1;
+    size_t len;
+    char* src = sexp_corpus_generate(seed, 64 + seed * 8, flags, &len);
+    const char* failed = sexp_corpus_check(src, len);
+    if (failed != NULL) {
+      free(src);
+      mu_fail(failed);
+    }
+    free(src);
+  }
+
+  // inputs that found bugs before
+  const char* inputs[] = { "(a \"b\\", "0.1 (0.30000000000000004)", "", "[(a]", "((a] b)" };
+  for (int i = 0; i < 5; ++i) {
+    mu_check(sexp_corpus_check(inputs[i], strlen(inputs[i])) == NULL);
+  }
+}
+
+MU_TEST_SUITE(test_sexp_corpus) {
+  MU_RUN_TEST(test_corpus_generate);
+  MU_RUN_TEST(test_corpus_check);
 }
 
 int main(int argc, char** argv) {
   MU_RUN_SUITE(test_sexp_types);
   MU_RUN_SUITE(test_sexp_read);
   MU_RUN_SUITE(test_sexp_print);
+  MU_RUN_SUITE(test_sexp_equality);
+  MU_RUN_SUITE(test_sexp_query);
+  MU_RUN_SUITE(test_sexp_alloc);
+  MU_RUN_SUITE(test_sexp_schema);
+  MU_RUN_SUITE(test_sexp_diff);
+  MU_RUN_SUITE(test_sexp_eval);
+  MU_RUN_SUITE(test_sexp_traversal);
+  MU_RUN_SUITE(test_sexp_corpus);
   MU_REPORT();
   return minunit_status;
 }